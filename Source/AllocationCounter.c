@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "AllocationCounter.h"
+
+#if defined(__APPLE__)
+
+#include <malloc/malloc.h>
+#include <mach/mach.h>
+#include <libkern/OSAtomic.h>
+
+static malloc_zone_t * s_zone = NULL;
+static malloc_zone_t s_originalZone;
+static volatile int64_t s_count = 0;
+static volatile int64_t s_bytes = 0;
+static volatile int64_t s_peakBytes = 0;
+
+//! Adds the size of a block that was allocated (or subtracts it when @a sign is -1).
+static void CountBytes(malloc_zone_t * zone, void * ptr, int sign)
+{
+    int64_t bytes;
+    int64_t peak;
+
+    if (!ptr)
+    {
+        return;
+    }
+    bytes = OSAtomicAdd64(sign * (int64_t)s_originalZone.size(zone, ptr), &s_bytes);
+    while ((peak = s_peakBytes) < bytes && !OSAtomicCompareAndSwap64(peak, bytes, &s_peakBytes))
+    {
+    }
+}
+
+static void * CountingMalloc(malloc_zone_t * zone, size_t size)
+{
+    void * ptr = s_originalZone.malloc(zone, size);
+    OSAtomicIncrement64(&s_count);
+    CountBytes(zone, ptr, 1);
+    return ptr;
+}
+
+static void * CountingCalloc(malloc_zone_t * zone, size_t count, size_t size)
+{
+    void * ptr = s_originalZone.calloc(zone, count, size);
+    OSAtomicIncrement64(&s_count);
+    CountBytes(zone, ptr, 1);
+    return ptr;
+}
+
+static void * CountingValloc(malloc_zone_t * zone, size_t size)
+{
+    void * ptr = s_originalZone.valloc(zone, size);
+    OSAtomicIncrement64(&s_count);
+    CountBytes(zone, ptr, 1);
+    return ptr;
+}
+
+static void * CountingRealloc(malloc_zone_t * zone, void * ptr, size_t size)
+{
+    OSAtomicIncrement64(&s_count);
+    CountBytes(zone, ptr, -1);
+    ptr = s_originalZone.realloc(zone, ptr, size);
+    CountBytes(zone, ptr, 1);
+    return ptr;
+}
+
+static void * CountingMemalign(malloc_zone_t * zone, size_t alignment, size_t size)
+{
+    void * ptr = s_originalZone.memalign(zone, alignment, size);
+    OSAtomicIncrement64(&s_count);
+    CountBytes(zone, ptr, 1);
+    return ptr;
+}
+
+static void CountingFree(malloc_zone_t * zone, void * ptr)
+{
+    CountBytes(zone, ptr, -1);
+    s_originalZone.free(zone, ptr);
+}
+
+static void CountingFreeDefiniteSize(malloc_zone_t * zone, void * ptr, size_t size)
+{
+    CountBytes(zone, ptr, -1);
+    s_originalZone.free_definite_size(zone, ptr, size);
+}
+
+//! Newer zones are kept read-only, so the page has to be unprotected to change them.
+static void SetZoneWritable(malloc_zone_t * zone, int isWritable)
+{
+    if (zone->version >= 8)
+    {
+        vm_protect(mach_task_self(), (vm_address_t)zone, sizeof(malloc_zone_t), 0, isWritable ? (VM_PROT_READ | VM_PROT_WRITE) : VM_PROT_READ);
+    }
+}
+
+int AllocationCounterStart(void)
+{
+    if (s_zone)
+    {
+        s_count = 0;
+        s_bytes = 0;
+        s_peakBytes = 0;
+        return 0;
+    }
+
+    s_zone = malloc_default_zone();
+    s_originalZone = *s_zone;
+    s_count = 0;
+    s_bytes = 0;
+    s_peakBytes = 0;
+
+    SetZoneWritable(s_zone, 1);
+    s_zone->malloc = CountingMalloc;
+    s_zone->calloc = CountingCalloc;
+    s_zone->valloc = CountingValloc;
+    s_zone->realloc = CountingRealloc;
+    s_zone->free = CountingFree;
+    if (s_zone->version >= 5 && s_originalZone.memalign)
+    {
+        s_zone->memalign = CountingMemalign;
+    }
+    if (s_zone->version >= 6 && s_originalZone.free_definite_size)
+    {
+        s_zone->free_definite_size = CountingFreeDefiniteSize;
+    }
+    SetZoneWritable(s_zone, 0);
+
+    return 0;
+}
+
+void AllocationCounterStop(void)
+{
+    if (!s_zone)
+    {
+        return;
+    }
+
+    SetZoneWritable(s_zone, 1);
+    s_zone->malloc = s_originalZone.malloc;
+    s_zone->calloc = s_originalZone.calloc;
+    s_zone->valloc = s_originalZone.valloc;
+    s_zone->realloc = s_originalZone.realloc;
+    s_zone->free = s_originalZone.free;
+    if (s_zone->version >= 5)
+    {
+        s_zone->memalign = s_originalZone.memalign;
+    }
+    if (s_zone->version >= 6)
+    {
+        s_zone->free_definite_size = s_originalZone.free_definite_size;
+    }
+    SetZoneWritable(s_zone, 0);
+    s_zone = NULL;
+}
+
+int64_t AllocationCounterGetCount(void)
+{
+    return s_count;
+}
+
+int64_t AllocationCounterGetPeakBytes(void)
+{
+    return s_peakBytes;
+}
+
+#elif defined(__GLIBC__)
+
+#include <stdlib.h>
+#include <malloc.h>
+#include <errno.h>
+
+// glibc lets a program replace malloc by defining it, and keeps the real allocator reachable
+// under these names. The replacements are always in place; they only count while s_counting
+// is set.
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t count, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+extern void __libc_free(void * ptr);
+extern void * __libc_memalign(size_t alignment, size_t size);
+extern void * __libc_valloc(size_t size);
+
+static volatile int s_counting = 0;
+static volatile int64_t s_count = 0;
+static volatile int64_t s_bytes = 0;
+static volatile int64_t s_peakBytes = 0;
+
+//! Adds the size of a block that was allocated (or subtracts it when @a sign is -1).
+static void CountBytes(void * ptr, int sign)
+{
+    int64_t bytes;
+    int64_t peak;
+
+    if (!ptr || !s_counting)
+    {
+        return;
+    }
+    bytes = __sync_add_and_fetch(&s_bytes, sign * (int64_t)malloc_usable_size(ptr));
+    while ((peak = s_peakBytes) < bytes && !__sync_bool_compare_and_swap(&s_peakBytes, peak, bytes))
+    {
+    }
+}
+
+static void CountAllocation(void * ptr)
+{
+    if (s_counting)
+    {
+        __sync_fetch_and_add(&s_count, 1);
+        CountBytes(ptr, 1);
+    }
+}
+
+void * malloc(size_t size)
+{
+    void * ptr = __libc_malloc(size);
+    CountAllocation(ptr);
+    return ptr;
+}
+
+void * calloc(size_t count, size_t size)
+{
+    void * ptr = __libc_calloc(count, size);
+    CountAllocation(ptr);
+    return ptr;
+}
+
+void * realloc(void * ptr, size_t size)
+{
+    if (s_counting)
+    {
+        __sync_fetch_and_add(&s_count, 1);
+        CountBytes(ptr, -1);
+    }
+    ptr = __libc_realloc(ptr, size);
+    CountBytes(ptr, 1);
+    return ptr;
+}
+
+void * memalign(size_t alignment, size_t size)
+{
+    void * ptr = __libc_memalign(alignment, size);
+    CountAllocation(ptr);
+    return ptr;
+}
+
+void * aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void ** result, size_t alignment, size_t size)
+{
+    void * ptr;
+
+    if (!alignment || (alignment & (alignment - 1)) || alignment % sizeof(void *))
+    {
+        return EINVAL;
+    }
+    ptr = memalign(alignment, size);
+    if (!ptr)
+    {
+        return ENOMEM;
+    }
+    *result = ptr;
+    return 0;
+}
+
+void * valloc(size_t size)
+{
+    void * ptr = __libc_valloc(size);
+    CountAllocation(ptr);
+    return ptr;
+}
+
+void free(void * ptr)
+{
+    CountBytes(ptr, -1);
+    __libc_free(ptr);
+}
+
+int AllocationCounterStart(void)
+{
+    s_count = 0;
+    s_bytes = 0;
+    s_peakBytes = 0;
+    __sync_synchronize();
+    s_counting = 1;
+    return 0;
+}
+
+void AllocationCounterStop(void)
+{
+    s_counting = 0;
+    __sync_synchronize();
+}
+
+int64_t AllocationCounterGetCount(void)
+{
+    return s_count;
+}
+
+int64_t AllocationCounterGetPeakBytes(void)
+{
+    return s_peakBytes;
+}
+
+#else
+
+int AllocationCounterStart(void)
+{
+    return -1;
+}
+
+void AllocationCounterStop(void)
+{
+}
+
+int64_t AllocationCounterGetCount(void)
+{
+    return 0;
+}
+
+int64_t AllocationCounterGetPeakBytes(void)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#if !defined(_AllocationCounter_h_)
+#define _AllocationCounter_h_
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @file AllocationCounter.h
+ * @brief Counts heap allocations made by the whole process, for benchmarking.
+ *
+ * On Mac OS X the allocation entry points of the default malloc zone are wrapped while
+ * counting, so that each malloc, calloc, realloc, valloc and memalign call increments a
+ * counter. With glibc this file defines malloc and its relatives itself, on top of the
+ * __libc_ functions, so linking it into a program replaces the allocator and only counting
+ * is switched on and off. Frees are wrapped too, so the largest amount of memory held at once
+ * can be reported. Elsewhere AllocationCounterStart() fails.
+ */
+
+//! @brief Start counting allocations and reset the count to zero.
+//! @return 0 on success, or -1 if allocations can't be counted on this system.
+int AllocationCounterStart(void);
+
+//! @brief Stop counting and restore the original allocation functions.
+void AllocationCounterStop(void);
+
+//! @brief Number of allocations since counting started.
+int64_t AllocationCounterGetCount(void);
+
+//! @brief Most bytes ever held at once by blocks allocated since counting started.
+//!
+//! Blocks allocated before counting started and freed during it lower the count, so this is
+//! the peak growth of the heap rather than its absolute size.
+int64_t AllocationCounterGetPeakBytes(void);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _AllocationCounter_h_
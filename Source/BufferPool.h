@@ -18,60 +18,72 @@
  */
 
 #import <Cocoa/Cocoa.h>
-
-/*!
- * @brief One buffer in the pool.
- */
-struct _BufferInfo
-{
-    uint8_t * data;
-    size_t length;
-    struct _BufferInfo * next;
-    struct _BufferInfo * prev;
-};
-
-typedef struct _BufferInfo BufferInfo_t;
-
-/*!
- * @brief A linked list of buffers.
- */
-@interface BufferList : NSObject
-{
-    BufferInfo_t * _head;
-    BufferInfo_t * _tail;
-    int _count;
-}
-
-@property int count;
-@property BufferInfo_t * head;
-@property BufferInfo_t * tail;
-
-- (void)addBuffer:(BufferInfo_t *)buffer;
-- (void)removeBuffer:(BufferInfo_t *)buffer;
-
-
-@end
+#import <libkern/OSAtomic.h>
+#import <pthread.h>
 
 //! @brief Option flag masks for acquiring a buffer.
 enum _BufferOptions
 {
     kBufferOptionAllocate = 1,  //!< Allocate a new buffer if none are available.
-    kBufferOptionGrow = 2,      //!< Grow a small buffer to match the requested size.
+    kBufferOptionGrow = 2,      //!< Grow a free buffer of a smaller size class if none of the requested size are available.
     kBufferOptionWait = 4,      //!< Wait for a buffer to become available.
 };
 
+//! @brief Number of power-of-two size classes, from 256 bytes to 16 MB.
+#define kBufferSizeClassCount (17)
+
+//! @brief Number of buffers of each size class kept by a thread's private cache.
+#define kBufferThreadCacheDepth (4)
+
+//! @brief Counters describing buffer pool activity.
+typedef struct _BufferPoolStatistics
+{
+    int64_t hits;           //!< Acquires satisfied with a buffer already held by the pool.
+    int64_t misses;         //!< Acquires that had to allocate a new buffer.
+    int64_t grows;          //!< Acquires satisfied by growing a smaller free buffer.
+    int64_t waits;          //!< Acquires that had to wait for a buffer to be released.
+    int64_t trimmed;        //!< Buffers freed because the pool was over its idle budget.
+    int64_t bytesHeld;      //!< Bytes currently allocated by the pool, both in use and idle.
+    int64_t bytesIdle;      //!< Bytes currently allocated but not in use.
+    int64_t peakBytes;      //!< Largest value bytesHeld has ever reached.
+} BufferPoolStatistics_t;
+
 /*!
- * @brief Manages a cyclic pool of variable sized buffers.
+ * @brief Manages a pool of reusable buffers grouped into power-of-two size classes.
+ *
+ * Each buffer is preceded by a small header recording its size class, so acquiring and
+ * releasing are O(1). Free buffers of each class are kept on a lock-free queue shared by
+ * all threads, in front of which every thread has a small private cache that needs no
+ * atomic operations at all. Requests larger than the biggest size class are allocated and
+ * freed directly.
  *
- * @todo Retire buffers not used in a while, to allow the pool size to grow and shrink over
- *      time, as connections are opened and closed.
+ * Idle memory is limited by the idle budget. A released buffer that would push the idle
+ * total over the budget is freed instead of being kept, and -trim frees idle buffers held
+ * on the shared queues until the pool is back under budget.
  */
 @interface BufferPool : NSObject
 {
-    BufferList * _freeBuffers;  //!< The list of buffers available for callers to use.
-    BufferList * _activeBuffers;    //!< The list of buffers currently in use.
+    OSQueueHead _freeBuffers[kBufferSizeClassCount];    //!< Shared free queue for each size class.
+    pthread_key_t _cacheKey;    //!< Key for each thread's private cache.
+    pthread_mutex_t _waitLock;  //!< Protects waiting for a released buffer.
+    pthread_cond_t _bufferReleased; //!< Signalled on release while there are waiters.
+    volatile int32_t _waiterCount;  //!< Number of threads waiting for a buffer.
+    volatile int64_t _idleBudget;   //!< Most idle bytes the pool will hold.
+    volatile int64_t _byteLimit;    //!< Most bytes the pool will allocate in total, or 0 for no limit.
+    BufferPoolStatistics_t _stats;
 }
 
+//! @brief Maximum number of bytes held by the pool in idle buffers.
+@property int64_t idleBudget;
+
+//! @brief Maximum number of bytes the pool may allocate, or 0 for no limit.
+//!
+//! Acquires that would exceed the limit fail, or wait if kBufferOptionWait is set.
+@property int64_t byteLimit;
+
+//! @brief Returns the pool shared by the whole application.
++ (BufferPool *)sharedPool;
+
 //! @brief Designated initializer.
 - (id)init;
 
@@ -81,5 +93,13 @@ enum _BufferOptions
 //! @brief Return a buffer to the pool.
 - (void)releaseBuffer:(const uint8_t *)buf;
 
-@end
+//! @brief Returns the number of usable bytes in a buffer acquired from the pool.
+- (size_t)capacityOfBuffer:(const uint8_t *)buf;
 
+//! @brief Free idle buffers until the pool is within its idle budget.
+- (void)trim;
+
+//! @brief Read the pool's counters.
+- (void)getStatistics:(BufferPoolStatistics_t *)stats;
+
+@end
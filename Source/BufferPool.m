@@ -18,186 +18,478 @@
  */
 
 #import "BufferPool.h"
+#import <stddef.h>
+#import <sys/time.h>
 
-@implementation BufferList
+//! Bytes reserved in front of each buffer for its header. Keeps the data 16-byte aligned.
+#define kBufferHeaderSize (32)
 
-@synthesize count = _count;
-@synthesize head = _head;
-@synthesize tail = _tail;
+//! log2 of the capacity of the smallest size class.
+#define kSmallestSizeClassShift (8)
 
-//! @brief Append a buffer to the end of the list.
-- (void)addBuffer:(BufferInfo_t *)buffer
+//! Size class of buffers too big to pool. These are allocated and freed directly.
+#define kLargeBufferClass (0xffffffffU)
+
+//! Value stored in each header, used to catch buffers that didn't come from a pool.
+#define kBufferMagic (0x42756650U)
+
+//! Largest buffer kept in a thread's private cache.
+#define kThreadCacheMaxSize (64 * 1024)
+
+//! Idle budget of a new pool.
+#define kDefaultIdleBudget (16 * 1024 * 1024)
+
+//! Longest a waiting acquire sleeps before checking the free queues again.
+#define kWaitPollInterval (100)
+
+/*!
+ * @brief Header placed in front of every buffer.
+ */
+typedef struct _BufferHeader
+{
+    struct _BufferHeader * link;    //!< Link used by the shared free queue.
+    size_t capacity;                //!< Number of usable bytes following the header.
+    uint32_t sizeClass;             //!< Index of the size class, or kLargeBufferClass.
+    uint32_t magic;                 //!< Always kBufferMagic.
+} BufferHeader_t;
+
+/*!
+ * @brief One thread's private stack of free buffers for each of the smaller size classes.
+ */
+typedef struct _ThreadCache
+{
+    BufferPool * pool;
+    unsigned count[kBufferSizeClassCount];
+    BufferHeader_t * buffers[kBufferSizeClassCount][kBufferThreadCacheDepth];
+} ThreadCache_t;
+
+//! Returns the size class that fits @a length bytes.
+static inline uint32_t SizeClassForLength(size_t length)
+{
+    uint32_t sizeClass = 0;
+    size_t capacity = 1 << kSmallestSizeClassShift;
+    while (capacity < length)
+    {
+        capacity <<= 1;
+        if (++sizeClass >= kBufferSizeClassCount)
+        {
+            return kLargeBufferClass;
+        }
+    }
+    return sizeClass;
+}
+
+//! Returns the number of bytes in a buffer of the given size class.
+static inline size_t CapacityOfSizeClass(uint32_t sizeClass)
+{
+    return (size_t)1 << (sizeClass + kSmallestSizeClassShift);
+}
+
+static inline BufferHeader_t * HeaderForBuffer(const uint8_t * buf)
+{
+    return (BufferHeader_t *)(buf - kBufferHeaderSize);
+}
+
+static inline uint8_t * BufferForHeader(BufferHeader_t * header)
+{
+    return (uint8_t *)header + kBufferHeaderSize;
+}
+
+@interface BufferPool ()
+
+- (BufferHeader_t *)allocateBufferWithClass:(uint32_t)sizeClass capacity:(size_t)capacity;
+- (BufferHeader_t *)growBufferToClass:(uint32_t)sizeClass;
+- (BufferHeader_t *)waitForBufferWithClass:(uint32_t)sizeClass capacity:(size_t)capacity options:(uint32_t)options;
+- (void)putBuffer:(BufferHeader_t *)header;
+- (void)freeBuffer:(BufferHeader_t *)header;
+- (void)flushThreadCache:(ThreadCache_t *)cache;
+
+@end
+
+//! Returns a thread's cached buffers to the pool's shared queues when the thread exits.
+static void ThreadCacheDestructor(void * value)
+{
+    ThreadCache_t * cache = (ThreadCache_t *)value;
+    [cache->pool flushThreadCache:cache];
+    free(cache);
+}
+
+@implementation BufferPool
+
++ (BufferPool *)sharedPool
 {
-    assert(buffer);
+    static BufferPool * s_sharedPool = nil;
+    static dispatch_once_t s_once;
+    dispatch_once(&s_once, ^{
+        s_sharedPool = [[BufferPool alloc] init];
+    });
+    return s_sharedPool;
+}
+
+- (id)init
+{
+    if ((self = [super init]))
+    {
+        unsigned i;
+        for (i = 0; i < kBufferSizeClassCount; ++i)
+        {
+            OSQueueHead emptyQueue = OS_ATOMIC_QUEUE_INIT;
+            _freeBuffers[i] = emptyQueue;
+        }
+        
+        pthread_key_create(&_cacheKey, ThreadCacheDestructor);
+        pthread_mutex_init(&_waitLock, NULL);
+        pthread_cond_init(&_bufferReleased, NULL);
+        _idleBudget = kDefaultIdleBudget;
+    }
+    
+    return self;
+}
 
-    _count++;
+//! Buffers in the private caches of threads other than the calling one are leaked, so a
+//! pool should only be destroyed once the other threads that used it have exited.
+- (void)dealloc
+{
+    // Drop the calling thread's cache. The key is deleted first so the destructor doesn't
+    // run for it later.
+    ThreadCache_t * cache = (ThreadCache_t *)pthread_getspecific(_cacheKey);
+    pthread_key_delete(_cacheKey);
+    if (cache)
+    {
+        uint32_t sizeClass;
+        for (sizeClass = 0; sizeClass < kBufferSizeClassCount; ++sizeClass)
+        {
+            while (cache->count[sizeClass])
+            {
+                free(cache->buffers[sizeClass][--cache->count[sizeClass]]);
+            }
+        }
+        free(cache);
+    }
     
-    // Handle an empty list.
-    if (!_tail)
+    // Free everything on the shared queues.
+    uint32_t sizeClass;
+    for (sizeClass = 0; sizeClass < kBufferSizeClassCount; ++sizeClass)
     {
-        _head = buffer;
-        _tail = buffer;
-        buffer->next = NULL;
-        buffer->prev = NULL;
-        return;
+        BufferHeader_t * header;
+        while ((header = (BufferHeader_t *)OSAtomicDequeue(&_freeBuffers[sizeClass], offsetof(BufferHeader_t, link))))
+        {
+            free(header);
+        }
     }
     
-    buffer->next = NULL;
-    buffer->prev = _tail;
-    _tail->next = buffer;
-    _tail = buffer;
+    pthread_cond_destroy(&_bufferReleased);
+    pthread_mutex_destroy(&_waitLock);
+    
+    [super dealloc];
+}
+
+- (int64_t)idleBudget
+{
+    return _idleBudget;
+}
+
+- (void)setIdleBudget:(int64_t)budget
+{
+    _idleBudget = budget;
+    [self trim];
+}
+
+- (int64_t)byteLimit
+{
+    return _byteLimit;
 }
 
-//! @brief Remove a buffer from a list.
-//! @pre The buffer must already be linked into the list.
-- (void)removeBuffer:(BufferInfo_t *)buffer
+- (void)setByteLimit:(int64_t)limit
 {
-    assert(buffer);
+    _byteLimit = limit;
+}
+
+- (uint8_t *)acquireBufferWithLength:(size_t)length options:(uint32_t)options
+{
+    uint32_t sizeClass = SizeClassForLength(length);
+    size_t capacity = (sizeClass == kLargeBufferClass) ? length : CapacityOfSizeClass(sizeClass);
+    BufferHeader_t * header = NULL;
+    
+    if (sizeClass != kLargeBufferClass)
+    {
+        // Try this thread's private cache first.
+        ThreadCache_t * cache = (ThreadCache_t *)pthread_getspecific(_cacheKey);
+        if (cache && cache->count[sizeClass])
+        {
+            header = cache->buffers[sizeClass][--cache->count[sizeClass]];
+        }
+        // Then the shared queue.
+        else
+        {
+            header = (BufferHeader_t *)OSAtomicDequeue(&_freeBuffers[sizeClass], offsetof(BufferHeader_t, link));
+        }
+        
+        if (header)
+        {
+            OSAtomicIncrement64(&_stats.hits);
+            OSAtomicAdd64Barrier(-(int64_t)capacity, &_stats.bytesIdle);
+            return BufferForHeader(header);
+        }
+        
+        // Reuse the memory of a smaller idle buffer if we're allowed to.
+        if ((options & kBufferOptionGrow) && (header = [self growBufferToClass:sizeClass]))
+        {
+            return BufferForHeader(header);
+        }
+    }
     
-    // Update head and tail pointers.
-    if (buffer == _head)
+    if ((options & kBufferOptionAllocate) && (header = [self allocateBufferWithClass:sizeClass capacity:capacity]))
     {
-        _head = buffer->next;
+        return BufferForHeader(header);
     }
-    if (buffer == _tail)
+    
+    if (options & kBufferOptionWait)
     {
-        _tail = buffer->prev;
+        header = [self waitForBufferWithClass:sizeClass capacity:capacity options:options];
+        return BufferForHeader(header);
     }
     
-    _count--;
+    return NULL;
+}
+
+- (void)releaseBuffer:(const uint8_t *)buf
+{
+    if (!buf)
+    {
+        return;
+    }
     
-    // Unlink the buffer.
-    if (buffer->prev)
+    BufferHeader_t * header = HeaderForBuffer(buf);
+    if (header->magic != kBufferMagic)
     {
-        buffer->prev->next = buffer->next;
+        NSLog(@"%s: buffer %p not owned by pool %p", __func__, buf, self);
+        return;
     }
-    if (buffer->next)
+    
+    // Small buffers go to this thread's private cache, unless another thread is waiting.
+    if (header->capacity <= kThreadCacheMaxSize && _waiterCount == 0)
     {
-        buffer->next->prev = buffer->prev;
+        ThreadCache_t * cache = (ThreadCache_t *)pthread_getspecific(_cacheKey);
+        if (!cache)
+        {
+            cache = (ThreadCache_t *)calloc(1, sizeof(ThreadCache_t));
+            if (cache)
+            {
+                cache->pool = self;
+                pthread_setspecific(_cacheKey, cache);
+            }
+        }
+        
+        if (cache && cache->count[header->sizeClass] < kBufferThreadCacheDepth)
+        {
+            cache->buffers[header->sizeClass][cache->count[header->sizeClass]++] = header;
+            OSAtomicAdd64Barrier(header->capacity, &_stats.bytesIdle);
+            return;
+        }
     }
     
-    // Clear the buffer's links.
-    buffer->next = NULL;
-    buffer->prev = NULL;
+    [self putBuffer:header];
 }
 
-@end
-
-@implementation BufferPool
+- (size_t)capacityOfBuffer:(const uint8_t *)buf
+{
+    return buf ? HeaderForBuffer(buf)->capacity : 0;
+}
 
-- (id)init
+- (void)trim
 {
-    if ((self = [super init]))
+    // Free the largest buffers first, since they are the least likely to be needed again.
+    uint32_t sizeClass = kBufferSizeClassCount;
+    while (sizeClass-- && _stats.bytesIdle > _idleBudget)
     {
-        _freeBuffers = [[BufferList alloc] init];
-        _activeBuffers = [[BufferList alloc] init];
+        BufferHeader_t * header;
+        while (_stats.bytesIdle > _idleBudget && (header = (BufferHeader_t *)OSAtomicDequeue(&_freeBuffers[sizeClass], offsetof(BufferHeader_t, link))))
+        {
+            OSAtomicAdd64Barrier(-(int64_t)header->capacity, &_stats.bytesIdle);
+            OSAtomicIncrement64(&_stats.trimmed);
+            [self freeBuffer:header];
+        }
     }
-    
-    return self;
 }
 
-- (void)dealloc
+- (void)getStatistics:(BufferPoolStatistics_t *)stats
+{
+    OSMemoryBarrier();
+    *stats = _stats;
+}
+
+//! Allocates a new buffer, unless that would put the pool over its byte limit.
+- (BufferHeader_t *)allocateBufferWithClass:(uint32_t)sizeClass capacity:(size_t)capacity
 {
-    BufferInfo_t * cursor;
-    BufferInfo_t * temp;
+    int64_t held = OSAtomicAdd64Barrier(capacity, &_stats.bytesHeld);
+    if (_byteLimit && held > _byteLimit)
+    {
+        OSAtomicAdd64Barrier(-(int64_t)capacity, &_stats.bytesHeld);
+        return NULL;
+    }
     
-    // Free all active buffers.
-    cursor = _activeBuffers.head;
-    while (cursor)
+    BufferHeader_t * header = (BufferHeader_t *)malloc(kBufferHeaderSize + capacity);
+    if (!header)
     {
-        temp = cursor->next;
-        free(cursor->data);
-        free(cursor);
-        cursor = temp;
+        NSLog(@"%s: failed to allocate buffer (len=%lu)", __func__, (unsigned long)capacity);
+        OSAtomicAdd64Barrier(-(int64_t)capacity, &_stats.bytesHeld);
+        return NULL;
     }
     
-    // Free all free buffers.
-    cursor = _freeBuffers.head;
-    while (cursor)
+    header->link = NULL;
+    header->capacity = capacity;
+    header->sizeClass = sizeClass;
+    header->magic = kBufferMagic;
+    
+    OSAtomicIncrement64(&_stats.misses);
+    
+    // Update the high water mark.
+    int64_t peak;
+    while (held > (peak = _stats.peakBytes) && !OSAtomicCompareAndSwap64Barrier(peak, held, &_stats.peakBytes))
     {
-        temp = cursor->next;
-        free(cursor->data);
-        free(cursor);
-        cursor = temp;
     }
     
-    [super dealloc];
+    return header;
 }
 
-- (uint8_t *)acquireBufferWithLength:(size_t)length options:(uint32_t)options
+//! Takes the largest idle buffer smaller than the given size class and reallocates it.
+- (BufferHeader_t *)growBufferToClass:(uint32_t)sizeClass
 {
-    @synchronized(self)
+    size_t capacity = CapacityOfSizeClass(sizeClass);
+    uint32_t smallerClass = sizeClass;
+    while (smallerClass--)
     {
-        // Scan the free list for a buffer of the required size.
-        BufferInfo_t * cursor = _freeBuffers.head;
-        while (cursor)
+        BufferHeader_t * header = (BufferHeader_t *)OSAtomicDequeue(&_freeBuffers[smallerClass], offsetof(BufferHeader_t, link));
+        if (!header)
         {
-            if (cursor->length >= length)
-            {
-                // Move this buffer to the active list.
-                [_freeBuffers removeBuffer:cursor];
-                [_activeBuffers addBuffer:cursor];
-                return cursor->data;
-            }
-            
-            cursor = cursor->next;
+            continue;
         }
         
-        // If we exit the loop, then we didn't find a matching buffer.
-        if (options | kBufferOptionAllocate)
-        {
-            // Allocate the buffer descriptor.
-            BufferInfo_t * newBuffer = (BufferInfo_t *)malloc(sizeof(BufferInfo_t));
-            assert(newBuffer);
-            
-            // Allocate the buffer itself and fill in the descriptor.
-            newBuffer->length = length;
-            newBuffer->data = (uint8_t *)malloc(length);
-            if (!newBuffer->data)
-            {
-                NSLog(@"%s: failed to allocate buffer (len=%lu) (%d active, %d free)", __func__, length, _activeBuffers.count, _freeBuffers.count);
-            }
-            assert(newBuffer->data);
-            
-            // Insert the new buffer into the list of active buffers.
-            [_activeBuffers addBuffer:newBuffer];
-            
-            if (_activeBuffers.count > 5000)
-            {
-                NSLog(@"too many buffers have been allocated!");
-            }
-            
-            return newBuffer->data;
+        size_t oldCapacity = header->capacity;
+        int64_t held = OSAtomicAdd64Barrier(capacity - oldCapacity, &_stats.bytesHeld);
+        BufferHeader_t * grown = NULL;
+        if (!_byteLimit || held <= _byteLimit)
+        {
+            grown = (BufferHeader_t *)realloc(header, kBufferHeaderSize + capacity);
         }
-    }
+        if (!grown)
+        {
+            // Put the buffer back untouched.
+            OSAtomicAdd64Barrier(oldCapacity - capacity, &_stats.bytesHeld);
+            OSAtomicEnqueue(&_freeBuffers[smallerClass], header, offsetof(BufferHeader_t, link));
+            return NULL;
+        }
+        
+        grown->capacity = capacity;
+        grown->sizeClass = sizeClass;
+        OSAtomicAdd64Barrier(-(int64_t)oldCapacity, &_stats.bytesIdle);
+        OSAtomicIncrement64(&_stats.grows);
         
+        int64_t peak;
+        while (held > (peak = _stats.peakBytes) && !OSAtomicCompareAndSwap64Barrier(peak, held, &_stats.peakBytes))
+        {
+        }
+        
+        return grown;
+    }
+    
     return NULL;
 }
 
-- (void)releaseBuffer:(const uint8_t *)buf
+//! Blocks until a buffer of the size class is released, or one can be allocated within
+//! the pool's byte limit.
+- (BufferHeader_t *)waitForBufferWithClass:(uint32_t)sizeClass capacity:(size_t)capacity options:(uint32_t)options
 {
-    @synchronized(self)
+    BufferHeader_t * header = NULL;
+    
+    OSAtomicIncrement64(&_stats.waits);
+    OSAtomicIncrement32Barrier(&_waiterCount);
+    pthread_mutex_lock(&_waitLock);
+    
+    while (!header)
     {
-        // Search the active buffer list for the data pointer.
-        BufferInfo_t * cursor = _activeBuffers.head;
-        while (cursor)
+        if (sizeClass != kLargeBufferClass)
         {
-            if (cursor->data == buf)
+            header = (BufferHeader_t *)OSAtomicDequeue(&_freeBuffers[sizeClass], offsetof(BufferHeader_t, link));
+            if (header)
             {
-                // We found it; move this buffer back to the free list.
-                [_activeBuffers removeBuffer:cursor];
-                [_freeBuffers addBuffer:cursor];
-                return;
+                OSAtomicIncrement64(&_stats.hits);
+                OSAtomicAdd64Barrier(-(int64_t)capacity, &_stats.bytesIdle);
+                break;
             }
-            
-            cursor = cursor->next;
         }
         
-        // We exited the loop, meaning that the given buffer pointer wasn't one of the buffers
-        // managed by this buffer pool.
-        NSLog(@"%s: buffer 0x%08x not owned by pool 0x%08x", __func__, (unsigned int)buf, (unsigned int)self);
+        if ((options & kBufferOptionAllocate) && (header = [self allocateBufferWithClass:sizeClass capacity:capacity]))
+        {
+            break;
+        }
+        
+        // Wake up periodically in case a release was missed.
+        struct timeval now;
+        struct timespec timeout;
+        gettimeofday(&now, NULL);
+        timeout.tv_sec = now.tv_sec;
+        timeout.tv_nsec = now.tv_usec * 1000 + kWaitPollInterval * 1000000;
+        if (timeout.tv_nsec >= 1000000000)
+        {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&_bufferReleased, &_waitLock, &timeout);
     }
+    
+    pthread_mutex_unlock(&_waitLock);
+    OSAtomicDecrement32Barrier(&_waiterCount);
+    
+    return header;
 }
 
-@end
+//! Puts a buffer on its shared free queue, or frees it if the pool is over its idle budget.
+- (void)putBuffer:(BufferHeader_t *)header
+{
+    if (header->sizeClass == kLargeBufferClass || _stats.bytesIdle + (int64_t)header->capacity > _idleBudget)
+    {
+        if (header->sizeClass != kLargeBufferClass)
+        {
+            OSAtomicIncrement64(&_stats.trimmed);
+        }
+        [self freeBuffer:header];
+    }
+    else
+    {
+        OSAtomicAdd64Barrier(header->capacity, &_stats.bytesIdle);
+        OSAtomicEnqueue(&_freeBuffers[header->sizeClass], header, offsetof(BufferHeader_t, link));
+    }
+    
+    // Wake anyone waiting for a buffer, whether it was queued or freed below the byte limit.
+    if (_waiterCount)
+    {
+        pthread_mutex_lock(&_waitLock);
+        pthread_cond_broadcast(&_bufferReleased);
+        pthread_mutex_unlock(&_waitLock);
+    }
+}
 
+- (void)flushThreadCache:(ThreadCache_t *)cache
+{
+    uint32_t sizeClass;
+    for (sizeClass = 0; sizeClass < kBufferSizeClassCount; ++sizeClass)
+    {
+        while (cache->count[sizeClass])
+        {
+            BufferHeader_t * header = cache->buffers[sizeClass][--cache->count[sizeClass]];
+            OSAtomicAdd64Barrier(-(int64_t)header->capacity, &_stats.bytesIdle);
+            [self putBuffer:header];
+        }
+    }
+}
+
+- (void)freeBuffer:(BufferHeader_t *)header
+{
+    OSAtomicAdd64Barrier(-(int64_t)header->capacity, &_stats.bytesHeld);
+    header->magic = 0;
+    free(header);
+}
+
+@end
@@ -19,6 +19,10 @@
  */
 
 #import "ByteBlockReader.h"
+#import "BufferPool.h"
+
+//! Blocks smaller than this always keep their buffer when the block size shrinks.
+#define kShrinkThreshold (64 * 1024)
 
 @implementation ByteBlockReader
 
@@ -32,20 +36,20 @@
 
 - (void)dealloc
 {
-    if(buffer) {
-        free(buffer);
-    }
+    [[BufferPool sharedPool] releaseBuffer:(uint8_t *)buffer];
     [super dealloc];
 }
 
 - (void)setBufferSize:(unsigned)aSize
 {
-    if(aSize > capacity) {
-        capacity = aSize;
-        if(buffer) {
-            free(buffer);
-        }
-        buffer = malloc(aSize);
+    // Swap in a buffer from the pool when the block no longer fits. A large buffer is also
+    // handed back once blocks get much smaller, so a burst of big rects doesn't pin its memory.
+    if ((aSize > capacity) || (capacity > kShrinkThreshold && aSize < capacity / 4))
+    {
+        BufferPool * pool = [BufferPool sharedPool];
+        [pool releaseBuffer:(uint8_t *)buffer];
+        buffer = (char *)[pool acquireBufferWithLength:aSize options:kBufferOptionAllocate];
+        capacity = (unsigned)[pool capacityOfBuffer:(uint8_t *)buffer];
     }
     size = aSize;
 }
@@ -19,55 +19,12 @@
  */
 
 #import "CoRREEncodingReader.h"
-#import "ByteBlockReader.h"
-#import "RectangleList.h"
 
 @implementation CoRREEncodingReader
 
-- (void)setBackground:(NSData*)data
+- (unsigned)subrectangleGeometrySize
 {
-    [frameBuffer fillRect:frame withPixel:(unsigned char*)[data bytes]];
-    if(useList) {
-        float	rgb[3];
-        [frameBuffer getRGB:rgb fromPixel:(unsigned char*)[data bytes]];
-        [rectList putRectangle:frame withColor:rgb];
-    }
-    if(numOfSubRects) {
-        int size = ([frameBuffer bytesPerPixel] + 4) * numOfSubRects;
-#ifdef COLLECT_STATS
-        bytesTransferred += size;
-#endif
-        [subRectReader setBufferSize:size];
-        [target setReader:subRectReader];
-    } else {
-        [target performSelector:action withObject:self];
-    }
-}
-
-- (void)drawRectangles:(NSData*)data
-{
-    unsigned char*	bytes = (unsigned char*)[data bytes];
-    unsigned char*	pixptr;
-    float		rgb[3];
-    NSRect		r;
-    unsigned int	bpp = [frameBuffer bytesPerPixel];
-
-    while(numOfSubRects--) {
-        if(useList) {
-            [frameBuffer getRGB:rgb fromPixel:bytes];
-        }
-        pixptr = bytes;
-        bytes += bpp;
-        r.origin.x = *bytes++ + frame.origin.x;
-        r.origin.y = *bytes++ + frame.origin.y;
-        r.size.width = *bytes++;
-        r.size.height = *bytes++;
-        [frameBuffer fillRect:r withPixel:pixptr];
-        if(useList) {
-            [rectList putRectangle:r withColor:rgb];
-        }
-    }
-    [target performSelector:action withObject:self];
+    return kCoRRESubrectGeometry;
 }
 
 @end
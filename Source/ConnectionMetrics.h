@@ -18,9 +18,27 @@
  */
 
 #import <Cocoa/Cocoa.h>
+#import "SendQueue.h"
 
 @class ConnectionMetrics;
 
+//! Most distinct encodings that byte, rectangle and pixel counts are kept for.
+#define kMaxEncodingStatistics (16)
+
+//! Updates at the start of a connection whose heap allocations aren't counted as steady state,
+//! while buffers and tables are still growing to their working size.
+#define kAllocationWarmupUpdates (16)
+
+//! @brief Counts for the rectangles of one encoding.
+typedef struct _EncodingStatistics
+{
+    int32_t encoding;   //!< RFB encoding number.
+    uint32_t rects;     //!< Number of rectangles.
+    uint64_t pixels;    //!< Number of pixels covered by the rectangles.
+    uint64_t bytes;     //!< Bytes of rectangle data received, not including rectangle headers.
+    uint64_t firstPixelNanoseconds; //!< Sum of the times from each rectangle header to its first drawn pixels.
+} EncodingStatistics_t;
+
 /*!
  * @brief Protocol for delegates of ConnectionMetrics.
  */
@@ -56,6 +74,35 @@
     double _sentThroughput;     //!< Bytes per second of data sent to the server.
     double _peakSentThroughput; //!< Maximum bytes per second.
     id<MetricsDelegate> _delegate;
+    uint64_t _readNanoseconds;      //!< Time spent by the reader stage.
+    uint64_t _decodeNanoseconds;    //!< Time spent by the decode stage.
+    uint64_t _queueDelayNanoseconds;    //!< Total time received data waited for the decode stage.
+    uint64_t _queuedBytesSum;       //!< Sum of the receive queue occupancy samples.
+    uint32_t _decodeBatches;        //!< Number of times the decode stage ran.
+    uint32_t _peakQueuedBytes;      //!< Most bytes ever waiting in the receive queue.
+    uint32_t _readerPauses;         //!< Number of times the reader stopped because the queue was full.
+    uint64_t _pendingRequestTime;   //!< Time the oldest unanswered update request was sent.
+    uint64_t _currentUpdateRequestTime; //!< Time the request answered by the current update was sent.
+    uint64_t _updateLatencySum;     //!< Sum of request-to-completion times of all updates.
+    uint32_t _updatesCompleted;     //!< Number of updates that have been completely decoded.
+    uint32_t _updatesSeen;          //!< Number of updates that have begun, answered or not.
+    int64_t _updateAllocationStart; //!< Allocation count when the current update began.
+    uint32_t _updateRectStart;      //!< Rectangle count when the current update began.
+    uint32_t _steadyUpdates;        //!< Updates completed after the warmup updates.
+    uint32_t _steadyRects;          //!< Rectangles in those updates.
+    uint64_t _steadyAllocations;    //!< Heap allocations made during those updates.
+    uint32_t _allocatingUpdates;    //!< Number of those updates that allocated at all.
+    SendQueueStatistics_t _sendStatistics;  //!< Latest snapshot of the send queue statistics.
+    uint32_t _scrollEvents;         //!< Number of local scroll wheel events.
+    uint32_t _scrollClicks;         //!< Number of wheel clicks sent for those events.
+    EncodingStatistics_t _encodingStatistics[kMaxEncodingStatistics];
+    unsigned _encodingCount;        //!< Number of used entries in _encodingStatistics.
+    int _currentEncodingIndex;      //!< Entry for the rectangle being decoded, or -1 between rectangles.
+    int _decodeCallEncodingIndex;   //!< Entry that was current when the last reader call started.
+    uint32_t _attributedBytes;      //!< Bytes of the current reader call already counted for an encoding.
+    uint64_t _overheadBytes;        //!< Decoded bytes that weren't rectangle data.
+    uint64_t _rectStartTime;        //!< Time the current rectangle's header was read.
+    BOOL _rectDrewPixels;           //!< Whether the current rectangle's first pixels were counted.
 }
 
 @property(readonly) uint64_t bytesReceived;
@@ -73,6 +120,16 @@
 @property(readonly) double peakPixelThroughput;
 @property(readonly) double sentThroughput;
 @property(readonly) double peakSentThroughput;
+@property(readonly) uint64_t readNanoseconds;
+@property(readonly) uint64_t decodeNanoseconds;
+@property(readonly) uint32_t peakQueuedBytes;
+@property(readonly) uint32_t readerPauses;
+@property(readonly) double averageQueuedBytes;
+@property(readonly) double averageQueueDelay;   //!< Seconds data waited between the reader and decode stages.
+@property(readonly) double averageUpdateLatency;    //!< Seconds from update request to the update being decoded.
+@property(readonly) uint32_t updatesCompleted;
+@property(readonly) uint32_t scrollEvents;
+@property(readonly) uint32_t scrollClicks;
 
 @property(nonatomic, assign) id<MetricsDelegate> delegate;
 
@@ -87,5 +144,67 @@
 - (void)addRect:(NSRect)pixelRect;
 - (void)addUpdateRequest;
 
+//! @name Receive pipeline
+//@{
+- (void)addReadTime:(uint64_t)nanoseconds;
+- (void)addDecodeTime:(uint64_t)nanoseconds queueDelay:(uint64_t)delay queuedBytes:(uint32_t)byteCount;
+- (void)addReaderPause;
+//@}
+
+//! @name Update latency
+//!
+//! While AllocationCounter is counting, the heap allocations made between the beginning and
+//! end of each update after the first kAllocationWarmupUpdates are also added up. Decoding
+//! and drawing an update in steady state shouldn't allocate, so any that do show up in
+//! allocatingUpdates.
+//@{
+- (void)updateDidBegin;
+- (void)updateDidComplete;
+
+@property(readonly) uint32_t steadyUpdates;
+@property(readonly) uint32_t steadyRects;
+@property(readonly) uint64_t steadyAllocations;
+@property(readonly) uint32_t allocatingUpdates;
+//@}
+
+//! @name Send queue
+//@{
+- (void)setSendQueueStatistics:(const SendQueueStatistics_t *)stats;
+
+//! @brief Average seconds messages of the given class waited in the send queue.
+- (double)averageSendQueueDelayForClass:(unsigned)messageClass;
+//@}
+
+//! @name Encodings
+//!
+//! The decode stage reports every reader call with -addDecodedBytes:. Bytes are counted for
+//! the encoding of the rectangle that was being decoded when the call started, so calls that
+//! finish a rectangle are still counted for it. Readers that decode whole rectangles inside
+//! one call report them separately with -addRectangleBytes:.
+//!
+//! The time to a rectangle's first pixels ends when its reader sends -rectDidDrawPixels, or
+//! when the rectangle ends for readers that only draw complete rectangles.
+//@{
+- (void)rectDidBeginWithEncoding:(int32_t)encoding pixels:(uint64_t)pixelCount;
+- (void)rectDidDrawPixels;
+- (void)rectDidEnd;
+- (void)addRectangleBytes:(uint32_t)byteCount;
+- (void)addDecodedBytes:(uint32_t)byteCount;
+
+//! @brief Copy the per-encoding counts.
+//! @return Number of entries written to @a stats, at most kMaxEncodingStatistics.
+- (unsigned)getEncodingStatistics:(EncodingStatistics_t *)stats;
+
+@property(readonly) uint64_t overheadBytes;
+//@}
+
+//! @name Input
+//@{
+- (void)addScrollEventWithClicks:(unsigned)clickCount;
+//@}
+
+//! @brief Log a summary of the receive pipeline statistics.
+- (void)logPipelineSummary;
+
 @end
 
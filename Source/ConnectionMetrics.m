@@ -18,6 +18,7 @@
  */
 
 #import "ConnectionMetrics.h"
+#import "AllocationCounter.h"
 #import <CoreAudio/CoreAudio.h>
 
 @interface ConnectionMetrics ()
@@ -43,6 +44,18 @@
 @synthesize sentThroughput = _sentThroughput;
 @synthesize peakSentThroughput = _peakSentThroughput;
 @synthesize delegate = _delegate;
+@synthesize readNanoseconds = _readNanoseconds;
+@synthesize decodeNanoseconds = _decodeNanoseconds;
+@synthesize peakQueuedBytes = _peakQueuedBytes;
+@synthesize readerPauses = _readerPauses;
+@synthesize updatesCompleted = _updatesCompleted;
+@synthesize scrollEvents = _scrollEvents;
+@synthesize scrollClicks = _scrollClicks;
+@synthesize overheadBytes = _overheadBytes;
+@synthesize steadyUpdates = _steadyUpdates;
+@synthesize steadyRects = _steadyRects;
+@synthesize steadyAllocations = _steadyAllocations;
+@synthesize allocatingUpdates = _allocatingUpdates;
 
 - (id)init
 {
@@ -50,6 +63,8 @@
     {
         _startTime = AudioConvertHostTimeToNanos(AudioGetCurrentHostTime());
         _lastTimestamp = _startTime;
+        _currentEncodingIndex = -1;
+        _decodeCallEncodingIndex = -1;
         _timer = [[NSTimer scheduledTimerWithTimeInterval:1.0 target:self selector:@selector(updateMetrics:) userInfo:nil repeats:YES] retain];
     }
     
@@ -145,6 +160,198 @@
 - (void)addUpdateRequest
 {
     _totalRequests++;
+    
+    if (!_pendingRequestTime)
+    {
+        _pendingRequestTime = AudioConvertHostTimeToNanos(AudioGetCurrentHostTime());
+    }
+}
+
+- (void)addReadTime:(uint64_t)nanoseconds
+{
+    _readNanoseconds += nanoseconds;
+}
+
+- (void)addDecodeTime:(uint64_t)nanoseconds queueDelay:(uint64_t)delay queuedBytes:(uint32_t)byteCount
+{
+    _decodeNanoseconds += nanoseconds;
+    _queueDelayNanoseconds += delay;
+    _queuedBytesSum += byteCount;
+    _decodeBatches++;
+    
+    if (byteCount > _peakQueuedBytes)
+    {
+        _peakQueuedBytes = byteCount;
+    }
+}
+
+- (void)addReaderPause
+{
+    _readerPauses++;
+}
+
+- (double)averageQueuedBytes
+{
+    return _decodeBatches ? (double)_queuedBytesSum / (double)_decodeBatches : 0.0;
+}
+
+- (double)averageQueueDelay
+{
+    return _decodeBatches ? (double)_queueDelayNanoseconds / (double)_decodeBatches / 1.0e9 : 0.0;
+}
+
+//! The update being started answers the oldest outstanding request. Requests sent from
+//! now on are answered by later updates.
+- (void)updateDidBegin
+{
+    _currentUpdateRequestTime = _pendingRequestTime;
+    _pendingRequestTime = 0;
+    _updatesSeen++;
+    _updateRectStart = _totalRects;
+    _updateAllocationStart = AllocationCounterGetCount();
+}
+
+- (void)updateDidComplete
+{
+    if (_currentUpdateRequestTime)
+    {
+        _updateLatencySum += AudioConvertHostTimeToNanos(AudioGetCurrentHostTime()) - _currentUpdateRequestTime;
+        _updatesCompleted++;
+        _currentUpdateRequestTime = 0;
+    }
+    
+    if (_updatesSeen > kAllocationWarmupUpdates)
+    {
+        int64_t allocations = AllocationCounterGetCount() - _updateAllocationStart;
+        
+        _steadyUpdates++;
+        _steadyRects += _totalRects - _updateRectStart;
+        if (allocations > 0)
+        {
+            _steadyAllocations += allocations;
+            _allocatingUpdates++;
+        }
+    }
+}
+
+- (double)averageUpdateLatency
+{
+    return _updatesCompleted ? (double)_updateLatencySum / (double)_updatesCompleted / 1.0e9 : 0.0;
+}
+
+- (void)setSendQueueStatistics:(const SendQueueStatistics_t *)stats
+{
+    _sendStatistics = *stats;
+}
+
+- (double)averageSendQueueDelayForClass:(unsigned)messageClass
+{
+    if (messageClass >= kSendClassCount || !_sendStatistics.messages[messageClass])
+    {
+        return 0.0;
+    }
+    return (double)_sendStatistics.queuedNanoseconds[messageClass] / (double)_sendStatistics.messages[messageClass] / 1.0e9;
+}
+
+- (void)addScrollEventWithClicks:(unsigned)clickCount
+{
+    _scrollEvents++;
+    _scrollClicks += clickCount;
+}
+
+- (void)rectDidBeginWithEncoding:(int32_t)encoding pixels:(uint64_t)pixelCount
+{
+    unsigned i;
+    for (i = 0; i < _encodingCount && _encodingStatistics[i].encoding != encoding; ++i)
+    {
+    }
+    
+    if (i == _encodingCount)
+    {
+        // Count anything past the table limit as overhead.
+        if (_encodingCount == kMaxEncodingStatistics)
+        {
+            _currentEncodingIndex = -1;
+            return;
+        }
+        
+        _encodingStatistics[i].encoding = encoding;
+        _encodingCount++;
+    }
+    
+    _encodingStatistics[i].rects++;
+    _encodingStatistics[i].pixels += pixelCount;
+    _currentEncodingIndex = i;
+    _rectStartTime = AudioConvertHostTimeToNanos(AudioGetCurrentHostTime());
+    _rectDrewPixels = NO;
+}
+
+- (void)rectDidDrawPixels
+{
+    if (_currentEncodingIndex >= 0 && !_rectDrewPixels)
+    {
+        _encodingStatistics[_currentEncodingIndex].firstPixelNanoseconds += AudioConvertHostTimeToNanos(AudioGetCurrentHostTime()) - _rectStartTime;
+        _rectDrewPixels = YES;
+    }
+}
+
+- (void)rectDidEnd
+{
+    [self rectDidDrawPixels];
+    _currentEncodingIndex = -1;
+}
+
+- (void)addRectangleBytes:(uint32_t)byteCount
+{
+    if (_currentEncodingIndex >= 0)
+    {
+        _encodingStatistics[_currentEncodingIndex].bytes += byteCount;
+    }
+    else
+    {
+        _overheadBytes += byteCount;
+    }
+    _attributedBytes += byteCount;
+}
+
+- (void)addDecodedBytes:(uint32_t)byteCount
+{
+    uint32_t remaining = byteCount > _attributedBytes ? byteCount - _attributedBytes : 0;
+    
+    if (_decodeCallEncodingIndex >= 0)
+    {
+        _encodingStatistics[_decodeCallEncodingIndex].bytes += remaining;
+    }
+    else
+    {
+        _overheadBytes += remaining;
+    }
+    
+    // The next call starts with whatever rectangle is current now.
+    _attributedBytes = 0;
+    _decodeCallEncodingIndex = _currentEncodingIndex;
+}
+
+- (unsigned)getEncodingStatistics:(EncodingStatistics_t *)stats
+{
+    memcpy(stats, _encodingStatistics, _encodingCount * sizeof(EncodingStatistics_t));
+    return _encodingCount;
+}
+
+- (void)logPipelineSummary
+{
+    NSLog(@"receive pipeline: read %.3f s, decode %.3f s, %u decode batches, queue avg %.0f bytes peak %u bytes, avg wait %.3f ms, %u reader pauses",
+        (double)_readNanoseconds / 1.0e9, (double)_decodeNanoseconds / 1.0e9, _decodeBatches,
+        self.averageQueuedBytes, _peakQueuedBytes, self.averageQueueDelay * 1000.0, _readerPauses);
+    NSLog(@"update latency: %u updates, avg %.3f ms", _updatesCompleted, self.averageUpdateLatency * 1000.0);
+    NSLog(@"send queue: %llu bytes in %llu writes; input %llu msgs avg %.3f ms max %.3f ms; control %llu msgs avg %.3f ms; clipboard %llu msgs avg %.3f ms",
+        _sendStatistics.bytesWritten, _sendStatistics.writeCalls,
+        _sendStatistics.messages[kSendClassInput], [self averageSendQueueDelayForClass:kSendClassInput] * 1000.0,
+        (double)_sendStatistics.maxQueuedNanoseconds[kSendClassInput] / 1.0e6,
+        _sendStatistics.messages[kSendClassControl], [self averageSendQueueDelayForClass:kSendClassControl] * 1000.0,
+        _sendStatistics.messages[kSendClassClipboard], [self averageSendQueueDelayForClass:kSendClassClipboard] * 1000.0);
+    NSLog(@"input: %llu pointer events coalesced, %u scroll events sent as %u wheel clicks",
+        _sendStatistics.coalesced, _scrollEvents, _scrollClicks);
 }
 
 @end
@@ -22,4 +22,10 @@
 
 @implementation CopyFilter
 
+/* The rows need no filtering, so they are converted straight from the server data. */
+- (void)drawRows:(const unsigned char*)data count:(unsigned)numRows at:(NSRect)aRect
+{
+    [frameBuffer putRect:aRect fromTightData:(unsigned char*)data];
+}
+
 @end
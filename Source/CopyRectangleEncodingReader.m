@@ -46,16 +46,33 @@
     [target setReader:posReader];
 }
 
-- (void)setPosition:(NSData*)position
+//! Copies from the source position in @a position, which is two big endian CARD16s.
+- (void)copyFromPosition:(const uint8_t *)position
 {
     CARD16	source[2];
     NSRect	srect = frame;
 
-    memcpy(source, [position bytes], sizeof(source));
+    memcpy(source, position, sizeof(source));
     srect.origin.x = ntohs(source[0]);
     srect.origin.y = ntohs(source[1]);
     [frameBuffer copyRect:srect to:frame.origin];
+}
+
+- (void)setPosition:(NSData*)position
+{
+    [self copyFromPosition:(const uint8_t *)[position bytes]];
     [target performSelector:action withObject:self];
 }
 
+- (unsigned)readRectangleFromBytes:(const uint8_t *)bytes length:(unsigned)length
+{
+    if (length < 4)
+    {
+        return 0;
+    }
+    
+    [self copyFromPosition:bytes];
+    return 4;
+}
+
 @end
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2009 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#import <Cocoa/Cocoa.h>
+
+//! @brief Version of the benchmark's JSON output. Bump it when fields change meaning.
+#define kDecodeBenchmarkFormatVersion (3)
+
+/*!
+ * @brief Measures decoding speed by replaying session captures.
+ *
+ * Each capture is replayed into a TrueColorFrameBuffer and a HighColorFrameBuffer several
+ * times, and the fastest run is reported. Timing covers only the decode stage, so reading the
+ * capture file isn't included. The results are written as JSON with a fixed key order and
+ * number formatting, so the output of two builds can be compared with diff.
+ *
+ * For each run the results include input MB/s, output Mpixel/s, ns per rectangle,
+ * heap allocations per update, the peak heap growth and the counts for each encoding in the
+ * capture. Allocations are also given for the updates after the connection's warmup, both per
+ * update and per rectangle, with the number of those updates that allocated at all; in steady
+ * state decoding and drawing shouldn't allocate, so that number should be zero. Each encoding
+ * also gets the average time from a rectangle's header to its first drawn pixels, which shows
+ * how soon streaming decoders put something on screen.
+ *
+ * Captures can also be run once for each of several render thread counts. The thread count of
+ * each run is in its results, so the runs of a capture give the decoder's scaling curve.
+ *
+ * @sa SessionReplay
+ */
+@interface DecodeBenchmark : NSObject
+{
+    NSArray * _paths;
+    unsigned _iterations;
+    NSArray * _renderThreads;
+    BOOL _checkAllocations;
+    NSMutableArray * _results;  //!< JSON object for each capture, thread count and frame buffer class.
+}
+
+//! @brief NSNumbers with the render thread counts to run every capture with. Empty or nil
+//!     for one run with the connection's default.
+@property(nonatomic, copy) NSArray * renderThreads;
+
+//! @brief Whether a run fails if any update after the warmup allocated. Also fails where
+//!     allocations can't be counted.
+@property(nonatomic, assign) BOOL checkAllocations;
+
+- (id)initWithPaths:(NSArray *)paths iterations:(unsigned)iterations;
+
+//! @brief Run every capture. Blocks until all of them have been replayed.
+- (BOOL)runReturningError:(NSError **)error;
+
+//! @brief Results of the last run as a JSON document.
+- (NSString *)JSONString;
+
+@end
@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2009 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#import "DecodeBenchmark.h"
+#import "SessionReplay.h"
+#import "RFBConnection.h"
+#import "ConnectionMetrics.h"
+#import "TrueColorFrameBuffer.h"
+#import "HighColorFrameBuffer.h"
+#import "AllocationCounter.h"
+
+@interface DecodeBenchmark ()
+
+- (NSString *)benchmarkPath:(NSString *)path frameBufferClass:(Class)frameBufferClass renderThreads:(unsigned)renderThreads error:(NSError **)error;
+
+@end
+
+//! @brief Returns @a string as a quoted JSON string.
+static NSString * JSONQuote(NSString * string)
+{
+    NSMutableString * quoted = [NSMutableString stringWithString:string];
+    [quoted replaceOccurrencesOfString:@"\\" withString:@"\\\\" options:0 range:NSMakeRange(0, [quoted length])];
+    [quoted replaceOccurrencesOfString:@"\"" withString:@"\\\"" options:0 range:NSMakeRange(0, [quoted length])];
+    return [NSString stringWithFormat:@"\"%@\"", quoted];
+}
+
+//! @brief Creates the error for a run that allocated in steady state.
+static NSError * SteadyAllocationError(NSString * path, Class frameBufferClass, ConnectionMetrics * metrics, BOOL canCountAllocations)
+{
+    NSString * reason;
+    if (canCountAllocations)
+    {
+        reason = [NSString stringWithFormat:@"%@ (%@): %u of %u updates after warmup allocated, %llu allocations",
+            [path lastPathComponent], NSStringFromClass(frameBufferClass), metrics.allocatingUpdates, metrics.steadyUpdates, metrics.steadyAllocations];
+    }
+    else
+    {
+        reason = @"heap allocations can't be counted on this system";
+    }
+    NSDictionary * info = [NSDictionary dictionaryWithObject:reason forKey:NSLocalizedDescriptionKey];
+    return [NSError errorWithDomain:NSPOSIXErrorDomain code:canCountAllocations ? EFAULT : ENOTSUP userInfo:info];
+}
+
+@implementation DecodeBenchmark
+
+@synthesize renderThreads = _renderThreads;
+@synthesize checkAllocations = _checkAllocations;
+
+- (id)initWithPaths:(NSArray *)paths iterations:(unsigned)iterations
+{
+    if (self = [super init])
+    {
+        _paths = [paths copy];
+        _iterations = MAX(iterations, 1);
+        _results = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [_paths release];
+    [_renderThreads release];
+    [_results release];
+    [super dealloc];
+}
+
+- (BOOL)runReturningError:(NSError **)error
+{
+    Class frameBufferClasses[] = { [TrueColorFrameBuffer class], [HighColorFrameBuffer class] };
+    
+    NSArray * threadCounts = [_renderThreads count] ? _renderThreads : [NSArray arrayWithObject:[NSNumber numberWithUnsignedInt:0]];
+    
+    [_results removeAllObjects];
+    for (NSString * path in _paths)
+    {
+        for (NSNumber * threads in threadCounts)
+        {
+            unsigned i;
+            for (i = 0; i < sizeof(frameBufferClasses) / sizeof(frameBufferClasses[0]); ++i)
+            {
+                NSString * result = [self benchmarkPath:path frameBufferClass:frameBufferClasses[i] renderThreads:[threads unsignedIntValue] error:error];
+                if (!result)
+                {
+                    return NO;
+                }
+                [_results addObject:result];
+            }
+        }
+    }
+    return YES;
+}
+
+//! Replays the capture the requested number of times and formats the fastest run.
+- (NSString *)benchmarkPath:(NSString *)path frameBufferClass:(Class)frameBufferClass renderThreads:(unsigned)renderThreads error:(NSError **)error
+{
+    NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+    SessionReplay * best = nil;
+    int64_t bestAllocations = -1;
+    int64_t bestPeakBytes = -1;
+    BOOL canCountAllocations = NO;
+    unsigned i;
+    
+    for (i = 0; i < _iterations; ++i)
+    {
+        SessionReplay * replay = [[[SessionReplay alloc] initWithPath:path paced:NO] autorelease];
+        replay.frameBufferClass = frameBufferClass;
+        replay.renderThreads = renderThreads;
+        
+        canCountAllocations = (AllocationCounterStart() == 0);
+        BOOL didReplay = [replay replayReturningError:error];
+        int64_t allocations = AllocationCounterGetCount();
+        int64_t peakBytes = AllocationCounterGetPeakBytes();
+        AllocationCounterStop();
+        
+        if (!didReplay)
+        {
+            if (error)
+            {
+                [*error retain];
+            }
+            [pool release];
+            if (error)
+            {
+                [*error autorelease];
+            }
+            return nil;
+        }
+        
+        if (!best || [[replay.connection metrics] decodeNanoseconds] < [[best.connection metrics] decodeNanoseconds])
+        {
+            best = replay;
+            bestAllocations = allocations;
+            bestPeakBytes = peakBytes;
+        }
+    }
+    
+    ConnectionMetrics * metrics = [best.connection metrics];
+    if (_checkAllocations && (!canCountAllocations || metrics.allocatingUpdates))
+    {
+        if (error)
+        {
+            *error = [SteadyAllocationError(path, frameBufferClass, metrics, canCountAllocations) retain];
+        }
+        [pool release];
+        if (error)
+        {
+            [*error autorelease];
+        }
+        return nil;
+    }
+    
+    double seconds = (double)metrics.decodeNanoseconds / 1.0e9;
+    uint32_t updates = metrics.updatesCompleted;
+    EncodingStatistics_t stats[kMaxEncodingStatistics];
+    unsigned count = [metrics getEncodingStatistics:stats];
+    NSMutableString * result = [[NSMutableString alloc] init];
+    
+    [result appendFormat:@"    {\n      \"capture\": %@,\n      \"frameBuffer\": \"%@\",\n", JSONQuote([path lastPathComponent]), NSStringFromClass(frameBufferClass)];
+    [result appendFormat:@"      \"renderThreads\": %u,\n", [best.connection renderThreads]];
+    [result appendFormat:@"      \"bytesIn\": %llu,\n      \"pixels\": %llu,\n      \"rects\": %u,\n      \"updates\": %u,\n",
+        best.bytesFromServer, metrics.totalPixels, metrics.totalRects, updates];
+    [result appendFormat:@"      \"decodeSeconds\": %.6f,\n", seconds];
+    [result appendFormat:@"      \"megabytesPerSecond\": %.3f,\n", seconds > 0.0 ? (double)best.bytesFromServer / seconds / 1.0e6 : 0.0];
+    [result appendFormat:@"      \"megapixelsPerSecond\": %.3f,\n", seconds > 0.0 ? (double)metrics.totalPixels / seconds / 1.0e6 : 0.0];
+    [result appendFormat:@"      \"nanosecondsPerRect\": %.1f,\n", metrics.totalRects ? (double)metrics.decodeNanoseconds / (double)metrics.totalRects : 0.0];
+    if (canCountAllocations)
+    {
+        [result appendFormat:@"      \"allocationsPerUpdate\": %.1f,\n", updates ? (double)bestAllocations / (double)updates : (double)bestAllocations];
+        [result appendFormat:@"      \"peakHeapBytes\": %lld,\n", bestPeakBytes];
+        [result appendFormat:@"      \"steadyUpdates\": %u,\n", metrics.steadyUpdates];
+        [result appendFormat:@"      \"steadyAllocationsPerUpdate\": %.2f,\n", metrics.steadyUpdates ? (double)metrics.steadyAllocations / (double)metrics.steadyUpdates : 0.0];
+        [result appendFormat:@"      \"steadyAllocationsPerRect\": %.3f,\n", metrics.steadyRects ? (double)metrics.steadyAllocations / (double)metrics.steadyRects : 0.0];
+        [result appendFormat:@"      \"allocatingUpdates\": %u,\n", metrics.allocatingUpdates];
+    }
+    else
+    {
+        [result appendString:@"      \"allocationsPerUpdate\": null,\n"];
+        [result appendString:@"      \"peakHeapBytes\": null,\n"];
+        [result appendFormat:@"      \"steadyUpdates\": %u,\n", metrics.steadyUpdates];
+        [result appendString:@"      \"steadyAllocationsPerUpdate\": null,\n"];
+        [result appendString:@"      \"steadyAllocationsPerRect\": null,\n"];
+        [result appendString:@"      \"allocatingUpdates\": null,\n"];
+    }
+    [result appendString:@"      \"encodings\": {"];
+    for (i = 0; i < count; ++i)
+    {
+        [result appendFormat:@"%@\n        %@: { \"rects\": %u, \"pixels\": %llu, \"bytes\": %llu, \"firstPixelMicroseconds\": %.1f }", i ? @"," : @"",
+            JSONQuote([SessionReplay nameOfEncoding:stats[i].encoding]), stats[i].rects, stats[i].pixels, stats[i].bytes,
+            stats[i].rects ? (double)stats[i].firstPixelNanoseconds / (double)stats[i].rects / 1.0e3 : 0.0];
+    }
+    [result appendString:count ? @"\n      }\n    }" : @"}\n    }"];
+    
+    [pool release];
+    return [result autorelease];
+}
+
+- (NSString *)JSONString
+{
+    return [NSString stringWithFormat:@"{\n  \"version\": %d,\n  \"iterations\": %u,\n  \"results\": [\n%@\n  ]\n}\n",
+        kDecodeBenchmarkFormatVersion, _iterations, [_results componentsJoinedByString:@",\n"]];
+}
+
+@end
@@ -33,9 +33,35 @@
 
 - (void)setRectangle:(NSRect)aRect;
 - (void)setFrameBuffer:(id)aBuffer;
-- (id)rectangleList;
 - (NSRect)rectangle;
 - (FrameBuffer*)frameBuffer;
 - (unsigned)bytesTransferred;
 
+//! @brief Decode the whole rectangle directly from contiguous bytes.
+//!
+//! FrameBufferUpdateReader calls this with the data following the rectangle header when it
+//! is already in the receive buffer, before falling back to the incremental reader chain.
+//! The rectangle set with -setRectangle: is decoded into the frame buffer without creating
+//! any objects. The target's action is not performed; the caller finishes the rectangle.
+//!
+//! @return The number of bytes in the encoded rectangle, or 0 if @a length bytes do not
+//!     hold the whole rectangle or the encoding has no fast path. Nothing is decoded when
+//!     0 is returned.
+- (unsigned)readRectangleFromBytes:(const uint8_t *)bytes length:(unsigned)length;
+
+//! @brief Whether the rectangle just read is still being decoded on another thread.
+//!
+//! FrameBufferUpdateReader does not display such a rectangle; the encoding reader has it
+//! displayed once it is in the frame buffer.
+- (BOOL)isRectanglePending;
+
+//! @brief Wait for the pending rectangles and have them displayed, in the order they arrived.
+//!
+//! Whatever is drawn over a pending rectangle has to wait for it, and so does the end of the
+//! update. Raises if one of them could not be decoded.
+- (void)finishPendingRects;
+
+//! @brief Same as -finishPendingRects, but only if a pending rectangle intersects @a aRect.
+- (void)finishPendingRectsIntersecting:(NSRect)aRect;
+
 @end
@@ -33,11 +33,6 @@
     frameBuffer = aBuffer;
 }
 
-- (id)rectangleList
-{
-    return nil;
-}
-
 - (NSRect)rectangle
 {
     return frame;
@@ -53,4 +48,22 @@
     return bytesTransferred;
 }
 
+- (unsigned)readRectangleFromBytes:(const uint8_t *)bytes length:(unsigned)length
+{
+    return 0;
+}
+
+- (BOOL)isRectanglePending
+{
+    return NO;
+}
+
+- (void)finishPendingRects
+{
+}
+
+- (void)finishPendingRectsIntersecting:(NSRect)aRect
+{
+}
+
 @end
@@ -7,6 +7,7 @@
 //
 
 #import <Cocoa/Cocoa.h>
+#import "InputCoalescing.h"
 
 @class RFBConnectionController, RFBConnection, RFBView, Profile, RFBProtocol;
 
@@ -91,6 +92,13 @@ typedef enum {
  *  _lastMousePoint:    Maintains the last unpublished mouse move. Mouse moves are cached and only sent to the
  *                      server on a periodic basis so as not to flood the server with mouse moves.
  *
+ *  _motionWindow:      When the next mouse move may be sent. Moves are at least a display frame or half the
+ *                      connection's round trip time apart, whichever is longer; one that comes sooner is
+ *                      cached and sent by _mouseTimer.
+ *
+ *  _scroll:            Scroll distance from continuous devices such as trackpads that hasn't added up to a
+ *                      whole wheel click yet.
+ *
  * When an event is received from the NSResponder, it is added to _pendingEvents.  Then, _pendingEvents 
  * is scanned to determine whether any action can be taken.  Things that might occur at this point are:
  *
@@ -135,6 +143,8 @@ typedef enum {
 	NSTimer *_mouseTimer;
 	NSPoint  _lastMousePoint;
 	bool     _unsentMouseMoveExists;
+	MotionWindow_t _motionWindow;
+	ScrollAccumulator_t _scroll;
 }
 
 @property(nonatomic, assign) RFBConnectionController * controller;
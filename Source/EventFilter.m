@@ -13,8 +13,16 @@
 #import "RFBConnection.h"
 #import "RFBView.h"
 #import "RFBConnectionController.h"
+#import "ConnectionMetrics.h"
 #import <ApplicationServices/ApplicationServices.h>
 
+//! Same clock as NSEvent timestamps, in nanoseconds.
+static inline uint64_t
+UptimeNanoseconds( NSTimeInterval uptime )
+{
+	return (uint64_t)(uptime * 1.0e9);
+}
+
 static inline unsigned int
 ButtonNumberToArrayIndex( unsigned int buttonNumber )
 {
@@ -164,23 +172,31 @@ ButtonNumberToRFBButtomMask( unsigned int buttonNumber )
 		return;
     }
     
-    // Get the vertical scroll amount.
+    // Convert the vertical scroll amount into a number of wheel clicks. Continuous devices
+    // report many small pixel deltas, which are accumulated until they add up to a click.
+    // Line based wheels report whole clicks.
     CGEventRef cgEvent = [theEvent CGEvent];
-    int64_t pixy = CGEventGetIntegerValueField(cgEvent, kCGScrollWheelEventPointDeltaAxis1);
+    int clicks = ScrollAccumulatorAdd(&_scroll,
+                                      CGEventGetIntegerValueField(cgEvent, kCGScrollWheelEventIsContinuous),
+                                      CGEventGetIntegerValueField(cgEvent, kCGScrollWheelEventPointDeltaAxis1),
+                                      CGEventGetIntegerValueField(cgEvent, kCGScrollWheelEventDeltaAxis1));
     
     // Detect the scroll direction and convert to a button mask.
 	int addMask = 0;
-    if (pixy > 0)
+    if (clicks > 0)
     {
         // Scroll up
 		addMask = rfbButton4Mask;
     }
-	else if (pixy < 0)
+	else if (clicks < 0)
     {
         // Scroll down
 		addMask = rfbButton5Mask;
+        clicks = -clicks;
     }
     
+    [[_connection metrics] addScrollEventWithClicks:(unsigned)clicks];
+    
     if (addMask)
     {
         NSPoint	p = [_view convertPoint:[theEvent locationInWindow] fromView: nil];
@@ -189,8 +205,11 @@ ButtonNumberToRFBButtomMask( unsigned int buttonNumber )
         [self clearUnpublishedMouseMove];
         
         // Send the scroll on and off events.
-        [_connection mouseAt: p buttons: _pressedButtons | addMask];	// 'Mouse button down'
-        [_connection mouseAt: p buttons: _pressedButtons];			// 'Mouse button up'
+        for (; clicks; --clicks)
+        {
+            [_connection mouseAt: p buttons: _pressedButtons | addMask];	// 'Mouse button down'
+            [_connection mouseAt: p buttons: _pressedButtons];			// 'Mouse button up'
+        }
     }
 }
 
@@ -199,48 +218,32 @@ ButtonNumberToRFBButtomMask( unsigned int buttonNumber )
 	if ( _viewOnly )
 		return;
 	
-	if( nil != _mouseTimer )
-	{
-        [_mouseTimer invalidate];
-		[_mouseTimer release];
-        _mouseTimer = nil;
-    }
-
 	NSPoint currentPoint = [_view convertPoint: [theEvent locationInWindow] fromView: nil];
-
-	//#define CHANGE_DIFF 5
-	#define IGNORE_COUNT 10
-	
-//	static int ct = IGNORE_COUNT;
-    bool bSendEventImmediately = NO;
-	
-//	if( IGNORE_COUNT == ct )
-//	{
-	//	if( (_lastMousePoint.x - currentPoint.x <= CHANGE_DIFF && _lastMousePoint.x - currentPoint.x >= -CHANGE_DIFF) &&
-	//		(_lastMousePoint.y - currentPoint.y <= CHANGE_DIFF && _lastMousePoint.y - currentPoint.y >= -CHANGE_DIFF) )
-	//	{
-            bSendEventImmediately = YES;
-	//	}
-		
-//		ct = 0;
-//	}
-//	else
-//	{
-//		++ct;
-//	}
     
     _unsentMouseMoveExists = YES;
     _lastMousePoint = currentPoint;
     
-    if( YES == bSendEventImmediately )
+    // The timer sends the latest point when the window ends.
+	if( nil != _mouseTimer )
+		return;
+    
+    // Moves closer together than half the round trip are overtaken by the next one before the
+    // server's answer arrives, and moves closer than a display frame can't be seen, so the
+    // window is the longer of the two.
+    uint64_t now = UptimeNanoseconds( [theEvent timestamp] );
+    if( MotionWindowNeedsRoundTrip( &_motionWindow, now ) )
+    {
+        MotionWindowSetRoundTrip( &_motionWindow, [_connection roundTripNanoseconds], now );
+    }
+    
+    uint64_t delay = MotionWindowDelay( &_motionWindow, now );
+    if( 0 == delay )
     {
-//        NSLog( @"Forced Mouse Move." );
         [self sendUnpublishedMouseMove];
     }
     else
     {
-//        NSLog( @"Ignored Mouse Move." );
-        _mouseTimer = [NSTimer scheduledTimerWithTimeInterval: 0.05
+        _mouseTimer = [NSTimer scheduledTimerWithTimeInterval: delay / 1.0e9
                                                        target: self
                                                      selector: @selector(handleMouseTimer:)
                                                      userInfo: nil
@@ -270,6 +273,7 @@ ButtonNumberToRFBButtomMask( unsigned int buttonNumber )
     {
         [self clearUnpublishedMouseMove];
         [_connection mouseAt: _lastMousePoint buttons: _pressedButtons];
+        MotionWindowDidSend( &_motionWindow, UptimeNanoseconds( [[NSProcessInfo processInfo] systemUptime] ) );
     }
 }
 
@@ -32,6 +32,7 @@
 
 - (void)setFrameBuffer:(FrameBuffer*)aFrameBuffer;
 - (NSData*)filter:(NSData*)data rows:(unsigned)numRows;
+- (void)drawRows:(const unsigned char*)data count:(unsigned)numRows at:(NSRect)aRect;
 - (unsigned)bitsPerPixel;
 - (unsigned)bytesTransferred;
 
@@ -34,6 +34,16 @@
     return data;
 }
 
+/* Filters numRows rows of server data and draws them into aRect of the frame buffer. */
+- (void)drawRows:(const unsigned char*)data count:(unsigned)numRows at:(NSRect)aRect
+{
+    unsigned rowSize = ((unsigned)aRect.size.width * [self bitsPerPixel] + 7) / 8;
+    NSData* rows = [NSData dataWithBytesNoCopy:(void*)data length:rowSize * numRows freeWhenDone:NO];
+
+    rows = [self filter:rows rows:numRows];
+    [frameBuffer putRect:aRect fromTightData:(unsigned char*)[rows bytes]];
+}
+
 - (void)resetReader
 {
     [target performSelector:action withObject:self];
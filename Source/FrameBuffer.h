@@ -21,6 +21,12 @@
 
 #import <AppKit/AppKit.h>
 #import <rfbproto.h>
+#import "PixelConverter.h"
+#import "FrameBufferRows.h"
+#import "ZRLETile.h"
+#import "HextileRect.h"
+#import "RRERects.h"
+#import "TightJpeg.h"
 
 #define SCRATCHPAD_SIZE			(384*384)
 
@@ -32,6 +38,12 @@ typedef union _FrameBufferColor {
 
 typedef unsigned char	FrameBufferPaletteIndex;
 
+/* One run of a run list, see -putRuns:count:at:pixelOffset: */
+typedef struct _FrameBufferRun {
+    FrameBufferColor	color;
+    unsigned int		length;
+} FrameBufferRun;
+
 @interface FrameBuffer : NSObject
 {
     BOOL		isBig;
@@ -59,7 +71,17 @@ typedef unsigned char	FrameBufferPaletteIndex;
 	BOOL			currentReaderIsTight;
 	int				serverMajorVersion;
 	int				serverMinorVersion;
-	unsigned int	*tightBytesPerPixelOverride;
+	PixelConverter_t	pixelConverter;			// server pixels, see -updatePixelConverters
+	PixelConverter_t	tightPixelConverter;	// Tight compact pixels
+	PixelConverter_t	zrlePixelConverter;		// ZRLE CPIXELs
+	unsigned int		zrleBytesPerPixel;
+#if SUPPORT_JPEG
+	unsigned int		jpegRedClut[256];		// colour tables for 8-bit JPEG channels
+	unsigned int		jpegGreenClut[256];
+	unsigned int		jpegBlueClut[256];
+	PixelConverter_t	jpegPixelConverter;		// decoded Tight JPEG pixels
+	TightJpegLayout		jpegLayout;
+#endif
 }
 
 + (BOOL)bigEndian;
@@ -68,7 +90,9 @@ typedef unsigned char	FrameBufferPaletteIndex;
 - (id)initWithSize:(NSSize)aSize andFormat:(rfbPixelFormat*)theFormat;
 - (unsigned int)bytesPerPixel;
 - (unsigned int)tightBytesPerPixel;
-- (void)setTightBytesPerPixelOverride: (unsigned int)count;
+- (unsigned int)zrleBytesPerPixel;
+- (unsigned int)bytesPerColor;
+- (void)updatePixelConverters;
 - (BOOL)bigEndian;
 - (BOOL)serverIsBigEndian;
 - (void)setCurrentReaderIsTight: (BOOL)flag;
@@ -79,6 +103,7 @@ typedef unsigned char	FrameBufferPaletteIndex;
 - (void)setPixelFormat:(rfbPixelFormat*)theFormat;
 - (rfbPixelFormat *)getServerPixelFormat;
 - (void *)pixelData;
+- (unsigned char*)directRowsForRect:(NSRect)aRect stride:(size_t*)stride;
 - (size_t)pixelDataSize;
 
 - (void)fillColor:(FrameBufferColor*)fbc fromPixel:(unsigned char*)pixValue;
@@ -96,8 +121,15 @@ typedef unsigned char	FrameBufferPaletteIndex;
 - (void)combineRGB:(int*)rgb pixels:(unsigned)length into:(unsigned char*)pixValue;
 
 - (void)putRect:(NSRect)aRect withColors:(FrameBufferPaletteIndex*)data fromPalette:(FrameBufferColor*)palette;
+- (void)putRect:(NSRect)aRect withBits:(const unsigned char*)data fromPalette:(FrameBufferColor*)palette;
 - (void)putRun:(FrameBufferColor*)fbc ofLength:(int)length at:(NSRect)aRect pixelOffset:(int)offset;
-- (void)putRect:(NSRect)aRect fromRGBBytes:(unsigned char*)rgb;
+- (void)putRuns:(FrameBufferRun*)runs count:(unsigned)count at:(NSRect)aRect pixelOffset:(int)offset;
+- (int)putZRLETile:(NSRect)aTile fromData:(const unsigned char*)data length:(unsigned)length;
+- (void)putHextileRect:(NSRect)aRect fromData:(const unsigned char*)data background:(FrameBufferColor*)bg foreground:(FrameBufferColor*)fg;
+- (void)fillRRESubrects:(const unsigned char*)data count:(unsigned)count geometrySize:(unsigned)geometryBytes inRect:(NSRect)aRect;
+#if SUPPORT_JPEG
+- (BOOL)putRect:(NSRect)aRect fromJpeg:(TightJpeg_t*)decoder data:(const unsigned char*)data length:(unsigned)length;
+#endif
 - (void)putRect:(NSRect)aRect fromARGBBytes:(unsigned char*)argb;
 @end
 
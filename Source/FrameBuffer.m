@@ -213,6 +213,65 @@ static void ns_pixel(unsigned char* v, FrameBuffer *this, float* clr)
     m[2] = pixelFormat.blueMax;
 }
 
+/* --------------------------------------------------------------------------------- */
+- (unsigned int)bytesPerColor
+{
+    return 0;
+}
+
+/* --------------------------------------------------------------------------------- */
+/* Picks the converters for the current server format, byte order and colour tables. They are
+   specialised for the subclass' colour size, so the drawing code never has to test the format
+   per pixel. Must be called again whenever anything they depend on changes. */
+- (void)updatePixelConverters
+{
+    unsigned int colorBytes = [self bytesPerColor];
+    rfbPixelFormat zrleFormat = pixelFormat;
+    unsigned int colorBits = (pixelFormat.redMax << pixelFormat.redShift)
+        | (pixelFormat.greenMax << pixelFormat.greenShift)
+        | (pixelFormat.blueMax << pixelFormat.blueShift);
+
+    /* ZRLE sends 32-bit pixels as 3-byte CPIXELs when the colour bits fit in the low or the
+       high three bytes. UltraVNC 1.0.1 does so even when it reports a depth of 32 (Chicken
+       Bug #1351494), so the depth is not checked. */
+    zrleBytesPerPixel = bytesPerPixel;
+    if (bytesPerPixel == 4 && (colorBits & 0xff000000) == 0) {
+        zrleBytesPerPixel = 3;
+    } else if (bytesPerPixel == 4 && (colorBits & 0xff) == 0) {
+        zrleBytesPerPixel = 3;
+        zrleFormat.redShift -= 8;
+        zrleFormat.greenShift -= 8;
+        zrleFormat.blueShift -= 8;
+    }
+
+    if (colorBytes == 0)
+        return;
+    PixelConverterFree(&pixelConverter);
+    PixelConverterFree(&tightPixelConverter);
+    PixelConverterFree(&zrlePixelConverter);
+#if SUPPORT_JPEG
+    PixelConverterFree(&jpegPixelConverter);
+    if (TightJpegConverterInit(&jpegPixelConverter, &jpegLayout, jpegRedClut, jpegGreenClut, jpegBlueClut, colorBytes) < 0) {
+        memset(&jpegPixelConverter, 0, sizeof(jpegPixelConverter));
+        [NSException raise:NSGenericException format:@"Unsupported bytesPerColor %u", colorBytes];
+    }
+#endif
+    if (PixelConverterInit(&pixelConverter, &pixelFormat, bytesPerPixel, [self serverIsBigEndian],
+                           redClut, greenClut, blueClut, colorBytes) < 0
+        || PixelConverterInit(&tightPixelConverter, &pixelFormat, [self tightBytesPerPixel], [self serverIsBigEndian],
+                              redClut, greenClut, blueClut, colorBytes) < 0
+        || PixelConverterInit(&zrlePixelConverter, &zrleFormat, zrleBytesPerPixel, [self serverIsBigEndian],
+                              redClut, greenClut, blueClut, colorBytes) < 0) {
+        PixelConverterFree(&pixelConverter);
+        PixelConverterFree(&tightPixelConverter);
+        PixelConverterFree(&zrlePixelConverter);
+        memset(&pixelConverter, 0, sizeof(pixelConverter));
+        memset(&tightPixelConverter, 0, sizeof(tightPixelConverter));
+        memset(&zrlePixelConverter, 0, sizeof(zrlePixelConverter));
+        [NSException raise:NSGenericException format:@"Unsupported bytesPerPixel %u", bytesPerPixel];
+    }
+}
+
 /* --------------------------------------------------------------------------------- */
 - (void)setPixelFormat:(rfbPixelFormat*)theFormat
 {
@@ -230,6 +289,12 @@ static void ns_pixel(unsigned char* v, FrameBuffer *this, float* clr)
         theFormat->blueMax = 255;	/* limit at our LUT size */
     memcpy(&pixelFormat, theFormat, sizeof(pixelFormat));
     bytesPerPixel = pixelFormat.bitsPerPixel / 8;
+
+    // The Tight byte order hack depends on the format, so have it worked out again.
+    if ( forceServerBigEndian ) {
+        free( forceServerBigEndian );
+        forceServerBigEndian = NULL;
+    }
 	
     if(samplesPerPixel == 1) {			/* greyscale */
         rweight = 0.3;
@@ -248,6 +313,15 @@ static void ns_pixel(unsigned char* v, FrameBuffer *this, float* clr)
     for(i=0; i<=theFormat->blueMax; i++) {
         blueClut[i] = (int)(bweight * pow((double)i / (double)theFormat->blueMax, gamma) * maxValue + 0.5) << bshift;
     }
+#if SUPPORT_JPEG
+    /* JPEG channels are always 8 bits, whatever the server's maxima. */
+    for(i=0; i<256; i++) {
+        jpegRedClut[i] = redClut[(i * theFormat->redMax + 127) / 255];
+        jpegGreenClut[i] = greenClut[(i * theFormat->greenMax + 127) / 255];
+        jpegBlueClut[i] = blueClut[(i * theFormat->blueMax + 127) / 255];
+    }
+#endif
+    [self updatePixelConverters];
 }
 
 - (rfbPixelFormat *)getServerPixelFormat
@@ -313,13 +387,23 @@ static void ns_pixel(unsigned char* v, FrameBuffer *this, float* clr)
 {
 	serverMajorVersion = major;
 	serverMinorVersion = minor;
+	if ( forceServerBigEndian )
+	{
+		free( forceServerBigEndian );
+		forceServerBigEndian = NULL;
+	}
+	[self updatePixelConverters];
 }
 
 /* --------------------------------------------------------------------------------- */
 - (void)setCurrentReaderIsTight: (BOOL)flag
 {
 //	NSLog(@"current reader is tight: %@", flag ? @"YES" : @"NO");
-	currentReaderIsTight = currentReaderIsTight || flag;
+	if ( flag && ! currentReaderIsTight )
+	{
+		currentReaderIsTight = YES;
+		[self updatePixelConverters];
+	}
 }
 
 /* --------------------------------------------------------------------------------- */
@@ -347,8 +431,12 @@ static void ns_pixel(unsigned char* v, FrameBuffer *this, float* clr)
 {
 	if ( forceServerBigEndian )
 		free( forceServerBigEndian );
-	if ( tightBytesPerPixelOverride )
-		free( tightBytesPerPixelOverride );
+	PixelConverterFree(&pixelConverter);
+	PixelConverterFree(&tightPixelConverter);
+	PixelConverterFree(&zrlePixelConverter);
+#if SUPPORT_JPEG
+	PixelConverterFree(&jpegPixelConverter);
+#endif
 	[super dealloc];
 }
 
@@ -402,6 +490,13 @@ static void ns_pixel(unsigned char* v, FrameBuffer *this, float* clr)
 	return 0;
 }
 
+/* Returns where server pixels for aRect can be written without conversion, or NULL if
+   they have to go through putRect:fromData:. */
+- (unsigned char*)directRowsForRect:(NSRect)aRect stride:(size_t*)stride
+{
+	return NULL;
+}
+
 /* --------------------------------------------------------------------------------- */
 - (unsigned int)bytesPerPixel
 {
@@ -410,8 +505,6 @@ static void ns_pixel(unsigned char* v, FrameBuffer *this, float* clr)
 
 - (unsigned int)tightBytesPerPixel
 {
-	if ( tightBytesPerPixelOverride )
-		return *tightBytesPerPixelOverride;
     if((pixelFormat.bitsPerPixel == 32) &&
 		(pixelFormat.depth == 24) &&
         (pixelFormat.redMax == 0xff) &&
@@ -424,11 +517,10 @@ static void ns_pixel(unsigned char* v, FrameBuffer *this, float* clr)
 }
 
 /* --------------------------------------------------------------------------------- */
-- (void)setTightBytesPerPixelOverride: (unsigned int)count
+/* Size of a ZRLE CPIXEL, see -updatePixelConverters. */
+- (unsigned int)zrleBytesPerPixel
 {
-	if ( ! tightBytesPerPixelOverride )
-		tightBytesPerPixelOverride = (unsigned int *)malloc(sizeof(unsigned int));
-	*tightBytesPerPixelOverride = count;
+    return zrleBytesPerPixel;
 }
 
 /* --------------------------------------------------------------------------------- */
@@ -457,8 +549,15 @@ static void ns_pixel(unsigned char* v, FrameBuffer *this, float* clr)
 - (void)fillRect:(NSRect)aRect tightPixel:(unsigned char*)pixValue {}
 - (void)putRect:(NSRect)aRect fromTightData:(unsigned char*)data {}
 - (void)putRect:(NSRect)aRect withColors:(FrameBufferPaletteIndex*)data fromPalette:(FrameBufferColor*)palette {}
+- (void)putRect:(NSRect)aRect withBits:(const unsigned char*)data fromPalette:(FrameBufferColor*)palette {}
 - (void)putRun:(FrameBufferColor*)fbc ofLength:(int)length at:(NSRect)aRect pixelOffset:(int)offset {}
-- (void)putRect:(NSRect)aRect fromRGBBytes:(unsigned char*)rgb {}
+- (void)putRuns:(FrameBufferRun*)runs count:(unsigned)count at:(NSRect)aRect pixelOffset:(int)offset {}
+- (int)putZRLETile:(NSRect)aTile fromData:(const unsigned char*)data length:(unsigned)length { return -1; }
+- (void)putHextileRect:(NSRect)aRect fromData:(const unsigned char*)data background:(FrameBufferColor*)bg foreground:(FrameBufferColor*)fg {}
+- (void)fillRRESubrects:(const unsigned char*)data count:(unsigned)count geometrySize:(unsigned)geometryBytes inRect:(NSRect)aRect {}
+#if SUPPORT_JPEG
+- (BOOL)putRect:(NSRect)aRect fromJpeg:(TightJpeg_t*)decoder data:(const unsigned char*)data length:(unsigned)length { return NO; }
+#endif
 - (void)putRect:(NSRect)aRect fromARGBBytes:(unsigned char*)rgb {}
 /* --------------------------------------------------------------------------------- */
 
@@ -19,96 +19,52 @@
  */
 
 /* --------------------------------------------------------------------------------- */
-/* the compiler will hopefully pull the switch() and if()s out of the loop after inlining... */
+/* Server pixels are converted by the converters set up in -[FrameBuffer updatePixelConverters],
+   which are specialised for the server format and for FBColor. */
 
 #undef PINFO
 
-static inline unsigned int cvt_pixel24(unsigned char* v, FrameBuffer* this)
+/* --------------------------------------------------------------------------------- */
+- (unsigned int)bytesPerColor
 {
-    unsigned int pix = 0, col;
-	
-    if([this serverIsBigEndian]) {
-        pix += *v++; pix <<= 8;
-        pix += *v++; pix <<= 8;
-        pix += *v;
-    } else {
-        pix = *v++;
-        pix += (((unsigned int)*v++) << 8);
-        pix += (((unsigned int)*v++) << 16);
-    }
-    col = this->redClut[(pix >> this->pixelFormat.redShift) & this->pixelFormat.redMax];
-    col += this->greenClut[(pix >> this->pixelFormat.greenShift) & this->pixelFormat.greenMax];
-    col += this->blueClut[(pix >> this->pixelFormat.blueShift) & this->pixelFormat.blueMax];
-    return col;
+    return sizeof(FBColor);
 }
 
-static inline unsigned int cvt_pixel(unsigned char* v, FrameBuffer *this)
+/* --------------------------------------------------------------------------------- */
+- (unsigned char*)directRowsForRect:(NSRect)aRect stride:(size_t*)stride
 {
-    unsigned int pix = 0, col;
-
-    switch(this->pixelFormat.bitsPerPixel / 8) {
-        case 1:
-            pix = *v;
-            break;
-        case 2:
-            if([this serverIsBigEndian]) {
-                pix = *v++; pix <<= 8; pix += *v;
-            } else {
-                pix = *v++; pix += (((unsigned int)*v) << 8);
-            }
-            break;
-        case 4:
-            if([this serverIsBigEndian]) {
-                pix = *v++; pix <<= 8;
-                pix += *v++; pix <<= 8;
-                pix += *v++; pix <<= 8;
-                pix += *v;
-            } else {
-                pix = *v++;
-                pix += (((unsigned int)*v++) << 8);
-                pix += (((unsigned int)*v++) << 16);
-                pix += (((unsigned int)*v) << 24);
-            }
-            break;
-		default:
-			[NSException raise: NSGenericException format: @"Unsupported bytesPerPixel"];
+    if(!PixelConverterIsCopy(&pixelConverter) || bytesPerPixel != sizeof(FBColor)) {
+        return NULL;
     }
-    col = this->redClut[(pix >> this->pixelFormat.redShift) & this->pixelFormat.redMax];
-    col += this->greenClut[(pix >> this->pixelFormat.greenShift) & this->pixelFormat.greenMax];
-    col += this->blueClut[(pix >> this->pixelFormat.blueShift) & this->pixelFormat.blueMax];
-    return col;
+    *stride = (size_t)size.width * sizeof(FBColor);
+    return (unsigned char*)(pixels + (int)(aRect.origin.y * size.width) + (int)aRect.origin.x);
 }
 
 /* --------------------------------------------------------------------------------- */
 - (FBColor)colorFromPixel:(unsigned char*)pixValue
 {
-    return (FBColor)cvt_pixel(pixValue, self);
+    return (FBColor)PixelConverterConvertPixel(&pixelConverter, pixValue);
 }
 
-- (FBColor)colorFromPixel24:(unsigned char*)pixValue
+- (FBColor)colorFromTightPixel:(unsigned char*)pixValue
 {
-    return (FBColor)cvt_pixel24(pixValue, self);
+    return (FBColor)PixelConverterConvertPixel(&tightPixelConverter, pixValue);
 }
 
 - (void)fillColor:(FrameBufferColor*)fbc fromPixel:(unsigned char*)pixValue
 {
-    *((FBColor*)fbc) = cvt_pixel(pixValue, self);
+    *((FBColor*)fbc) = PixelConverterConvertPixel(&pixelConverter, pixValue);
 }
 
 - (void)fillColor:(FrameBufferColor*)fbc fromTightPixel:(unsigned char*)pixValue
 {
-	if([self tightBytesPerPixel] == 3) {
-		*((FBColor*)fbc) = cvt_pixel24(pixValue, self);
-	} else {
-		*((FBColor*)fbc) = cvt_pixel(pixValue, self);
-	}
+    *((FBColor*)fbc) = PixelConverterConvertPixel(&tightPixelConverter, pixValue);
 }
 
 /* --------------------------------------------------------------------------------- */
 - (void)fillRect:(NSRect)aRect withColor:(FBColor)aColor
 {	
     FBColor* start;
-    unsigned int stride, i, lines;
 
 #ifdef DEBUG_DRAW
 printf("fill x=%f y=%f w=%f h=%f -> %d\n", aRect.origin.x, aRect.origin.y, aRect.size.width, aRect.size.height, aColor);
@@ -120,14 +76,7 @@ printf("fill x=%f y=%f w=%f h=%f -> %d\n", aRect.origin.x, aRect.origin.y, aRect
 #endif
 
     start = pixels + (int)(aRect.origin.y * size.width) + (int)aRect.origin.x;
-    lines = aRect.size.height;
-    stride = size.width - aRect.size.width;
-    while(lines--) {
-        for(i=aRect.size.width; i; i--) {
-            *start++ = aColor;
-        }
-        start += stride;
-    }
+    FrameBufferFillRect(start, (size_t)size.width * sizeof(FBColor), sizeof(FBColor), aColor, aRect.size.width, aRect.size.height);
 }
 
 /* --------------------------------------------------------------------------------- */
@@ -149,33 +98,120 @@ printf("fill x=%f y=%f w=%f h=%f -> %d\n", aRect.origin.x, aRect.origin.y, aRect
 }
 
 /* --------------------------------------------------------------------------------- */
-- (void)putRun:(FrameBufferColor*)fbc ofLength:(int)length at:(NSRect)aRect pixelOffset:(int)offset
+- (void)putRect:(NSRect)aRect withBits:(const unsigned char*)data fromPalette:(FrameBufferColor*)palette
 {
 	FBColor*		start;
-	unsigned int	stride, width;
-	unsigned int	offLines, offPixels;
-
-	offLines = offset / (int)aRect.size.width;
-	offPixels = offset - (offLines * (int)aRect.size.width);
-	width = aRect.size.width - offPixels;
-	offLines += aRect.origin.y;
-	offPixels += aRect.origin.x;
-	start = pixels + (int)(offLines * size.width + offPixels);
-    stride = size.width - aRect.size.width;
-	if(width > length) {
-		width = length;
+	unsigned int	width, lines;
+
+    start = pixels + (int)(aRect.origin.y * size.width) + (int)aRect.origin.x;
+    width = aRect.size.width;
+    lines = aRect.size.height;
+    while(lines--) {
+        FrameBufferExpandBits(start, sizeof(FBColor), data, width, *((FBColor*)palette), *((FBColor*)(palette + 1)));
+        data += (width + 7) / 8;
+        start += (int)size.width;
+    }
+}
+
+/* --------------------------------------------------------------------------------- */
+- (void)putRun:(FrameBufferColor*)fbc ofLength:(int)length at:(NSRect)aRect pixelOffset:(int)offset
+{
+	FrameBufferRun run;
+
+	run.color = *fbc;
+	run.length = length;
+	[self putRuns:&run count:1 at:aRect pixelOffset:offset];
+}
+
+/* --------------------------------------------------------------------------------- */
+- (void)putRuns:(FrameBufferRun*)runs count:(unsigned)count at:(NSRect)aRect pixelOffset:(int)offset
+{
+	FBColor*		row;
+	unsigned int	width, lines, x, n, length;
+	FBColor			color;
+
+	width = aRect.size.width;
+	lines = aRect.size.height;
+	if(width == 0 || offset >= (int)(width * lines)) {
+		return;
 	}
-	do {
-		length -= width;
-		while(width--) {
-			*start++ = *((FBColor*)fbc);
-		}
-		start += stride;
-		width = aRect.size.width;
-		if(width > length) {
-			width = length;
+	x = offset % width;
+	lines -= offset / width;
+	row = pixels + (int)((aRect.origin.y + offset / width) * size.width + aRect.origin.x);
+	for(; count; count--, runs++) {
+		color = *((FBColor*)&runs->color);
+		length = runs->length;
+		while(length) {
+			n = MIN(length, width - x);
+			if(n == 1) {
+				row[x] = color;
+			} else {
+				FrameBufferFillRow(row + x, sizeof(FBColor), color, n);
+			}
+			length -= n;
+			x += n;
+			if(x == width) {
+				/* runs beyond the end of the rect are dropped */
+				if(--lines == 0) {
+					return;
+				}
+				x = 0;
+				row += (int)size.width;
+			}
 		}
-	} while(width > 0);
+	}
+}
+
+/* --------------------------------------------------------------------------------- */
+/* Draws the ZRLE tile at the start of data. Returns the bytes it used, 0 if length doesn't
+   cover all of it yet, or -1 if its subencoding is invalid. */
+- (int)putZRLETile:(NSRect)aTile fromData:(const unsigned char*)data length:(unsigned)length
+{
+    FBColor* start;
+
+#ifdef PINFO
+    putRectCount++;
+    putPixelCount += aTile.size.width * aTile.size.height;
+#endif
+
+    start = pixels + (int)(aTile.origin.y * size.width) + (int)aTile.origin.x;
+    return ZRLEDrawTile(&zrlePixelConverter, data, length, start, (size_t)size.width * sizeof(FBColor),
+                        aTile.size.width, aTile.size.height);
+}
+
+/* --------------------------------------------------------------------------------- */
+/* The whole rect must be in data, see HextileRectLength(). */
+- (void)putHextileRect:(NSRect)aRect fromData:(const unsigned char*)data background:(FrameBufferColor*)bg foreground:(FrameBufferColor*)fg
+{
+    FBColor* start;
+    uint32_t background = *((FBColor*)bg);
+    uint32_t foreground = *((FBColor*)fg);
+
+#ifdef PINFO
+    putRectCount++;
+    putPixelCount += aRect.size.width * aRect.size.height;
+#endif
+
+    start = pixels + (int)(aRect.origin.y * size.width) + (int)aRect.origin.x;
+    HextileDrawRect(&pixelConverter, data, start, (size_t)size.width * sizeof(FBColor),
+                    aRect.size.width, aRect.size.height, &background, &foreground);
+    *((FBColor*)bg) = (FBColor)background;
+    *((FBColor*)fg) = (FBColor)foreground;
+}
+
+/* --------------------------------------------------------------------------------- */
+/* Subrect positions are relative to aRect. */
+- (void)fillRRESubrects:(const unsigned char*)data count:(unsigned)count geometrySize:(unsigned)geometryBytes inRect:(NSRect)aRect
+{
+    FBColor* start;
+
+#ifdef PINFO
+    fillRectCount += count;
+#endif
+
+    start = pixels + (int)(aRect.origin.y * size.width) + (int)aRect.origin.x;
+    RREDrawSubrects(&pixelConverter, data, count, geometryBytes, start, (size_t)size.width * sizeof(FBColor),
+                    aRect.size.width, aRect.size.height);
 }
 
 /* --------------------------------------------------------------------------------- */
@@ -193,22 +229,12 @@ printf("fill x=%f y=%f w=%f h=%f -> %d\n", aRect.origin.x, aRect.origin.y, aRect
 /* --------------------------------------------------------------------------------- */
 - (void)fillRect:(NSRect)aRect tightPixel:(unsigned char*)pixValue
 {
-    if([self tightBytesPerPixel] == 3) {
-        [self fillRect:aRect withColor:[self colorFromPixel24:pixValue]];
-    } else {
-        [self fillRect:aRect withPixel:pixValue];
-    }
+    [self fillRect:aRect withColor:[self colorFromTightPixel:pixValue]];
 }
 
 /* --------------------------------------------------------------------------------- */
 - (void)copyRect:(NSRect)aRect to:(NSPoint)aPoint
 {
-        int line_step, src_start_x, dst_start_x;
-        int stride, src_start_y, dst_start_y;
-        FBColor* src, *dst;
-        int lines = aRect.size.height;
-        int i;
-
 #ifdef DEBUG_DRAW
 printf("copy x=%f y=%f w=%f h=%f -> x=%f y=%f\n", aRect.origin.x, aRect.origin.y, aRect.size.width, aRect.size.height, aPoint.x, aPoint.y);
 #endif
@@ -217,75 +243,41 @@ printf("copy x=%f y=%f w=%f h=%f -> x=%f y=%f\n", aRect.origin.x, aRect.origin.y
     copyRectCount++;
     copyPixelCount += aRect.size.width * aRect.size.height;
 #endif
-        if(aPoint.x < aRect.origin.x) {
-                line_step = 1;
-                src_start_x = aRect.origin.x;
-                dst_start_x = aPoint.x;
-        } else {
-                line_step = -1;
-                src_start_x = NSMaxX(aRect) - 1;
-                dst_start_x = aPoint.x + aRect.size.width - 1;
-        }
-        if(aPoint.y < aRect.origin.y) {
-                stride = (line_step > 0) ? size.width - aRect.size.width :
-                                           size.width + aRect.size.width;
-                src_start_y = aRect.origin.y;
-                dst_start_y = aPoint.y;
-        } else {
-                stride = (line_step > 0) ? -size.width - aRect.size.width :
-                                           -size.width + aRect.size.width;
-                src_start_y = NSMaxY(aRect) - 1;
-                dst_start_y = aPoint.y + aRect.size.height - 1;
-        }
-        src = pixels + (int)(src_start_y * size.width) + (int)src_start_x;
-        dst = pixels + (int)(dst_start_y * size.width) + (int)dst_start_x;
-        while(lines--) {
-			for(i=aRect.size.width; i; i--) {
-				*dst = *src;
-				dst += line_step;
-				src += line_step;
-			}
-			dst += stride;
-			src += stride;
-        }
+    FrameBufferCopyRect(pixels, (size_t)size.width * sizeof(FBColor), sizeof(FBColor),
+                        aRect.origin.x, aRect.origin.y, aRect.size.width, aRect.size.height, aPoint.x, aPoint.y);
 }
 
 /* --------------------------------------------------------------------------------- */
 - (void)putRect:(NSRect)aRect fromTightData:(unsigned char*)data
 {
-    if([self tightBytesPerPixel] == 3) {
-        FBColor* start;
-        unsigned int stride, i, lines;
-
-    #ifdef DEBUG_DRAW
-    printf("put x=%f y=%f w=%f h=%f\n", aRect.origin.x, aRect.origin.y, aRect.size.width, aRect.size.height);
-    #endif
-
-    #ifdef PINFO
-        putRectCount++;
-        putPixelCount += aRect.size.width * aRect.size.height;
-    #endif
-
-        start = pixels + (int)(aRect.origin.y * size.width) + (int)aRect.origin.x;
-        lines = aRect.size.height;
-        stride = size.width - aRect.size.width;
-		while(lines--) {
-			for(i=aRect.size.width; i; i--) {
-				*start++ = cvt_pixel24(data, self);
-				data += 3;
-			}
-			start += stride;
-		}
-    } else {
-        [self putRect:aRect fromData:data];
+    FBColor* start;
+    unsigned int width, lines;
+    PixelConverter_t* converter = &tightPixelConverter;
+
+#ifdef DEBUG_DRAW
+printf("put x=%f y=%f w=%f h=%f\n", aRect.origin.x, aRect.origin.y, aRect.size.width, aRect.size.height);
+#endif
+
+#ifdef PINFO
+    putRectCount++;
+    putPixelCount += aRect.size.width * aRect.size.height;
+#endif
+
+    start = pixels + (int)(aRect.origin.y * size.width) + (int)aRect.origin.x;
+    width = aRect.size.width;
+    lines = aRect.size.height;
+    while(lines--) {
+        PixelConverterConvertRow(converter, data, start, width);
+        data += width * converter->sourceBytes;
+        start += (int)size.width;
     }
 }
 
+#if SUPPORT_JPEG
 /* --------------------------------------------------------------------------------- */
-- (void)putRect:(NSRect)aRect fromRGBBytes:(unsigned char*)rgb
+- (BOOL)putRect:(NSRect)aRect fromJpeg:(TightJpeg_t*)decoder data:(const unsigned char*)data length:(unsigned)length
 {
-	FBColor* start;
-	unsigned int stride, i, lines, col;
+	FBColor*	start;
 
 #ifdef PINFO
 	putRectCount++;
@@ -293,18 +285,11 @@ printf("copy x=%f y=%f w=%f h=%f -> x=%f y=%f\n", aRect.origin.x, aRect.origin.y
 #endif
 
     start = pixels + (int)(aRect.origin.y * size.width) + (int)aRect.origin.x;
-    lines = aRect.size.height;
-    stride = size.width - aRect.size.width;
-	while(lines--) {
-        for(i=aRect.size.width; i; i--) {
-			col = redClut[(maxValue * *rgb++) / 255];
-			col += greenClut[(maxValue * *rgb++) / 255];
-			col += blueClut[(maxValue * *rgb++) / 255];
-			*start++ = col;
-		}
-		start += stride;
-	}
+    return TightJpegDecode(decoder, data, length, aRect.size.width, aRect.size.height, jpegLayout,
+                           PixelConverterIsCopy(&jpegPixelConverter) ? NULL : &jpegPixelConverter,
+                           start, (size_t)size.width * sizeof(FBColor)) == 0;
 }
+#endif
 
 /* --------------------------------------------------------------------------------- */
 - (void)putRect:(NSRect)aRect fromARGBBytes:(unsigned char*)argb
@@ -333,15 +318,11 @@ printf("copy x=%f y=%f w=%f h=%f -> x=%f y=%f\n", aRect.origin.x, aRect.origin.y
 }
 
 /* --------------------------------------------------------------------------------- */
-#define CLUT(c,p)																\
-c = redClut[(p >> pixelFormat.redShift) & pixelFormat.redMax];					\
-c += greenClut[(p >> pixelFormat.greenShift) & pixelFormat.greenMax]; 			\
-c += blueClut[(p >> pixelFormat.blueShift) & pixelFormat.blueMax]
-
 - (void)putRect:(NSRect)aRect fromData:(unsigned char*)data
 {
     FBColor* start;
-    unsigned int stride, i, lines, pix, col;
+    unsigned int width, lines;
+    PixelConverter_t* converter = &pixelConverter;
 
 #ifdef DEBUG_DRAW
 printf("put x=%f y=%f w=%f h=%f\n", aRect.origin.x, aRect.origin.y, aRect.size.width, aRect.size.height);
@@ -353,69 +334,13 @@ printf("put x=%f y=%f w=%f h=%f\n", aRect.origin.x, aRect.origin.y, aRect.size.w
 #endif
 
     start = pixels + (int)(aRect.origin.y * size.width) + (int)aRect.origin.x;
+    width = aRect.size.width;
     lines = aRect.size.height;
-    stride = size.width - aRect.size.width;
-
-	switch(pixelFormat.bitsPerPixel / 8) {
-		case 1:
-			while(lines--) {
-				for(i=aRect.size.width; i; i--) {
-					pix = *data++;
-					CLUT(col, pix);
-					*start++ = col;
-				}
-				start += stride;
-			}
-			break;
-		case 2:
-			if([self serverIsBigEndian]) {
-				while(lines--) {
-					for(i=aRect.size.width; i; i--) {
-						pix = *data++; pix <<= 8; pix += *data++;
-						CLUT(col, pix);
-						*start++ = col;
-					}
-					start += stride;
-				}
-			} else {
-				while(lines--) {
-					for(i=aRect.size.width; i; i--) {
-						pix = *data++; pix += (((unsigned int)*data++) << 8);
-						CLUT(col, pix);
-						*start++ = col;
-					}
-					start += stride;
-				}
-			}
-			break;
-		case 4:
-			if([self serverIsBigEndian]) {
-				while(lines--) {
-					for(i=aRect.size.width; i; i--) {
-						pix = *data++; pix <<= 8;
-						pix += *data++; pix <<= 8;
-						pix += *data++; pix <<= 8;
-						pix += *data++;
-						CLUT(col, pix);
-						*start++ = col;
-					}
-					start += stride;
-				}
-			} else {
-				while(lines--) {
-					for(i=aRect.size.width; i; i--) {
-						pix = *data++;
-						pix += (((unsigned int)*data++) << 8);
-						pix += (((unsigned int)*data++) << 16);
-						pix += (((unsigned int)*data++) << 24);
-						CLUT(col, pix);
-						*start++ = col;
-					}
-					start += stride;
-				}
-			}
-			break;
-	}
+    while(lines--) {
+        PixelConverterConvertRow(converter, data, start, width);
+        data += width * converter->sourceBytes;
+        start += (int)size.width;
+    }
 }
 
 /* --------------------------------------------------------------------------------- */
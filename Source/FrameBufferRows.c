@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "FrameBufferRows.h"
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define FRAME_BUFFER_ROWS_X86 1
+#include <emmintrin.h>
+#endif
+
+//! Rows shorter than this are filled one colour at a time.
+#define kShortRow 8
+
+//! Repeats a colour to fill 32 bits.
+static inline uint32_t Replicate(unsigned colorBytes, uint32_t color)
+{
+    switch (colorBytes)
+    {
+        case 1:
+            return (color & 0xff) * 0x01010101u;
+        case 2:
+            return (color & 0xffff) * 0x00010001u;
+        default:
+            return color;
+    }
+}
+
+#if FRAME_BUFFER_ROWS_X86
+
+//! Stores @a pattern over @a bytes bytes. The pattern repeats every colour, and @a bytes is a
+//! multiple of the colour size, so the last store may overlap the one before it.
+__attribute__((target("sse2")))
+static void FillPattern(uint8_t * dest, uint32_t pattern, size_t bytes)
+{
+    const __m128i v = _mm_set1_epi32((int)pattern);
+    uint8_t * end = dest + bytes;
+
+    while (dest + 64 <= end)
+    {
+        _mm_storeu_si128((__m128i *)dest, v);
+        _mm_storeu_si128((__m128i *)(dest + 16), v);
+        _mm_storeu_si128((__m128i *)(dest + 32), v);
+        _mm_storeu_si128((__m128i *)(dest + 48), v);
+        dest += 64;
+    }
+    while (dest + 16 <= end)
+    {
+        _mm_storeu_si128((__m128i *)dest, v);
+        dest += 16;
+    }
+    if (dest < end)
+    {
+        _mm_storeu_si128((__m128i *)(end - 16), v);
+    }
+}
+
+#else
+
+static void FillPattern(uint8_t * dest, uint32_t pattern, size_t bytes)
+{
+    uint64_t wide = ((uint64_t)pattern << 32) | pattern;
+    uint8_t * end = dest + bytes;
+
+    while (dest + 8 <= end)
+    {
+        memcpy(dest, &wide, 8);
+        dest += 8;
+    }
+    if (dest < end)
+    {
+        memcpy(end - 8, &wide, 8);
+    }
+}
+
+#endif // FRAME_BUFFER_ROWS_X86
+
+//! Fills a row of any length. Long rows are at least 16 bytes, which the overlapping tail
+//! store of FillPattern() relies on.
+static inline void FillRow(void * dest, unsigned colorBytes, uint32_t color, size_t count)
+{
+    switch (colorBytes)
+    {
+        case 1:
+            memset(dest, (int)color, count);
+            break;
+        case 2:
+            if (count < kShortRow)
+            {
+                uint16_t * out = (uint16_t *)dest;
+                while (count--)
+                {
+                    *out++ = (uint16_t)color;
+                }
+            }
+            else
+            {
+                FillPattern((uint8_t *)dest, Replicate(2, color), count * 2);
+            }
+            break;
+        default:
+            if (count < kShortRow)
+            {
+                uint32_t * out = (uint32_t *)dest;
+                while (count--)
+                {
+                    *out++ = color;
+                }
+            }
+            else
+            {
+                FillPattern((uint8_t *)dest, color, count * 4);
+            }
+            break;
+    }
+}
+
+void FrameBufferFillRow(void * dest, unsigned colorBytes, uint32_t color, unsigned count)
+{
+    FillRow(dest, colorBytes, color, count);
+}
+
+void FrameBufferFillRect(void * dest, size_t rowBytes, unsigned colorBytes, uint32_t color, unsigned width, unsigned lines)
+{
+    uint8_t * row = (uint8_t *)dest;
+
+    if ((size_t)width * colorBytes == rowBytes)
+    {
+        FillRow(row, colorBytes, color, (size_t)width * lines);
+        return;
+    }
+    while (lines--)
+    {
+        FillRow(row, colorBytes, color, width);
+        row += rowBytes;
+    }
+}
+
+void FrameBufferCopyRect(void * base, size_t rowBytes, unsigned colorBytes, unsigned sourceX, unsigned sourceY, unsigned width, unsigned lines, unsigned destX, unsigned destY)
+{
+    size_t bytes = (size_t)width * colorBytes;
+    const uint8_t * source = (const uint8_t *)base + sourceY * rowBytes + (size_t)sourceX * colorBytes;
+    uint8_t * dest = (uint8_t *)base + destY * rowBytes + (size_t)destX * colorBytes;
+
+    if (lines == 0 || bytes == 0)
+    {
+        return;
+    }
+    if (bytes == rowBytes)
+    {
+        memmove(dest, source, bytes * lines);
+        return;
+    }
+
+    // Moving up or down, no row overlaps its own source, but rows must be copied in the order
+    // that reads each source row before it is overwritten. Moving sideways, each row overlaps
+    // its source and needs memmove().
+    if (destY > sourceY)
+    {
+        source += (lines - 1) * rowBytes;
+        dest += (lines - 1) * rowBytes;
+        while (lines--)
+        {
+            memcpy(dest, source, bytes);
+            source -= rowBytes;
+            dest -= rowBytes;
+        }
+    }
+    else if (destY < sourceY)
+    {
+        while (lines--)
+        {
+            memcpy(dest, source, bytes);
+            source += rowBytes;
+            dest += rowBytes;
+        }
+    }
+    else
+    {
+        while (lines--)
+        {
+            memmove(dest, source, bytes);
+            source += rowBytes;
+            dest += rowBytes;
+        }
+    }
+}
+
+#if FRAME_BUFFER_ROWS_X86
+
+//! Expands whole bytes of bits, eight pixels at a time, by comparing the byte against a
+//! register of single bit masks and blending the two colours with the result.
+__attribute__((target("sse2")))
+static unsigned ExpandBytes(uint8_t * dest, unsigned colorBytes, const uint8_t * bits, unsigned bytes, uint32_t color0, uint32_t color1)
+{
+    const __m128i highBits = _mm_set_epi32(0x10, 0x20, 0x40, 0x80);
+    const __m128i lowBits = _mm_set_epi32(0x01, 0x02, 0x04, 0x08);
+    const __m128i wordBits = _mm_set_epi16(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80);
+    __m128i first = _mm_set1_epi32((int)Replicate(colorBytes, color0));
+    __m128i difference = _mm_xor_si128(first, _mm_set1_epi32((int)Replicate(colorBytes, color1)));
+    unsigned done = 0;
+
+    switch (colorBytes)
+    {
+        case 1:
+            // Two bytes of bits make one register of 8-bit colours.
+            for (; done + 2 <= bytes; done += 2)
+            {
+                __m128i a = _mm_set1_epi16(bits[done]);
+                __m128i b = _mm_set1_epi16(bits[done + 1]);
+                a = _mm_cmpeq_epi16(_mm_and_si128(a, wordBits), wordBits);
+                b = _mm_cmpeq_epi16(_mm_and_si128(b, wordBits), wordBits);
+                __m128i mask = _mm_packs_epi16(a, b);
+                _mm_storeu_si128((__m128i *)dest, _mm_xor_si128(first, _mm_and_si128(difference, mask)));
+                dest += 16;
+            }
+            break;
+        case 2:
+            for (; done < bytes; ++done)
+            {
+                __m128i mask = _mm_set1_epi16(bits[done]);
+                mask = _mm_cmpeq_epi16(_mm_and_si128(mask, wordBits), wordBits);
+                _mm_storeu_si128((__m128i *)dest, _mm_xor_si128(first, _mm_and_si128(difference, mask)));
+                dest += 16;
+            }
+            break;
+        default:
+            for (; done < bytes; ++done)
+            {
+                __m128i byte = _mm_set1_epi32(bits[done]);
+                __m128i high = _mm_cmpeq_epi32(_mm_and_si128(byte, highBits), highBits);
+                __m128i low = _mm_cmpeq_epi32(_mm_and_si128(byte, lowBits), lowBits);
+                _mm_storeu_si128((__m128i *)dest, _mm_xor_si128(first, _mm_and_si128(difference, high)));
+                _mm_storeu_si128((__m128i *)(dest + 16), _mm_xor_si128(first, _mm_and_si128(difference, low)));
+                dest += 32;
+            }
+            break;
+    }
+    return done;
+}
+
+#else
+
+//! Only 32-bit colours are worth a special case without vectors: each byte of bits is
+//! written as eight stores chosen from a two entry table.
+static unsigned ExpandBytes(uint8_t * dest, unsigned colorBytes, const uint8_t * bits, unsigned bytes, uint32_t color0, uint32_t color1)
+{
+    const uint32_t colors[2] = { color0, color1 };
+    uint32_t * out = (uint32_t *)dest;
+    unsigned done;
+
+    if (colorBytes != 4)
+    {
+        return 0;
+    }
+    for (done = 0; done < bytes; ++done)
+    {
+        unsigned byte = bits[done];
+        out[0] = colors[(byte >> 7) & 1];
+        out[1] = colors[(byte >> 6) & 1];
+        out[2] = colors[(byte >> 5) & 1];
+        out[3] = colors[(byte >> 4) & 1];
+        out[4] = colors[(byte >> 3) & 1];
+        out[5] = colors[(byte >> 2) & 1];
+        out[6] = colors[(byte >> 1) & 1];
+        out[7] = colors[byte & 1];
+        out += 8;
+    }
+    return done;
+}
+
+#endif // FRAME_BUFFER_ROWS_X86
+
+void FrameBufferExpandBits(void * dest, unsigned colorBytes, const uint8_t * bits, unsigned count, uint32_t color0, uint32_t color1)
+{
+    uint8_t * out = (uint8_t *)dest;
+    unsigned done = ExpandBytes(out, colorBytes, bits, count / 8, color0, color1);
+    unsigned i;
+
+    // Whatever the vector code left, including the last partial byte.
+    out += (size_t)done * 8 * colorBytes;
+    bits += done;
+    count -= done * 8;
+    for (i = 0; i < count; ++i)
+    {
+        uint32_t color = (bits[i / 8] & (0x80 >> (i % 8))) ? color1 : color0;
+        switch (colorBytes)
+        {
+            case 1:
+                out[i] = (uint8_t)color;
+                break;
+            case 2:
+                ((uint16_t *)out)[i] = (uint16_t)color;
+                break;
+            default:
+                ((uint32_t *)out)[i] = color;
+                break;
+        }
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#if !defined(_FrameBufferRows_h_)
+#define _FrameBufferRows_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @file FrameBufferRows.h
+ * @brief Row fill and copy primitives shared by the framebuffer classes.
+ *
+ * The framebuffer classes store 1, 2 or 4 byte colours in rows of @a rowBytes bytes. These
+ * functions fill and move whole rows at a time with wide stores instead of looping over
+ * pixels, and treat a rect that spans the full width of the framebuffer as a single row.
+ */
+
+//! @brief Fill @a count colours starting at @a dest with @a color.
+void FrameBufferFillRow(void * dest, unsigned colorBytes, uint32_t color, unsigned count);
+
+//! @brief Fill a rect of @a width by @a lines colours.
+//! @param dest First colour of the rect.
+//! @param rowBytes Distance between framebuffer rows, in bytes.
+void FrameBufferFillRect(void * dest, size_t rowBytes, unsigned colorBytes, uint32_t color, unsigned width, unsigned lines);
+
+//! @brief Copy a rect of @a width by @a lines colours within one framebuffer.
+//!
+//! Source and destination may overlap in any direction.
+//!
+//! @param base First colour of the framebuffer.
+//! @param rowBytes Distance between framebuffer rows, in bytes.
+void FrameBufferCopyRect(void * base, size_t rowBytes, unsigned colorBytes, unsigned sourceX, unsigned sourceY, unsigned width, unsigned lines, unsigned destX, unsigned destY);
+
+//! @brief Draw a row of 1-bit pixels.
+//!
+//! Each bit selects @a color1 if set and @a color0 if clear. The first pixel is the most
+//! significant bit of the first byte.
+void FrameBufferExpandBits(void * dest, unsigned colorBytes, const uint8_t * bits, unsigned count, uint32_t color0, uint32_t color1);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _FrameBufferRows_h_
@@ -21,8 +21,27 @@
 #import <AppKit/AppKit.h>
 #import "ByteReader.h"
 
+@class EncodingReader;
+
+//! @brief What a FrameBufferUpdateReader expects to parse next when it is the current reader.
+typedef enum _FrameBufferUpdateState
+{
+    kFrameBufferUpdateIdle,         //!< No update is in progress.
+    kFrameBufferUpdateHeader,       //!< The update message header follows.
+    kFrameBufferUpdateRectHeader    //!< The next rectangle header follows.
+} FrameBufferUpdateState;
+
+/*!
+ * @brief Reads the frame buffer update message.
+ *
+ * When the message header or a rectangle header is already in the receive buffer, it is
+ * parsed in place, and the rectangle's encoding reader is given the chance to decode the
+ * whole rectangle directly from the buffer with -readRectangleFromBytes:length:. Only when
+ * data is split across reads are the block readers and incremental encoding readers used.
+ */
 @interface FrameBufferUpdateReader : ByteReader
 {
+    FrameBufferUpdateState _state;
     id	headerReader;
     id	rectHeaderReader;
     id	rawEncodingReader;
@@ -46,6 +65,9 @@
 - (void)setFrameBuffer:(id)aBuffer;
 - (void)updateComplete;
 
+//! @brief Parse as much of the update as possible directly from @a theBytes.
+- (unsigned)readBytes:(unsigned char*)theBytes length:(unsigned)aLength;
+
 - (double)compressRatio;
 - (double)rectanglesTransferred;
 - (double)bytesTransferred;
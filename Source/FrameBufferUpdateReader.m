@@ -24,7 +24,6 @@
 #import "CopyRectangleEncodingReader.h"
 #import "CoRREEncodingReader.h"
 #import "HextileEncodingReader.h"
-#import "PrefController.h"
 #import "RFBConnection.h"
 #import "RFBConnectionManager.h"
 #import "RREEncodingReader.h"
@@ -37,15 +36,19 @@
 
 #import "debug.h"
 
+@interface FrameBufferUpdateReader ()
+
+- (void)beginUpdateWithHeader:(const uint8_t *)header;
+- (EncodingReader *)beginRectWithHeader:(const uint8_t *)header;
+- (void)finishRect:(EncodingReader *)aReader;
+
+@end
+
 @implementation FrameBufferUpdateReader
 
 - (id)initTarget:(id)aTarget action:(SEL)anAction
 {
     if (self = [super initTarget:aTarget action:anAction]) {
-		PrefController *prefs = [PrefController sharedController];
-		int pst = [prefs PS_THRESHOLD];
-		int mpr = [prefs PS_MAXRECTS];
-
 		headerReader = [[ByteBlockReader alloc] initTarget:self action:@selector(setHeader:) size:3];
 		rawEncodingReader = [[RawEncodingReader alloc] initTarget:self action:@selector(didRect:)];
 		copyRectangleEncodingReader = [[CopyRectangleEncodingReader alloc] initTarget:self action:@selector(didRect:)];
@@ -59,10 +62,6 @@
 		richCursorEncodingReader = [[RichCursorEncodingReader alloc] initTarget:self action:@selector(didRect:)];
 		rectHeaderReader = [[ByteBlockReader alloc] initTarget:self action:@selector(setRect:) size:12];
 		connection = [target topTarget];
-		[rreEncodingReader setPSThreshold:pst];
-		[coRreEncodingReader setPSThreshold:pst];
-		[rreEncodingReader setMaximumPSRectangles:mpr];
-		[coRreEncodingReader setMaximumPSRectangles:mpr];
 	}
     return self;
 }
@@ -97,29 +96,84 @@
 	[richCursorEncodingReader setFrameBuffer:aBuffer];
 }
 
+//! We become the current reader at the start of each update message.
 - (void)resetReader
 {
-    [target setReader:headerReader];
+    _state = kFrameBufferUpdateHeader;
 }
 
-- (void)setHeader:(NSData*)header
+- (unsigned)readBytes:(unsigned char*)theBytes length:(unsigned)aLength
+{
+    const uint8_t * bytes = theBytes;
+    const uint8_t * end = theBytes + aLength;
+    
+    if (_state == kFrameBufferUpdateHeader)
+    {
+        // Let the block reader collect a header that is split across reads.
+        if (aLength < sz_rfbFramebufferUpdateMsg - 1)
+        {
+            [target setReader:headerReader];
+            return 0;
+        }
+        
+        [self beginUpdateWithHeader:bytes];
+        bytes += sz_rfbFramebufferUpdateMsg - 1;
+    }
+    
+    while (_state == kFrameBufferUpdateRectHeader && bytes < end)
+    {
+        if (end - bytes < sz_rfbFramebufferUpdateRectHeader)
+        {
+            [target setReader:rectHeaderReader];
+            break;
+        }
+        
+        EncodingReader * theReader = [self beginRectWithHeader:bytes];
+        bytes += sz_rfbFramebufferUpdateRectHeader;
+        if (!theReader)
+        {
+            break;
+        }
+        
+        // Decode the rectangle in place if all of it is here, otherwise hand off to the
+        // encoding's incremental readers.
+        unsigned consumed = [theReader readRectangleFromBytes:bytes length:end - bytes];
+        if (!consumed)
+        {
+            [target setReader:theReader];
+            break;
+        }
+        
+        bytes += consumed;
+        [[self metrics] addRectangleBytes:consumed];
+        [self finishRect:theReader];
+    }
+    
+    return bytes - theBytes;
+}
+
+//! Handles the update message header, not including the message type byte.
+- (void)beginUpdateWithHeader:(const uint8_t *)header
 {
     rfbFramebufferUpdateMsg msg;
+    
+    // This update answers the oldest outstanding request.
+    [[self metrics] updateDidBegin];
 	
 	// Send an update request before we start processing this update, in order
 	// to give the server time to put the next update together.
 	[connection queueUpdateRequest];
 
 #ifdef COLLECT_STATS
-    bytesTransferred += [header length];
+    bytesTransferred += sz_rfbFramebufferUpdateMsg - 1;
 #endif
-    memcpy(&msg.pad, [header bytes], sizeof(msg) - 1);
+    memcpy(&msg.pad, header, sizeof(msg) - 1);
     numberOfRects = ntohs(msg.nRects);
     
     if (numberOfRects)
     {
         [connection pauseDrawing];
-        [target setReader:rectHeaderReader];
+        _state = kFrameBufferUpdateRectHeader;
     }
     else
     {
@@ -128,26 +182,39 @@
     }
 }
 
-- (void)setRect:(NSData*)rectInfo
+- (void)setHeader:(NSData*)header
+{
+    [self beginUpdateWithHeader:(const uint8_t *)[header bytes]];
+    if (_state == kFrameBufferUpdateRectHeader)
+    {
+        [target setReaderWithoutReset:self];
+    }
+}
+
+//! Handles a rectangle header and selects the encoding reader for the rectangle.
+//!
+//! @return The encoding reader, or nil if the rectangle ended the update.
+- (EncodingReader *)beginRectWithHeader:(const uint8_t *)header
 {
     id theReader = nil;
     CARD32 e;
-    rfbFramebufferUpdateRectHeader* msg = (rfbFramebufferUpdateRectHeader*)[rectInfo bytes];
+    rfbFramebufferUpdateRectHeader msg;
 
+    memcpy(&msg, header, sz_rfbFramebufferUpdateRectHeader);
 #ifdef COLLECT_STATS
-    bytesTransferred += [rectInfo length];
+    bytesTransferred += sz_rfbFramebufferUpdateRectHeader;
 #endif
-    currentRect.origin.x = ntohs(msg->r.x);
-    currentRect.origin.y = ntohs(msg->r.y);
-    currentRect.size.width = ntohs(msg->r.w);
-    currentRect.size.height = ntohs(msg->r.h);
-    e = ntohl(msg->encoding);
+    currentRect.origin.x = ntohs(msg.r.x);
+    currentRect.origin.y = ntohs(msg.r.y);
+    currentRect.size.width = ntohs(msg.r.w);
+    currentRect.size.height = ntohs(msg.r.h);
+    e = ntohl(msg.encoding);
     if ((e != rfbEncodingRichCursor) && (currentRect.size.width == 0) && (currentRect.size.height == 0)) {
 		// This is a hack for compatibility with OSXvnc 1.0.
 		// However, we have to avoid it for cursor encodings since they may
 		// have a valid hotspot (represented by w and h) of (0,0).
 		[self updateComplete];
-		return;
+		return nil;
     }
     switch(e) {
         case rfbEncodingRaw:
@@ -195,15 +262,36 @@
     if(theReader == nil) {
         @throw [NSException exceptionWithName:kRFBConnectionException reason:[NSString stringWithFormat:
             @"Unknown rectangle encoding %d -> exiting", e] userInfo:nil];
-    } else {
-        [theReader setRectangle:currentRect];
+    }
+    
+    // Tight JPEG rects and big ZRLE rects may still be drawing, and whatever is drawn over
+    // them has to wait. A CopyRect's source is not known yet, so it always waits.
+    if (e == rfbEncodingCopyRect) {
+        [tightEncodingReader finishPendingRects];
+        [zrleEncodingReader finishPendingRects];
+    } else if (e != rfbEncodingRichCursor) {
+        [tightEncodingReader finishPendingRectsIntersecting:currentRect];
+        [zrleEncodingReader finishPendingRectsIntersecting:currentRect];
+    }
+
+    [[self metrics] rectDidBeginWithEncoding:(int32_t)e pixels:(uint64_t)currentRect.size.width * (uint64_t)currentRect.size.height];
+    [theReader setRectangle:currentRect];
+    return theReader;
+}
+
+- (void)setRect:(NSData*)rectInfo
+{
+    EncodingReader * theReader = [self beginRectWithHeader:(const uint8_t *)[rectInfo bytes]];
+    if (theReader)
+    {
         [target setReader:theReader];
     }
 }
 
-- (void)didRect:(EncodingReader*)aReader
+//! Draws a decoded rectangle and moves on to the next one or ends the update.
+- (void)finishRect:(EncodingReader *)aReader
 {
-    id rlist = [aReader rectangleList];
+    [[self metrics] rectDidEnd];
 
 #ifdef COLLECT_STATS
     ConnectionMetrics * metrics = [self metrics];
@@ -213,19 +301,30 @@
     rectsTransferred++;
 #endif
 
-    if(rlist) {
-        [connection drawRectList:rlist];
+    if([aReader isRectanglePending]) {
+        // Displayed by the reader once it has been decoded.
     } else {
         [connection drawRectFromBuffer:currentRect];
     }
     numberOfRects--;
     if(numberOfRects) {
-        [target setReader:rectHeaderReader];
+        _state = kFrameBufferUpdateRectHeader;
     } else {
 		[self updateComplete];
     }
 }
 
+- (void)didRect:(EncodingReader*)aReader
+{
+    [self finishRect:aReader];
+    
+    // Parse the next rectangle header ourselves.
+    if (_state == kFrameBufferUpdateRectHeader)
+    {
+        [target setReaderWithoutReset:self];
+    }
+}
+
 - (double)compressRatio
 {
     return (bytesRepresented/bytesTransferred);
@@ -248,8 +347,13 @@
 
 - (void)updateComplete
 {
+    // Every rect has to be in the frame buffer before the update is flushed.
+    [tightEncodingReader finishPendingRects];
+    [zrleEncodingReader finishPendingRects];
+    _state = kFrameBufferUpdateIdle;
 	[target performSelector:action withObject:self];
 	[connection flushDrawing];
+    [[self metrics] updateDidComplete];
 }
 
 @end
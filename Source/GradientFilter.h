@@ -30,6 +30,9 @@
     unsigned int	rowSize, rowBytes;
     unsigned int	rowCapacity;
     NSMutableData*	filterData;
+    BOOL			fused;			/* whole byte channels, decoded by TightGradientDecodeRow() */
+    unsigned char*	pixelRow;		/* previous row, then this row, for the fused decoder */
+    unsigned int	pixelRowCapacity;
 }
 
 @end
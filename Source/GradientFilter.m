@@ -21,6 +21,7 @@
 #import "GradientFilter.h"
 #import "FrameBuffer.h"
 #import "EncodingReader.h"
+#import "TightGradient.h"
 
 @implementation GradientFilter
 
@@ -45,6 +46,7 @@ static void _free(void* p) {
     _free(prevRow);
     _free(thisRow);
     _free(src);
+    _free(pixelRow);
     [super dealloc];
 }
 
@@ -52,6 +54,17 @@ static void _free(void* p) {
 {
     rowSize = [target rectangle].size.width;
     rowBytes = rowSize * bytesPerPixel;
+    fused = TightGradientCanDecode([frameBuffer getServerPixelFormat], bytesPerPixel);
+    if(fused) {
+        if(TightGradientRowBufferSize(rowSize) > pixelRowCapacity) {
+            pixelRowCapacity = TightGradientRowBufferSize(rowSize);
+            _free(pixelRow);
+            pixelRow = malloc(pixelRowCapacity);
+        }
+        memset(pixelRow, 0, TightGradientRowBufferSize(rowSize));
+        [target performSelector:action withObject:self];
+        return;
+    }
     if(rowSize > rowCapacity) {
         rowCapacity = rowSize;
         _free(prevRow);
@@ -65,6 +78,26 @@ static void _free(void* p) {
     [target performSelector:action withObject:self];
 }
 
+/* With whole byte channels each row is decoded in place over the previous one and converted
+   straight into the frame buffer. */
+- (void)drawRows:(const unsigned char*)data count:(unsigned)numRows at:(NSRect)aRect
+{
+    NSRect r;
+
+    if(!fused) {
+        [super drawRows:data count:numRows at:aRect];
+        return;
+    }
+    r = aRect;
+    r.size.height = 1;
+    while(numRows--) {
+        TightGradientDecodeRow(data, pixelRow, rowSize);
+        [frameBuffer putRect:r fromTightData:pixelRow];
+        data += rowBytes;
+        r.origin.y += 1;
+    }
+}
+
 - (NSData*)filter:(NSData*)data rows:(unsigned)numRows
 {
     int* tmp;
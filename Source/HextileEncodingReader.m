@@ -65,6 +65,9 @@
     currentTile.origin = frame.origin;
     currentTile.size.width = MIN(frame.size.width, TILE_SIZE);
     currentTile.size.height = MIN(frame.size.height, TILE_SIZE);
+    /* Like the other tiles, and like -readRectangleFromBytes:length:, the first one starts
+       out in the background colour. */
+    [frameBuffer fillRect:currentTile withFbColor:&background];
     [target setReader:subEncodingReader];
 }
 
@@ -210,4 +213,20 @@
     [self nextTile];
 }
 
+/* A rect that is all in the receive buffer is drawn in one pass, without going through the
+   sub-readers tile by tile. */
+- (unsigned)readRectangleFromBytes:(const uint8_t *)bytes length:(unsigned)length
+{
+    unsigned total = HextileRectLength(bytes, length, [frameBuffer bytesPerPixel], frame.size.width, frame.size.height);
+
+    if(total == 0) {
+        return 0;
+    }
+#ifdef COLLECT_STATS
+    bytesTransferred = total;
+#endif
+    [frameBuffer putHextileRect:frame fromData:bytes background:&background foreground:&foreground];
+    return total;
+}
+
 @end
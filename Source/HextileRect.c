@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "HextileRect.h"
+#include "FrameBufferRows.h"
+#include <string.h>
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+#define kTileSize 16
+
+//! Converts one pixel. With @a inlineBytes the channels are moved as bytes, which is only
+//! valid when the converter has byteChannels set.
+static ALWAYS_INLINE uint32_t ConvertPixel(const PixelConverter_t * c, const uint8_t * p, int inlineBytes)
+{
+    if (inlineBytes)
+    {
+        return ((uint32_t)p[c->sourceIndex[0]] << c->destShift[0])
+            | ((uint32_t)p[c->sourceIndex[1]] << c->destShift[1])
+            | ((uint32_t)p[c->sourceIndex[2]] << c->destShift[2]);
+    }
+    return c->convertPixel(c, p);
+}
+
+//! Stores colour @a i of a row.
+static ALWAYS_INLINE void StoreColor(uint8_t * row, unsigned colorBytes, unsigned i, uint32_t color)
+{
+    switch (colorBytes)
+    {
+        case 1:
+            row[i] = (uint8_t)color;
+            break;
+        case 2:
+            ((uint16_t *)row)[i] = (uint16_t)color;
+            break;
+        default:
+            ((uint32_t *)row)[i] = color;
+            break;
+    }
+}
+
+//! Repeats a colour across 8 bytes.
+static ALWAYS_INLINE uint64_t ColorPattern(unsigned colorBytes, uint32_t color)
+{
+    switch (colorBytes)
+    {
+        case 1:
+            return 0x0101010101010101ULL * (uint8_t)color;
+        case 2:
+            return 0x0001000100010001ULL * (uint16_t)color;
+        default:
+            return 0x0000000100000001ULL * color;
+    }
+}
+
+//! Fills a subrect, which is at most a tile wide. The store size is chosen once from the row
+//! length in bytes: each row takes one or two stores of that size, or 16-byte stores for rows
+//! of 16 bytes or more, with the last store overlapping the one before it. The row length is
+//! a multiple of the colour size, so every store lines up with the pattern.
+static ALWAYS_INLINE void FillSubrect(uint8_t * row, size_t rowBytes, uint64_t pattern, unsigned rowLength, unsigned lines)
+{
+    const uint64_t wide[2] = { pattern, pattern };
+    unsigned x;
+
+    if (rowLength >= 16)
+    {
+        for (; lines; --lines, row += rowBytes)
+        {
+            for (x = 0; x + 16 < rowLength; x += 16)
+            {
+                memcpy(row + x, wide, 16);
+            }
+            memcpy(row + rowLength - 16, wide, 16);
+        }
+    }
+    else if (rowLength >= 8)
+    {
+        for (; lines; --lines, row += rowBytes)
+        {
+            memcpy(row, &pattern, 8);
+            memcpy(row + rowLength - 8, &pattern, 8);
+        }
+    }
+    else if (rowLength >= 4)
+    {
+        for (; lines; --lines, row += rowBytes)
+        {
+            memcpy(row, &pattern, 4);
+            memcpy(row + rowLength - 4, &pattern, 4);
+        }
+    }
+    else if (rowLength >= 2)
+    {
+        for (; lines; --lines, row += rowBytes)
+        {
+            memcpy(row, &pattern, 2);
+            memcpy(row + rowLength - 2, &pattern, 2);
+        }
+    }
+    else
+    {
+        for (; lines; --lines, row += rowBytes)
+        {
+            row[0] = (uint8_t)pattern;
+        }
+    }
+}
+
+unsigned HextileRectLength(const uint8_t * data, unsigned length, unsigned pixelBytes, unsigned width, unsigned height)
+{
+    const uint8_t * p = data;
+    const uint8_t * end = data + length;
+    unsigned tx, ty;
+
+    for (ty = 0; ty < height; ty += kTileSize)
+    {
+        unsigned th = height - ty < kTileSize ? height - ty : kTileSize;
+        for (tx = 0; tx < width; tx += kTileSize)
+        {
+            unsigned tw = width - tx < kTileSize ? width - tx : kTileSize;
+            size_t need = 0;
+            unsigned subencoding;
+
+            if (p == end)
+            {
+                return 0;
+            }
+            subencoding = *p++;
+            if (subencoding & rfbHextileRaw)
+            {
+                need = (size_t)tw * th * pixelBytes;
+            }
+            else
+            {
+                if (subencoding & rfbHextileBackgroundSpecified)
+                {
+                    need += pixelBytes;
+                }
+                if (subencoding & rfbHextileForegroundSpecified)
+                {
+                    need += pixelBytes;
+                    subencoding &= ~rfbHextileSubrectsColoured;
+                }
+                if (subencoding & rfbHextileAnySubrects)
+                {
+                    if ((size_t)(end - p) <= need)
+                    {
+                        return 0;
+                    }
+                    need += 1 + (size_t)p[need] * ((subencoding & rfbHextileSubrectsColoured) ? pixelBytes + 2 : 2);
+                }
+            }
+            if ((size_t)(end - p) < need)
+            {
+                return 0;
+            }
+            p += need;
+        }
+    }
+    return (unsigned)(p - data);
+}
+
+//! The rect decoder, specialised for each colour size and for pixels whose channels are
+//! whole bytes.
+static ALWAYS_INLINE void DrawRect(const PixelConverter_t * c, const uint8_t * p, uint8_t * dest, size_t rowBytes, unsigned width, unsigned height,
+    uint32_t * background, uint32_t * foreground, unsigned colorBytes, unsigned pixelBytes, int inlineBytes)
+{
+    uint32_t bg = *background;
+    uint32_t fg = *foreground;
+    unsigned tx, ty, y;
+
+    for (ty = 0; ty < height; ty += kTileSize, dest += rowBytes * kTileSize)
+    {
+        unsigned th = height - ty < kTileSize ? height - ty : kTileSize;
+        for (tx = 0; tx < width; tx += kTileSize)
+        {
+            unsigned tw = width - tx < kTileSize ? width - tx : kTileSize;
+            uint8_t * tile = dest + (size_t)tx * colorBytes;
+            unsigned subencoding = *p++;
+
+            if (subencoding & rfbHextileRaw)
+            {
+                for (y = 0; y < th; ++y, p += (size_t)tw * pixelBytes)
+                {
+                    PixelConverterConvertRow(c, p, tile + y * rowBytes, tw);
+                }
+                continue;
+            }
+            if (subencoding & rfbHextileBackgroundSpecified)
+            {
+                bg = ConvertPixel(c, p, inlineBytes);
+                p += pixelBytes;
+            }
+            FrameBufferFillRect(tile, rowBytes, colorBytes, bg, tw, th);
+            if (subencoding & rfbHextileForegroundSpecified)
+            {
+                fg = ConvertPixel(c, p, inlineBytes);
+                p += pixelBytes;
+                subencoding &= ~rfbHextileSubrectsColoured;
+            }
+            if (subencoding & rfbHextileAnySubrects)
+            {
+                unsigned count = *p++;
+                int coloured = (subencoding & rfbHextileSubrectsColoured) != 0;
+                while (count--)
+                {
+                    uint32_t color = fg;
+                    unsigned x0, y0, w, h;
+                    if (coloured)
+                    {
+                        color = ConvertPixel(c, p, inlineBytes);
+                        p += pixelBytes;
+                    }
+                    x0 = rfbHextileExtractX(p[0]);
+                    y0 = rfbHextileExtractY(p[0]);
+                    w = rfbHextileExtractW(p[1]);
+                    h = rfbHextileExtractH(p[1]);
+                    p += 2;
+                    if (x0 >= tw || y0 >= th)
+                    {
+                        continue;
+                    }
+                    if (w > tw - x0)
+                    {
+                        w = tw - x0;
+                    }
+                    if (h > th - y0)
+                    {
+                        h = th - y0;
+                    }
+                    if (w == 1 && h == 1)
+                    {
+                        StoreColor(tile + y0 * rowBytes, colorBytes, x0, color);
+                    }
+                    else
+                    {
+                        FillSubrect(tile + y0 * rowBytes + (size_t)x0 * colorBytes, rowBytes, ColorPattern(colorBytes, color), w * colorBytes, h);
+                    }
+                }
+            }
+        }
+    }
+    *background = bg;
+    *foreground = fg;
+}
+
+static void DrawRect8(const PixelConverter_t * c, const uint8_t * data, uint8_t * dest, size_t rowBytes, unsigned width, unsigned height,
+    uint32_t * background, uint32_t * foreground)
+{
+    DrawRect(c, data, dest, rowBytes, width, height, background, foreground, 1, c->sourceBytes, 0);
+}
+
+static void DrawRect16(const PixelConverter_t * c, const uint8_t * data, uint8_t * dest, size_t rowBytes, unsigned width, unsigned height,
+    uint32_t * background, uint32_t * foreground)
+{
+    DrawRect(c, data, dest, rowBytes, width, height, background, foreground, 2, c->sourceBytes, 0);
+}
+
+static void DrawRect32(const PixelConverter_t * c, const uint8_t * data, uint8_t * dest, size_t rowBytes, unsigned width, unsigned height,
+    uint32_t * background, uint32_t * foreground)
+{
+    DrawRect(c, data, dest, rowBytes, width, height, background, foreground, 4, c->sourceBytes, 0);
+}
+
+static void DrawRect32Bytes4(const PixelConverter_t * c, const uint8_t * data, uint8_t * dest, size_t rowBytes, unsigned width, unsigned height,
+    uint32_t * background, uint32_t * foreground)
+{
+    DrawRect(c, data, dest, rowBytes, width, height, background, foreground, 4, 4, 1);
+}
+
+void HextileDrawRect(const PixelConverter_t * converter, const uint8_t * data, void * dest, size_t rowBytes, unsigned width, unsigned height,
+    uint32_t * background, uint32_t * foreground)
+{
+    if (converter->byteChannels && converter->sourceBytes == 4)
+    {
+        DrawRect32Bytes4(converter, data, (uint8_t *)dest, rowBytes, width, height, background, foreground);
+        return;
+    }
+    switch (converter->destBytes)
+    {
+        case 1:
+            DrawRect8(converter, data, (uint8_t *)dest, rowBytes, width, height, background, foreground);
+            break;
+        case 2:
+            DrawRect16(converter, data, (uint8_t *)dest, rowBytes, width, height, background, foreground);
+            break;
+        default:
+            DrawRect32(converter, data, (uint8_t *)dest, rowBytes, width, height, background, foreground);
+            break;
+    }
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#if !defined(_HextileRect_h_)
+#define _HextileRect_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "PixelConverter.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @file HextileRect.h
+ * @brief Draws whole Hextile rects straight into the framebuffer.
+ *
+ * Once all of a rect's bytes are in memory, its 16x16 tiles are walked in one loop. The
+ * background and foreground are converted once when a tile specifies them and carried over
+ * to the following tiles. Tile backgrounds are filled with FrameBufferFillRect(). Subrects are
+ * never wider than a tile, so they are filled inline with stores sized to their rows.
+ */
+
+//! @brief Find the length of a rect without drawing it.
+//!
+//! @param pixelBytes Size of a server pixel.
+//! @return Bytes used by the rect, or 0 if @a length bytes don't hold all of it.
+unsigned HextileRectLength(const uint8_t * data, unsigned length, unsigned pixelBytes, unsigned width, unsigned height);
+
+//! @brief Decode a rect whose length has been checked with HextileRectLength().
+//!
+//! The converter's source size is the server pixel size. Subrects reaching outside their
+//! tile are clipped to it.
+//!
+//! @param dest First colour of the rect in the framebuffer.
+//! @param rowBytes Distance between framebuffer rows, in bytes.
+//! @param background Colour tiles that don't specify one start with. Updated to the last
+//!     one specified, so it carries over to the next rect.
+//! @param foreground Colour of subrects without their own, updated the same way.
+void HextileDrawRect(const PixelConverter_t * converter, const uint8_t * data, void * dest, size_t rowBytes, unsigned width, unsigned height,
+    uint32_t * background, uint32_t * foreground);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _HextileRect_h_
@@ -0,0 +1,555 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "IOReactor.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#if defined(__APPLE__) || defined(__FreeBSD__)
+    #define USE_KQUEUE 1
+    #include <sys/types.h>
+    #include <sys/event.h>
+    #include <sys/time.h>
+#elif defined(__linux__)
+    #define USE_EPOLL 1
+    #include <sys/epoll.h>
+#else
+    #error "IOReactor requires kqueue or epoll"
+#endif
+
+//! Maximum number of events collected by one wait call.
+#define kMaxEventsPerWait (16)
+
+//! Source identifier reserved for the shutdown pipe.
+#define kWakeupSourceID (0)
+
+/*!
+ * @brief One registered descriptor.
+ *
+ * Source records are never freed while the reactor exists. When a source is removed its slot
+ * is put on the free list and its generation is incremented, so that a stale identifier
+ * delivered by the kernel after removal is recognised and ignored.
+ */
+typedef struct _IOReactorSource
+{
+    int fd;
+    uint32_t index;
+    uint32_t generation;
+    IOReactorCallback_t callback;
+    IOReactorFinalizer_t finalizer;
+    void * context;
+    int isRegistered;   //!< Source is live.
+    int isBusy;         //!< A callback is currently running on some I/O thread.
+    int isPaused;       //!< The callback asked not to be re-armed.
+    int resumePending;  //!< Resumed while the callback was running.
+    struct _IOReactorSource * nextFree;
+} IOReactorSource_t;
+
+struct _IOReactor
+{
+    int queue;  //!< The kqueue or epoll descriptor.
+    int wakePipe[2];    //!< Written to on shutdown to wake all I/O threads.
+    volatile int isShuttingDown;
+    pthread_mutex_t lock;   //!< Protects the source table.
+    IOReactorSource_t ** sources;
+    uint32_t sourceCapacity;
+    uint32_t sourceCount;   //!< Number of live sources.
+    uint32_t sourceAllocated;   //!< Number of source records in the table.
+    IOReactorSource_t * freeSources;
+    unsigned threadCount;
+    pthread_t * threads;
+    volatile uint64_t wakeups;
+    volatile uint64_t callbacks;
+    volatile uint64_t pauses;
+};
+
+static IOReactor_t * s_sharedReactor = NULL;
+static pthread_once_t s_sharedReactorOnce = PTHREAD_ONCE_INIT;
+
+static inline IOReactorSourceID_t MakeSourceID(IOReactorSource_t * source)
+{
+    return ((uint64_t)source->generation << 32) | (uint64_t)(source->index + 1);
+}
+
+//! @pre The reactor lock is held.
+static IOReactorSource_t * LookupSource(IOReactor_t * reactor, IOReactorSourceID_t sourceID)
+{
+    uint32_t index = (uint32_t)(sourceID & 0xffffffff);
+    uint32_t generation = (uint32_t)(sourceID >> 32);
+
+    if (index == 0 || index > reactor->sourceAllocated)
+    {
+        return NULL;
+    }
+
+    IOReactorSource_t * source = reactor->sources[index - 1];
+    if (!source || !source->isRegistered || source->generation != generation)
+    {
+        return NULL;
+    }
+
+    return source;
+}
+
+//! @brief Ask the kernel for the next readability notification on a source.
+//! @pre The reactor lock is held.
+static int ArmSource(IOReactor_t * reactor, IOReactorSource_t * source, int isNew)
+{
+    IOReactorSourceID_t sourceID = MakeSourceID(source);
+
+#if USE_KQUEUE
+    struct kevent change;
+    EV_SET(&change, source->fd, EVFILT_READ, isNew ? (EV_ADD | EV_DISPATCH) : EV_ENABLE, 0, 0, (void *)(uintptr_t)sourceID);
+    return kevent(reactor->queue, &change, 1, NULL, 0, NULL);
+#elif USE_EPOLL
+    struct epoll_event change;
+    memset(&change, 0, sizeof(change));
+    change.events = EPOLLIN | EPOLLONESHOT;
+    change.data.u64 = sourceID;
+    return epoll_ctl(reactor->queue, isNew ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, source->fd, &change);
+#endif
+}
+
+//! @pre The reactor lock is held.
+static void DisarmSource(IOReactor_t * reactor, IOReactorSource_t * source)
+{
+    // Errors are ignored here, since the descriptor may already have been closed.
+#if USE_KQUEUE
+    struct kevent change;
+    EV_SET(&change, source->fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    kevent(reactor->queue, &change, 1, NULL, 0, NULL);
+#elif USE_EPOLL
+    struct epoll_event change;
+    memset(&change, 0, sizeof(change));
+    epoll_ctl(reactor->queue, EPOLL_CTL_DEL, source->fd, &change);
+#endif
+}
+
+//! @brief Return a source record to the free list.
+//! @pre The reactor lock is held.
+static void RetireSource(IOReactor_t * reactor, IOReactorSource_t * source)
+{
+    source->isRegistered = 0;
+    source->generation++;
+    source->callback = NULL;
+    source->finalizer = NULL;
+    source->context = NULL;
+    source->nextFree = reactor->freeSources;
+    reactor->freeSources = source;
+    reactor->sourceCount--;
+}
+
+//! @brief Handle one notification delivered by the kernel.
+static void DispatchSource(IOReactor_t * reactor, IOReactorSourceID_t sourceID)
+{
+    IOReactorSource_t * source;
+    IOReactorCallback_t callback;
+    IOReactorFinalizer_t finalizer = NULL;
+    void * context;
+    int fd;
+    int result;
+
+    pthread_mutex_lock(&reactor->lock);
+    source = LookupSource(reactor, sourceID);
+    if (!source)
+    {
+        // The source was removed after the kernel queued this event.
+        pthread_mutex_unlock(&reactor->lock);
+        return;
+    }
+    source->isBusy = 1;
+    callback = source->callback;
+    context = source->context;
+    fd = source->fd;
+    pthread_mutex_unlock(&reactor->lock);
+
+    __sync_fetch_and_add(&reactor->callbacks, 1);
+    result = callback(context, fd);
+
+    pthread_mutex_lock(&reactor->lock);
+    source->isBusy = 0;
+    if (result == kIOReactorRemove && source->isRegistered)
+    {
+        DisarmSource(reactor, source);
+        source->isRegistered = 0;
+    }
+    if (source->isRegistered)
+    {
+        if (result == kIOReactorPause && !source->resumePending)
+        {
+            // Leave the source disarmed until it is resumed.
+            source->isPaused = 1;
+            __sync_fetch_and_add(&reactor->pauses, 1);
+        }
+        else
+        {
+            ArmSource(reactor, source, 0);
+        }
+        source->resumePending = 0;
+    }
+    else
+    {
+        // The source was removed while its callback was running, so we are responsible for
+        // retiring and finalizing it.
+        finalizer = source->finalizer;
+        RetireSource(reactor, source);
+    }
+    pthread_mutex_unlock(&reactor->lock);
+
+    if (finalizer)
+    {
+        finalizer(context);
+    }
+}
+
+static void * IOThread(void * arg)
+{
+    IOReactor_t * reactor = (IOReactor_t *)arg;
+
+    while (!reactor->isShuttingDown)
+    {
+        IOReactorSourceID_t readyIDs[kMaxEventsPerWait];
+        int count;
+        int i;
+
+#if USE_KQUEUE
+        struct kevent events[kMaxEventsPerWait];
+        count = kevent(reactor->queue, NULL, 0, events, kMaxEventsPerWait, NULL);
+        for (i = 0; i < count; ++i)
+        {
+            readyIDs[i] = (IOReactorSourceID_t)(uintptr_t)events[i].udata;
+        }
+#elif USE_EPOLL
+        struct epoll_event events[kMaxEventsPerWait];
+        count = epoll_wait(reactor->queue, events, kMaxEventsPerWait, -1);
+        for (i = 0; i < count; ++i)
+        {
+            readyIDs[i] = events[i].data.u64;
+        }
+#endif
+
+        __sync_fetch_and_add(&reactor->wakeups, 1);
+
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+
+        for (i = 0; i < count; ++i)
+        {
+            if (readyIDs[i] != kWakeupSourceID)
+            {
+                DispatchSource(reactor, readyIDs[i]);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+IOReactor_t * IOReactorCreate(unsigned threadCount)
+{
+    IOReactor_t * reactor = (IOReactor_t *)calloc(1, sizeof(IOReactor_t));
+    if (!reactor)
+    {
+        return NULL;
+    }
+
+    if (threadCount == 0)
+    {
+        threadCount = 1;
+    }
+
+    pthread_mutex_init(&reactor->lock, NULL);
+    reactor->wakePipe[0] = reactor->wakePipe[1] = -1;
+
+#if USE_KQUEUE
+    reactor->queue = kqueue();
+#elif USE_EPOLL
+    reactor->queue = epoll_create(kMaxEventsPerWait);
+#endif
+    if (reactor->queue < 0 || pipe(reactor->wakePipe) != 0)
+    {
+        goto fail;
+    }
+    fcntl(reactor->queue, F_SETFD, FD_CLOEXEC);
+
+    // The wakeup pipe is level triggered and never re-armed, so that once it is written every
+    // I/O thread sees it.
+#if USE_KQUEUE
+    struct kevent change;
+    EV_SET(&change, reactor->wakePipe[0], EVFILT_READ, EV_ADD, 0, 0, (void *)(uintptr_t)kWakeupSourceID);
+    if (kevent(reactor->queue, &change, 1, NULL, 0, NULL) != 0)
+    {
+        goto fail;
+    }
+#elif USE_EPOLL
+    struct epoll_event change;
+    memset(&change, 0, sizeof(change));
+    change.events = EPOLLIN;
+    change.data.u64 = kWakeupSourceID;
+    if (epoll_ctl(reactor->queue, EPOLL_CTL_ADD, reactor->wakePipe[0], &change) != 0)
+    {
+        goto fail;
+    }
+#endif
+
+    reactor->threads = (pthread_t *)calloc(threadCount, sizeof(pthread_t));
+    if (!reactor->threads)
+    {
+        goto fail;
+    }
+    for (; reactor->threadCount < threadCount; reactor->threadCount++)
+    {
+        if (pthread_create(&reactor->threads[reactor->threadCount], NULL, IOThread, reactor) != 0)
+        {
+            goto fail;
+        }
+    }
+
+    return reactor;
+
+fail:
+    IOReactorDestroy(reactor);
+    return NULL;
+}
+
+void IOReactorDestroy(IOReactor_t * reactor)
+{
+    unsigned i;
+    uint32_t n;
+
+    if (!reactor)
+    {
+        return;
+    }
+
+    // Wake up and join all I/O threads.
+    reactor->isShuttingDown = 1;
+    if (reactor->wakePipe[1] >= 0)
+    {
+        char c = 0;
+        while (write(reactor->wakePipe[1], &c, 1) < 0 && errno == EINTR)
+        {
+        }
+    }
+    for (i = 0; i < reactor->threadCount; ++i)
+    {
+        pthread_join(reactor->threads[i], NULL);
+    }
+    free(reactor->threads);
+
+    // Finalize any remaining sources. No I/O threads are left, so none can be busy.
+    for (n = 0; n < reactor->sourceAllocated; ++n)
+    {
+        IOReactorSource_t * source = reactor->sources[n];
+        if (source)
+        {
+            if (source->isRegistered && source->finalizer)
+            {
+                source->finalizer(source->context);
+            }
+            free(source);
+        }
+    }
+    free(reactor->sources);
+
+    if (reactor->queue >= 0)
+    {
+        close(reactor->queue);
+    }
+    if (reactor->wakePipe[0] >= 0)
+    {
+        close(reactor->wakePipe[0]);
+        close(reactor->wakePipe[1]);
+    }
+    pthread_mutex_destroy(&reactor->lock);
+    free(reactor);
+}
+
+static void CreateSharedReactor(void)
+{
+    s_sharedReactor = IOReactorCreate(kIOReactorDefaultThreadCount);
+}
+
+IOReactor_t * IOReactorGetShared(void)
+{
+    pthread_once(&s_sharedReactorOnce, CreateSharedReactor);
+    return s_sharedReactor;
+}
+
+IOReactorSourceID_t IOReactorAddSource(IOReactor_t * reactor, int fd, IOReactorCallback_t callback, IOReactorFinalizer_t finalizer, void * context)
+{
+    IOReactorSource_t * source;
+    IOReactorSourceID_t sourceID;
+
+    if (!reactor || fd < 0 || !callback)
+    {
+        errno = EINVAL;
+        return 0;
+    }
+
+    pthread_mutex_lock(&reactor->lock);
+
+    // Reuse a retired source record if possible, otherwise create a new one.
+    source = reactor->freeSources;
+    if (source)
+    {
+        reactor->freeSources = source->nextFree;
+    }
+    else
+    {
+        if (reactor->sourceAllocated >= reactor->sourceCapacity)
+        {
+            uint32_t newCapacity = reactor->sourceCapacity ? reactor->sourceCapacity * 2 : 16;
+            IOReactorSource_t ** newSources = (IOReactorSource_t **)realloc(reactor->sources, newCapacity * sizeof(IOReactorSource_t *));
+            if (!newSources)
+            {
+                pthread_mutex_unlock(&reactor->lock);
+                errno = ENOMEM;
+                return 0;
+            }
+            memset(newSources + reactor->sourceCapacity, 0, (newCapacity - reactor->sourceCapacity) * sizeof(IOReactorSource_t *));
+            reactor->sources = newSources;
+            reactor->sourceCapacity = newCapacity;
+        }
+
+        source = (IOReactorSource_t *)calloc(1, sizeof(IOReactorSource_t));
+        if (!source)
+        {
+            pthread_mutex_unlock(&reactor->lock);
+            errno = ENOMEM;
+            return 0;
+        }
+        source->index = reactor->sourceAllocated++;
+        source->generation = 1;
+        reactor->sources[source->index] = source;
+    }
+
+    source->fd = fd;
+    source->callback = callback;
+    source->finalizer = finalizer;
+    source->context = context;
+    source->isBusy = 0;
+    source->isPaused = 0;
+    source->resumePending = 0;
+    source->isRegistered = 1;
+    source->nextFree = NULL;
+    reactor->sourceCount++;
+
+    if (ArmSource(reactor, source, 1) != 0)
+    {
+        int savedErrno = errno;
+        RetireSource(reactor, source);
+        pthread_mutex_unlock(&reactor->lock);
+        errno = savedErrno;
+        return 0;
+    }
+
+    sourceID = MakeSourceID(source);
+    pthread_mutex_unlock(&reactor->lock);
+
+    return sourceID;
+}
+
+void IOReactorRemoveSource(IOReactor_t * reactor, IOReactorSourceID_t sourceID)
+{
+    IOReactorSource_t * source;
+    IOReactorFinalizer_t finalizer = NULL;
+    void * context = NULL;
+
+    if (!reactor)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&reactor->lock);
+    source = LookupSource(reactor, sourceID);
+    if (source)
+    {
+        DisarmSource(reactor, source);
+        source->isRegistered = 0;
+
+        // If a callback is running, the I/O thread running it will retire and finalize the
+        // source once it returns.
+        if (!source->isBusy)
+        {
+            finalizer = source->finalizer;
+            context = source->context;
+            RetireSource(reactor, source);
+        }
+    }
+    pthread_mutex_unlock(&reactor->lock);
+
+    if (finalizer)
+    {
+        finalizer(context);
+    }
+}
+
+void IOReactorResumeSource(IOReactor_t * reactor, IOReactorSourceID_t sourceID)
+{
+    IOReactorSource_t * source;
+
+    if (!reactor)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&reactor->lock);
+    source = LookupSource(reactor, sourceID);
+    if (source)
+    {
+        if (source->isBusy)
+        {
+            // The I/O thread running the callback will re-arm the source when it returns.
+            source->resumePending = 1;
+        }
+        else if (source->isPaused)
+        {
+            source->isPaused = 0;
+            ArmSource(reactor, source, 0);
+        }
+    }
+    pthread_mutex_unlock(&reactor->lock);
+}
+
+void IOReactorGetStatistics(IOReactor_t * reactor, IOReactorStatistics_t * stats)
+{
+    if (!reactor || !stats)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&reactor->lock);
+    stats->wakeups = reactor->wakeups;
+    stats->callbacks = reactor->callbacks;
+    stats->pauses = reactor->pauses;
+    stats->sourceCount = reactor->sourceCount;
+    stats->threadCount = reactor->threadCount;
+    pthread_mutex_unlock(&reactor->lock);
+}
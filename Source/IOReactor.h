@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#if !defined(_IOReactor_h_)
+#define _IOReactor_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @file IOReactor.h
+ * @brief Event loop shared by all connections.
+ *
+ * An I/O reactor multiplexes any number of sockets over a small, fixed set of I/O threads.
+ * kqueue is used on Mac OS X and epoll on Linux. The reactor has no dependency on Cocoa, so it
+ * can be built and run headless against loopback sockets to measure its overhead.
+ *
+ * Each source is registered for one-shot readability notifications. When a source becomes
+ * readable, exactly one I/O thread invokes its callback and the source is not re-armed until
+ * that callback returns. So callbacks for a given source are always serialized, even though
+ * callbacks for different sources run concurrently.
+ */
+
+//! @brief Opaque reactor type.
+typedef struct _IOReactor IOReactor_t;
+
+//! @brief Identifies one registered source. Zero is never a valid identifier.
+typedef uint64_t IOReactorSourceID_t;
+
+//! @brief Values returned from a source callback.
+enum _IOReactorCallbackResult
+{
+    kIOReactorContinue = 0,     //!< Re-arm the source for the next notification.
+    kIOReactorRemove = 1,       //!< Remove the source, as if IOReactorRemoveSource() was called.
+    kIOReactorPause = 2         //!< Keep the source but don't re-arm it until IOReactorResumeSource().
+};
+
+//! @brief Invoked on an I/O thread when the source's descriptor is readable.
+//! @return One of the kIOReactor callback result constants.
+typedef int (*IOReactorCallback_t)(void * context, int fd);
+
+//! @brief Invoked once after a source has been removed and its last callback has returned.
+typedef void (*IOReactorFinalizer_t)(void * context);
+
+//! @brief Counters describing reactor activity. All values are totals since creation.
+typedef struct _IOReactorStatistics
+{
+    uint64_t wakeups;       //!< Number of times an I/O thread returned from waiting.
+    uint64_t callbacks;     //!< Number of source callbacks invoked.
+    uint64_t pauses;        //!< Number of times a callback paused its source.
+    uint32_t sourceCount;   //!< Number of currently registered sources.
+    uint32_t threadCount;   //!< Number of I/O threads.
+} IOReactorStatistics_t;
+
+//! @brief Default number of I/O threads used by the shared reactor.
+#define kIOReactorDefaultThreadCount (2)
+
+//! @brief Create a reactor and start its I/O threads.
+//! @return NULL if the kernel event queue or any thread could not be created.
+IOReactor_t * IOReactorCreate(unsigned threadCount);
+
+//! @brief Stop the I/O threads and free the reactor.
+//!
+//! Finalizers are invoked for any sources that are still registered.
+void IOReactorDestroy(IOReactor_t * reactor);
+
+//! @brief Returns the reactor shared by all connections, creating it on first use.
+IOReactor_t * IOReactorGetShared(void);
+
+//! @brief Register a descriptor for readability notifications.
+//! @return The new source's identifier, or 0 on failure with errno set.
+IOReactorSourceID_t IOReactorAddSource(IOReactor_t * reactor, int fd, IOReactorCallback_t callback, IOReactorFinalizer_t finalizer, void * context);
+
+//! @brief Unregister a source.
+//!
+//! No callbacks are started for the source after this returns. If a callback is currently
+//! running, the finalizer is invoked by the I/O thread once it returns; otherwise the finalizer
+//! is invoked before this function returns. Removing a source that was already removed has
+//! no effect. This may be called from within the source's own callback.
+void IOReactorRemoveSource(IOReactor_t * reactor, IOReactorSourceID_t source);
+
+//! @brief Re-arm a source whose callback returned kIOReactorPause.
+//!
+//! If the source's callback is running when this is called, the source is re-armed when the
+//! callback returns even if it returns kIOReactorPause, so a resume is never lost. Resuming a
+//! source that is not paused has no effect.
+void IOReactorResumeSource(IOReactor_t * reactor, IOReactorSourceID_t source);
+
+//! @brief Read the reactor's counters.
+void IOReactorGetStatistics(IOReactor_t * reactor, IOReactorStatistics_t * stats);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _IOReactor_h_
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "InflateRows.h"
+#include <string.h>
+
+void InflateRowsBegin(InflateRows_t * r, z_stream * stream, unsigned rowBytes, unsigned rows, uint8_t * window, size_t windowBytes, uint8_t * dest, size_t destStride)
+{
+    r->stream = stream;
+    r->rowBytes = rowBytes;
+    r->rows = rowBytes ? rows : 0;
+    r->rowsDone = 0;
+    r->partialBytes = 0;
+    r->window = window;
+    r->windowRows = rowBytes ? (unsigned)(windowBytes / rowBytes) : 0;
+    r->dest = dest;
+    r->destStride = destStride;
+}
+
+int InflateRowsInput(InflateRows_t * r, const uint8_t * input, unsigned length, InflateRowsCallback callback, void * context)
+{
+    z_stream * stream = r->stream;
+    uint8_t discard[256];
+
+    stream->next_in = (Bytef *)input;
+    stream->avail_in = length;
+    stream->data_type = Z_BINARY;
+
+    while (stream->avail_in)
+    {
+        unsigned rowsLeft = r->rows - r->rowsDone;
+        uint8_t * out;
+        size_t room;
+
+        if (rowsLeft == 0)
+        {
+            // Only the end of the server's flush should be left, but keep the stream in step
+            // whatever it is.
+            out = discard;
+            room = sizeof(discard);
+        }
+        else if (r->dest)
+        {
+            // Consecutive rows can be inflated in one go when they are contiguous.
+            out = r->dest + r->rowsDone * r->destStride + r->partialBytes;
+            room = (r->destStride == r->rowBytes ? (size_t)rowsLeft * r->rowBytes : r->rowBytes) - r->partialBytes;
+        }
+        else
+        {
+            unsigned windowRows = r->windowRows < rowsLeft ? r->windowRows : rowsLeft;
+            out = r->window + r->partialBytes;
+            room = (size_t)windowRows * r->rowBytes - r->partialBytes;
+        }
+
+        stream->next_out = out;
+        stream->avail_out = (uInt)room;
+        uInt availableIn = stream->avail_in;
+        int result = inflate(stream, Z_SYNC_FLUSH);
+        if (result == Z_NEED_DICT || (result < 0 && result != Z_BUF_ERROR))
+        {
+            return result;
+        }
+
+        size_t produced = room - stream->avail_out;
+        if (produced == 0 && stream->avail_in == availableIn)
+        {
+            // No progress is possible, which zlib only allows at the end of a stream.
+            return result == Z_STREAM_END ? Z_OK : Z_BUF_ERROR;
+        }
+        if (rowsLeft == 0)
+        {
+            continue;
+        }
+
+        size_t bytes = r->partialBytes + produced;
+        unsigned complete = (unsigned)(bytes / r->rowBytes);
+        r->partialBytes = (unsigned)(bytes - (size_t)complete * r->rowBytes);
+        if (complete == 0)
+        {
+            continue;
+        }
+        if (r->dest)
+        {
+            callback(context, r->dest + r->rowsDone * r->destStride, r->rowsDone, complete);
+        }
+        else
+        {
+            callback(context, r->window, r->rowsDone, complete);
+            if (r->partialBytes)
+            {
+                memmove(r->window, r->window + (size_t)complete * r->rowBytes, r->partialBytes);
+            }
+        }
+        r->rowsDone += complete;
+    }
+    return Z_OK;
+}
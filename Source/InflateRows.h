@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#if !defined(_InflateRows_h_)
+#define _InflateRows_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @file InflateRows.h
+ * @brief Inflates a rect of pixel rows as its compressed bytes arrive.
+ *
+ * Rows are inflated either into a small window that holds a few rows, and handed to a
+ * callback as soon as they are complete, or straight into their final place in the
+ * framebuffer when the server pixels need no conversion. Neither needs a buffer the size of
+ * the rect.
+ */
+
+//! @brief Called with rows that have been completely inflated.
+//! @param rows First byte of the first row. Rows are packed in the window, but are spaced
+//!     by the destination stride when inflating into the destination.
+//! @param firstRow Index of the first row within the rect.
+typedef void (*InflateRowsCallback)(void * context, const uint8_t * rows, unsigned firstRow, unsigned count);
+
+//! @brief State of a rect being inflated. Treat the fields as private.
+typedef struct _InflateRows
+{
+    z_stream * stream;      //!< Stream shared by every rect of the connection.
+    unsigned rowBytes;
+    unsigned rows;
+    unsigned rowsDone;      //!< Rows handed to the callback so far.
+    unsigned partialBytes;  //!< Bytes of the next row already inflated.
+    uint8_t * window;
+    unsigned windowRows;
+    uint8_t * dest;         //!< First row of the destination, or NULL to use the window.
+    size_t destStride;
+} InflateRows_t;
+
+//! @brief Start inflating a rect.
+//!
+//! @param stream Initialised zlib stream. It is shared by every rect of the connection.
+//! @param window Buffer of @a windowBytes bytes, at least one row long, for rows that have to
+//!     be converted. Unused if @a dest is set.
+//! @param dest Where to inflate rows to in place, or NULL to inflate into @a window.
+//! @param destStride Distance between rows at @a dest, in bytes.
+void InflateRowsBegin(InflateRows_t * inflater, z_stream * stream, unsigned rowBytes, unsigned rows, uint8_t * window, size_t windowBytes, uint8_t * dest, size_t destStride);
+
+//! @brief Inflate the next chunk of compressed bytes.
+//!
+//! All of the input is consumed, even past the last row, so the stream stays in step with
+//! the server. Output beyond the last row is discarded.
+//!
+//! @return Z_OK, or the zlib error that stopped inflation.
+int InflateRowsInput(InflateRows_t * inflater, const uint8_t * input, unsigned length, InflateRowsCallback callback, void * context);
+
+//! @brief Whether every row of the rect has been inflated.
+static inline int InflateRowsIsComplete(const InflateRows_t * inflater)
+{
+    return inflater->rowsDone == inflater->rows;
+}
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _InflateRows_h_
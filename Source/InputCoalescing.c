@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "InputCoalescing.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+int ScrollAccumulatorAdd(ScrollAccumulator_t * accumulator, int isContinuous, int64_t pixelDelta, int64_t lineDelta)
+{
+    int64_t clicks;
+
+    if (isContinuous)
+    {
+        // Start over when the direction changes.
+        if ((pixelDelta > 0 && accumulator->remainder < 0) || (pixelDelta < 0 && accumulator->remainder > 0))
+        {
+            accumulator->remainder = 0;
+        }
+        accumulator->remainder += pixelDelta;
+        clicks = accumulator->remainder / kScrollPixelsPerClick;
+        accumulator->remainder -= clicks * kScrollPixelsPerClick;
+    }
+    else
+    {
+        clicks = lineDelta;
+        accumulator->remainder = 0;
+    }
+
+    if (clicks > kMaxScrollClicksPerEvent)
+    {
+        clicks = kMaxScrollClicksPerEvent;
+    }
+    else if (clicks < -kMaxScrollClicksPerEvent)
+    {
+        clicks = -kMaxScrollClicksPerEvent;
+    }
+    return (int)clicks;
+}
+
+int MotionWindowNeedsRoundTrip(const MotionWindow_t * motion, uint64_t now)
+{
+    return motion->roundTripUpdated == 0 || now - motion->roundTripUpdated >= kRoundTripRefreshNanoseconds;
+}
+
+void MotionWindowSetRoundTrip(MotionWindow_t * motion, uint64_t roundTripNanoseconds, uint64_t now)
+{
+    motion->window = roundTripNanoseconds / 2;
+    if (motion->window < kMinMotionWindowNanoseconds)
+    {
+        motion->window = kMinMotionWindowNanoseconds;
+    }
+    else if (motion->window > kMaxMotionWindowNanoseconds)
+    {
+        motion->window = kMaxMotionWindowNanoseconds;
+    }
+    motion->roundTripUpdated = now;
+}
+
+uint64_t MotionWindowDelay(const MotionWindow_t * motion, uint64_t now)
+{
+    uint64_t elapsed = now - motion->lastSent;
+
+    if (motion->lastSent == 0 || elapsed >= motion->window)
+    {
+        return 0;
+    }
+    return motion->window - elapsed;
+}
+
+void MotionWindowDidSend(MotionWindow_t * motion, uint64_t now)
+{
+    motion->lastSent = now;
+}
+
+int SocketGetRoundTrip(int fd, uint64_t * nanoseconds)
+{
+#if defined(__APPLE__) && defined(TCP_CONNECTION_INFO)
+    struct tcp_connection_info info;
+    socklen_t length = sizeof(info);
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_CONNECTION_INFO, &info, &length) < 0 || info.tcpi_srtt == 0)
+    {
+        return -1;
+    }
+    // Milliseconds.
+    *nanoseconds = (uint64_t)info.tcpi_srtt * 1000000ULL;
+    return 0;
+#elif defined(TCP_INFO) && defined(__linux__)
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) < 0 || info.tcpi_rtt == 0)
+    {
+        return -1;
+    }
+    // Microseconds.
+    *nanoseconds = (uint64_t)info.tcpi_rtt * 1000ULL;
+    return 0;
+#else
+    (void)fd;
+    (void)nanoseconds;
+    return -1;
+#endif
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#if !defined(_InputCoalescing_h_)
+#define _InputCoalescing_h_
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @file InputCoalescing.h
+ * @brief Decides how many pointer events local input turns into.
+ *
+ * Pointer motion is limited to one position per window. The window is at least one display
+ * frame and grows with the connection's round trip time. A motion event inside the window is
+ * held, and only the latest held position is sent when the window ends. Button changes are
+ * not held; the caller sends any held position first so the order is kept.
+ *
+ * Scrolling from continuous devices is accumulated in pixels and turned into whole wheel
+ * clicks, with a bound on the clicks sent for one event.
+ */
+
+//! Pixels of continuous scrolling that make up one wheel click.
+#define kScrollPixelsPerClick (16)
+
+//! Most wheel clicks sent for a single scroll event. Extra distance is dropped so a fast
+//! flick doesn't flood the server with button 4/5 presses.
+#define kMaxScrollClicksPerEvent (4)
+
+//! Shortest motion window: one frame of a 60 Hz display. The server's picture of a position
+//! can't be shown any sooner, so on a fast link more positions than that are wasted.
+#define kMinMotionWindowNanoseconds (16666667ULL)
+
+//! Longest motion window, whatever the round trip time.
+#define kMaxMotionWindowNanoseconds (33000000ULL)
+
+//! How often the round trip time is worth asking for again.
+#define kRoundTripRefreshNanoseconds (1000000000ULL)
+
+//! @brief Scroll distance not yet sent.
+typedef struct _ScrollAccumulator
+{
+    int64_t remainder;      //!< Pixels that haven't added up to a whole click.
+} ScrollAccumulator_t;
+
+//! @brief When pointer motion may next be sent.
+typedef struct _MotionWindow
+{
+    uint64_t window;            //!< Least time between two motion events, in nanoseconds.
+    uint64_t lastSent;          //!< When motion was last sent.
+    uint64_t roundTripUpdated;  //!< When the window was last set from the round trip time.
+} MotionWindow_t;
+
+//! @brief Add one scroll event.
+//!
+//! Continuous devices report @a pixelDelta; line based wheels report whole clicks in
+//! @a lineDelta, which reset any accumulated distance.
+//!
+//! @return Wheel clicks to send, positive for up, at most kMaxScrollClicksPerEvent either way.
+int ScrollAccumulatorAdd(ScrollAccumulator_t * accumulator, int isContinuous, int64_t pixelDelta, int64_t lineDelta);
+
+//! @brief Whether the window should be set from a fresh round trip time.
+int MotionWindowNeedsRoundTrip(const MotionWindow_t * motion, uint64_t now);
+
+//! @brief Set the window to half the round trip time, between kMinMotionWindowNanoseconds
+//!     and kMaxMotionWindowNanoseconds.
+//!
+//! A position sent more often than that would be overtaken by the next one before the
+//! server's answer to it arrives. An unknown round trip time, given as 0, gets the shortest
+//! window.
+void MotionWindowSetRoundTrip(MotionWindow_t * motion, uint64_t roundTripNanoseconds, uint64_t now);
+
+//! @brief How long motion at @a now has to be held.
+//! @return 0 if it may be sent now, otherwise nanoseconds until the window ends.
+uint64_t MotionWindowDelay(const MotionWindow_t * motion, uint64_t now);
+
+//! @brief Note that motion was sent at @a now.
+void MotionWindowDidSend(MotionWindow_t * motion, uint64_t now);
+
+//! @brief Read the kernel's smoothed round trip time for a connected TCP socket.
+//! @return 0 on success, -1 if the socket or platform doesn't report one.
+int SocketGetRoundTrip(int fd, uint64_t * nanoseconds);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _InputCoalescing_h_
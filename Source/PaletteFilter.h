@@ -23,14 +23,10 @@
 
 @interface PaletteFilter : FilterReader
 {
-    id				numColorReader;
-    id				paletteReader;
-    int				numColors;
-    int				palette[256*3];
-    int*			src;
-    unsigned int	rowSize;
-    unsigned int	rowCapacity;
-    NSMutableData*	filterData;
+    id					numColorReader;
+    id					paletteReader;
+    int					numColors;
+    FrameBufferColor	palette[256];	/* converted once into frame buffer colours */
 }
 
 @end
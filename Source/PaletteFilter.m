@@ -32,7 +32,6 @@
     if (self = [super initTarget:aTarget action:anAction]) {
 		numColorReader = [[CARD8Reader alloc] initTarget:self action:@selector(setColors:)];
 		paletteReader = [[ByteBlockReader alloc] initTarget:self action:@selector(setPalette:)];
-		filterData = [[NSMutableData alloc] init];
 	}
     return self;
 }
@@ -41,23 +40,11 @@
 {
     [numColorReader release];
     [paletteReader release];
-    [filterData release];
-    if(src) {
-		free(src);
-    }
     [super dealloc];
 }
 
 - (void)resetReader
 {
-    rowSize = [target rectangle].size.width;
-    if(rowSize > rowCapacity) {
-        rowCapacity = rowSize;
-		if(src) {
-			free(src);
-		}
-        src = malloc(3 * rowSize * sizeof(int));
-    }
     [target setReader:numColorReader];
 }
 
@@ -73,68 +60,24 @@
 
 - (void)setPalette:(NSData*)data
 {
-/*   {
-        int i;
-        unsigned short* sp = (unsigned short*)[data bytes];
-        printf("palette: ");
-        for(i=0; i<numColors; i++) {
-            printf("%04x ", sp[i]);
-        }
-        printf("\n");
+    const unsigned char* pixel = [data bytes];
+    int i;
+
+    for(i=0; i<numColors; i++) {
+        [frameBuffer fillColor:palette + i fromTightPixel:(unsigned char*)pixel];
+        pixel += bytesPerPixel;
     }
-*/
-    [frameBuffer splitRGB:(unsigned char*)[data bytes] pixels:numColors into:palette];
     [target performSelector:action withObject:self];
 }
 
-- (NSData*)filter:(NSData*)data rows:(unsigned)numRows
+/* Rows are looked up in the converted palette straight into the frame buffer. */
+- (void)drawRows:(const unsigned char*)data count:(unsigned)numRows at:(NSRect)aRect
 {
-    int b, w, x, y, rowBytes, val;
-    unsigned char* fd;
-    int* dst;
-    unsigned char* bytes = (unsigned char*)[data bytes];
-
-    rowBytes = rowSize * bytesPerPixel;
-    [filterData setLength:numRows * rowBytes];
-    fd = [filterData mutableBytes];
     if(numColors == 2) {
-        w = (rowSize + 7) / 8;
-        for(y=0; y<numRows; y++) {
-            dst = src;
-            for(x=0; x<rowSize/8; x++) {
-                for(b=7; b>=0; b--) {
-                    val = ((int)((bytes[y*w+x] >> b) & 1)) * 3;
-                    *dst++ = palette[val];
-                    *dst++ = palette[val+1];
-                    *dst++ = palette[val+2];
-                }
-            }
-            for(b=7; b>=8 - (rowSize & 7); b--) {
-                val = ((int)((bytes[y*w+x] >> b) & 1)) * 3;
-                *dst++ = palette[val];
-                *dst++ = palette[val+1];
-                *dst++ = palette[val+2];
-            }
-            [frameBuffer combineRGB:src pixels:rowSize into:fd];
-            fd += rowBytes;
-        }
+        [frameBuffer putRect:aRect withBits:data fromPalette:palette];
     } else {
-//        printf("palettedata: ");
-        for(y=0; y<numRows; y++) {
-            dst = src;
-            for(x=0; x<rowSize; x++) {
-//                printf("%02x ", bytes[y*rowSize+x] & 0xff);
-                val = ((int)bytes[y*rowSize+x]) * 3;                
-                *dst++ = palette[val];
-                *dst++ = palette[val+1];
-                *dst++ = palette[val+2];
-            }
-            [frameBuffer combineRGB:src pixels:rowSize into:fd];
-            fd += rowBytes;
-        }
-//        printf("\n");
+        [frameBuffer putRect:aRect withColors:(FrameBufferPaletteIndex*)data fromPalette:palette];
     }
-    return filterData;
 }
 
 - (unsigned)bitsPerPixel
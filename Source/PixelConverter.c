@@ -0,0 +1,437 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "PixelConverter.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PIXEL_CONVERTER_X86 1
+#include <immintrin.h>
+#endif
+
+static int HostIsBigEndian(void)
+{
+    union
+    {
+        uint16_t s;
+        uint8_t c[2];
+    } x;
+
+    x.s = 0x1234;
+    return x.c[0] == 0x12;
+}
+
+#define LOAD_8(p)       ((unsigned)(p)[0])
+#define LOAD_16BE(p)    (((unsigned)(p)[0] << 8) | (p)[1])
+#define LOAD_16LE(p)    ((unsigned)(p)[0] | ((unsigned)(p)[1] << 8))
+#define LOAD_24BE(p)    (((unsigned)(p)[0] << 16) | ((unsigned)(p)[1] << 8) | (p)[2])
+#define LOAD_24LE(p)    ((unsigned)(p)[0] | ((unsigned)(p)[1] << 8) | ((unsigned)(p)[2] << 16))
+#define LOAD_32BE(p)    (((unsigned)(p)[0] << 24) | ((unsigned)(p)[1] << 16) | ((unsigned)(p)[2] << 8) | (p)[3])
+#define LOAD_32LE(p)    ((unsigned)(p)[0] | ((unsigned)(p)[1] << 8) | ((unsigned)(p)[2] << 16) | ((unsigned)(p)[3] << 24))
+
+//! Looks up the three channel tables for one server pixel value.
+static inline unsigned LookUpChannels(const PixelConverter_t * c, unsigned pix)
+{
+    return c->redClut[(pix >> c->redShift) & c->redMax]
+        + c->greenClut[(pix >> c->greenShift) & c->greenMax]
+        + c->blueClut[(pix >> c->blueShift) & c->blueMax];
+}
+
+//! Defines a row kernel that looks up each channel, for one source layout and colour size.
+#define DEFINE_LOOKUP_KERNEL(NAME, TYPE, BYTES, LOAD)                                           \
+static void NAME(const PixelConverter_t * c, const uint8_t * source, void * dest, unsigned count) \
+{                                                                                               \
+    TYPE * out = (TYPE *)dest;                                                                  \
+    while (count--)                                                                             \
+    {                                                                                           \
+        *out++ = (TYPE)LookUpChannels(c, LOAD(source));                                         \
+        source += BYTES;                                                                        \
+    }                                                                                           \
+}
+
+//! Defines the lookup kernels for one source layout, one per colour size, and the function
+//! converting a single pixel of that layout.
+#define DEFINE_LOOKUP_FUNCTIONS(LAYOUT, BYTES, LOAD)                                            \
+DEFINE_LOOKUP_KERNEL(ConvertLookup##LAYOUT##To8, uint8_t, BYTES, LOAD)                          \
+DEFINE_LOOKUP_KERNEL(ConvertLookup##LAYOUT##To16, uint16_t, BYTES, LOAD)                        \
+DEFINE_LOOKUP_KERNEL(ConvertLookup##LAYOUT##To32, uint32_t, BYTES, LOAD)                        \
+static unsigned ConvertPixel##LAYOUT(const PixelConverter_t * c, const uint8_t * source)        \
+{                                                                                               \
+    return LookUpChannels(c, LOAD(source));                                                     \
+}
+
+DEFINE_LOOKUP_FUNCTIONS(8, 1, LOAD_8)
+DEFINE_LOOKUP_FUNCTIONS(16LE, 2, LOAD_16LE)
+DEFINE_LOOKUP_FUNCTIONS(16BE, 2, LOAD_16BE)
+DEFINE_LOOKUP_FUNCTIONS(24LE, 3, LOAD_24LE)
+DEFINE_LOOKUP_FUNCTIONS(24BE, 3, LOAD_24BE)
+DEFINE_LOOKUP_FUNCTIONS(32LE, 4, LOAD_32LE)
+DEFINE_LOOKUP_FUNCTIONS(32BE, 4, LOAD_32BE)
+
+typedef struct
+{
+    PixelConverterRowFunction rows[3];      //!< For 1, 2 and 4 byte colours.
+    PixelConverterPixelFunction pixel;
+} LookupFunctions_t;
+
+#define LOOKUP_FUNCTIONS(LAYOUT) \
+    { { ConvertLookup##LAYOUT##To8, ConvertLookup##LAYOUT##To16, ConvertLookup##LAYOUT##To32 }, ConvertPixel##LAYOUT }
+
+//! Lookup functions indexed by bytes per source pixel minus one, then big endian.
+static const LookupFunctions_t kLookupFunctions[4][2] = {
+    { LOOKUP_FUNCTIONS(8), LOOKUP_FUNCTIONS(8) },
+    { LOOKUP_FUNCTIONS(16LE), LOOKUP_FUNCTIONS(16BE) },
+    { LOOKUP_FUNCTIONS(24LE), LOOKUP_FUNCTIONS(24BE) },
+    { LOOKUP_FUNCTIONS(32LE), LOOKUP_FUNCTIONS(32BE) }
+};
+
+//! Defines a kernel that converts each pixel with one lookup in a table of all pixel values.
+#define DEFINE_TABLE_KERNEL(NAME, SOURCE_TYPE, TYPE)                                            \
+static void NAME(const PixelConverter_t * c, const uint8_t * source, void * dest, unsigned count) \
+{                                                                                               \
+    const TYPE * table = (const TYPE *)c->table;                                                \
+    TYPE * out = (TYPE *)dest;                                                                  \
+    SOURCE_TYPE pix[4];                                                                         \
+    while (count >= 4)                                                                          \
+    {                                                                                           \
+        memcpy(pix, source, sizeof(pix));                                                       \
+        out[0] = table[pix[0]];                                                                 \
+        out[1] = table[pix[1]];                                                                 \
+        out[2] = table[pix[2]];                                                                 \
+        out[3] = table[pix[3]];                                                                 \
+        out += 4;                                                                               \
+        source += sizeof(pix);                                                                  \
+        count -= 4;                                                                             \
+    }                                                                                           \
+    while (count--)                                                                             \
+    {                                                                                           \
+        memcpy(pix, source, sizeof(SOURCE_TYPE));                                               \
+        *out++ = table[pix[0]];                                                                 \
+        source += sizeof(SOURCE_TYPE);                                                          \
+    }                                                                                           \
+}
+
+DEFINE_TABLE_KERNEL(ConvertTable8To8, uint8_t, uint8_t)
+DEFINE_TABLE_KERNEL(ConvertTable8To16, uint8_t, uint16_t)
+DEFINE_TABLE_KERNEL(ConvertTable8To32, uint8_t, uint32_t)
+DEFINE_TABLE_KERNEL(ConvertTable16To8, uint16_t, uint8_t)
+DEFINE_TABLE_KERNEL(ConvertTable16To16, uint16_t, uint16_t)
+DEFINE_TABLE_KERNEL(ConvertTable16To32, uint16_t, uint32_t)
+
+//! @brief Builds the table used by the table kernels.
+//!
+//! The table is indexed by a source pixel loaded from memory in host byte order, so the
+//! kernels never need to swap bytes.
+static int BuildTable(PixelConverter_t * c)
+{
+    unsigned entries = 1u << (c->sourceBytes * 8);
+    c->table = malloc((size_t)entries * c->destBytes);
+    if (!c->table)
+    {
+        return -1;
+    }
+
+    unsigned i;
+    for (i = 0; i < entries; ++i)
+    {
+        uint8_t bytes[2];
+        unsigned pix;
+        if (c->sourceBytes == 1)
+        {
+            pix = i;
+        }
+        else
+        {
+            uint16_t key = (uint16_t)i;
+            memcpy(bytes, &key, sizeof(key));
+            pix = c->sourceBigEndian ? LOAD_16BE(bytes) : LOAD_16LE(bytes);
+        }
+
+        unsigned colour = LookUpChannels(c, pix);
+        switch (c->destBytes)
+        {
+            case 1:
+                ((uint8_t *)c->table)[i] = (uint8_t)colour;
+                break;
+            case 2:
+                ((uint16_t *)c->table)[i] = (uint16_t)colour;
+                break;
+            default:
+                ((uint32_t *)c->table)[i] = colour;
+                break;
+        }
+    }
+    return 0;
+}
+
+static void ConvertCopy(const PixelConverter_t * c, const uint8_t * source, void * dest, unsigned count)
+{
+    (void)c;
+    memcpy(dest, source, (size_t)count * 4);
+}
+
+#if PIXEL_CONVERTER_X86
+
+//! Moves each 8-bit channel with shifts and masks; only for 4-byte sources.
+__attribute__((target("sse2")))
+static void ConvertShiftSSE2(const PixelConverter_t * c, const uint8_t * source, void * dest, unsigned count)
+{
+    uint32_t * out = (uint32_t *)dest;
+    const __m128i mask = _mm_set1_epi32(0xff);
+    __m128i sourceShift[3];
+    __m128i destShift[3];
+    int i;
+    for (i = 0; i < 3; ++i)
+    {
+        sourceShift[i] = _mm_cvtsi32_si128(c->sourceIndex[i] * 8);
+        destShift[i] = _mm_cvtsi32_si128(c->destShift[i]);
+    }
+
+    while (count >= 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)source);
+        __m128i r = _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(v, sourceShift[0]), mask), destShift[0]);
+        __m128i g = _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(v, sourceShift[1]), mask), destShift[1]);
+        __m128i b = _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(v, sourceShift[2]), mask), destShift[2]);
+        _mm_storeu_si128((__m128i *)out, _mm_or_si128(_mm_or_si128(r, g), b));
+        source += 16;
+        out += 4;
+        count -= 4;
+    }
+    c->lookupRow(c, source, out, count);
+}
+
+__attribute__((target("ssse3")))
+static void ConvertShuffleSSSE3(const PixelConverter_t * c, const uint8_t * source, void * dest, unsigned count)
+{
+    uint32_t * out = (uint32_t *)dest;
+    const __m128i shuffle = _mm_loadu_si128((const __m128i *)c->shuffle);
+    unsigned step = c->sourceBytes * 4;
+
+    // Each load reads 16 bytes, which is more than four 3-byte pixels.
+    unsigned reserve = c->sourceBytes == 3 ? 2 : 0;
+    while (count >= 4 + reserve)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)source);
+        _mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(v, shuffle));
+        source += step;
+        out += 4;
+        count -= 4;
+    }
+    c->lookupRow(c, source, out, count);
+}
+
+__attribute__((target("avx2")))
+static void ConvertShuffleAVX2(const PixelConverter_t * c, const uint8_t * source, void * dest, unsigned count)
+{
+    uint32_t * out = (uint32_t *)dest;
+    const __m128i laneShuffle = _mm_loadu_si128((const __m128i *)c->shuffle);
+    const __m256i shuffle = _mm256_broadcastsi128_si256(laneShuffle);
+
+    if (c->sourceBytes == 4)
+    {
+        while (count >= 8)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)source);
+            _mm256_storeu_si256((__m256i *)out, _mm256_shuffle_epi8(v, shuffle));
+            source += 32;
+            out += 8;
+            count -= 8;
+        }
+    }
+    else
+    {
+        // The shuffle works within 128-bit lanes, so load four pixels into each lane. The
+        // second load reads 4 bytes past the eighth pixel.
+        while (count >= 10)
+        {
+            __m128i lo = _mm_loadu_si128((const __m128i *)source);
+            __m128i hi = _mm_loadu_si128((const __m128i *)(source + 12));
+            __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+            _mm256_storeu_si256((__m256i *)out, _mm256_shuffle_epi8(v, shuffle));
+            source += 24;
+            out += 8;
+            count -= 8;
+        }
+    }
+    c->lookupRow(c, source, out, count);
+}
+
+#endif // PIXEL_CONVERTER_X86
+
+//! @brief Works out which bytes the channels occupy if the tables are plain shifts.
+//!
+//! This is the case when each channel has 8 bits on a byte boundary in the server pixel and
+//! the table maps a channel value to itself shifted to a byte boundary in a 4-byte colour.
+static int FindChannelBytes(PixelConverter_t * c)
+{
+    const unsigned int * cluts[3] = { c->redClut, c->greenClut, c->blueClut };
+    unsigned shifts[3] = { c->redShift, c->greenShift, c->blueShift };
+    unsigned maxes[3] = { c->redMax, c->greenMax, c->blueMax };
+    int hostBig = HostIsBigEndian();
+    int channel;
+
+    if (c->destBytes != 4 || c->sourceBytes < 3)
+    {
+        return 0;
+    }
+
+    for (channel = 0; channel < 3; ++channel)
+    {
+        const unsigned int * clut = cluts[channel];
+        unsigned sourceByte = shifts[channel] / 8;
+        if (maxes[channel] != 255 || shifts[channel] % 8 || sourceByte >= c->sourceBytes)
+        {
+            return 0;
+        }
+
+        unsigned destShift;
+        for (destShift = 0; destShift < 32; destShift += 8)
+        {
+            if (clut[1] == 1u << destShift)
+            {
+                break;
+            }
+        }
+        if (destShift == 32)
+        {
+            return 0;
+        }
+
+        unsigned i;
+        for (i = 0; i < 256; ++i)
+        {
+            if (clut[i] != i << destShift)
+            {
+                return 0;
+            }
+        }
+
+        c->sourceIndex[channel] = c->sourceBigEndian ? c->sourceBytes - 1 - sourceByte : sourceByte;
+        c->destShift[channel] = destShift;
+        c->destIndex[channel] = hostBig ? 3 - destShift / 8 : destShift / 8;
+    }
+
+    int pixel, byte;
+    for (pixel = 0; pixel < 4; ++pixel)
+    {
+        for (byte = 0; byte < 4; ++byte)
+        {
+            c->shuffle[pixel * 4 + byte] = 0x80;
+        }
+        for (channel = 0; channel < 3; ++channel)
+        {
+            c->shuffle[pixel * 4 + c->destIndex[channel]] = pixel * c->sourceBytes + c->sourceIndex[channel];
+        }
+    }
+    c->byteChannels = 1;
+    return 1;
+}
+
+int PixelConverterInit(PixelConverter_t * c, const rfbPixelFormat * format, unsigned sourceBytes, int sourceBigEndian, const unsigned int * redClut, const unsigned int * greenClut, const unsigned int * blueClut, unsigned destBytes)
+{
+    memset(c, 0, sizeof(*c));
+    if (sourceBytes < 1 || sourceBytes > 4 || (destBytes != 1 && destBytes != 2 && destBytes != 4))
+    {
+        return -1;
+    }
+
+    c->redClut = redClut;
+    c->greenClut = greenClut;
+    c->blueClut = blueClut;
+    c->redShift = format->redShift;
+    c->greenShift = format->greenShift;
+    c->blueShift = format->blueShift;
+    c->redMax = format->redMax;
+    c->greenMax = format->greenMax;
+    c->blueMax = format->blueMax;
+    c->sourceBytes = sourceBytes;
+    c->sourceBigEndian = sourceBigEndian;
+    c->destBytes = destBytes;
+
+    const LookupFunctions_t * lookup = &kLookupFunctions[sourceBytes - 1][sourceBigEndian ? 1 : 0];
+    c->lookupRow = lookup->rows[destBytes == 4 ? 2 : destBytes - 1];
+    c->convertPixel = lookup->pixel;
+
+    if (FindChannelBytes(c))
+    {
+        if (sourceBytes == 4
+            && c->sourceIndex[0] == c->destIndex[0]
+            && c->sourceIndex[1] == c->destIndex[1]
+            && c->sourceIndex[2] == c->destIndex[2])
+        {
+            c->convertRow = ConvertCopy;
+            c->kernelName = "copy";
+            return 0;
+        }
+
+#if PIXEL_CONVERTER_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            c->convertRow = ConvertShuffleAVX2;
+            c->kernelName = "shuffle-avx2";
+            return 0;
+        }
+        if (__builtin_cpu_supports("ssse3"))
+        {
+            c->convertRow = ConvertShuffleSSSE3;
+            c->kernelName = "shuffle-ssse3";
+            return 0;
+        }
+        if (sourceBytes == 4)
+        {
+            c->convertRow = ConvertShiftSSE2;
+            c->kernelName = "shift-sse2";
+            return 0;
+        }
+#endif
+    }
+
+    if (sourceBytes <= 2)
+    {
+        static const PixelConverterRowFunction kTableKernels[2][3] = {
+            { ConvertTable8To8, ConvertTable8To16, ConvertTable8To32 },
+            { ConvertTable16To8, ConvertTable16To16, ConvertTable16To32 }
+        };
+        if (BuildTable(c) < 0)
+        {
+            return -1;
+        }
+        c->convertRow = kTableKernels[sourceBytes - 1][destBytes == 4 ? 2 : destBytes - 1];
+        c->kernelName = "table";
+        return 0;
+    }
+
+    c->convertRow = c->lookupRow;
+    c->kernelName = "channel-tables";
+    return 0;
+}
+
+int PixelConverterIsCopy(const PixelConverter_t * c)
+{
+    return c->convertRow == ConvertCopy;
+}
+
+void PixelConverterFree(PixelConverter_t * c)
+{
+    free(c->table);
+    c->table = NULL;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#if !defined(_PixelConverter_h_)
+#define _PixelConverter_h_
+
+#include <stdint.h>
+#include "rfbproto.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @file PixelConverter.h
+ * @brief Row converters from server pixel formats to local framebuffer colours.
+ *
+ * A converter is set up once for a combination of server pixel format, source pixel size,
+ * source byte order and framebuffer colour size. Setup picks the cheapest row kernel that
+ * produces exactly the same colours as looking each channel up in the framebuffer's colour
+ * tables:
+ *
+ * - If the tables are plain shifts of 8-bit channels and the server bytes are already laid out
+ *   as the framebuffer wants them, rows are copied with memcpy().
+ * - If the tables are plain shifts but the channels are in different bytes, as with BGRX
+ *   servers, opposite byte order or 24-bit Tight and ZRLE pixels, the bytes are rearranged
+ *   with SSSE3 or AVX2 shuffles, or SSE2 shifts and masks. The instruction set is chosen at
+ *   run time. Without any of them the channel tables below are used instead.
+ * - 8- and 16-bit server pixels are converted with a single lookup in a table covering every
+ *   possible pixel value, built when the converter is set up.
+ * - Anything else looks up the three channel tables per pixel.
+ *
+ * The channel table kernels are generated for every combination of source pixel size, byte
+ * order and colour size, so no kernel tests the format while it runs. Single pixels, such as
+ * fill colours, are converted by a function specialised in the same way.
+ */
+
+//! @brief Pixel converter state. Treat the fields as private.
+typedef struct _PixelConverter PixelConverter_t;
+
+//! @brief Signature of a row kernel.
+typedef void (*PixelConverterRowFunction)(const PixelConverter_t * converter, const uint8_t * source, void * dest, unsigned count);
+
+//! @brief Signature of a function converting a single pixel.
+typedef unsigned (*PixelConverterPixelFunction)(const PixelConverter_t * converter, const uint8_t * source);
+
+struct _PixelConverter
+{
+    PixelConverterRowFunction convertRow;   //!< Kernel chosen by PixelConverterInit().
+    PixelConverterRowFunction lookupRow;    //!< Channel table kernel for this layout and colour size.
+    PixelConverterPixelFunction convertPixel;   //!< Single pixel conversion for this layout.
+    const char * kernelName;                //!< Short description of the kernel, for logging.
+    const unsigned int * redClut;           //!< Framebuffer colour tables, indexed by channel value.
+    const unsigned int * greenClut;
+    const unsigned int * blueClut;
+    unsigned redShift;
+    unsigned greenShift;
+    unsigned blueShift;
+    unsigned redMax;
+    unsigned greenMax;
+    unsigned blueMax;
+    unsigned sourceBytes;                   //!< 1, 2, 3 or 4 bytes per server pixel.
+    int sourceBigEndian;
+    unsigned destBytes;                     //!< 1, 2 or 4 bytes per framebuffer colour.
+    int byteChannels;                       //!< Whether the fields below describe the conversion.
+    uint8_t sourceIndex[3];                 //!< Byte of the source pixel holding each channel.
+    uint8_t destIndex[3];                   //!< Byte of the framebuffer colour receiving each channel.
+    uint8_t destShift[3];                   //!< Shift of each channel within the framebuffer colour.
+    uint8_t shuffle[16];                    //!< Byte shuffle converting four pixels.
+    void * table;                           //!< Pixel lookup table for 8- and 16-bit sources.
+};
+
+//! @brief Set up a converter.
+//!
+//! The colour tables are referenced, not copied, and must outlive the converter. Any previous
+//! state of the converter must have been released with PixelConverterFree().
+//!
+//! @param format Server pixel format. Only the channel shifts and maxima are used.
+//! @param sourceBytes Bytes per server pixel; 3 for Tight and ZRLE compact pixels.
+//! @param sourceBigEndian Whether multi-byte server pixels are big endian.
+//! @param destBytes Size of a framebuffer colour.
+//! @return 0 on success, -1 if the sizes are unsupported or a table could not be allocated.
+int PixelConverterInit(PixelConverter_t * converter, const rfbPixelFormat * format, unsigned sourceBytes, int sourceBigEndian, const unsigned int * redClut, const unsigned int * greenClut, const unsigned int * blueClut, unsigned destBytes);
+
+//! @brief Whether server rows are stored unchanged, so they can be written to the framebuffer
+//!     directly instead of being converted.
+int PixelConverterIsCopy(const PixelConverter_t * converter);
+
+//! @brief Release the storage owned by a converter.
+void PixelConverterFree(PixelConverter_t * converter);
+
+//! @brief Convert one server pixel into a framebuffer colour.
+static inline unsigned PixelConverterConvertPixel(const PixelConverter_t * converter, const uint8_t * source)
+{
+    return converter->convertPixel(converter, source);
+}
+
+//! @brief Convert @a count server pixels into framebuffer colours.
+static inline void PixelConverterConvertRow(const PixelConverter_t * converter, const uint8_t * source, void * dest, unsigned count)
+{
+    converter->convertRow(converter, source, dest, count);
+}
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _PixelConverter_h_
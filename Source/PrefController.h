@@ -27,8 +27,6 @@
 - (BOOL)displayFullScreenWarning;
 - (float)fullscreenAutoscrollIncrement;
 - (BOOL)fullscreenHasScrollbars;
-- (int)PS_THRESHOLD;
-- (int)PS_MAXRECTS;
 - (float)frontFrameBufferUpdateSeconds;
 - (float)otherFrameBufferUpdateSeconds;
 - (float)gammaCorrection;
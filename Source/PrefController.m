@@ -40,8 +40,6 @@ static int const kPrefsVersion = 0x00000002;
 		[NSNumber numberWithBool: YES],			kPrefs_FullscreenWarning_Key,
 		[NSNumber numberWithFloat: 42.0],		kPrefs_AutoscrollIncrement_Key,
 		[NSNumber numberWithBool: NO],			kPrefs_FullscreenScrollbars_Key,
-		[NSNumber numberWithInt: 128],			kPrefs_PSMaxRect_Key,
-		[NSNumber numberWithInt: 10000],		kPrefs_PSThreshold_Key,
 		[NSNumber numberWithBool: YES],			kPrefs_UseRendezvous_Key,
 		[NSNumber numberWithFloat: 0],			kPrefs_FrontFrameBufferUpdateSeconds_Key,
 		[NSNumber numberWithFloat: 0.9],		kPrefs_OtherFrameBufferUpdateSeconds_Key, 
@@ -153,14 +151,6 @@ static int const kPrefsVersion = 0x00000002;
 {  return [[[NSUserDefaults standardUserDefaults] objectForKey: kPrefs_FullscreenScrollbars_Key] boolValue];  }
 
 
-- (int)PS_THRESHOLD
-{  return [[[NSUserDefaults standardUserDefaults] objectForKey: kPrefs_PSThreshold_Key] intValue];  }
-
-
-- (int)PS_MAXRECTS
-{  return [[[NSUserDefaults standardUserDefaults] objectForKey: kPrefs_PSMaxRect_Key] intValue];  }
-
-
 - (float)frontFrameBufferUpdateSeconds
 {  return [[[NSUserDefaults standardUserDefaults] objectForKey: kPrefs_FrontFrameBufferUpdateSeconds_Key] floatValue];  }
 
@@ -17,15 +17,17 @@
  */
 
 #import <AppKit/AppKit.h>
+#import <pthread.h>
 #import "ByteReader.h"
 #import "FrameBuffer.h"
 #import "Profile.h"
 #import "rfbproto.h"
 #import "RFBProtocol.h"
 #import "AppDelegate.h"
-
-//! Set to 1 to write an I/O to a file.
-#define DUMP_CONNECTION_TO_FILE 0
+#import "IOReactor.h"
+#import "RingBuffer.h"
+#import "SendQueue.h"
+#import "SessionCapture.h"
 
 @class RFBConnectionController;
 @class EventFilter;
@@ -38,6 +40,16 @@
 //! @brief Exception to signal a failure during communications.
 extern NSString * const kRFBConnectionException;
 
+//! @brief User default naming a directory to record a capture file of each session into.
+extern NSString * const kSessionCaptureDirectoryDefault;
+
+//! @brief Most threads used to draw the tiles of a ZRLE rect.
+#define kMaxRenderThreads (8)
+
+//! @brief Most decoded rects waiting to be displayed. Once full, further rects are merged
+//!     into the last one.
+#define kMaxDrawRects (64)
+
 //! @brief Types of special keys and key combinations.
 enum
 {
@@ -78,7 +90,18 @@ enum
     BOOL _isConnected;
     BOOL _didReceiveData;   //!< Set to YES after receiving the first byte from the server.
     BOOL terminating;
-    BOOL _readerThreadDidExit;   //!< True when the reader thread has exited.
+    BOOL _readerDidStop;    //!< True when the socket is no longer being read by the I/O reactor.
+    IOReactorSourceID_t _readSource;    //!< Our socket's registration with the shared I/O reactor.
+    RingBuffer_t * _receiveBuffer;  //!< Data read from the socket waiting to be consumed.
+    volatile int32_t _readPaused;   //!< Set while the socket is paused because the ring is full.
+    volatile int32_t _decodeScheduled;  //!< Set while a run of the decode stage is queued or running.
+    uint64_t _decodeScheduledTime;  //!< When the pending decode stage run was queued.
+    pthread_mutex_t _drawRectLock;  //!< Protects the rects waiting to be displayed.
+    NSRect _drawRects[kMaxDrawRects];   //!< Decoded rects not yet displayed.
+    unsigned _drawRectCount;
+    BOOL _drawScheduled;    //!< Set while a display of the waiting rects is queued or running.
+    NSString * _readError;  //!< Why the reader stage stopped, reported once decoding catches up.
+    BOOL _decodeFailed;     //!< Set when decoding raised an exception.
     NSPoint	_mouseLocation;
 	unsigned int _lastMask;
     BOOL updateRequested;	//!< Has someone already requested an update?
@@ -89,15 +112,18 @@ enum
 	BOOL _hasManualFrameBufferUpdates;
     BOOL _sendClientPasteboardUpdates;  //!< Whether we should send client cut messages.
     ConnectionMetrics * _metrics;   //!< Metrics computer.
-    NSRecursiveLock * _writeLock;    //!< Lock to protect writing from multiple threads so messages aren't mixed.
+    SendQueue_t * _outgoingMessages;    //!< Messages waiting to be written to the socket.
     BOOL _didAuthenticate; //!< Indicates that authentication has succeeded.
     dispatch_queue_t _processQueue; //!< Serial dispatch queue to process incoming data.
     dispatch_queue_t _drawQueue;    //!< Serial dispatch queue to draw from the framebuffer.
+    dispatch_queue_t _sendQueue;    //!< Serial dispatch queue that writes outgoing messages.
     NSCondition * _receivedDataCondition;   //!< Signalled when we first receive data from the server.
-    
-#if DUMP_CONNECTION_TO_FILE
-    int _dump_fd;   //!< File descriptor for data log.
-#endif
+    SessionCapture_t * _capture;    //!< Records the session if capturing is enabled.
+    BOOL _isReplaying;  //!< Data comes from a capture file instead of a socket.
+    BOOL _hasReplayPixelFormat;
+    rfbPixelFormat _replayPixelFormat;  //!< Pixel format the captured session was using.
+    Class _frameBufferClass;    //!< Overrides the preferred frame buffer class if set.
+    unsigned _renderThreads;    //!< Requested number of render threads, or 0 to choose.
 }
 
 @property(nonatomic, assign) RFBConnectionController * controller;
@@ -118,9 +144,48 @@ enum
 @property(readonly) NSRect displayRect; //!< Rect with origin 0,0 and size \a displaySize.
 @property(readonly) BOOL sendClientPasteboardUpdates;
 
+//! @brief Class of the frame buffer created once the display size is known. Defaults to the
+//!     class PrefController chooses for the local screen depth.
+@property(nonatomic, assign) Class frameBufferClass;
+
+//! @brief Threads drawing the tiles of big ZRLE rects, 1 to draw them while reading. Setting
+//!     0 uses one per processor, up to kMaxRenderThreads, which is also the default. Decoders
+//!     read it when the first rect arrives.
+@property(nonatomic, assign) unsigned renderThreads;
+
+//! @brief The kernel's smoothed round trip time for the socket, or 0 if it isn't known, as
+//!     when replaying.
+@property(readonly) uint64_t roundTripNanoseconds;
+
 - (id)initWithServer:(id<IServerData>)server profile:(Profile*)p;
 - (id)initWithFileHandle:(NSFileHandle*)file server:(id<IServerData>)server profile:(Profile*)p;
 
+//! @name Replay
+//!
+//! A replaying connection has no socket. Received data is supplied by the caller, and
+//! outgoing messages are dropped.
+//@{
+//! @param format The pixel format the client asked for when the session was captured, or NULL
+//!     to negotiate it from the profile as usual.
+- (id)initForReplayWithServer:(id<IServerData>)server profile:(Profile*)p pixelFormat:(const rfbPixelFormat *)format;
+
+@property(readonly) BOOL isReplaying;
+
+//! @brief Get the pixel format to use instead of the negotiated one.
+//! @return NO if the format should be negotiated normally.
+- (BOOL)getReplayPixelFormat:(rfbPixelFormat *)format;
+
+//! @brief Decode data as if it had been received from the server.
+- (void)replayReceivedBytes:(const void *)bytes length:(uint32_t)length;
+
+//! @brief Switch to a pixel format the client changed to during the captured session. Data
+//!     replayed before this call is decoded with the old format first.
+- (void)replayPixelFormat:(const rfbPixelFormat *)format;
+
+//! @brief Wait until all replayed data has been decoded.
+- (void)finishReplay;
+//@}
+
 //! @brief Initiate the connection; start talking to the server.
 - (BOOL)connectReturningError:(NSError **)error;
 
@@ -132,7 +197,6 @@ enum
 - (void)ringBell;
 
 - (void)drawRectFromBuffer:(NSRect)aRect;
-- (void)drawRectList:(id)aList;
 - (void)pauseDrawing;
 - (void)flushDrawing;
 - (void)queueUpdateRequest;
@@ -146,9 +210,19 @@ enum
 - (void)mouseAt:(NSPoint)thePoint buttons:(unsigned int)mask;
 - (void)sendSpecialKey:(int)keyType;
 
-- (BOOL)lockForWriting;
-- (void)unlockWriteLock;
-- (void)writeBytes:(unsigned char*)bytes length:(unsigned int)length;
+//! @name Sending
+//!
+//! Messages are copied into the connection's send queue and written asynchronously. Each
+//! message is written whole, so messages queued from different threads are never mixed.
+//! Higher priority classes from SendQueue.h are written first.
+//@{
+- (void)queueMessage:(const void *)bytes length:(size_t)length priority:(unsigned)priority;
+- (void)queueMessage:(const void *)header length:(size_t)headerLength payload:(const void *)payload payloadLength:(size_t)payloadLength priority:(unsigned)priority;
+
+//! @brief Queue a message that replaces the last one of the same class if it is still unsent
+//!     and its first @a keyLength bytes are the same.
+- (void)queueMessage:(const void *)bytes length:(size_t)length coalescingWithKeyLength:(size_t)keyLength priority:(unsigned)priority;
+//@}
 
 - (void)setRemoteCursor:(NSCursor *)remoteCursor;
 
@@ -18,8 +18,11 @@
 
 #import <unistd.h>
 #import <libc.h>
+#import <fcntl.h>
+#import <poll.h>
 #import <sys/socket.h>
 #import <CoreAudio/HostTime.h>
+#import <libkern/OSAtomic.h>
 #import "RFBConnection.h"
 #import "EncodingReader.h"
 #import "EventFilter.h"
@@ -27,10 +30,10 @@
 #import "FrameBufferUpdateReader.h"
 #import "FullscreenWindow.h"
 #import "IServerData.h"
+#import "InputCoalescing.h"
 #import "KeyEquivalentManager.h"
 #import "NLTStringReader.h"
 #import "PrefController.h"
-#import "RectangleList.h"
 #import "RFBConnectionManager.h"
 #import "RFBHandshaker.h"
 #import "RFBProtocol.h"
@@ -42,13 +45,22 @@
 #import "ConnectionMetrics.h"
 #import "BufferPool.h"
 
-//! Maximum number of bytes to read at once.
-#define READ_BUF_LEN (256*1024)
+//! Size of each connection's receive ring buffer. This is also the most data read at once.
+#define RECEIVE_BUFFER_SIZE (256*1024)
+
+//! Maximum number of full buffers read per reactor notification. After this many reads, other
+//! connections serviced by the same I/O thread get a turn.
+#define MAX_READS_PER_WAKEUP (4)
+
+//! Number of milliseconds to wait for the socket to become writable before giving up.
+#define WRITE_TIMEOUT_MS (10000)
+
+//! Longest single wait for the socket to become writable, so the writer notices termination.
+#define WRITE_POLL_INTERVAL_MS (100)
 
 NSString * const kRFBConnectionException = @"kRFBConnectionException";
 
-//! Buffer pool shared by all connections.
-BufferPool * g_sharedBuffers = nil;
+NSString * const kSessionCaptureDirectoryDefault = @"SessionCaptureDirectory";
 
 @interface RFBConnection ()
 
@@ -58,7 +70,23 @@ BufferPool * g_sharedBuffers = nil;
 
 - (void)handleBlockException:(NSException *)e;
 
-- (void)readerThread:(NSFileHandle *)fileHandle;
+- (int)readFromSocket:(int)fd;
+
+- (void)scheduleDecode;
+
+- (void)decodeReceivedData;
+
+- (void)readerDidStop;
+
+- (void)startWriterForEnqueueResult:(int)result;
+
+- (void)drainSendQueue;
+
+- (void)scheduleDisplay;
+
+- (void)displayPendingRects;
+
+- (void)startCapture;
 
 @end
 
@@ -77,6 +105,9 @@ BufferPool * g_sharedBuffers = nil;
 @synthesize isConnected = _isConnected;
 @synthesize sendClientPasteboardUpdates = _sendClientPasteboardUpdates;
 @synthesize didAuthenticate = _didAuthenticate;
+@synthesize isReplaying = _isReplaying;
+@synthesize frameBufferClass = _frameBufferClass;
+@synthesize renderThreads = _renderThreads;
 
 + (void)initialize
 {
@@ -86,14 +117,34 @@ BufferPool * g_sharedBuffers = nil;
 	[standardUserDefaults registerDefaults: dict];
 }
 
+- (unsigned)renderThreads
+{
+    if (_renderThreads)
+    {
+        return _renderThreads;
+    }
+    return (unsigned)MIN([[NSProcessInfo processInfo] activeProcessorCount], kMaxRenderThreads);
+}
+
+- (uint64_t)roundTripNanoseconds
+{
+    uint64_t nanoseconds;
+    
+    if (!socketHandler || SocketGetRoundTrip([socketHandler fileDescriptor], &nanoseconds) < 0)
+    {
+        return 0;
+    }
+    return nanoseconds;
+}
+
 // mark refactored init methods
 - (void)_prepareWithServer:(id<IServerData>)server profile:(Profile*)p
 {
     server_ = [server retain];
     _profile = [p retain];
     
-    // Set this to true until the thread actually starts.
-    _readerThreadDidExit = YES;
+    // Set this to true until the socket is actually registered with the I/O reactor.
+    _readerDidStop = YES;
 
     // Set the host string.
     host = [server host];
@@ -112,22 +163,20 @@ BufferPool * g_sharedBuffers = nil;
     // Create the metrics object.
     _metrics = [[ConnectionMetrics alloc] init];
     
-    // Create the write lock.
-    _writeLock = [[NSRecursiveLock alloc] init];
-    [_writeLock setName:[NSString stringWithFormat:@"%@ write lock", host]];
-    
     // Create the received data condition.
     _receivedDataCondition = [[NSCondition alloc] init];
     
     // Create the operation queue used to process incoming data.
     _processQueue = dispatch_queue_create([[NSString stringWithFormat:@"com.geekspiff.cotvnc.process.%@", host] UTF8String], NULL);
     _drawQueue = dispatch_queue_create([[NSString stringWithFormat:@"com.geekspiff.cotvnc.draw.%@", host] UTF8String], NULL);
+    pthread_mutex_init(&_drawRectLock, NULL);
+    _sendQueue = dispatch_queue_create([[NSString stringWithFormat:@"com.geekspiff.cotvnc.send.%@", host] UTF8String], NULL);
     
-    // Create the global buffer pool if it doesn't exist yet.
-    if (!g_sharedBuffers)
-    {
-        g_sharedBuffers = [[BufferPool alloc] init];
-    }
+    // Create the queue of outgoing messages.
+    _outgoingMessages = SendQueueCreate();
+    
+    // Create the ring that data from the socket is received into.
+    _receiveBuffer = RingBufferCreate(RECEIVE_BUFFER_SIZE);
 }
 
 - (id)initWithServer:(id<IServerData>)server profile:(Profile*)p
@@ -145,6 +194,24 @@ BufferPool * g_sharedBuffers = nil;
     {
         [self _prepareWithServer:server profile:p];
         socketHandler = [file retain];
+        
+        // The socket handed to us is already connected.
+        _isConnected = YES;
+	}
+    return self;
+}
+
+- (id)initForReplayWithServer:(id<IServerData>)server profile:(Profile*)p pixelFormat:(const rfbPixelFormat *)format
+{
+    if (self = [super init])
+    {
+        [self _prepareWithServer:server profile:p];
+        _isReplaying = YES;
+        if (format)
+        {
+            _replayPixelFormat = *format;
+            _hasReplayPixelFormat = YES;
+        }
 	}
     return self;
 }
@@ -162,10 +229,15 @@ BufferPool * g_sharedBuffers = nil;
     [_profile release];
     [host release];
     [_metrics release];
-    [_writeLock release];
     [_receivedDataCondition release];
     dispatch_release(_processQueue);
     dispatch_release(_drawQueue);
+    pthread_mutex_destroy(&_drawRectLock);
+    dispatch_release(_sendQueue);
+    RingBufferDestroy(_receiveBuffer);
+    SendQueueDestroy(_outgoingMessages);
+    SessionCaptureClose(_capture);
+    [_readError release];
     [super dealloc];
 }
 
@@ -185,7 +257,24 @@ BufferPool * g_sharedBuffers = nil;
     }
 }
 
-//! The reader thread is created after opening a connection to the server.
+//! @brief Called by the shared I/O reactor on one of its threads when our socket is readable.
+static int SocketReadableCallback(void * context, int fd)
+{
+    return [(RFBConnection *)context readFromSocket:fd];
+}
+
+//! @brief Called by the shared I/O reactor once our socket will no longer be read.
+static void SocketReaderFinalizer(void * context)
+{
+    RFBConnection * connection = (RFBConnection *)context;
+    [connection readerDidStop];
+    
+    // Balance the retain made when the socket was registered.
+    [connection release];
+}
+
+//! The socket is registered with the shared I/O reactor after opening a connection to the
+//! server. All incoming data is then processed on the reactor's I/O threads.
 //!
 - (BOOL)connectReturningError:(NSError **)error
 {
@@ -289,26 +378,45 @@ BufferPool * g_sharedBuffers = nil;
         // We're connected now.
         _isConnected = YES;
     }
-
-#if DUMP_CONNECTION_TO_FILE
-    _dump_fd = open("data.txt", O_WRONLY | O_CREAT | O_TRUNC | O_NONBLOCK, 0777);
-    if (_dump_fd < 0)
+    
+    if (!_receiveBuffer)
     {
-        _dump_fd = 0;
-        NSLog(@"failed to open dump file (errno = %d)", errno);
+        [self perror:NSLocalizedString( @"OpenConnection", nil ) call:@"RingBufferCreate()" errorCode:ENOMEM errorString:strerror(ENOMEM) error:error];
+        return NO;
     }
-#endif
+    
+    // The socket is serviced by the shared I/O reactor, so reads must never block.
+    int fd = [socketHandler fileDescriptor];
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        [self perror:NSLocalizedString( @"OpenConnection", nil ) call:@"fcntl()" errorCode:errno errorString:strerror(errno) error:error];
+        return NO;
+    }
+
+    [self startCapture];
 
     // Lock the condition variable.
     [_receivedDataCondition lock];
 
-	// Spawn I/O thread.
-    _readerThreadDidExit = NO;
+	// Start reading from the socket. The reactor holds a reference to us until the finalizer
+    // is called.
+    _readerDidStop = NO;
     _didReceiveData = NO;
-	[NSThread detachNewThreadSelector:@selector(readerThread:) toTarget:self withObject:socketHandler];
+    [self retain];
+    _readSource = IOReactorAddSource(IOReactorGetShared(), fd, SocketReadableCallback, SocketReaderFinalizer, self);
+    if (!_readSource)
+    {
+        int savedErrno = errno;
+        _readerDidStop = YES;
+        [_receivedDataCondition unlock];
+        [self release];
+        [self perror:NSLocalizedString( @"OpenConnection", nil ) call:@"IOReactorAddSource()" errorCode:savedErrno errorString:strerror(savedErrno) error:error];
+        return NO;
+    }
     
     // Block until the condition variable is signalled.
-    while (!_didReceiveData && !terminating)
+    while (!_didReceiveData && !_readerDidStop && !terminating)
     {
         [_receivedDataCondition wait];
     }
@@ -318,6 +426,90 @@ BufferPool * g_sharedBuffers = nil;
     return _didReceiveData && !terminating;
 }
 
+//! Starts recording the session if the kSessionCaptureDirectoryDefault user default names a
+//! directory. Each connection gets its own file named after the host and the time.
+- (void)startCapture
+{
+    NSString * directory = [[NSUserDefaults standardUserDefaults] stringForKey:kSessionCaptureDirectoryDefault];
+    if (![directory length])
+    {
+        return;
+    }
+    
+    NSString * name = [NSString stringWithFormat:@"%@-%ld.rfbcap", host, (long)time(NULL)];
+    NSString * path = [[directory stringByExpandingTildeInPath] stringByAppendingPathComponent:name];
+    _capture = SessionCaptureCreate([path fileSystemRepresentation]);
+    if (_capture)
+    {
+        NSLog(@"capturing session to %@", path);
+    }
+    else
+    {
+        NSLog(@"failed to create capture file %@ (errno = %d)", path, errno);
+    }
+}
+
+- (BOOL)getReplayPixelFormat:(rfbPixelFormat *)format
+{
+    if (_hasReplayPixelFormat)
+    {
+        *format = _replayPixelFormat;
+    }
+    return _hasReplayPixelFormat;
+}
+
+//! Stands in for the reader stage. The data is copied into the receive ring and the decode
+//! stage is scheduled exactly as for data read from a socket. If the ring is full, we wait for
+//! the decode stage to empty it.
+- (void)replayReceivedBytes:(const void *)bytes length:(uint32_t)length
+{
+    const uint8_t * source = (const uint8_t *)bytes;
+    
+    while (length && !terminating && !_decodeFailed)
+    {
+        uint8_t * region;
+        uint32_t space = RingBufferGetWritePointer(_receiveBuffer, &region);
+        if (!space)
+        {
+            dispatch_sync(_processQueue, ^{});
+            continue;
+        }
+        
+        space = MIN(space, length);
+        memcpy(region, source, space);
+        RingBufferCommit(_receiveBuffer, space);
+        [_metrics addBytesReceived:space];
+        [self scheduleDecode];
+        
+        source += space;
+        length -= space;
+    }
+}
+
+- (void)replayPixelFormat:(const rfbPixelFormat *)format
+{
+    rfbPixelFormat newFormat = *format;
+    
+    // As in -finishReplay, the block runs once everything replayed so far has been decoded.
+    dispatch_sync(_processQueue, ^{
+        _replayPixelFormat = newFormat;
+        _hasReplayPixelFormat = YES;
+        
+        // Giving the readers the frame buffer makes them finish their pending rects, so none
+        // is drawn with the new format. Afterwards it lets Tight pick up the new pixel size.
+        [rfbProtocol setFrameBuffer:frameBuffer];
+        [frameBuffer setPixelFormat:&_replayPixelFormat];
+        [rfbProtocol setFrameBuffer:frameBuffer];
+    });
+}
+
+- (void)finishReplay
+{
+    // The decode stage empties the ring before it finishes, so once a run queued before this
+    // point is done, everything has been decoded.
+    dispatch_sync(_processQueue, ^{});
+}
+
 - (void)ringBell
 {
     NSBeep();
@@ -335,15 +527,20 @@ BufferPool * g_sharedBuffers = nil;
     currentReader = aReader;
 }
 
-//! \note This method must be executed on a different thread than the reader thread.
+//! \note This method must not be executed on an I/O reactor thread.
 //!
 - (void)connectionHasTerminated
 {
     NSLog(@"RFBConnection connectionHasTerminated");
     if (_isConnected)
     {
-        // Close the connection socket, thus causing the reader thread to exit if it hasn't
-        // already noticed the terminating flag.
+        // Stop receiving notifications for the socket before closing it. A callback that is
+        // already running will notice the terminating flag or get an error from read().
+        IOReactorRemoveSource(IOReactorGetShared(), _readSource);
+        
+        // Let the writer finish with the socket. It gives up quickly once terminating is set.
+        dispatch_sync(_sendQueue, ^{});
+        
         NSLog(@"closing socket");
         [socketHandler closeFile];
         
@@ -353,21 +550,27 @@ BufferPool * g_sharedBuffers = nil;
         // Stop computing metrics.
         [_metrics connectionDidClose];
         
-        // Wait for the reader thread to exit.
-        while (!_readerThreadDidExit)
+        // Wait for any in-progress read to finish.
+        while (!_readerDidStop)
         {
             // Run the run loop for a bit to process events.
             [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
         }
-        NSLog(@"reader thread did exit");
-
-#if DUMP_CONNECTION_TO_FILE
-        // Close the dump file.
-        if (_dump_fd)
+        NSLog(@"reader did stop");
+        
+        // Wait for the decode stage to notice that we're terminating.
+        while (_decodeScheduled)
         {
-            close(_dump_fd);
+            [[NSRunLoop currentRunLoop] runUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.1]];
         }
-#endif
+        [_metrics logPipelineSummary];
+        
+        // Give back idle memory that was only needed by this connection.
+        [[BufferPool sharedPool] trim];
+
+        // Close the capture file now that nothing else will be recorded.
+        SessionCaptureClose(_capture);
+        _capture = NULL;
     }
 }
 
@@ -413,7 +616,11 @@ BufferPool * g_sharedBuffers = nil;
 
     // Create a new framebuffer the size of the remote screen. The prefs controller tells us
     // what class of frame buffer to instantiate based on the local screen depth.
-    Class frameBufferClass = [[PrefController sharedController] defaultFrameBufferClass];
+    Class frameBufferClass = _frameBufferClass;
+    if (!frameBufferClass)
+    {
+        frameBufferClass = [[PrefController sharedController] defaultFrameBufferClass];
+    }
     frameBuffer = [[frameBufferClass alloc] initWithSize:aSize andFormat:pixf];
 	[frameBuffer setServerMajorVersion: rfbProtocol.serverMajorVersion minorVersion: rfbProtocol.serverMinorVersion];
     _metrics.bytesPerPixel = [frameBuffer bytesPerPixel];
@@ -476,50 +683,90 @@ BufferPool * g_sharedBuffers = nil;
     [self performSelectorOnMainThread:@selector(terminateConnection:) withObject:reason waitUntilDone:NO];
 }
 
+static void DisplayPendingRects(void * context)
+{
+    RFBConnection * connection = (RFBConnection *)context;
+    [connection displayPendingRects];
+    [connection release];
+}
+
+//! Rects are collected while an update is decoded and displayed together when it is flushed,
+//! so decoding a rect doesn't allocate anything to hand it to the draw queue.
 - (void)drawRectFromBuffer:(NSRect)aRect
 {
-    dispatch_async(_drawQueue,
-        ^{
-            NSAutoreleasePool * pool;
-            
-            @try
-            {
-                pool = [[NSAutoreleasePool alloc] init];
-                
-                [_controller.rfbView displayFromBuffer:aRect];
-            }
-            @catch (NSException * e)
-            {
-               [self handleBlockException:e];
-            }
-            @finally
-            {
-                [pool release];
-            }
-        });
+    BOOL isFull;
+    
+    pthread_mutex_lock(&_drawRectLock);
+    if (_drawRectCount < kMaxDrawRects)
+    {
+        _drawRects[_drawRectCount++] = aRect;
+    }
+    else
+    {
+        _drawRects[kMaxDrawRects - 1] = NSUnionRect(_drawRects[kMaxDrawRects - 1], aRect);
+    }
+    isFull = (_drawRectCount == kMaxDrawRects);
+    pthread_mutex_unlock(&_drawRectLock);
+    
+    if (isFull)
+    {
+        [self scheduleDisplay];
+    }
 }
 
-- (void)drawRectList:(id)aList
+//! Queues a display of the waiting rects, unless one is already queued or running.
+- (void)scheduleDisplay
 {
-//    dispatch_async(_drawQueue,
-//        ^{
-            NSAutoreleasePool * pool;
-            
-            @try
-            {
-                pool = [[NSAutoreleasePool alloc] init];
-                
-                [_controller.rfbView drawRectList:aList];
-            }
-            @catch (NSException * e)
-            {
-               [self handleBlockException:e];
-            }
-            @finally
-            {
-                [pool release];
-            }
-//        });
+    BOOL needsDisplay;
+    
+    pthread_mutex_lock(&_drawRectLock);
+    needsDisplay = (_drawRectCount && !_drawScheduled);
+    if (needsDisplay)
+    {
+        _drawScheduled = YES;
+    }
+    pthread_mutex_unlock(&_drawRectLock);
+    
+    if (needsDisplay)
+    {
+        // The draw queue holds a reference to us until it is done.
+        [self retain];
+        dispatch_async_f(_drawQueue, self, DisplayPendingRects);
+    }
+}
+
+//! Runs on the draw queue.
+- (void)displayPendingRects
+{
+    NSRect rects[kMaxDrawRects];
+    unsigned count;
+    unsigned i;
+    NSAutoreleasePool * pool;
+    
+    pthread_mutex_lock(&_drawRectLock);
+    count = _drawRectCount;
+    memcpy(rects, _drawRects, count * sizeof(NSRect));
+    _drawRectCount = 0;
+    _drawScheduled = NO;
+    pthread_mutex_unlock(&_drawRectLock);
+    
+    @try
+    {
+        pool = [[NSAutoreleasePool alloc] init];
+        
+        for (i = 0; i < count; ++i)
+        {
+            [_controller.rfbView displayFromBuffer:rects[i]];
+        }
+    }
+    @catch (NSException * e)
+    {
+       [self handleBlockException:e];
+    }
+    @finally
+    {
+        [pool release];
+    }
 }
 
 //! Used to postpone drawing until all the rectangles within one update are
@@ -535,6 +782,8 @@ BufferPool * g_sharedBuffers = nil;
 //! also queues another update request from the server.
 - (void)flushDrawing
 {
+    [self scheduleDisplay];
+    
 //    dispatch_async(_drawQueue,
 //        ^{
             NSAutoreleasePool * pool;
@@ -556,286 +805,384 @@ BufferPool * g_sharedBuffers = nil;
 //        });
 }
 
-#if DUMP_CONNECTION_TO_FILE
-- (void)dumpData:(const void *)data length:(uint32_t)length prefix:(const char *)prefix
+//! Reader stage of the receive pipeline. Reads whatever data is waiting on the socket into
+//! the receive ring and schedules the decode stage to consume it. Reading stops once the
+//! socket is drained, so this never blocks.
+//!
+//! If the ring fills up because decoding has fallen behind, the socket is paused until the
+//! decode stage frees some space. The server then sees TCP backpressure instead of us
+//! buffering without limit.
+//!
+//! @return kIOReactorRemove if the connection has failed and the socket should no longer be
+//!     read, kIOReactorPause if the ring is full, otherwise kIOReactorContinue.
+- (int)readFromSocket:(int)fd
 {
-    if (_dump_fd)
+    int result = kIOReactorContinue;
+    uint64_t startTime = AudioConvertHostTimeToNanos(AudioGetCurrentHostTime());
+    
+    // Signal the connect thread if this is the first bit of data we've received. We also
+    // need to signal the condition if we get an error, so the connect thread doesn't get
+    // stuck.
+    if (!_didReceiveData)
     {
-        const uint8_t * byte = (const uint8_t *)data;
-        uint32_t remaining = length;
-        unsigned prefixLength = strlen(prefix);
+        [_receivedDataCondition lock];
+        _didReceiveData = YES;
+        [_receivedDataCondition signal];
+        [_receivedDataCondition unlock];
+    }
+    
+    if (terminating || _decodeFailed)
+    {
+        return kIOReactorRemove;
+    }
+    
+    int readCount;
+    for (readCount = 0; readCount < MAX_READS_PER_WAKEUP && !terminating; ++readCount)
+    {
+        uint32_t freeSpace = RingBufferGetFree(_receiveBuffer);
+        if (freeSpace == 0)
+        {
+            // Tell the decode stage to resume us, then check again in case it freed space
+            // before seeing the flag. Whichever side clears the flag gets to continue.
+            OSAtomicCompareAndSwap32Barrier(0, 1, &_readPaused);
+            if (RingBufferGetFree(_receiveBuffer) && OSAtomicCompareAndSwap32Barrier(1, 0, &_readPaused))
+            {
+                continue;
+            }
+            
+            [_metrics addReaderPause];
+            result = kIOReactorPause;
+            break;
+        }
         
-        while (remaining)
+        // Read data from the socket directly into the ring's free space.
+        ssize_t length = RingBufferReadFromDescriptor(_receiveBuffer, fd);
+        
+        // Handle any error that occurred while reading from the socket.
+        if (length < 0)
         {
-            // Print 16 bytes into a string.
-            char lineBytes[128] = {0};
-            int lineOffset = 0;
-            for (; remaining && lineOffset < 16; byte++, lineOffset++, remaining--)
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            else if (errno == EAGAIN)
+            {
+                // The socket is drained, so wait for the next notification.
+                break;
+            }
+            else if (errno == EBADF && terminating)
             {
-                const char * lastCharString = (lineOffset < 15 && remaining > 1) ? " " : "\n";
-                sprintf(&lineBytes[lineOffset * 3], "%02x%s", *byte, lastCharString);
+                // The socket was closed because we're terminating, so we don't want to
+                // treat it as an error.
+                NSLog(@"socket was closed, stopping reader");
+                result = kIOReactorRemove;
+                break;
             }
             
-            // Form the full line and write it to the dump file.
-            write(_dump_fd, prefix, prefixLength);
-            write(_dump_fd, lineBytes, strlen(lineBytes));
+            NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+            _readError = [[NSString alloc] initWithFormat:NSLocalizedString(@"ReadError", nil), errno, [NSString stringWithUTF8String:strerror(errno)]];
+            NSLog(@"%@", _readError);
+            [pool release];
+            
+            result = kIOReactorRemove;
+            break;
         }
+        // The connection was closed if we get an empty read back.
+        else if (length == 0)
+        {
+            _readError = [NSLocalizedString(@"ServerClosed", nil) copy];
+            result = kIOReactorRemove;
+            break;
+        }
+        
+        // Update metrics.
+        [_metrics addBytesReceived:length];
+        
+        // Record the data exactly as it was read.
+        if (_capture)
+        {
+            struct iovec regions[2];
+            int regionCount = RingBufferGetCommittedRegions(_receiveBuffer, (uint32_t)length, regions);
+            SessionCaptureWriteVectors(_capture, kSessionCaptureFromServer, regions, regionCount);
+        }
+        
+        [self scheduleDecode];
+        
+        // A short read means the socket has been drained, so there's no need to make
+        // another call to read() just to get EAGAIN back.
+        if (length < freeSpace)
+        {
+            break;
+        }
+    }
+    
+    // The decode stage reports a read error once it has consumed everything before it.
+    if (_readError)
+    {
+        [self scheduleDecode];
+    }
+    
+    [_metrics addReadTime:AudioConvertHostTimeToNanos(AudioGetCurrentHostTime()) - startTime];
+    
+    return result;
+}
+
+//! @brief Runs the decode stage on a connection's process queue.
+static void DecodeReceivedData(void * context)
+{
+    RFBConnection * connection = (RFBConnection *)context;
+    [connection decodeReceivedData];
+    [connection release];
+}
+
+//! Queues a run of the decode stage, unless one is already queued or running.
+- (void)scheduleDecode
+{
+    if (OSAtomicCompareAndSwap32Barrier(0, 1, &_decodeScheduled))
+    {
+        _decodeScheduledTime = AudioConvertHostTimeToNanos(AudioGetCurrentHostTime());
+        
+        // The decode stage holds a reference to us until it finishes.
+        [self retain];
+        dispatch_async_f(_processQueue, self, DecodeReceivedData);
     }
 }
-#endif
 
-- (void)readerThread:(NSFileHandle *)fileHandle
+//! Decode stage of the receive pipeline. Feeds everything in the receive ring to the
+//! current reader object, in place, and resumes the reader stage if it was paused.
+- (void)decodeReceivedData
 {
 	NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
-	uint8_t * buf = 0;
-	int fd = [fileHandle fileDescriptor];
-    NSString * reason;
-    
-    // Set the thread name.
-    [[NSThread currentThread] setName:[NSString stringWithFormat:@"reader:%@", host]];
+    uint64_t startTime = AudioConvertHostTimeToNanos(AudioGetCurrentHostTime());
+    uint32_t queuedBytes = RingBufferGetUsed(_receiveBuffer);
+    BOOL isScheduled = YES;
     
 	@try
 	{
-        _readerThreadDidExit = NO;
-        
-		// Loop until the connection is closed.
-		while (!terminating)
-		{
-            socklen_t optionLength;
-            int socketError = 0;
-            ssize_t length = 0;
-            
-			// Create an autorelease pool for this loop iteration.
-			if (pool)
-			{
-				[pool release];
-			}
-			pool = [[NSAutoreleasePool alloc] init];
-            
-            // Wait until there is data available to read. If the socket is closed intentionally
-            // from our side, we'll get an EBADF error back from select().
-            assert(fd < FD_SETSIZE);
-            fd_set readSet;
-            fd_set errorSet;
-            FD_ZERO(&readSet);
-            FD_SET(fd, &readSet);
-            FD_COPY(&readSet, &errorSet);
-            int nReady = select(fd + 1, &readSet, NULL, &errorSet, NULL);
-            
-            // Signal the connect thread if this is the first bit of data we've received. We also
-            // need to signal the condition if we get an error, so the connect thread doesn't get
-            // stuck.
-            if (!_didReceiveData)
-            {
-                [_receivedDataCondition lock];
-                _didReceiveData = YES;
-                [_receivedDataCondition signal];
-                [_receivedDataCondition unlock];
-            }
-
-            // Handle error from select().
-            if (nReady < 0)
-            {
-                // Get error from select().
-                NSLog(@"error %d from select()", errno);
-                socketError = errno;
-                goto handle_err;
-            }
-            assert(nReady == 1);
-            
-            // Check for an error on the socket.
-            if (FD_ISSET(fd, &errorSet))
+        while (isScheduled)
+        {
+            // Let the current reader object eat up the bytes in place. The received data
+            // may wrap around the end of the ring, so it is consumed in up to two pieces.
+            const uint8_t * region;
+            uint32_t regionLength;
+            while (!terminating && !_decodeFailed && (regionLength = RingBufferGetReadPointer(_receiveBuffer, &region)))
             {
-                // Get the socket error number.
-                optionLength = sizeof(socketError);
-                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &socketError, &optionLength) != 0)
+                unsigned char * bytes = (unsigned char *)region;
+                uint32_t remaining = regionLength;
+                while (remaining && !terminating)
                 {
-                    // Got an error from getsockopt().
-                    NSLog(@"error %d from getsockopt(SO_ERROR)", errno);
-                    socketError = errno;
+                    unsigned consumed = [currentReader readBytes:bytes length:remaining];
+                    [_metrics addDecodedBytes:consumed];
+                    remaining -= consumed;
+                    bytes += consumed;
                 }
                 
-                goto handle_err;
-            }
-
-            // Get number of available bytes.
-            int availableCount;
-            optionLength = sizeof(availableCount);
-            if (getsockopt(fd, SOL_SOCKET, SO_NREAD, &availableCount, &optionLength) != 0)
-            {
-                // Got an error from getsockopt().
-                NSLog(@"error %d from getsockopt(SO_NREAD)", errno);
-                socketError = errno;
-                goto handle_err;
-            }
-//            NSLog(@"[%@] availableCount = %d", host, availableCount);
-            
-            // Grab a buffer to hold the available data.
-            buf = [g_sharedBuffers acquireBufferWithLength:availableCount options:kBufferOptionAllocate];
-            
-            // Read data from the socket.
-            length = read(fd, buf, availableCount);
-            
-            // Check for an error.
-            if (length < 0)
-            {
-                socketError = errno;
-            }
-            // The connection was closed if we get an empty read back.
-            else if (length == 0)
-            {
-                @throw [NSException exceptionWithName:kRFBConnectionException reason:NSLocalizedString(@"ServerClosed", nil) userInfo:nil];
-            }
-            
-            // Handle any error that occurred while reading from the socket.
-handle_err: if (socketError)
-            {
-				// If the read timed out, just loop and start again.
-				if (errno == ETIMEDOUT)
-				{
-					continue;
-				}
-                else if (errno == EBADF && terminating)
+                RingBufferConsume(_receiveBuffer, regionLength);
+                
+                // There's room in the ring again, so let the reader stage continue.
+                if (_readPaused && OSAtomicCompareAndSwap32Barrier(1, 0, &_readPaused))
                 {
-                    // The socket was closed because we're terminating, so we don't want to
-                    // treat it as an error. Just exit.
-                    NSLog(@"socket was closed, exiting reader thread");
-                    return;
+                    IOReactorResumeSource(IOReactorGetShared(), _readSource);
                 }
-				
-				reason = [NSString stringWithFormat:NSLocalizedString(@"ReadError", nil), errno, [NSString stringWithUTF8String:strerror(errno)]];
-				NSLog(@"%@", reason);
-
-                @throw [NSException exceptionWithName:kRFBConnectionException reason:reason userInfo:nil];
-			}
-			
-            // Update metrics.
-            if (_metrics)
-            {
-                [_metrics addBytesReceived:length];
             }
             
-#if DUMP_CONNECTION_TO_FILE
-            // Write incoming data to the dump file.
-            [self dumpData:buf length:length prefix:"<-- "];
-#endif
-            
-            // Put a block to process this chunk of data into this connection's serial dispatch queue.
-//            dispatch_async(_processQueue,
-//                ^
-                {
-                    NSAutoreleasePool * pool;
-                    
-                    @try
-                    {
-                        pool = [[NSAutoreleasePool alloc] init];
-                        
-                        // Let the current reader object eat up the bytes in this read.
-                        uint8_t * bytes = buf;
-                        uint32_t remaining = length;
-                        while (remaining && !terminating)
-                        {
-                            unsigned consumed = [currentReader readBytes:bytes length:remaining];
-                            remaining -= consumed;
-                            bytes += consumed;
-                        }
-                    }
-                    @catch (NSException * e)
-                    {
-                       [self handleBlockException:e];
-                    }
-                    @finally
-                    {
-                        [g_sharedBuffers releaseBuffer:buf];
-                        [pool release];
-                    }
-                }//);
-            
-		}
+            // Allow the reader stage to schedule us again, then pick up any data that
+            // arrived before it could.
+            OSAtomicCompareAndSwap32Barrier(1, 0, &_decodeScheduled);
+            isScheduled = !terminating && !_decodeFailed && RingBufferGetUsed(_receiveBuffer)
+                && OSAtomicCompareAndSwap32Barrier(0, 1, &_decodeScheduled);
+        }
+        
+        // Now that all data received before the error has been processed, report it.
+        if (_readError && !terminating && !_decodeFailed && !RingBufferGetUsed(_receiveBuffer))
+        {
+            @throw [NSException exceptionWithName:kRFBConnectionException reason:_readError userInfo:nil];
+        }
 	}
 	@catch (NSException * e)
 	{
-        if ([[e name] isEqualToString:kRFBConnectionException])
-        {
-            reason = [e reason];
-        }
-        else
+        // Stop decoding and terminate the connection.
+        _decodeFailed = YES;
+        if (isScheduled)
         {
-            NSLog(@"got unknown exception in io thread: %@", e);
-            reason = [NSString stringWithFormat:NSLocalizedString(@"UnexpectedException", nil), e];
+            OSAtomicCompareAndSwap32Barrier(1, 0, &_decodeScheduled);
         }
-        
-        // Execute the terminate method on the main thread so it can wait for us to exit.
-        [self performSelectorOnMainThread:@selector(terminateConnection:) withObject:reason waitUntilDone:NO];
+        [self handleBlockException:e];
 	}
 	@finally
 	{
-		if (pool)
-		{
-			[pool release];
-		}
-		
-		// Make sure the input data buffer gets freed.
-//		if (buf)
-//		{
-//			free(buf);
-//		}
-        
-        // Tell anyone who wants to know that we've finished executing.
-        _readerThreadDidExit = YES;
+        [_metrics addDecodeTime:AudioConvertHostTimeToNanos(AudioGetCurrentHostTime()) - startTime queueDelay:startTime - _decodeScheduledTime queuedBytes:queuedBytes];
+        [pool release];
 	}
 }
 
-- (void)writeBytes:(unsigned char*)bytes length:(unsigned int)length
+//! Invoked by the I/O reactor once it will no longer call -readFromSocket:.
+- (void)readerDidStop
 {
-#if DUMP_CONNECTION_TO_FILE
-    // Write outgoing data to the dump file.
-    [self dumpData:bytes length:length prefix:"--> "];
-#endif
-            
+    // Make sure the connect thread doesn't wait forever if we never received anything.
+    [_receivedDataCondition lock];
+    _readerDidStop = YES;
+    [_receivedDataCondition signal];
+    [_receivedDataCondition unlock];
+}
+
+//! @brief Runs the writer for a connection's send queue.
+static void DrainSendQueue(void * context)
+{
+    RFBConnection * connection = (RFBConnection *)context;
+    [connection drainSendQueue];
+    [connection release];
+}
+
+- (void)queueMessage:(const void *)bytes length:(size_t)length priority:(unsigned)priority
+{
+    [self queueMessage:bytes length:length payload:NULL payloadLength:0 priority:priority];
+}
+
+//! The header and payload are copied into a single message, so callers don't have to build
+//! a contiguous buffer for messages with variable length data. If no writer is running on
+//! the send queue, one is started.
+- (void)queueMessage:(const void *)header length:(size_t)headerLength payload:(const void *)payload payloadLength:(size_t)payloadLength priority:(unsigned)priority
+{
+    if (terminating)
+    {
+        return;
+    }
+    
+    if (_capture)
+    {
+        struct iovec message[2] = {
+                { .iov_base = (void *)header, .iov_len = headerLength },
+                { .iov_base = (void *)payload, .iov_len = payloadLength }
+            };
+        SessionCaptureWriteVectors(_capture, kSessionCaptureToServer, message, payloadLength ? 2 : 1);
+    }
+    
+    // A replayed session has no server to send to.
+    if (_isReplaying)
+    {
+        return;
+    }
+
+    [self startWriterForEnqueueResult:SendQueueEnqueue(_outgoingMessages, priority, header, headerLength, payload, payloadLength)];
+}
+
+//! Used for pointer motion, so a server that can't keep up only receives the latest position
+//! instead of every intermediate one.
+- (void)queueMessage:(const void *)bytes length:(size_t)length coalescingWithKeyLength:(size_t)keyLength priority:(unsigned)priority
+{
+    if (terminating)
+    {
+        return;
+    }
+    
+    if (_capture)
+    {
+        SessionCaptureWrite(_capture, kSessionCaptureToServer, bytes, length);
+    }
+    
+    if (_isReplaying)
+    {
+        return;
+    }
+
+    [self startWriterForEnqueueResult:SendQueueEnqueueCoalescing(_outgoingMessages, priority, bytes, length, keyLength)];
+}
+
+//! @param result Return value from one of the SendQueue enqueue functions.
+- (void)startWriterForEnqueueResult:(int)result
+{
+    if (result < 0)
+    {
+        NSString * reason = NSLocalizedString( @"ServerError", nil );
+        reason = [NSString stringWithFormat: reason, strerror(errno)];
+        [self terminateConnection:reason];
+    }
+    else if (result > 0)
+    {
+        // We became the writer. It holds a reference to us until the queue is empty.
+        [self retain];
+        dispatch_async_f(_sendQueue, self, DrainSendQueue);
+    }
+}
+
+//! Writes queued messages until the send queue is empty. Several messages are written with
+//! each system call, highest priority first. Only one writer runs at a time.
+- (void)drainSendQueue
+{
+    NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
     int fd = [socketHandler fileDescriptor];
-    while (length && !terminating)
-	{
-        ssize_t result = write(fd, bytes, length);
-        if (result >= 0)
-		{
-            length -= result;
-			bytes += result;
+    NSString * reason = nil;
+    
+    while (!terminating)
+    {
+        ssize_t result = SendQueueWrite(_outgoingMessages, fd);
+        if (result > 0)
+        {
             [_metrics addBytesSent:result];
         }
-		else
-		{
-            NSString *reason;
-            
-            if (errno == EAGAIN)
-			{
-                continue;
+        else if (result == 0)
+        {
+            // Stop if the queue is still empty. Otherwise pick up the new messages.
+            if (SendQueueFinishWriting(_outgoingMessages))
+            {
+                break;
+            }
+        }
+        else if (errno == EINTR)
+        {
+            continue;
+        }
+        else if (errno == EAGAIN)
+        {
+            // The socket's send buffer is full. Wait until it can accept more data.
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT, .revents = 0 };
+            int waited;
+            for (waited = 0; !terminating && waited < WRITE_TIMEOUT_MS; waited += WRITE_POLL_INTERVAL_MS)
+            {
+                if (poll(&pfd, 1, WRITE_POLL_INTERVAL_MS) > 0)
+                {
+                    break;
+                }
+            }
+            if (waited >= WRITE_TIMEOUT_MS)
+            {
+                reason = NSLocalizedString( @"ServerError", nil );
+                reason = [NSString stringWithFormat: reason, strerror(ETIMEDOUT)];
+                break;
             }
-            else if (errno == EPIPE)
-			{
-				reason = NSLocalizedString( @"ServerClosed", nil );
+        }
+        else
+        {
+            if (errno == EPIPE)
+            {
+                reason = NSLocalizedString( @"ServerClosed", nil );
             }
-			else
+            else
             {
                 reason = NSLocalizedString( @"ServerError", nil );
                 reason = [NSString stringWithFormat: reason, strerror(errno)];
             }
-            
-            // Terminate the connection directly instead of raising an exception, since threads
-            // other than the reader thread call this method.
-            [self terminateConnection:reason];
+            break;
         }
     }
-}
-
-- (BOOL)lockForWriting
-{
-    return [_writeLock lockBeforeDate:[NSDate dateWithTimeIntervalSinceNow:10.0]];
-}
-
-- (void)unlockWriteLock
-{
-    [_writeLock unlock];
+    
+    // Nothing more will be written once the connection is failing or closing.
+    if (reason || terminating)
+    {
+        SendQueueDiscard(_outgoingMessages);
+    }
+    
+    SendQueueStatistics_t stats;
+    SendQueueGetStatistics(_outgoingMessages, &stats);
+    [_metrics setSendQueueStatistics:&stats];
+    
+    if (reason)
+    {
+        [self terminateConnection:reason];
+    }
+    
+    [pool release];
 }
 
 - (void)_queueUpdateRequest
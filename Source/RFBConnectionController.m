@@ -31,7 +31,6 @@
 #import "KeyEquivalentManager.h"
 #import "NLTStringReader.h"
 #import "PrefController.h"
-#import "RectangleList.h"
 #import "RFBConnectionManager.h"
 #import "RFBHandshaker.h"
 #import "RFBProtocol.h"
@@ -629,8 +628,8 @@
     window = NULL;
     
     // If we were to call terminateConnection: directly, there is a possibility of a deadlock.
-    // The connectionHasTerminated method in RFBConnection waits for the reader thread to exit.
-    // But the reader thread could be waiting for the lock on the window to do some drawing.
+    // The connectionHasTerminated method in RFBConnection waits for the socket reader to stop.
+    // But the reader could be waiting for the lock on the window to do some drawing.
     // So if connectionHasTerminated is called from this window will close handler (which
     // holds the window lock), you have a deadlock. Posting the terminate message to the main
     // thread (even though we're already on the main thread) will cause it to run outside of
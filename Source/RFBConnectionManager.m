@@ -30,6 +30,8 @@
 #import "ServerStandAlone.h"
 #import "ServerDataManager.h"
 #import "RFBConnectionController.h"
+#import "SessionReplay.h"
+#import "DecodeBenchmark.h"
 
 id g_sharedConnectionManager = nil;
 
@@ -37,6 +39,10 @@ id g_sharedConnectionManager = nil;
 
 - (void)connectSelectedServer:(id)sender;
 
+- (void)runReplay:(SessionReplay *)replay;
+
+- (void)runBenchmark:(DecodeBenchmark *)benchmark;
+
 @end
 
 @implementation RFBConnectionManager
@@ -185,6 +191,12 @@ id g_sharedConnectionManager = nil;
 	
 	ServerFromPrefs* cmdlineServer = [[[ServerFromPrefs alloc] init] autorelease];
 	Profile* profile = nil;
+    NSString * replayPath = nil;
+    BOOL replayPaced = NO;
+    NSMutableArray * benchmarkPaths = [NSMutableArray array];
+    unsigned benchmarkIterations = 5;
+    NSMutableArray * benchmarkThreads = [NSMutableArray array];
+    BOOL benchmarkCheckAllocations = NO;
 	ProfileManager *profileManager = [ProfileManager sharedManager];
 	
 	// Check our arguments.  Args start at 0, which is the application name
@@ -236,6 +248,44 @@ id g_sharedConnectionManager = nil;
 			}
 			profile = [profileManager profileNamed: profileName];
 		}
+        else if ([arg hasPrefix:@"--CaptureDirectory"])
+        {
+			if (i + 1 >= argCount) [self cmdlineUsage];
+            // Only for this run, so the setting isn't saved in the preferences.
+            NSDictionary * captureDefaults = [NSDictionary dictionaryWithObject:[args objectAtIndex:++i] forKey:kSessionCaptureDirectoryDefault];
+            [[NSUserDefaults standardUserDefaults] setVolatileDomain:captureDefaults forName:NSArgumentDomain];
+        }
+        else if ([arg hasPrefix:@"--BenchmarkIterations"])
+        {
+			if (i + 1 >= argCount) [self cmdlineUsage];
+            benchmarkIterations = [[args objectAtIndex:++i] intValue];
+        }
+        else if ([arg hasPrefix:@"--BenchmarkCheckAllocations"])
+        {
+            benchmarkCheckAllocations = YES;
+        }
+        else if ([arg hasPrefix:@"--BenchmarkThreads"])
+        {
+			if (i + 1 >= argCount) [self cmdlineUsage];
+            for (NSString * count in [[args objectAtIndex:++i] componentsSeparatedByString:@","])
+            {
+                [benchmarkThreads addObject:[NSNumber numberWithUnsignedInt:(unsigned)MAX([count intValue], 0)]];
+            }
+        }
+        else if ([arg hasPrefix:@"--Benchmark"])
+        {
+			if (i + 1 >= argCount) [self cmdlineUsage];
+            [benchmarkPaths addObject:[args objectAtIndex:++i]];
+        }
+        else if ([arg hasPrefix:@"--ReplayPaced"])
+        {
+            replayPaced = YES;
+        }
+        else if ([arg hasPrefix:@"--Replay"])
+        {
+			if (i + 1 >= argCount) [self cmdlineUsage];
+            replayPath = [args objectAtIndex:++i];
+        }
         else if ([arg hasPrefix:@"-NSDocumentRevisionsDebugMode"])
         {
             ++i; // skip argument value (YES or NO)
@@ -252,6 +302,24 @@ id g_sharedConnectionManager = nil;
 			mRunningFromCommandLine = YES;
 		} 
     }
+    
+    // Measure decoding speed of captures without any windows, print the results and quit.
+    if ([benchmarkPaths count])
+    {
+        DecodeBenchmark * benchmark = [[[DecodeBenchmark alloc] initWithPaths:benchmarkPaths iterations:benchmarkIterations] autorelease];
+        benchmark.renderThreads = benchmarkThreads;
+        benchmark.checkAllocations = benchmarkCheckAllocations;
+        [NSThread detachNewThreadSelector:@selector(runBenchmark:) toTarget:self withObject:benchmark];
+        return YES;
+    }
+    
+    // Replay a capture without any windows, print the summary and quit.
+    if (replayPath)
+    {
+        SessionReplay * replay = [[[SessionReplay alloc] initWithPath:replayPath paced:replayPaced] autorelease];
+        [NSThread detachNewThreadSelector:@selector(runReplay:) toTarget:self withObject:replay];
+        return YES;
+    }
 	
 	if ( mRunningFromCommandLine )
 	{
@@ -294,6 +362,40 @@ id g_sharedConnectionManager = nil;
 	[self showConnectionDialog: nil];
 }
 
+//! Runs on its own thread, so the main thread is free to process anything the connection
+//! sends to it while decoding.
+- (void)runReplay:(SessionReplay *)replay
+{
+    NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+    NSError * error = nil;
+    
+    if (![replay replayReturningError:&error])
+    {
+        fprintf(stderr, "Replay failed: %s\n", [[error localizedDescription] UTF8String]);
+        exit(1);
+    }
+    
+    fputs([[replay summary] UTF8String], stdout);
+    [pool release];
+    exit(0);
+}
+
+- (void)runBenchmark:(DecodeBenchmark *)benchmark
+{
+    NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+    NSError * error = nil;
+    
+    if (![benchmark runReturningError:&error])
+    {
+        fprintf(stderr, "Benchmark failed: %s\n", [[error localizedDescription] UTF8String]);
+        exit(1);
+    }
+    
+    fputs([[benchmark JSONString] UTF8String], stdout);
+    [pool release];
+    exit(0);
+}
+
 - (void)cmdlineUsage
 {
     fprintf(stderr, "\nUsage: Chicken of the VNC [options] [host:port]\n\n");
@@ -303,6 +405,13 @@ id g_sharedConnectionManager = nil;
     fprintf(stderr, "--Display <display-number>\n");
     fprintf(stderr, "--FullScreen\n");
 	fprintf(stderr, "--ViewOnly\n");
+    fprintf(stderr, "--CaptureDirectory <directory>  record the session to a capture file\n");
+    fprintf(stderr, "--Replay <capture-file>  decode a capture without a server and print a summary\n");
+    fprintf(stderr, "--ReplayPaced  replay with the original timing\n");
+    fprintf(stderr, "--Benchmark <capture-file>  measure decoding speed, may be repeated\n");
+    fprintf(stderr, "--BenchmarkIterations <count>  runs of each capture, the fastest is reported\n");
+    fprintf(stderr, "--BenchmarkThreads <count,...>  render thread counts to run each capture with, e.g. 1,2,4,8\n");
+    fprintf(stderr, "--BenchmarkCheckAllocations  fail if decoding allocates once warmed up\n");
     exit(1);
 }
 
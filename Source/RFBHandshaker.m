@@ -61,7 +61,7 @@
 	int protocolMinorVersion = MIN(rfbProtocolMinorVersion, [target serverMinorVersion]);
 
 	sprintf(clientData, rfbProtocolVersionFormat, rfbProtocolMajorVersion, protocolMinorVersion);
-    [_connection writeBytes:(unsigned char*)clientData length:sz_rfbProtocolVersionMsg];
+    [_connection queueMessage:clientData length:sz_rfbProtocolVersionMsg priority:kSendClassControl];
 		
 	if (protocolMinorVersion >= 7)
 		[target setReader:authCountReader];
@@ -73,7 +73,7 @@
 {
     unsigned char shared = _connection.controller.isConnectionShared ? 1 : 0;
 
-    [_connection writeBytes:&shared length:1];
+    [_connection queueMessage:&shared length:1 priority:kSendClassControl];
     [target setReader:serverInitReader];
 }
 
@@ -101,7 +101,7 @@
 		
 		switch (availableAuthType) {
 			case rfbNoAuth: {
-				[_connection writeBytes:&availableAuthType length:1];
+				[_connection queueMessage:&availableAuthType length:1 priority:kSendClassControl];
 				
 				if (MIN(rfbProtocolMinorVersion, [target serverMinorVersion]) >= 8) // For 3.8+ we need to get a result back from the server
 					[target setReader: authResultReader];
@@ -111,7 +111,7 @@
 				return;
 			}
 			case rfbVncAuth: {
-				[_connection writeBytes:&availableAuthType length:1];
+				[_connection queueMessage:&availableAuthType length:1 priority:kSendClassControl];
 				[target setReader:challengeReader];
 				return;
 			}
@@ -131,7 +131,7 @@
 	// No valid auth type found
 	NSLog(@"%@", errorStr);
 	availableAuthType= 0;
-	[_connection writeBytes:&availableAuthType length:1];
+	[_connection queueMessage:&availableAuthType length:1 priority:kSendClassControl];
     @throw [NSException exceptionWithName:kRFBConnectionException reason:errorStr userInfo:nil];
 }
 
@@ -163,7 +163,7 @@
 
     [theChallenge getBytes:bytes length:CHALLENGESIZE];
     vncEncryptBytes(bytes, (char*)[[_connection.server password] UTF8String]);
-    [_connection writeBytes:bytes length:CHALLENGESIZE];
+    [_connection queueMessage:bytes length:CHALLENGESIZE priority:kSendClassControl];
     [target setReader:authResultReader];
 }
 
@@ -48,7 +48,6 @@
     int serverMinorVersion;
     NLTStringReader * versionReader;
     RFBHandshaker * handshaker;
-    id			typeReader;
     id			msgTypeReader[MAX_MSGTYPE + 1];
     BOOL		isStopped;
     BOOL		shouldUpdate;   //!< Whether to request an update after un-stopping.
@@ -62,6 +61,7 @@
     BOOL _isAppleVNCServer; //!< True if we think the server is Apple VNC (i.e., Apple Remote Desktop).
     uint64_t _lastUpdateRequestTimestamp;
     NSTimer * _throttledUpdateRequestTimer;
+    uint32_t _lastPointerMask;  //!< Button mask of the last pointer event queued.
 }
 
 @property(readonly) NSString * serverVersion;
@@ -19,7 +19,6 @@
  */
 
 #import "RFBProtocol.h"
-#import "CARD8Reader.h"
 #import "FrameBuffer.h"
 #import "FrameBufferUpdateReader.h"
 #import "PrefController.h"
@@ -38,6 +37,7 @@
 
 - (void)setServerVersion:(NSString*)aVersion;
 - (void)start:(ServerInitMessage*)info;
+- (void)receiveType:(unsigned)t;
 
 @end
 
@@ -69,8 +69,7 @@
         // The RFB protocol starts with the server sending its version.
         [target setReader:versionReader];
 
-        // Create message reader objects.
-		typeReader = [[CARD8Reader alloc] initTarget:self action:@selector(receiveType:)];
+        // Create message reader objects. We read the message type byte ourselves.
 		msgTypeReader[rfbFramebufferUpdate] = [[FrameBufferUpdateReader alloc] initTarget:self action:@selector(frameBufferUpdateComplete:)];
 		msgTypeReader[rfbSetColourMapEntries] = [[SetColorMapEntriesReader alloc] initTarget:self action:@selector(setColormapEntries:)];
 		msgTypeReader[rfbBell] = nil;
@@ -81,7 +80,6 @@
 
 - (void)dealloc
 {
-    [typeReader release];
     [versionReader release];
     [handshaker release];
     
@@ -121,8 +119,11 @@
     memcpy(&myFormat, (rfbPixelFormat*)[info pixelFormatData], sizeof(myFormat));
     [self setPixelFormat:&myFormat];
     [self setEncodings];
+    
+    // A replayed session has to be decoded with the format it was captured with.
+    [_connection getReplayPixelFormat:&myFormat];
 
-    [target setReader:typeReader];
+    [target setReader:self];
     
     // Let the connection know we're finished handshaking and authentication, and update it with
     // the remote display information.
@@ -146,19 +147,14 @@
     rfbSetEncodingsMsg msg;
     CARD32	enc[64];
 
-    if ([_connection lockForWriting])
-    {
-        numberOfEncodings = l;
-        msg.type = rfbSetEncodings;
-        msg.nEncodings = htons(l);
-        [_connection writeBytes:(unsigned char*)&msg length:sizeof(msg)];
-        for(i=0; i<l; i++) {
-            encodings[i] = newEncodings[i];
-            enc[i] = htonl(encodings[i]);
-        }
-        [_connection writeBytes:(unsigned char*)&enc length:numberOfEncodings * sizeof(CARD32)];
-        [_connection unlockWriteLock];
+    numberOfEncodings = l;
+    msg.type = rfbSetEncodings;
+    msg.nEncodings = htons(l);
+    for(i=0; i<l; i++) {
+        encodings[i] = newEncodings[i];
+        enc[i] = htonl(encodings[i]);
     }
+    [_connection queueMessage:&msg length:sizeof(msg) payload:enc payloadLength:numberOfEncodings * sizeof(CARD32) priority:kSendClassControl];
 }
 
 - (void)setEncodings
@@ -178,20 +174,15 @@
     // Update metrics.
     [_connection.metrics addUpdateRequest];
     
-    if ([_connection lockForWriting])
-    {
-        rfbFramebufferUpdateRequestMsg	msg;
-
-        msg.type = rfbFramebufferUpdateRequest;
-        msg.incremental = aFlag;
-        msg.x = frame.origin.x; msg.x = htons(msg.x);
-        msg.y = frame.origin.y; msg.y = htons(msg.y);
-        msg.w = frame.size.width; msg.w = htons(msg.w);
-        msg.h = frame.size.height; msg.h = htons(msg.h);
-        [_connection writeBytes:(unsigned char*)&msg length:sz_rfbFramebufferUpdateRequestMsg];
-        
-        [_connection unlockWriteLock];
-    }
+    rfbFramebufferUpdateRequestMsg	msg;
+
+    msg.type = rfbFramebufferUpdateRequest;
+    msg.incremental = aFlag;
+    msg.x = frame.origin.x; msg.x = htons(msg.x);
+    msg.y = frame.origin.y; msg.y = htons(msg.y);
+    msg.w = frame.size.width; msg.w = htons(msg.w);
+    msg.h = frame.size.height; msg.h = htons(msg.h);
+    [_connection queueMessage:&msg length:sz_rfbFramebufferUpdateRequestMsg priority:kSendClassControl];
     
     // If not incremental, then we want to hold off on further updates until this update
     // is finished.
@@ -234,11 +225,7 @@
     msg.format.greenMax = htons(msg.format.greenMax);
     msg.format.blueMax = htons(msg.format.blueMax);
 
-    if ([_connection lockForWriting])
-    {
-        [_connection writeBytes:(unsigned char*)&msg length:sz_rfbSetPixelFormatMsg];
-        [_connection unlockWriteLock];
-    }
+    [_connection queueMessage:&msg length:sz_rfbSetPixelFormatMsg priority:kSendClassControl];
 }
 
 - (FrameBufferUpdateReader*)frameBufferUpdateReader
@@ -345,18 +332,24 @@
     [target setReader:self];
 }
 
-- (void)resetReader
+//! Between messages the protocol object is the current reader. The message type byte is read
+//! directly out of the receive buffer and the reader for that message takes over.
+- (unsigned)readBytes:(unsigned char*)theBytes length:(unsigned)aLength
 {
-    [target setReader:typeReader];
+    if (aLength == 0)
+    {
+        return 0;
+    }
+    
+    [self receiveType:theBytes[0]];
+    return 1;
 }
 
-- (void)receiveType:(NSNumber*)type
+- (void)receiveType:(unsigned)t
 {
-    unsigned t = [type unsignedIntValue];
-
     if(t > MAX_MSGTYPE) {
 		NSString *errorStr = NSLocalizedString( @"UnknownMessageType", nil );
-		errorStr = [NSString stringWithFormat:errorStr, type];
+		errorStr = [NSString stringWithFormat:errorStr, [NSNumber numberWithUnsignedInt:t]];
         @throw [NSException exceptionWithName:kRFBConnectionException reason:errorStr userInfo:nil];
     } else if(t == rfbBell) {
         [target ringBell];
@@ -400,10 +393,16 @@
     msg.x = htons(thePoint.x);
     msg.y = htons(thePoint.y);
     
-    if ([_connection lockForWriting])
+    // Pure motion may replace an unsent motion event with the same button mask. Events that
+    // change the buttons are always sent where they happened, and stay in order.
+    if (mask == _lastPointerMask)
+    {
+        [_connection queueMessage:&msg length:sizeof(msg) coalescingWithKeyLength:offsetof(rfbPointerEventMsg, x) priority:kSendClassInput];
+    }
+    else
     {
-        [_connection writeBytes:(unsigned char*)&msg length:sizeof(msg)];
-        [_connection unlockWriteLock];
+        [_connection queueMessage:&msg length:sizeof(msg) priority:kSendClassInput];
+        _lastPointerMask = mask;
     }
 }
 
@@ -472,11 +471,7 @@
         .key = htonl(keycode)
     };
 
-    if ([_connection lockForWriting])
-    {
-        [_connection writeBytes:(unsigned char*)&msg length:sizeof(msg)];
-        [_connection unlockWriteLock];
-    }
+    [_connection queueMessage:&msg length:sizeof(msg) priority:kSendClassInput];
 }
 
 - (void)sendClientCutText:(NSString *)text
@@ -487,12 +482,8 @@
     msg.type = rfbClientCutText;
 	msg.length = htonl(len);
     
-    if ([_connection lockForWriting])
-    {
-        [_connection writeBytes:(unsigned char *)&msg length:sizeof(msg)];
-        [_connection writeBytes:(unsigned char *)[encodedText bytes] length:len];
-        [_connection unlockWriteLock];
-    }
+    // Clipboard contents can be large, so they're sent behind input and control messages.
+    [_connection queueMessage:&msg length:sizeof(msg) payload:[encodedText bytes] payloadLength:len priority:kSendClassClipboard];
 }
 
 @end
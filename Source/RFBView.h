@@ -47,7 +47,6 @@
 
 - (void)drawRect:(NSRect)aRect;
 - (void)displayFromBuffer:(NSRect)aRect;
-- (void)drawRectList:(id)aList;
 
 - (void)setCursorTo: (NSString *)name;
 - (void)setRemoteCursor:(NSCursor *)newCursor;
@@ -20,7 +20,6 @@
 #import "EventFilter.h"
 #import "RFBConnection.h"
 #import "FrameBuffer.h"
-#import "RectangleList.h"
 
 @implementation RFBView
 
@@ -204,16 +203,6 @@
 	}
 }
 
-- (void)drawRectList:(id)aList
-{
-	unsigned count = [aList rectCount];
-	unsigned i;
-	for (i=0; i < count; ++i)
-	{
-		[self displayFromBuffer:[aList rectAtIndex:i]];
-	}
-}
-
 - (void)mouseDown:(NSEvent *)theEvent
 {  [_eventFilter mouseDown: theEvent];  }
 
@@ -27,13 +27,12 @@
     id			backPixReader;
     id			subRectReader;
     CARD32		numOfSubRects;
-    id			rectList;
-    BOOL		useList;
-    unsigned int	psThreshold;
-    unsigned int	maxPsRects;
 }
 
-- (void)setPSThreshold:(unsigned int)anInt;
-- (void)setMaximumPSRectangles:(unsigned int)anInt;
+//! @brief Number of bytes of geometry following the pixel value of each subrectangle.
+- (unsigned)subrectangleGeometrySize;
+
+//! @brief Fill @a count subrectangles encoded at @a bytes into the frame buffer.
+- (void)drawSubrectangles:(const uint8_t *)bytes count:(unsigned)count;
 
 @end
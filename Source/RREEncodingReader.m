@@ -21,32 +21,15 @@
 #import "RREEncodingReader.h"
 #import "CARD32Reader.h"
 #import "ByteBlockReader.h"
-#import "RectangleList.h"
-
-#define PS_THRESHOLD	0x10000
-#define PS_MAXRECT	128
 
 @implementation RREEncodingReader
 
-- (void)setPSThreshold:(unsigned int)anInt
-{
-    psThreshold = anInt;
-}
-
-- (void)setMaximumPSRectangles:(unsigned int)anInt
-{
-    maxPsRects = anInt;
-}
-
 - (id)initTarget:(id)aTarget action:(SEL)anAction
 {
     if (self = [super initTarget:aTarget action:anAction]) {
-		[self setPSThreshold:PS_THRESHOLD];
-		[self setMaximumPSRectangles:PS_MAXRECT];
 		numOfReader = [[CARD32Reader alloc] initTarget:self action:@selector(setNumOfRects:)];
 		backPixReader = [[ByteBlockReader alloc] initTarget:self action:@selector(setBackground:)];
 		subRectReader = [[ByteBlockReader alloc] initTarget:self action:@selector(drawRectangles:)];
-		rectList = [[RectangleList alloc] initElements:psThreshold];
 	}
     return self;
 }
@@ -56,7 +39,6 @@
     [numOfReader release];
     [backPixReader release];
     [subRectReader release];
-    [rectList release];
     [super dealloc];
 }
 
@@ -76,36 +58,15 @@
 
 - (void)setNumOfRects:(NSNumber*)aNumber
 {
-    unsigned int totalSize = frame.size.width * frame.size.height;
-    unsigned int avgSize;
-
     numOfSubRects = [aNumber unsignedIntValue];
-    avgSize = totalSize / (numOfSubRects + 1);
-
-    if((numOfSubRects < maxPsRects) || (avgSize > psThreshold)) {
-        useList = YES;
-        [rectList startWithNumber:numOfSubRects + 1];
-    } else {
-        useList = NO;
-    }
     [target setReader:backPixReader];
 }
 
-- (id)rectangleList
-{
-    return (useList) ? rectList : nil;
-}
-
 - (void)setBackground:(NSData*)data
 {
     [frameBuffer fillRect:frame withPixel:(unsigned char*)[data bytes]];
-    if(useList) {
-        float	rgb[3];
-        [frameBuffer getRGB:rgb fromPixel:(unsigned char*)[data bytes]];
-        [rectList putRectangle:frame withColor:rgb];
-    }
     if(numOfSubRects) {
-        int size = ([frameBuffer bytesPerPixel] + 8) * numOfSubRects;
+        int size = ([frameBuffer bytesPerPixel] + [self subrectangleGeometrySize]) * numOfSubRects;
 #ifdef COLLECT_STATS
 	bytesTransferred += size;
 #endif
@@ -118,31 +79,46 @@
 
 - (void)drawRectangles:(NSData*)data
 {
-    unsigned char*	bytes = (unsigned char*)[data bytes];
-    unsigned char*	pixptr;
-    float		rgb[3];
-    rfbRectangle	subRect;
-    NSRect		r;
-    unsigned int	bpp = [frameBuffer bytesPerPixel];
+    [self drawSubrectangles:(const uint8_t *)[data bytes] count:numOfSubRects];
+    [target performSelector:action withObject:self];
+}
+
+- (unsigned)subrectangleGeometrySize
+{
+    return kRRESubrectGeometry;
+}
+
+- (void)drawSubrectangles:(const uint8_t *)data count:(unsigned)count
+{
+    [frameBuffer fillRRESubrects:data count:count geometrySize:[self subrectangleGeometrySize] inRect:frame];
+}
 
-    while(numOfSubRects--) {
-        if(useList) {
-            [frameBuffer getRGB:rgb fromPixel:bytes];
-        }
-        pixptr = bytes;
-        bytes += bpp;
-        memcpy(&subRect, bytes, sizeof(subRect));
-        bytes += sizeof(subRect);
-        r.origin.x = ntohs(subRect.x) + frame.origin.x;
-        r.origin.y = ntohs(subRect.y) + frame.origin.y;
-        r.size.width = ntohs(subRect.w);
-        r.size.height = ntohs(subRect.h);
-        [frameBuffer fillRect:r withPixel:pixptr];
-        if(useList) {
-            [rectList putRectangle:r withColor:rgb];
-        }
+- (unsigned)readRectangleFromBytes:(const uint8_t *)bytes length:(unsigned)length
+{
+    unsigned bpp = [frameBuffer bytesPerPixel];
+    CARD32 count;
+    uint64_t total;
+    
+    if (length < 4 + bpp)
+    {
+        return 0;
     }
-    [target performSelector:action withObject:self];
+    
+    memcpy(&count, bytes, sizeof(count));
+    count = ntohl(count);
+    total = 4 + bpp + (uint64_t)count * (bpp + [self subrectangleGeometrySize]);
+    if (length < total)
+    {
+        return 0;
+    }
+    
+    [frameBuffer fillRect:frame withPixel:(unsigned char*)bytes + 4];
+    [self drawSubrectangles:bytes + 4 + bpp count:count];
+
+#ifdef COLLECT_STATS
+    bytesTransferred = (unsigned)total;
+#endif
+    return (unsigned)total;
 }
 
 @end
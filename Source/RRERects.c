@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "RRERects.h"
+#include "FrameBufferRows.h"
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+//! Converts one pixel. With @a inlineBytes the channels are moved as bytes, which is only
+//! valid when the converter has byteChannels set.
+static ALWAYS_INLINE uint32_t ConvertPixel(const PixelConverter_t * c, const uint8_t * p, int inlineBytes)
+{
+    if (inlineBytes)
+    {
+        return ((uint32_t)p[c->sourceIndex[0]] << c->destShift[0])
+            | ((uint32_t)p[c->sourceIndex[1]] << c->destShift[1])
+            | ((uint32_t)p[c->sourceIndex[2]] << c->destShift[2]);
+    }
+    return c->convertPixel(c, p);
+}
+
+//! The subrect loop, specialised for each colour size and geometry size, and for pixels whose
+//! channels are whole bytes.
+static ALWAYS_INLINE void DrawSubrects(const PixelConverter_t * c, const uint8_t * p, unsigned count, uint8_t * dest, size_t rowBytes,
+    unsigned width, unsigned height, unsigned colorBytes, unsigned pixelBytes, int inlineBytes, unsigned geometryBytes)
+{
+    while (count--)
+    {
+        uint32_t color = ConvertPixel(c, p, inlineBytes);
+        unsigned x, y, w, h;
+
+        p += pixelBytes;
+        if (geometryBytes == kRRESubrectGeometry)
+        {
+            x = (p[0] << 8) | p[1];
+            y = (p[2] << 8) | p[3];
+            w = (p[4] << 8) | p[5];
+            h = (p[6] << 8) | p[7];
+        }
+        else
+        {
+            x = p[0];
+            y = p[1];
+            w = p[2];
+            h = p[3];
+        }
+        p += geometryBytes;
+
+        if (x >= width || y >= height)
+        {
+            continue;
+        }
+        if (w > width - x)
+        {
+            w = width - x;
+        }
+        if (h > height - y)
+        {
+            h = height - y;
+        }
+        FrameBufferFillRect(dest + y * rowBytes + (size_t)x * colorBytes, rowBytes, colorBytes, color, w, h);
+    }
+}
+
+//! Instantiates the loop for one colour size and pixel layout, in both geometries.
+#define DEFINE_DRAW_SUBRECTS(name, colorBytes, pixelBytes, inlineBytes) \
+    static void name(const PixelConverter_t * c, const uint8_t * data, unsigned count, unsigned geometryBytes, uint8_t * dest, size_t rowBytes, \
+        unsigned width, unsigned height) \
+    { \
+        if (geometryBytes == kRRESubrectGeometry) \
+        { \
+            DrawSubrects(c, data, count, dest, rowBytes, width, height, colorBytes, pixelBytes, inlineBytes, kRRESubrectGeometry); \
+        } \
+        else \
+        { \
+            DrawSubrects(c, data, count, dest, rowBytes, width, height, colorBytes, pixelBytes, inlineBytes, kCoRRESubrectGeometry); \
+        } \
+    }
+
+DEFINE_DRAW_SUBRECTS(DrawSubrects8, 1, c->sourceBytes, 0)
+DEFINE_DRAW_SUBRECTS(DrawSubrects16, 2, c->sourceBytes, 0)
+DEFINE_DRAW_SUBRECTS(DrawSubrects32, 4, c->sourceBytes, 0)
+DEFINE_DRAW_SUBRECTS(DrawSubrects32Bytes4, 4, 4, 1)
+
+void RREDrawSubrects(const PixelConverter_t * converter, const uint8_t * data, unsigned count, unsigned geometryBytes,
+    void * dest, size_t rowBytes, unsigned width, unsigned height)
+{
+    if (converter->byteChannels && converter->sourceBytes == 4)
+    {
+        DrawSubrects32Bytes4(converter, data, count, geometryBytes, (uint8_t *)dest, rowBytes, width, height);
+        return;
+    }
+    switch (converter->destBytes)
+    {
+        case 1:
+            DrawSubrects8(converter, data, count, geometryBytes, (uint8_t *)dest, rowBytes, width, height);
+            break;
+        case 2:
+            DrawSubrects16(converter, data, count, geometryBytes, (uint8_t *)dest, rowBytes, width, height);
+            break;
+        default:
+            DrawSubrects32(converter, data, count, geometryBytes, (uint8_t *)dest, rowBytes, width, height);
+            break;
+    }
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#if !defined(_RRERects_h_)
+#define _RRERects_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "PixelConverter.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @file RRERects.h
+ * @brief Fills RRE and CoRRE subrects straight into the framebuffer.
+ *
+ * Each subrect's pixel is converted to a framebuffer colour, inline when its channels are
+ * whole bytes, and the subrect is filled with the framebuffer's row fill. Nothing is
+ * collected for drawing later; the caller displays the whole rect once it is filled.
+ */
+
+//! @brief Size of the geometry following each RRE subrect's pixel: x, y, w and h as CARD16.
+#define kRRESubrectGeometry 8
+
+//! @brief Size of the geometry following each CoRRE subrect's pixel: x, y, w and h as CARD8.
+#define kCoRRESubrectGeometry 4
+
+//! @brief Fill @a count subrects.
+//!
+//! The converter's source size is the server pixel size. Subrects reaching outside the rect
+//! are clipped to it.
+//!
+//! @param geometryBytes kRRESubrectGeometry or kCoRRESubrectGeometry.
+//! @param dest First colour of the rect in the framebuffer.
+//! @param rowBytes Distance between framebuffer rows, in bytes.
+void RREDrawSubrects(const PixelConverter_t * converter, const uint8_t * data, unsigned count, unsigned geometryBytes,
+    void * dest, size_t rowBytes, unsigned width, unsigned height);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _RRERects_h_
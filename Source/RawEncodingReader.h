@@ -21,9 +21,14 @@
 #import <AppKit/AppKit.h>
 #import "EncodingReader.h"
 
+/* Raw rects are converted into the frame buffer a row at a time as the bytes arrive.
+   Only a row split across reads is kept back, in rowBuffer. */
 @interface RawEncodingReader : EncodingReader
 {
-    id			pixelReader;
+    unsigned		rowBytes;		/* bytes per server row of the rect */
+    unsigned		rowsDone;		/* rows already in the frame buffer */
+    unsigned		partialBytes;	/* bytes of the next row held in rowBuffer */
+    unsigned char*	rowBuffer;
 }
 
 @end
@@ -19,39 +19,103 @@
  */
 
 #import "RawEncodingReader.h"
-#import "ByteBlockReader.h"
+#import "BufferPool.h"
+#import "ConnectionMetrics.h"
 
 @implementation RawEncodingReader
 
-- (id)initTarget:(id)aTarget action:(SEL)anAction
-{
-    if (self = [super initTarget:aTarget action:anAction]) {
-		pixelReader = [[ByteBlockReader alloc] initTarget:self action:@selector(setPixels:)];
-	}
-    return self;
-}
-
 - (void)dealloc
 {
-    [pixelReader release];
+    [[BufferPool sharedPool] releaseBuffer:rowBuffer];
     [super dealloc];
 }
 
 - (void)resetReader
 {
-    unsigned s = [frameBuffer bytesPerPixel] * frame.size.width * frame.size.height;
+    BufferPool* pool = [BufferPool sharedPool];
 
+    rowBytes = [frameBuffer bytesPerPixel] * frame.size.width;
+    rowsDone = 0;
+    partialBytes = 0;
+    if (rowBytes > [pool capacityOfBuffer:rowBuffer]) {
+        [pool releaseBuffer:rowBuffer];
+        rowBuffer = [pool acquireBufferWithLength:rowBytes options:kBufferOptionAllocate];
+    }
 #ifdef COLLECT_STATS
-    bytesTransferred = s;
+    bytesTransferred = rowBytes * frame.size.height;
 #endif
-    [pixelReader setBufferSize:s];
-    [target setReader:pixelReader];
 }
 
-- (void)setPixels:(NSData*)pixel
+/* Draws the next count rows of the rect from data. */
+- (void)putRows:(unsigned)count fromData:(unsigned char*)data
+{
+    NSRect rows = NSMakeRect(frame.origin.x, frame.origin.y + rowsDone, frame.size.width, count);
+
+    [frameBuffer putRect:rows fromData:data];
+    if (rowsDone == 0) {
+        [[self metrics] rectDidDrawPixels];
+    }
+    rowsDone += count;
+}
+
+- (unsigned)readBytes:(unsigned char*)theBytes length:(unsigned)aLength
+{
+    unsigned rows = frame.size.height;
+    unsigned char* bytes = theBytes;
+    unsigned char* end = theBytes + aLength;
+    unsigned count;
+
+    if (rowBytes == 0) {
+        rowsDone = rows;
+    }
+
+    // Finish a row that was split across reads.
+    if (partialBytes && rowsDone < rows) {
+        count = MIN(rowBytes - partialBytes, (unsigned)(end - bytes));
+        memcpy(rowBuffer + partialBytes, bytes, count);
+        bytes += count;
+        if ((partialBytes += count) == rowBytes) {
+            [self putRows:1 fromData:rowBuffer];
+            partialBytes = 0;
+        }
+    }
+
+    // Draw all the whole rows straight from the read buffer.
+    if (rowsDone < rows && partialBytes == 0) {
+        count = MIN((unsigned)(end - bytes) / rowBytes, rows - rowsDone);
+        if (count) {
+            [self putRows:count fromData:bytes];
+            bytes += count * rowBytes;
+        }
+    }
+
+    // Keep the start of the next row.
+    if (rowsDone < rows && bytes < end) {
+        partialBytes = end - bytes;
+        memcpy(rowBuffer, bytes, partialBytes);
+        bytes = end;
+    }
+
+    if (rowsDone == rows) {
+        [target performSelector:action withObject:self];
+    }
+    return bytes - theBytes;
+}
+
+- (unsigned)readRectangleFromBytes:(const uint8_t *)bytes length:(unsigned)length
 {
-    [frameBuffer putRect:frame fromData:(unsigned char*)[pixel bytes]];
-    [target performSelector:action withObject:self];
+    unsigned s = [frameBuffer bytesPerPixel] * frame.size.width * frame.size.height;
+    
+    if (s == 0 || length < s)
+    {
+        return 0;
+    }
+
+#ifdef COLLECT_STATS
+    bytesTransferred = s;
+#endif
+    [frameBuffer putRect:frame fromData:(unsigned char*)bytes];
+    return s;
 }
 
 @end
@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "RingBuffer.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+struct _RingBuffer
+{
+    uint8_t * storage;
+    uint32_t capacity;      //!< Always a power of two.
+    uint32_t mask;          //!< capacity - 1.
+    volatile uint32_t head; //!< Position of the next byte to consume. Written by the consumer.
+    volatile uint32_t tail; //!< Position of the next byte to add. Written by the producer.
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    uint64_t fills;
+    uint32_t peakUsed;
+};
+
+//! Returns the smallest power of two that is greater than or equal to @a value.
+static uint32_t RoundUpToPowerOfTwo(uint32_t value)
+{
+    uint32_t result = 1;
+    while (result < value)
+    {
+        result <<= 1;
+    }
+    return result;
+}
+
+RingBuffer_t * RingBufferCreate(uint32_t capacity)
+{
+    RingBuffer_t * ring;
+
+    if (capacity == 0 || capacity > 0x80000000U)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ring = (RingBuffer_t *)calloc(1, sizeof(RingBuffer_t));
+    if (!ring)
+    {
+        return NULL;
+    }
+
+    ring->capacity = RoundUpToPowerOfTwo(capacity);
+    ring->mask = ring->capacity - 1;
+    ring->storage = (uint8_t *)malloc(ring->capacity);
+    if (!ring->storage)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+void RingBufferDestroy(RingBuffer_t * ring)
+{
+    if (ring)
+    {
+        free(ring->storage);
+        free(ring);
+    }
+}
+
+uint32_t RingBufferGetCapacity(RingBuffer_t * ring)
+{
+    return ring->capacity;
+}
+
+uint32_t RingBufferGetUsed(RingBuffer_t * ring)
+{
+    return ring->tail - ring->head;
+}
+
+uint32_t RingBufferGetFree(RingBuffer_t * ring)
+{
+    return ring->capacity - (ring->tail - ring->head);
+}
+
+uint32_t RingBufferGetReadPointer(RingBuffer_t * ring, const uint8_t ** bytes)
+{
+    uint32_t head = ring->head;
+    uint32_t used = ring->tail - head;
+    uint32_t offset = head & ring->mask;
+    uint32_t toEnd = ring->capacity - offset;
+
+    // Make sure the data is not read before the tail that covers it.
+    __sync_synchronize();
+
+    *bytes = ring->storage + offset;
+    return used < toEnd ? used : toEnd;
+}
+
+void RingBufferConsume(RingBuffer_t * ring, uint32_t count)
+{
+    // Finish reading the data before the producer is allowed to overwrite it.
+    __sync_synchronize();
+    ring->head += count;
+    ring->bytesOut += count;
+}
+
+uint32_t RingBufferGetWritePointer(RingBuffer_t * ring, uint8_t ** bytes)
+{
+    uint32_t tail = ring->tail;
+    uint32_t freeSpace = ring->capacity - (tail - ring->head);
+    uint32_t offset = tail & ring->mask;
+    uint32_t toEnd = ring->capacity - offset;
+
+    *bytes = ring->storage + offset;
+    return freeSpace < toEnd ? freeSpace : toEnd;
+}
+
+void RingBufferCommit(RingBuffer_t * ring, uint32_t count)
+{
+    uint32_t used;
+
+    // Publish the data before the tail that covers it.
+    __sync_synchronize();
+    ring->tail += count;
+    ring->bytesIn += count;
+
+    used = ring->tail - ring->head;
+    if (used > ring->peakUsed)
+    {
+        ring->peakUsed = used;
+    }
+}
+
+ssize_t RingBufferReadFromDescriptor(RingBuffer_t * ring, int fd)
+{
+    struct iovec vectors[2];
+    int vectorCount = 1;
+    uint32_t tail = ring->tail;
+    uint32_t freeSpace = ring->capacity - (tail - ring->head);
+    uint32_t offset = tail & ring->mask;
+    uint32_t toEnd = ring->capacity - offset;
+    ssize_t result;
+
+    if (freeSpace == 0)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    // The free space wraps if it extends past the end of the storage.
+    vectors[0].iov_base = ring->storage + offset;
+    if (freeSpace > toEnd)
+    {
+        vectors[0].iov_len = toEnd;
+        vectors[1].iov_base = ring->storage;
+        vectors[1].iov_len = freeSpace - toEnd;
+        vectorCount = 2;
+    }
+    else
+    {
+        vectors[0].iov_len = freeSpace;
+    }
+
+    result = readv(fd, vectors, vectorCount);
+    if (result > 0)
+    {
+        ++ring->fills;
+        RingBufferCommit(ring, (uint32_t)result);
+    }
+
+    return result;
+}
+
+int RingBufferGetCommittedRegions(RingBuffer_t * ring, uint32_t count, struct iovec regions[2])
+{
+    uint32_t offset = (ring->tail - count) & ring->mask;
+    uint32_t toEnd = ring->capacity - offset;
+
+    regions[0].iov_base = ring->storage + offset;
+    if (count > toEnd)
+    {
+        regions[0].iov_len = toEnd;
+        regions[1].iov_base = ring->storage;
+        regions[1].iov_len = count - toEnd;
+        return 2;
+    }
+
+    regions[0].iov_len = count;
+    return 1;
+}
+
+void RingBufferGetStatistics(RingBuffer_t * ring, RingBufferStatistics_t * stats)
+{
+    stats->bytesIn = ring->bytesIn;
+    stats->bytesOut = ring->bytesOut;
+    stats->fills = ring->fills;
+    stats->peakUsed = ring->peakUsed;
+}
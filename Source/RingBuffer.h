@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#if !defined(_RingBuffer_h_)
+#define _RingBuffer_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @file RingBuffer.h
+ * @brief Fixed capacity byte ring used to receive data from a socket.
+ *
+ * The ring is allocated once, when it is created. Data is read from a descriptor directly into
+ * the ring's free space with readv(), and consumers process it in place through a pointer to
+ * the contiguous readable region, so receiving data requires no allocation, copying or locking.
+ *
+ * One producer thread may add data while one consumer thread removes it. The head and tail
+ * positions are free-running counters that are masked by the power-of-two capacity, and each
+ * is only written by one side.
+ */
+
+//! @brief Opaque ring buffer type.
+typedef struct _RingBuffer RingBuffer_t;
+
+//! @brief Counters describing ring buffer activity. All values are totals since creation.
+typedef struct _RingBufferStatistics
+{
+    uint64_t bytesIn;       //!< Number of bytes added to the ring.
+    uint64_t bytesOut;      //!< Number of bytes consumed from the ring.
+    uint64_t fills;         //!< Number of successful reads from a descriptor.
+    uint32_t peakUsed;      //!< Most bytes ever held in the ring at once.
+} RingBufferStatistics_t;
+
+//! @brief Create a ring buffer.
+//! @param capacity Size of the ring in bytes, rounded up to the next power of two.
+//! @return NULL if the storage could not be allocated.
+RingBuffer_t * RingBufferCreate(uint32_t capacity);
+
+//! @brief Free a ring buffer and its storage.
+void RingBufferDestroy(RingBuffer_t * ring);
+
+//! @brief Returns the ring's size in bytes.
+uint32_t RingBufferGetCapacity(RingBuffer_t * ring);
+
+//! @brief Returns the number of bytes waiting to be consumed.
+uint32_t RingBufferGetUsed(RingBuffer_t * ring);
+
+//! @brief Returns the number of bytes that can be added before the ring is full.
+uint32_t RingBufferGetFree(RingBuffer_t * ring);
+
+//! @brief Get the first contiguous region of unconsumed data.
+//!
+//! If the unconsumed data wraps around the end of the ring, only the part up to the end is
+//! returned. Call RingBufferConsume() and then this function again to get the remainder.
+//!
+//! @return Number of bytes available at @a bytes, or 0 if the ring is empty.
+uint32_t RingBufferGetReadPointer(RingBuffer_t * ring, const uint8_t ** bytes);
+
+//! @brief Remove @a count bytes from the front of the ring.
+void RingBufferConsume(RingBuffer_t * ring, uint32_t count);
+
+//! @brief Get the first contiguous region of free space.
+//! @return Number of bytes that may be written at @a bytes before calling RingBufferCommit().
+uint32_t RingBufferGetWritePointer(RingBuffer_t * ring, uint8_t ** bytes);
+
+//! @brief Make @a count bytes written to the free space available to the consumer.
+void RingBufferCommit(RingBuffer_t * ring, uint32_t count);
+
+//! @brief Read from a descriptor into all of the ring's free space.
+//!
+//! A single readv() call is made, with one or two vectors depending on whether the free space
+//! wraps. The return value and errno are the same as for readv(). If the ring is full, errno
+//! is set to ENOBUFS and -1 is returned without reading.
+ssize_t RingBufferReadFromDescriptor(RingBuffer_t * ring, int fd);
+
+//! @brief Get the storage holding the last @a count bytes that were committed.
+//!
+//! Only the producer may call this, before it writes to the ring again. The data stays valid
+//! until then even if the consumer has already consumed it.
+//!
+//! @return Number of regions filled in, 1 or 2 depending on whether the data wraps.
+int RingBufferGetCommittedRegions(RingBuffer_t * ring, uint32_t count, struct iovec regions[2]);
+
+//! @brief Read the ring's counters.
+void RingBufferGetStatistics(RingBuffer_t * ring, RingBufferStatistics_t * stats);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _RingBuffer_h_
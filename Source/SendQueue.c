@@ -0,0 +1,423 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "SendQueue.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#if defined(__APPLE__)
+    #include <mach/mach_time.h>
+#else
+    #include <time.h>
+#endif
+
+//! Messages up to this size are stored in the message record instead of a separate block.
+#define kInlineMessageSize (32)
+
+//! Most messages gathered into one writev() call.
+#define kMaxVectorsPerWrite (64)
+
+//! Most unused message records kept for reuse.
+#define kMaxFreeMessages (64)
+
+/*!
+ * @brief One queued message.
+ */
+typedef struct _SendMessage
+{
+    struct _SendMessage * next;
+    uint64_t queuedTime;    //!< When the message was queued, in nanoseconds.
+    size_t length;
+    size_t offset;          //!< Number of bytes already written.
+    int isCoalescable;      //!< Whether a later message may replace this one.
+    uint8_t * data;         //!< Points at inlineData for small messages.
+    uint8_t inlineData[kInlineMessageSize];
+} SendMessage_t;
+
+struct _SendQueue
+{
+    pthread_mutex_t lock;
+    SendMessage_t * heads[kSendClassCount];
+    SendMessage_t * tails[kSendClassCount];
+    SendMessage_t * current;    //!< Partially written message, which must be finished before any other.
+    SendMessage_t * gathered[kSendClassCount];  //!< Last message of each class passed to an in-progress writev().
+    unsigned currentClass;
+    SendMessage_t * freeMessages;
+    unsigned freeCount;
+    int hasWriter;
+    SendQueueStatistics_t stats;
+};
+
+static uint64_t GetNanoseconds(void)
+{
+#if defined(__APPLE__)
+    static mach_timebase_info_data_t s_timebase;
+    if (!s_timebase.denom)
+    {
+        mach_timebase_info(&s_timebase);
+    }
+    return mach_absolute_time() * s_timebase.numer / s_timebase.denom;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+#endif
+}
+
+//! @pre The queue lock is held.
+static void FreeMessage(SendQueue_t * queue, SendMessage_t * message)
+{
+    if (message->data != message->inlineData)
+    {
+        free(message->data);
+    }
+
+    if (queue->freeCount < kMaxFreeMessages)
+    {
+        message->next = queue->freeMessages;
+        queue->freeMessages = message;
+        queue->freeCount++;
+    }
+    else
+    {
+        free(message);
+    }
+}
+
+//! @pre The queue lock is held.
+static void CompleteMessage(SendQueue_t * queue, SendMessage_t * message, unsigned messageClass, uint64_t now)
+{
+    uint64_t queued = now - message->queuedTime;
+
+    queue->stats.messages[messageClass]++;
+    queue->stats.queuedNanoseconds[messageClass] += queued;
+    if (queued > queue->stats.maxQueuedNanoseconds[messageClass])
+    {
+        queue->stats.maxQueuedNanoseconds[messageClass] = queued;
+    }
+
+    FreeMessage(queue, message);
+}
+
+SendQueue_t * SendQueueCreate(void)
+{
+    SendQueue_t * queue = (SendQueue_t *)calloc(1, sizeof(SendQueue_t));
+    if (queue)
+    {
+        pthread_mutex_init(&queue->lock, NULL);
+    }
+    return queue;
+}
+
+void SendQueueDestroy(SendQueue_t * queue)
+{
+    SendMessage_t * message;
+
+    if (!queue)
+    {
+        return;
+    }
+
+    SendQueueDiscard(queue);
+
+    while ((message = queue->freeMessages))
+    {
+        queue->freeMessages = message->next;
+        free(message);
+    }
+
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+}
+
+static int EnqueueMessage(SendQueue_t * queue, unsigned messageClass, const void * header, size_t headerLength, const void * payload, size_t payloadLength, int isCoalescable)
+{
+    SendMessage_t * message;
+    size_t length = headerLength + payloadLength;
+    uint8_t * data = NULL;
+    int needsWriter;
+
+    if (messageClass >= kSendClassCount || length == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Large messages are copied outside of the lock.
+    if (length > kInlineMessageSize)
+    {
+        data = (uint8_t *)malloc(length);
+        if (!data)
+        {
+            return -1;
+        }
+        memcpy(data, header, headerLength);
+        memcpy(data + headerLength, payload, payloadLength);
+    }
+
+    pthread_mutex_lock(&queue->lock);
+
+    message = queue->freeMessages;
+    if (message)
+    {
+        queue->freeMessages = message->next;
+        queue->freeCount--;
+    }
+    else if (!(message = (SendMessage_t *)malloc(sizeof(SendMessage_t))))
+    {
+        pthread_mutex_unlock(&queue->lock);
+        free(data);
+        return -1;
+    }
+
+    message->next = NULL;
+    message->queuedTime = GetNanoseconds();
+    message->length = length;
+    message->offset = 0;
+    message->isCoalescable = isCoalescable;
+    if (data)
+    {
+        message->data = data;
+    }
+    else
+    {
+        message->data = message->inlineData;
+        memcpy(message->data, header, headerLength);
+        memcpy(message->data + headerLength, payload, payloadLength);
+    }
+
+    if (queue->tails[messageClass])
+    {
+        queue->tails[messageClass]->next = message;
+    }
+    else
+    {
+        queue->heads[messageClass] = message;
+    }
+    queue->tails[messageClass] = message;
+
+    needsWriter = !queue->hasWriter;
+    queue->hasWriter = 1;
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return needsWriter;
+}
+
+int SendQueueEnqueue(SendQueue_t * queue, unsigned messageClass, const void * header, size_t headerLength, const void * payload, size_t payloadLength)
+{
+    return EnqueueMessage(queue, messageClass, header, headerLength, payload, payloadLength, 0);
+}
+
+int SendQueueEnqueueCoalescing(SendQueue_t * queue, unsigned messageClass, const void * message, size_t length, size_t keyLength)
+{
+    SendMessage_t * last;
+
+    if (messageClass >= kSendClassCount || keyLength > length)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // The last message of the class can be overwritten unless the writer is using it. The
+    // writer gathers each class from the head, so the last one is in use only if it was the
+    // last one gathered.
+    pthread_mutex_lock(&queue->lock);
+    last = queue->tails[messageClass];
+    if (last && last->isCoalescable && last != queue->gathered[messageClass]
+        && last->length == length && memcmp(last->data, message, keyLength) == 0)
+    {
+        memcpy(last->data, message, length);
+        queue->stats.coalesced++;
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return EnqueueMessage(queue, messageClass, message, length, NULL, 0, 1);
+}
+
+ssize_t SendQueueWrite(SendQueue_t * queue, int fd)
+{
+    struct iovec vectors[kMaxVectorsPerWrite];
+    SendMessage_t * gathered[kSendClassCount];
+    int vectorCount = 0;
+    unsigned messageClass;
+    SendMessage_t * message;
+    ssize_t result;
+    size_t remaining;
+    uint64_t now;
+
+    // Gather the partially written message followed by queued messages in priority order.
+    // Writing happens without the lock held. Other threads may append messages to any class
+    // meanwhile, even to a class ahead of one that was gathered, so the last message gathered
+    // from each class is recorded and only those messages are retired afterwards.
+    pthread_mutex_lock(&queue->lock);
+    if (queue->current)
+    {
+        vectors[vectorCount].iov_base = queue->current->data + queue->current->offset;
+        vectors[vectorCount].iov_len = queue->current->length - queue->current->offset;
+        vectorCount++;
+    }
+    for (messageClass = 0; messageClass < kSendClassCount && vectorCount < kMaxVectorsPerWrite; ++messageClass)
+    {
+        for (message = queue->heads[messageClass]; message && vectorCount < kMaxVectorsPerWrite; message = message->next)
+        {
+            vectors[vectorCount].iov_base = message->data;
+            vectors[vectorCount].iov_len = message->length;
+            vectorCount++;
+            queue->gathered[messageClass] = message;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    if (vectorCount == 0)
+    {
+        return 0;
+    }
+
+    result = writev(fd, vectors, vectorCount);
+
+    pthread_mutex_lock(&queue->lock);
+    for (messageClass = 0; messageClass < kSendClassCount; ++messageClass)
+    {
+        gathered[messageClass] = queue->gathered[messageClass];
+        queue->gathered[messageClass] = NULL;
+    }
+    if (result <= 0)
+    {
+        int savedErrno = errno;
+        pthread_mutex_unlock(&queue->lock);
+        errno = savedErrno;
+        return result;
+    }
+
+    // Retire the messages that were completely written, in the same order they were gathered.
+    // The first one that was only partly written becomes the current message.
+    now = GetNanoseconds();
+    remaining = (size_t)result;
+    queue->stats.writeCalls++;
+    queue->stats.bytesWritten += (uint64_t)result;
+
+    if (queue->current)
+    {
+        message = queue->current;
+        size_t unwritten = message->length - message->offset;
+        if (remaining < unwritten)
+        {
+            message->offset += remaining;
+            remaining = 0;
+        }
+        else
+        {
+            remaining -= unwritten;
+            queue->current = NULL;
+            CompleteMessage(queue, message, queue->currentClass, now);
+        }
+    }
+
+    for (messageClass = 0; messageClass < kSendClassCount && remaining; ++messageClass)
+    {
+        // Each class was gathered from its head up to gathered[messageClass].
+        int isLast = (gathered[messageClass] == NULL);
+        while (remaining && !isLast)
+        {
+            message = queue->heads[messageClass];
+            isLast = (message == gathered[messageClass]);
+
+            // Unlink the message from its class.
+            queue->heads[messageClass] = message->next;
+            if (!message->next)
+            {
+                queue->tails[messageClass] = NULL;
+            }
+            message->next = NULL;
+
+            if (remaining < message->length)
+            {
+                message->offset = remaining;
+                queue->current = message;
+                queue->currentClass = messageClass;
+                remaining = 0;
+            }
+            else
+            {
+                remaining -= message->length;
+                CompleteMessage(queue, message, messageClass, now);
+            }
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return result;
+}
+
+int SendQueueFinishWriting(SendQueue_t * queue)
+{
+    unsigned messageClass;
+    int isEmpty;
+
+    pthread_mutex_lock(&queue->lock);
+    isEmpty = (queue->current == NULL);
+    for (messageClass = 0; messageClass < kSendClassCount && isEmpty; ++messageClass)
+    {
+        isEmpty = (queue->heads[messageClass] == NULL);
+    }
+    if (isEmpty)
+    {
+        queue->hasWriter = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return isEmpty;
+}
+
+void SendQueueDiscard(SendQueue_t * queue)
+{
+    unsigned messageClass;
+    SendMessage_t * message;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->current)
+    {
+        FreeMessage(queue, queue->current);
+        queue->current = NULL;
+    }
+    for (messageClass = 0; messageClass < kSendClassCount; ++messageClass)
+    {
+        while ((message = queue->heads[messageClass]))
+        {
+            queue->heads[messageClass] = message->next;
+            FreeMessage(queue, message);
+        }
+        queue->tails[messageClass] = NULL;
+    }
+    queue->hasWriter = 0;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void SendQueueGetStatistics(SendQueue_t * queue, SendQueueStatistics_t * stats)
+{
+    pthread_mutex_lock(&queue->lock);
+    *stats = queue->stats;
+    pthread_mutex_unlock(&queue->lock);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#if !defined(_SendQueue_h_)
+#define _SendQueue_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @file SendQueue.h
+ * @brief Prioritized queue of outgoing messages for one connection.
+ *
+ * Any thread may queue a message. A single writer drains the queue, gathering as many
+ * complete messages as it can into each writev() call. Messages are sent in priority order,
+ * and in the order they were queued within a priority. A message is never interleaved with
+ * another one, so once the writer has started sending a message it finishes it before
+ * picking the next.
+ *
+ * The time each message spends queued is accumulated per priority class.
+ */
+
+//! @brief Message priority classes, from most to least urgent.
+enum _SendQueueClass
+{
+    kSendClassInput = 0,        //!< Pointer and key events.
+    kSendClassControl = 1,      //!< Handshake, pixel format, encodings and update requests.
+    kSendClassClipboard = 2,    //!< Client cut text.
+    kSendClassCount = 3
+};
+
+//! @brief Opaque send queue type.
+typedef struct _SendQueue SendQueue_t;
+
+//! @brief Counters describing send queue activity. All values are totals since creation.
+typedef struct _SendQueueStatistics
+{
+    uint64_t messages[kSendClassCount];         //!< Messages fully written, per class.
+    uint64_t queuedNanoseconds[kSendClassCount];    //!< Total time from queueing to fully written, per class.
+    uint64_t maxQueuedNanoseconds[kSendClassCount]; //!< Longest time any one message was queued, per class.
+    uint64_t coalesced;         //!< Messages that replaced an unsent message instead of being queued.
+    uint64_t writeCalls;        //!< Number of writev() calls.
+    uint64_t bytesWritten;      //!< Number of bytes written.
+} SendQueueStatistics_t;
+
+//! @brief Create an empty send queue.
+SendQueue_t * SendQueueCreate(void);
+
+//! @brief Free a send queue and any messages still in it.
+void SendQueueDestroy(SendQueue_t * queue);
+
+//! @brief Copy a message into the queue.
+//!
+//! The message is the concatenation of @a header and @a payload. Either part may be empty.
+//!
+//! @retval 1 The queue has no writer; the caller must arrange for SendQueueWrite() to be
+//!     called until SendQueueFinishWriting() returns true.
+//! @retval 0 A writer is already draining the queue.
+//! @retval -1 The message could not be allocated.
+int SendQueueEnqueue(SendQueue_t * queue, unsigned messageClass, const void * header, size_t headerLength, const void * payload, size_t payloadLength);
+
+//! @brief Copy a message into the queue, replacing the last message of its class if that one
+//!     has not been sent yet and is equivalent.
+//!
+//! The last queued message is equivalent if it was also queued with this function, has the
+//! same length, and its first @a keyLength bytes match. Messages queued with
+//! SendQueueEnqueue() are never replaced. Only the most recent message is ever replaced, so messages
+//! of the class that are not equivalent keep their relative order. A replaced message keeps
+//! its original queue time.
+//!
+//! @return Same as SendQueueEnqueue(). Replacing a message always returns 0.
+int SendQueueEnqueueCoalescing(SendQueue_t * queue, unsigned messageClass, const void * message, size_t length, size_t keyLength);
+
+//! @brief Write as many queued messages as possible to @a fd with one writev() call.
+//!
+//! Only the writer may call this.
+//!
+//! @return The number of bytes written, or -1 with errno set by writev().
+ssize_t SendQueueWrite(SendQueue_t * queue, int fd);
+
+//! @brief Returns non-zero once the queue is empty, at which point the caller stops being the
+//!     writer. Returns 0 if more messages remain.
+int SendQueueFinishWriting(SendQueue_t * queue);
+
+//! @brief Drop all queued messages and stop being the writer.
+void SendQueueDiscard(SendQueue_t * queue);
+
+//! @brief Read the queue's counters.
+void SendQueueGetStatistics(SendQueue_t * queue, SendQueueStatistics_t * stats);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _SendQueue_h_
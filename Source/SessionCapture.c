@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "SessionCapture.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__APPLE__)
+    #include <mach/mach_time.h>
+#else
+    #include <time.h>
+#endif
+
+//! Number of bytes buffered before records are written to the file.
+#define kCaptureBufferSize (256 * 1024)
+
+#define kFileHeaderSize (16)
+#define kRecordHeaderSize (16)
+
+static const char kCaptureMagic[8] = { 'C', 'O', 'T', 'V', 'N', 'C', 'A', 'P' };
+
+struct _SessionCapture
+{
+    pthread_mutex_t lock;
+    int fd;
+    int failed;         //!< Set after a write error; further records are dropped.
+    uint64_t startTime;
+    size_t used;
+    uint8_t buffer[kCaptureBufferSize];
+};
+
+struct _SessionCaptureReader
+{
+    int fd;
+    uint8_t * data;     //!< Holds the most recent record's data.
+    uint32_t capacity;
+};
+
+static uint64_t GetNanoseconds(void)
+{
+#if defined(__APPLE__)
+    static mach_timebase_info_data_t s_timebase;
+    if (!s_timebase.denom)
+    {
+        mach_timebase_info(&s_timebase);
+    }
+    return mach_absolute_time() * s_timebase.numer / s_timebase.denom;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+#endif
+}
+
+static void PutLittle32(uint8_t * p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static void PutLittle64(uint8_t * p, uint64_t value)
+{
+    PutLittle32(p, (uint32_t)value);
+    PutLittle32(p + 4, (uint32_t)(value >> 32));
+}
+
+static uint32_t GetLittle32(const uint8_t * p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t GetLittle64(const uint8_t * p)
+{
+    return (uint64_t)GetLittle32(p) | ((uint64_t)GetLittle32(p + 4) << 32);
+}
+
+//! Writes all of @a length bytes, retrying after signals and short writes.
+static int WriteFully(int fd, const uint8_t * bytes, size_t length)
+{
+    while (length)
+    {
+        ssize_t result = write(fd, bytes, length);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        bytes += result;
+        length -= (size_t)result;
+    }
+    return 0;
+}
+
+//! Reads exactly @a length bytes.
+//! @return 1 on success, 0 at the end of the file before any bytes, -1 on error or truncation.
+static int ReadFully(int fd, uint8_t * bytes, size_t length)
+{
+    size_t total = 0;
+    while (total < length)
+    {
+        ssize_t result = read(fd, bytes + total, length - total);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        else if (result == 0)
+        {
+            if (total == 0)
+            {
+                return 0;
+            }
+            errno = EIO;
+            return -1;
+        }
+        total += (size_t)result;
+    }
+    return 1;
+}
+
+//! @pre The capture lock is held.
+static int FlushBuffer(SessionCapture_t * capture)
+{
+    if (capture->used && !capture->failed)
+    {
+        if (WriteFully(capture->fd, capture->buffer, capture->used) < 0)
+        {
+            capture->failed = 1;
+        }
+    }
+    capture->used = 0;
+    return capture->failed ? -1 : 0;
+}
+
+//! @pre The capture lock is held.
+static int AppendBytes(SessionCapture_t * capture, const void * bytes, size_t length)
+{
+    // Large chunks go straight to the file once the buffer has been flushed.
+    if (capture->used + length > kCaptureBufferSize)
+    {
+        if (FlushBuffer(capture) < 0)
+        {
+            return -1;
+        }
+        if (length > kCaptureBufferSize)
+        {
+            if (WriteFully(capture->fd, (const uint8_t *)bytes, length) < 0)
+            {
+                capture->failed = 1;
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    memcpy(capture->buffer + capture->used, bytes, length);
+    capture->used += length;
+    return 0;
+}
+
+SessionCapture_t * SessionCaptureCreate(const char * path)
+{
+    uint8_t header[kFileHeaderSize] = {0};
+    SessionCapture_t * capture = (SessionCapture_t *)malloc(sizeof(SessionCapture_t));
+    if (!capture)
+    {
+        return NULL;
+    }
+
+    capture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (capture->fd < 0)
+    {
+        free(capture);
+        return NULL;
+    }
+
+    pthread_mutex_init(&capture->lock, NULL);
+    capture->failed = 0;
+    capture->used = 0;
+    capture->startTime = GetNanoseconds();
+
+    memcpy(header, kCaptureMagic, sizeof(kCaptureMagic));
+    PutLittle32(header + 8, kSessionCaptureVersion);
+    AppendBytes(capture, header, sizeof(header));
+
+    return capture;
+}
+
+void SessionCaptureClose(SessionCapture_t * capture)
+{
+    if (!capture)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&capture->lock);
+    FlushBuffer(capture);
+    pthread_mutex_unlock(&capture->lock);
+
+    close(capture->fd);
+    pthread_mutex_destroy(&capture->lock);
+    free(capture);
+}
+
+int SessionCaptureWriteVectors(SessionCapture_t * capture, unsigned direction, const struct iovec * vectors, int vectorCount)
+{
+    uint8_t header[kRecordHeaderSize] = {0};
+    size_t length = 0;
+    int result;
+    int i;
+
+    for (i = 0; i < vectorCount; ++i)
+    {
+        length += vectors[i].iov_len;
+    }
+
+    PutLittle32(header + 8, (uint32_t)length);
+    header[12] = (uint8_t)direction;
+
+    pthread_mutex_lock(&capture->lock);
+    if (capture->failed)
+    {
+        pthread_mutex_unlock(&capture->lock);
+        errno = EIO;
+        return -1;
+    }
+
+    // Take the timestamp under the lock so records are in time order.
+    PutLittle64(header, GetNanoseconds() - capture->startTime);
+    result = AppendBytes(capture, header, sizeof(header));
+    for (i = 0; i < vectorCount && result == 0; ++i)
+    {
+        result = AppendBytes(capture, vectors[i].iov_base, vectors[i].iov_len);
+    }
+    pthread_mutex_unlock(&capture->lock);
+
+    return result;
+}
+
+int SessionCaptureWrite(SessionCapture_t * capture, unsigned direction, const void * data, size_t length)
+{
+    struct iovec vector = { .iov_base = (void *)data, .iov_len = length };
+    return SessionCaptureWriteVectors(capture, direction, &vector, 1);
+}
+
+SessionCaptureReader_t * SessionCaptureOpen(const char * path)
+{
+    uint8_t header[kFileHeaderSize];
+    SessionCaptureReader_t * reader;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    if (ReadFully(fd, header, sizeof(header)) != 1
+        || memcmp(header, kCaptureMagic, sizeof(kCaptureMagic)) != 0
+        || GetLittle32(header + 8) != kSessionCaptureVersion)
+    {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    reader = (SessionCaptureReader_t *)calloc(1, sizeof(SessionCaptureReader_t));
+    if (!reader)
+    {
+        close(fd);
+        return NULL;
+    }
+    reader->fd = fd;
+    return reader;
+}
+
+void SessionCaptureCloseReader(SessionCaptureReader_t * reader)
+{
+    if (reader)
+    {
+        close(reader->fd);
+        free(reader->data);
+        free(reader);
+    }
+}
+
+int SessionCaptureReadRecord(SessionCaptureReader_t * reader, SessionCaptureRecord_t * record)
+{
+    uint8_t header[kRecordHeaderSize];
+    uint32_t length;
+    int result = ReadFully(reader->fd, header, sizeof(header));
+    if (result <= 0)
+    {
+        return result;
+    }
+
+    length = GetLittle32(header + 8);
+    if (length > reader->capacity)
+    {
+        uint8_t * data = (uint8_t *)realloc(reader->data, length);
+        if (!data)
+        {
+            return -1;
+        }
+        reader->data = data;
+        reader->capacity = length;
+    }
+
+    if (length && ReadFully(reader->fd, reader->data, length) != 1)
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    record->timestamp = GetLittle64(header);
+    record->length = length;
+    record->direction = header[12];
+    record->data = reader->data;
+    return 1;
+}
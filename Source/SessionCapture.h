@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#if !defined(_SessionCapture_h_)
+#define _SessionCapture_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @file SessionCapture.h
+ * @brief Binary recording of the data exchanged with a server.
+ *
+ * A capture file starts with a 16 byte header: the magic bytes "COTVNCAP", a 32-bit format
+ * version and 4 reserved bytes. It is followed by one record per chunk of data, each made of
+ * a 16 byte record header and the data itself. The record header holds a 64-bit timestamp
+ * in nanoseconds since the capture was created, the 32-bit data length, the direction and
+ * 3 reserved bytes. All integers are little endian.
+ *
+ * Received data is recorded in the chunks it was read from the socket, and each outgoing
+ * message is recorded as one chunk, so a capture can be replayed with its original pacing.
+ *
+ * Writes are buffered and may come from any thread.
+ */
+
+//! @brief Current capture file format version.
+#define kSessionCaptureVersion (1)
+
+//! @brief Which way a chunk of data was travelling.
+enum
+{
+    kSessionCaptureFromServer = 0,
+    kSessionCaptureToServer = 1
+};
+
+//! @brief Opaque capture writer type.
+typedef struct _SessionCapture SessionCapture_t;
+
+//! @brief Opaque capture reader type.
+typedef struct _SessionCaptureReader SessionCaptureReader_t;
+
+//! @brief One record read from a capture file.
+typedef struct _SessionCaptureRecord
+{
+    uint64_t timestamp;     //!< Nanoseconds since the capture was created.
+    unsigned direction;     //!< kSessionCaptureFromServer or kSessionCaptureToServer.
+    uint32_t length;        //!< Number of bytes at @a data.
+    const uint8_t * data;   //!< Valid until the next record is read.
+} SessionCaptureRecord_t;
+
+//! @brief Create a capture file, replacing any existing file at @a path.
+//! @return NULL with errno set if the file could not be created.
+SessionCapture_t * SessionCaptureCreate(const char * path);
+
+//! @brief Flush buffered records and close the file.
+void SessionCaptureClose(SessionCapture_t * capture);
+
+//! @brief Record one chunk of data made of the given pieces.
+//! @return 0 on success, or -1 with errno set if the file could not be written.
+int SessionCaptureWriteVectors(SessionCapture_t * capture, unsigned direction, const struct iovec * vectors, int vectorCount);
+
+//! @brief Record one contiguous chunk of data.
+int SessionCaptureWrite(SessionCapture_t * capture, unsigned direction, const void * data, size_t length);
+
+//! @brief Open a capture file for reading and validate its header.
+//! @return NULL with errno set if the file can't be read or isn't a capture file.
+SessionCaptureReader_t * SessionCaptureOpen(const char * path);
+
+//! @brief Close a capture file opened with SessionCaptureOpen().
+void SessionCaptureCloseReader(SessionCaptureReader_t * reader);
+
+//! @brief Read the next record.
+//! @retval 1 A record was read.
+//! @retval 0 The end of the capture was reached.
+//! @retval -1 The file could not be read or is truncated; errno is set.
+int SessionCaptureReadRecord(SessionCaptureReader_t * reader, SessionCaptureRecord_t * record);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _SessionCapture_h_
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2009 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#import <Cocoa/Cocoa.h>
+
+@class RFBConnection;
+
+/*!
+ * @brief Replays a session capture through a headless RFBConnection.
+ *
+ * The data received from the server is fed to the protocol readers exactly as if it had
+ * come from a socket, so a capture exercises the same decoding and drawing code as a live
+ * session. Outgoing messages in the capture are only used to recover the pixel formats the
+ * client asked for, each of which takes effect where it was sent. Data is fed either as fast
+ * as it can be decoded or with the pacing it was originally received with.
+ *
+ * @sa SessionCapture.h
+ */
+@interface SessionReplay : NSObject
+{
+    NSString * _path;
+    BOOL _isPaced;      //!< Whether to reproduce the original timing.
+    RFBConnection * _connection;
+    uint64_t _recordCount;
+    uint64_t _bytesFromServer;
+    uint64_t _bytesToServer;
+    uint64_t _elapsedNanoseconds;
+    Class _frameBufferClass;
+    unsigned _renderThreads;
+}
+
+@property(nonatomic, readonly) RFBConnection * connection;
+@property(nonatomic, assign) Class frameBufferClass;    //!< Nil to use the preferred class.
+@property(nonatomic, assign) unsigned renderThreads;    //!< 0 for the connection's default.
+@property(nonatomic, readonly) uint64_t bytesFromServer;
+@property(nonatomic, readonly) uint64_t elapsedNanoseconds;  //!< Wall clock time of the replay.
+
+//! @brief Returns a readable name for an RFB encoding number.
++ (NSString *)nameOfEncoding:(int32_t)encoding;
+
+- (id)initWithPath:(NSString *)path paced:(BOOL)paced;
+
+//! @brief Replay the whole capture. Blocks until all data has been decoded.
+- (BOOL)replayReturningError:(NSError **)error;
+
+//! @brief Summary of the replay, including byte, rectangle and pixel counts per encoding.
+- (NSString *)summary;
+
+@end
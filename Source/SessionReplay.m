@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2009 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#import "SessionReplay.h"
+#import "RFBConnection.h"
+#import "ConnectionMetrics.h"
+#import "ProfileManager.h"
+#import "ServerStandAlone.h"
+#import "SessionCapture.h"
+#import "rfbproto.h"
+#import <CoreAudio/HostTime.h>
+
+@interface SessionReplay ()
+
+- (BOOL)findFirstPixelFormat:(rfbPixelFormat *)format error:(NSError **)error;
+
+@end
+
+//! @brief Creates an error for a capture file that can't be read.
+static NSError * CaptureError(NSString * path, int code)
+{
+    NSString * reason = [NSString stringWithFormat:@"%@: %s", path, strerror(code)];
+    NSDictionary * info = [NSDictionary dictionaryWithObject:reason forKey:NSLocalizedDescriptionKey];
+    return [NSError errorWithDomain:NSPOSIXErrorDomain code:code userInfo:info];
+}
+
+//! @brief Gets the format from a SetPixelFormat message the client sent.
+//!
+//! The SetPixelFormat message is the only outgoing message that is exactly
+//! sz_rfbSetPixelFormatMsg bytes and starts with its type, since handshake messages are
+//! recorded one per chunk.
+//!
+//! @return NO if the record isn't a SetPixelFormat message.
+static BOOL GetPixelFormat(const SessionCaptureRecord_t * record, rfbPixelFormat * format)
+{
+    rfbSetPixelFormatMsg msg;
+    
+    if (record->direction != kSessionCaptureToServer || record->length != sz_rfbSetPixelFormatMsg || record->data[0] != rfbSetPixelFormat)
+    {
+        return NO;
+    }
+    memcpy(&msg, record->data, sz_rfbSetPixelFormatMsg);
+    *format = msg.format;
+    format->redMax = ntohs(format->redMax);
+    format->greenMax = ntohs(format->greenMax);
+    format->blueMax = ntohs(format->blueMax);
+    return YES;
+}
+
+@implementation SessionReplay
+
+@synthesize connection = _connection;
+@synthesize frameBufferClass = _frameBufferClass;
+@synthesize renderThreads = _renderThreads;
+@synthesize bytesFromServer = _bytesFromServer;
+@synthesize elapsedNanoseconds = _elapsedNanoseconds;
+
++ (NSString *)nameOfEncoding:(int32_t)encoding
+{
+    switch (encoding)
+    {
+        case rfbEncodingRaw:
+            return @"Raw";
+        case rfbEncodingCopyRect:
+            return @"CopyRect";
+        case rfbEncodingRRE:
+            return @"RRE";
+        case rfbEncodingCoRRE:
+            return @"CoRRE";
+        case rfbEncodingHextile:
+            return @"Hextile";
+        case rfbEncodingZlib:
+            return @"Zlib";
+        case rfbEncodingTight:
+            return @"Tight";
+        case rfbEncodingZlibHex:
+            return @"ZlibHex";
+        case rfbEncodingZRLE:
+            return @"ZRLE";
+        case rfbEncodingRichCursor:
+            return @"RichCursor";
+    }
+    return [NSString stringWithFormat:@"%d", encoding];
+}
+
+- (id)initWithPath:(NSString *)path paced:(BOOL)paced
+{
+    if (self = [super init])
+    {
+        _path = [path copy];
+        _isPaced = paced;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [_connection release];
+    [_path release];
+    [super dealloc];
+}
+
+//! The client sends its first SetPixelFormat in reply to the ServerInit message, so this is
+//! the format the frame buffer has to be created with.
+- (BOOL)findFirstPixelFormat:(rfbPixelFormat *)format error:(NSError **)error
+{
+    SessionCaptureReader_t * reader = SessionCaptureOpen([_path fileSystemRepresentation]);
+    SessionCaptureRecord_t record;
+    BOOL found = NO;
+    int result;
+    
+    if (!reader)
+    {
+        if (error)
+        {
+            *error = CaptureError(_path, errno);
+        }
+        return NO;
+    }
+    
+    while (!found && (result = SessionCaptureReadRecord(reader, &record)) == 1)
+    {
+        found = GetPixelFormat(&record, format);
+    }
+    SessionCaptureCloseReader(reader);
+    
+    if (result < 0)
+    {
+        if (error)
+        {
+            *error = CaptureError(_path, errno);
+        }
+        return NO;
+    }
+    return found;
+}
+
+- (BOOL)replayReturningError:(NSError **)error
+{
+    rfbPixelFormat format;
+    rfbPixelFormat newFormat;
+    NSError * formatError = nil;
+    BOOL hasFormat = [self findFirstPixelFormat:&format error:&formatError];
+    if (formatError)
+    {
+        if (error)
+        {
+            *error = formatError;
+        }
+        return NO;
+    }
+    
+    NSAutoreleasePool * pool = [[NSAutoreleasePool alloc] init];
+    ServerStandAlone * server = [[[ServerStandAlone alloc] init] autorelease];
+    [server setHost:@"replay"];
+    Profile * profile = [[ProfileManager sharedManager] defaultProfile];
+    _connection = [[RFBConnection alloc] initForReplayWithServer:server profile:profile pixelFormat:hasFormat ? &format : NULL];
+    _connection.frameBufferClass = _frameBufferClass;
+    _connection.renderThreads = _renderThreads;
+    
+    SessionCaptureReader_t * reader = SessionCaptureOpen([_path fileSystemRepresentation]);
+    SessionCaptureRecord_t record;
+    int result = -1;
+    uint64_t startTime = AudioConvertHostTimeToNanos(AudioGetCurrentHostTime());
+    
+    while (reader && ![_connection isTerminating] && (result = SessionCaptureReadRecord(reader, &record)) == 1)
+    {
+        _recordCount++;
+        if (record.direction != kSessionCaptureFromServer)
+        {
+            _bytesToServer += record.length;
+            
+            // The client switched formats here, so what follows is decoded with the new one.
+            if (GetPixelFormat(&record, &newFormat) && (!hasFormat || memcmp(&newFormat, &format, sizeof(format)) != 0))
+            {
+                format = newFormat;
+                hasFormat = YES;
+                [_connection replayPixelFormat:&format];
+            }
+            continue;
+        }
+        
+        // Wait until the time this chunk was originally received.
+        if (_isPaced)
+        {
+            uint64_t now = AudioConvertHostTimeToNanos(AudioGetCurrentHostTime()) - startTime;
+            if (record.timestamp > now)
+            {
+                usleep((useconds_t)((record.timestamp - now) / 1000));
+            }
+        }
+        
+        _bytesFromServer += record.length;
+        [_connection replayReceivedBytes:record.data length:record.length];
+    }
+    int savedErrno = errno;
+    SessionCaptureCloseReader(reader);
+    
+    [_connection finishReplay];
+    _elapsedNanoseconds = AudioConvertHostTimeToNanos(AudioGetCurrentHostTime()) - startTime;
+    [[_connection metrics] connectionDidClose];
+    
+    [pool release];
+    
+    if (result < 0)
+    {
+        if (error)
+        {
+            *error = CaptureError(_path, savedErrno);
+        }
+        return NO;
+    }
+    return YES;
+}
+
+- (NSString *)summary
+{
+    ConnectionMetrics * metrics = [_connection metrics];
+    EncodingStatistics_t stats[kMaxEncodingStatistics];
+    unsigned count = [metrics getEncodingStatistics:stats];
+    double seconds = (double)_elapsedNanoseconds / 1.0e9;
+    NSMutableString * summary = [NSMutableString string];
+    unsigned i;
+    
+    [summary appendFormat:@"%@: %llu records, %llu bytes from server, %llu bytes to server\n",
+        _path, _recordCount, _bytesFromServer, _bytesToServer];
+    [summary appendFormat:@"replayed in %.3f s (%.1f MB/s), %u updates, avg update latency %.3f ms\n",
+        seconds, seconds > 0.0 ? (double)_bytesFromServer / seconds / 1.0e6 : 0.0,
+        metrics.updatesCompleted, metrics.averageUpdateLatency * 1000.0];
+    [summary appendFormat:@"%-12s %10s %14s %14s\n", "encoding", "rects", "pixels", "bytes"];
+    for (i = 0; i < count; ++i)
+    {
+        [summary appendFormat:@"%-12s %10u %14llu %14llu\n", [[SessionReplay nameOfEncoding:stats[i].encoding] UTF8String],
+            stats[i].rects, stats[i].pixels, stats[i].bytes];
+    }
+    [summary appendFormat:@"%-12s %10s %14s %14llu\n", "(headers)", "", "", metrics.overheadBytes];
+    
+    return summary;
+}
+
+@end
@@ -20,21 +20,30 @@
 
 #import <AppKit/AppKit.h>
 #import "EncodingReader.h"
+#import "InflateRows.h"
+#import "TightJpeg.h"
 #import <zlib.h>
-
-//#define SUPPORT_JPEG
-#undef	SUPPORT_JPEG
-#ifdef SUPPORT_JPEG
-#import "../libjpeg/jpeglib.h"
-#endif
+#import <pthread.h>
 
 #define APPLE_JPEG 1
 
 #define NUM_ZSTREAMS		4
-//#define Z_BUFSIZE		4096
-#define TIGHT_BUFSIZE		16384
-#define Z_BUFSIZE		TIGHT_BUFSIZE
+#define TIGHT_BUFSIZE		16384	/* smallest window for inflated rows */
 #define TIGHT_MIN_TO_COMPRESS	12
+#define TIGHT_MAX_JPEG_JOBS		64		/* JPEG rects decoding at once */
+
+/* A JPEG rect being decoded on a worker thread. */
+typedef struct _TightJpegJob {
+    id				reader;
+    id				frameBuffer;	/* retained until the job is finished */
+    NSRect			rect;
+    unsigned char*	data;			/* from the BufferPool */
+    unsigned		length;
+    BOOL			failed;
+#if SUPPORT_JPEG
+    char			message[128];
+#endif
+} TightJpegJob;
 
 @interface TightEncodingReader : EncodingReader
 {
@@ -52,17 +61,22 @@
     int		pixelBits;
     int		compressedLength;
     int		rowSize;
-    int		rowsDone;
     
     CARD8	cntl;
     BOOL	zStreamActive[NUM_ZSTREAMS];
     z_stream	zStream[NUM_ZSTREAMS];
 
-    id		zBuffer;
-    int		zBufPos;
+    InflateRows_t	zRows;		/* rows of the rect being inflated */
+    unsigned char*	zWindow;	/* inflated rows waiting to be filtered */
     id		connection;
-#ifdef SUPPORT_JPEG
-	struct 	jpeg_source_mgr jpegSrcManager;
+    TightJpegJob	jpegJobs[TIGHT_MAX_JPEG_JOBS];	/* JPEG rects decoding on worker threads */
+    unsigned		jpegJobCount;
+    dispatch_group_t	jpegGroup;
+    BOOL			jpegRectPending;	/* the current rect is one of the jobs */
+#if SUPPORT_JPEG
+    TightJpeg_t*	jpegDecoders[TIGHT_MAX_JPEG_JOBS];	/* idle decoders, reused by the jobs */
+    unsigned		jpegDecoderCount;
+    pthread_mutex_t	jpegDecoderLock;
 #endif
 }
 
@@ -26,43 +26,21 @@
 #import "CARD8Reader.h"
 #import "ByteBlockReader.h"
 #import "RFBConnection.h"
+#import "BufferPool.h"
 
-#ifdef SUPPORT_JPEG
-
-static void JpegInitSource(j_decompress_ptr cinfo)
-{
-}
-
-static boolean JpegFillInputBuffer(j_decompress_ptr cinfo)
-{
-	return YES;
-}
-
-static void JpegSkipInputData(j_decompress_ptr cinfo, long num_bytes)
-{
-	if (num_bytes > 0 && num_bytes <= cinfo->src->bytes_in_buffer) {
-		cinfo->src->next_input_byte += (size_t) num_bytes;
-		cinfo->src->bytes_in_buffer -= (size_t) num_bytes;
-	}
-}
+@interface TightEncodingReader ()
+- (void)queueJpegData:(NSData*)data;
+- (BOOL)decodeJpegJob:(TightJpegJob*)job;
+@end
 
-static void JpegTermSource(j_decompress_ptr cinfo)
+/* Runs on a worker thread. */
+static void DecodeJpegJob(void* context)
 {
-}
+    TightJpegJob* job = (TightJpegJob*)context;
 
-static void JpegSetSrcManager(j_decompress_ptr cinfo, CARD8* compressedData, int compressedLen)
-{
-	cinfo->src->init_source = JpegInitSource;
-	cinfo->src->fill_input_buffer = JpegFillInputBuffer;
-	cinfo->src->skip_input_data = JpegSkipInputData;
-	cinfo->src->resync_to_restart = jpeg_resync_to_restart;
-	cinfo->src->term_source = JpegTermSource;
-	cinfo->src->next_input_byte = compressedData;
-	cinfo->src->bytes_in_buffer = compressedLen;
+    job->failed = ![job->reader decodeJpegJob:job];
 }
 
-#endif
-
 @implementation TightEncodingReader
 
 - (id)initTarget:(id)aTarget action:(SEL)anAction
@@ -77,8 +55,11 @@ static void JpegSetSrcManager(j_decompress_ptr cinfo, CARD8* compressedData, int
 		copyFilter = [[CopyFilter alloc] initTarget:self action:@selector(filterInitDone:)];
 		paletteFilter = [[PaletteFilter alloc] initTarget:self action:@selector(filterInitDone:)];
 		gradientFilter = [[GradientFilter alloc] initTarget:self action:@selector(filterInitDone:)];
-		zBuffer = [[NSMutableData alloc] initWithLength:Z_BUFSIZE];
 		connection = [aTarget topTarget];
+		jpegGroup = dispatch_group_create();
+#if SUPPORT_JPEG
+		pthread_mutex_init(&jpegDecoderLock, NULL);
+#endif
 	}
     return self;
 }
@@ -86,7 +67,14 @@ static void JpegSetSrcManager(j_decompress_ptr cinfo, CARD8* compressedData, int
 - (void)dealloc
 {
     int streamID;
+    unsigned i;
 
+    dispatch_group_wait(jpegGroup, DISPATCH_TIME_FOREVER);
+    for(i=0; i<jpegJobCount; i++) {
+        [[BufferPool sharedPool] releaseBuffer:jpegJobs[i].data];
+        [jpegJobs[i].frameBuffer release];
+    }
+    dispatch_release(jpegGroup);
     for(streamID=0; streamID<NUM_ZSTREAMS; streamID++) {
 		[self uninitializeStream: streamID];
     }
@@ -99,12 +87,20 @@ static void JpegSetSrcManager(j_decompress_ptr cinfo, CARD8* compressedData, int
     [copyFilter release];
     [paletteFilter release];
     [gradientFilter release];
-    [zBuffer release];
+    [[BufferPool sharedPool] releaseBuffer:zWindow];
+#if SUPPORT_JPEG
+    for(i=0; i<jpegDecoderCount; i++) {
+        TightJpegDestroy(jpegDecoders[i]);
+    }
+    pthread_mutex_destroy(&jpegDecoderLock);
+#endif
     [super dealloc];
 }
 
 - (void)setFrameBuffer:(id)aBuffer
 {
+    /* Pending JPEG rects belong to the old buffer. */
+    [self finishPendingRects];
     [super setFrameBuffer:aBuffer];
     [backPixReader setBufferSize:[aBuffer tightBytesPerPixel]];
     [copyFilter setFrameBuffer:aBuffer];
@@ -125,6 +121,7 @@ static void JpegSetSrcManager(j_decompress_ptr cinfo, CARD8* compressedData, int
     int streamId;
     
     cntl = [cntlByte unsignedCharValue];
+    jpegRectPending = NO;
     for(streamId=0; streamId<NUM_ZSTREAMS; streamId++) {
         if((cntl & 0x01)) {
 			[self uninitializeStream: streamId];
@@ -194,7 +191,6 @@ static void JpegSetSrcManager(j_decompress_ptr cinfo, CARD8* compressedData, int
         @throw [NSException exceptionWithName:kRFBConnectionException reason:@"Tight encoding: palette with length 0 received\n" userInfo:nil];
     }
     rowSize = (frame.size.width * pixelBits + 7) / 8;
-	NSParameterAssert( rowSize <= Z_BUFSIZE );
     size = rowSize * frame.size.height;
     if(size < TIGHT_MIN_TO_COMPRESS) {
         [unzippedDataReader setBufferSize:size];
@@ -209,8 +205,7 @@ static void JpegSetSrcManager(j_decompress_ptr cinfo, CARD8* compressedData, int
 #ifdef COLLECT_STATS
     bytesTransferred += [data length];
 #endif
-    data = [currentFilter filter:data rows:frame.size.height];
-    [frameBuffer putRect:frame fromTightData:(unsigned char*)[data bytes]];
+    [currentFilter drawRows:(unsigned char*)[data bytes] count:frame.size.height at:frame];
     [target performSelector:action withObject:self];
 }
 
@@ -255,20 +250,54 @@ static void JpegSetSrcManager(j_decompress_ptr cinfo, CARD8* compressedData, int
         zStreamActive[streamId] = YES;
 	}
     compressedLength = [zl unsignedIntValue];
-    zBufPos = 0;
-    rowsDone = 0;
-    [zippedDataReader setBufferSize:MIN(compressedLength, Z_BUFSIZE)];
-    [target setReader:zippedDataReader];
+
+    // The window holds at least one row, however wide the rect is.
+    if ((size_t)MAX(rowSize, TIGHT_BUFSIZE) > [[BufferPool sharedPool] capacityOfBuffer:zWindow]) {
+        [[BufferPool sharedPool] releaseBuffer:zWindow];
+        zWindow = [[BufferPool sharedPool] acquireBufferWithLength:MAX(rowSize, TIGHT_BUFSIZE) options:kBufferOptionAllocate];
+    }
+    InflateRowsBegin(&zRows, stream, rowSize, frame.size.height, zWindow,
+                     [[BufferPool sharedPool] capacityOfBuffer:zWindow], NULL, 0);
+    [target setReaderWithoutReset:self];
 }
 
-- (void)setZippedData:(NSData*)data
+/* Filters rows as soon as they have been inflated and draws them. */
+static void DrawRows(void* context, const uint8_t* rows, unsigned firstRow, unsigned count)
+{
+    TightEncodingReader* reader = (TightEncodingReader*)context;
+    NSRect r = reader->frame;
+
+    r.origin.y += firstRow;
+    r.size.height = count;
+    [reader->currentFilter drawRows:rows count:count at:r];
+}
+
+/* Compressed rect data is inflated as it arrives. */
+- (unsigned)readBytes:(unsigned char*)theBytes length:(unsigned)aLength
 {
-    NSData* filtered;
-    int numRows, error;
-    z_stream* stream;
-    NSRect r;
-	
+    unsigned length = MIN(aLength, (unsigned)compressedLength);
+    int error;
 
+#ifdef COLLECT_STATS
+    bytesTransferred += length;
+#endif
+    error = InflateRowsInput(&zRows, theBytes, length, DrawRows, self);
+    if ((error != Z_OK) && (error != Z_BUF_ERROR)) {	/* Input exhausted -- no problem. */
+        if(zRows.stream->msg != NULL) {
+            @throw [NSException exceptionWithName:kRFBConnectionException reason:[NSString stringWithFormat:@"Inflate error: %s.\n", zRows.stream->msg] userInfo:nil];
+        } else {
+            @throw [NSException exceptionWithName:kRFBConnectionException reason:@"Inflate error\n" userInfo:nil];
+        }
+    }
+    if ((compressedLength -= length) == 0) {
+        [target performSelector:action withObject:self];
+    }
+    return length;
+}
+
+/* Only JPEG data is collected in full; zlib data is inflated as it arrives by -readBytes:length:. */
+- (void)setZippedData:(NSData*)data
+{
 #ifdef ZDEBUG
 	fwrite([data bytes], 1, [data length], debugFiles[cntl & 3]);
 	fflush(debugFiles[cntl & 3]);
@@ -277,110 +306,14 @@ static void JpegSetSrcManager(j_decompress_ptr cinfo, CARD8* compressedData, int
 #ifdef COLLECT_STATS
     bytesTransferred += [data length];
 #endif
-#if SUPPORT_JPEG
+#if APPLE_JPEG || SUPPORT_JPEG
 	if(cntl == rfbTightJpeg) {
-		struct jpeg_decompress_struct cinfo;
-		struct jpeg_error_mgr jerr;
-		JSAMPROW rowPointer[1];
-		unsigned char* buffer;
-		NSRect r;
-
-		cinfo.err = jpeg_std_error(&jerr);
-		jpeg_create_decompress(&cinfo);
-		cinfo.src = &jpegSrcManager;
-		JpegSetSrcManager(&cinfo, (char*)[data bytes], [data length]);
-		jpeg_read_header(&cinfo, TRUE);
-		cinfo.out_color_space = JCS_RGB;
-		jpeg_start_decompress(&cinfo);
-		if(cinfo.output_width != frame.size.width || cinfo.output_height != frame.size.height || cinfo.output_components != 3) {
-			jpeg_destroy_decompress(&cinfo);
-            @throw [NSException exceptionWithName:kRFBConnectionException reason:[NSString stringWithFormat:@"Tight Encoding: Wrong JPEG data received.\n"] userInfo:nil];
-		}
-		buffer = malloc(3 * frame.size.width);
-		rowPointer[0] = (JSAMPROW)buffer;
-		r = frame;
-		r.size.height = 1;
-		while(cinfo.output_scanline < cinfo.output_height) {
-			jpeg_read_scanlines(&cinfo, rowPointer, 1);
-			[frameBuffer putRect:r fromRGBBytes:buffer];
-			r.origin.y += 1;
-		}
-		free(buffer);
-		jpeg_finish_decompress(&cinfo);
-		jpeg_destroy_decompress(&cinfo);
+		[self queueJpegData:data];
         [target performSelector:action withObject:self];
 		return;
 	}
-#else
-    if (cntl == rfbTightJpeg)
-    {
-        // Create the JPEG image.
-        CGDataProviderRef provider = CGDataProviderCreateWithCFData((CFDataRef)data);
-        CGImageRef image = CGImageCreateWithJPEGDataProvider(provider, NULL, false, kCGRenderingIntentDefault);
-        CFRelease(provider);
-        
-        // Create a bitmap context.
-        size_t bytesPerRow = (int)frame.size.width * sizeof(uint32_t);
-        void * bitmapBuffer = malloc(bytesPerRow * (int)frame.size.height);
-        CGColorSpaceRef space = CGColorSpaceCreateDeviceRGB();
-        CGContextRef context = CGBitmapContextCreate(bitmapBuffer, frame.size.width, frame.size.height, 8, bytesPerRow, space, kCGImageAlphaNoneSkipFirst);
-        CFRelease(space);
-        
-        // Draw the JPEG into the bitmap context.
-        CGRect r;
-        r.origin.x = 0;
-        r.origin.y = 0;
-        r.size.width = frame.size.width;
-        r.size.height = frame.size.height;
-        CGContextDrawImage(context, r, image);
-        
-        // Draw the image into the frame buffer.
-        [frameBuffer putRect:frame fromARGBBytes:bitmapBuffer];
-        
-        // Release everything.
-        CFRelease(context);
-        CFRelease(image);
-        free(bitmapBuffer);
-        
-        [target performSelector:action withObject:self];
-        return;
-    }
 #endif
-    stream = zStream + (cntl & 0x03);
-    stream->next_in = (unsigned char*)[data bytes];
-    stream->avail_in = [data length];
-    do {
-        stream->next_out = [zBuffer mutableBytes] + zBufPos;
-        stream->avail_out = Z_BUFSIZE - zBufPos;
-        error = inflate(stream, Z_SYNC_FLUSH);
-		if (error == Z_BUF_ERROR)   /* Input exhausted -- no problem. */
-			break;
-        if((error != Z_OK) && (error != Z_STREAM_END)) {
-            if(stream->msg != NULL) {
-                @throw [NSException exceptionWithName:kRFBConnectionException reason:[NSString stringWithFormat:@"Inflate error: %s.\n", stream->msg] userInfo:nil];
-            } else {
-                @throw [NSException exceptionWithName:kRFBConnectionException reason:@"Inflate error\n" userInfo:nil];
-            }
-        }
-        numRows = (Z_BUFSIZE - stream->avail_out) / rowSize;
-        filtered = [currentFilter filter:zBuffer rows:numRows];
-        r = frame;
-        r.origin.y += rowsDone;
-        r.size.height = numRows;
-        [frameBuffer putRect:r fromTightData:(unsigned char*)[filtered bytes]];
-        rowsDone += numRows;
-        zBufPos = Z_BUFSIZE - stream->avail_out - numRows * rowSize;
-        if(zBufPos > 0) {
-            char* z = [zBuffer mutableBytes];
-            memcpy(z, z + numRows * rowSize, zBufPos);
-        }
-    } while(stream->avail_out == 0);
-    if((compressedLength -= [data length]) > 0) {
-        [zippedDataReader setBufferSize:MIN(compressedLength, Z_BUFSIZE)];
-        [target setReader:zippedDataReader];
-    } else {
-        [target performSelector:action withObject:self];
-    }
+    @throw [NSException exceptionWithName:kRFBConnectionException reason:@"Tight encoding: unexpected compressed data.\n" userInfo:nil];
 }
 
 - (void)uninitializeStream: (int)streamID {
@@ -392,4 +325,141 @@ static void JpegSetSrcManager(j_decompress_ptr cinfo, CARD8* compressedData, int
 	}
 }
 
+/* JPEG rects share no state with each other or with the zlib streams, so they are decoded on
+   worker threads while the rest of the update is read. */
+- (void)queueJpegData:(NSData*)data
+{
+    TightJpegJob*	job;
+    unsigned char*	copy;
+
+    if(jpegJobCount == TIGHT_MAX_JPEG_JOBS) {
+        [self finishPendingRects];
+    }
+    copy = [[BufferPool sharedPool] acquireBufferWithLength:[data length] options:kBufferOptionAllocate];
+    if(copy == NULL) {
+        @throw [NSException exceptionWithName:kRFBConnectionException reason:@"Tight Encoding: out of memory for JPEG data.\n" userInfo:nil];
+    }
+    memcpy(copy, [data bytes], [data length]);
+    job = jpegJobs + jpegJobCount++;
+    job->reader = self;
+    job->frameBuffer = [frameBuffer retain];
+    job->rect = frame;
+    job->data = copy;
+    job->length = [data length];
+    job->failed = NO;
+    jpegRectPending = YES;
+    dispatch_group_async_f(jpegGroup, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), job, DecodeJpegJob);
+}
+
+#if SUPPORT_JPEG
+- (BOOL)decodeJpegJob:(TightJpegJob*)job
+{
+    TightJpeg_t*	decoder = NULL;
+    BOOL			ok;
+
+    /* Each decoder is used by one job at a time, so no more are created than run at once. */
+    pthread_mutex_lock(&jpegDecoderLock);
+    if(jpegDecoderCount) {
+        decoder = jpegDecoders[--jpegDecoderCount];
+    }
+    pthread_mutex_unlock(&jpegDecoderLock);
+    if(decoder == NULL && (decoder = TightJpegCreate()) == NULL) {
+        snprintf(job->message, sizeof(job->message), "cannot set up the JPEG decoder");
+        return NO;
+    }
+    ok = [job->frameBuffer putRect:job->rect fromJpeg:decoder data:job->data length:job->length];
+    if(!ok) {
+        snprintf(job->message, sizeof(job->message), "%s", TightJpegErrorMessage(decoder));
+    }
+    pthread_mutex_lock(&jpegDecoderLock);
+    jpegDecoders[jpegDecoderCount++] = decoder;
+    pthread_mutex_unlock(&jpegDecoderLock);
+    return ok;
+}
+#else
+- (BOOL)decodeJpegJob:(TightJpegJob*)job
+{
+    NSRect frameRect = job->rect;
+
+    // Create the JPEG image.
+    CGDataProviderRef provider = CGDataProviderCreateWithData(NULL, job->data, job->length, NULL);
+    CGImageRef image = CGImageCreateWithJPEGDataProvider(provider, NULL, false, kCGRenderingIntentDefault);
+    CFRelease(provider);
+    if (image == NULL)
+        return NO;
+
+    // Create a bitmap context.
+    size_t bytesPerRow = (int)frameRect.size.width * sizeof(uint32_t);
+    void * bitmapBuffer = malloc(bytesPerRow * (int)frameRect.size.height);
+    CGColorSpaceRef space = CGColorSpaceCreateDeviceRGB();
+    CGContextRef context = CGBitmapContextCreate(bitmapBuffer, frameRect.size.width, frameRect.size.height, 8, bytesPerRow, space, kCGImageAlphaNoneSkipFirst);
+    CFRelease(space);
+
+    // Draw the JPEG into the bitmap context.
+    CGRect r;
+    r.origin.x = 0;
+    r.origin.y = 0;
+    r.size.width = frameRect.size.width;
+    r.size.height = frameRect.size.height;
+    CGContextDrawImage(context, r, image);
+
+    // Draw the image into the frame buffer.
+    [job->frameBuffer putRect:frameRect fromARGBBytes:bitmapBuffer];
+
+    // Release everything.
+    CFRelease(context);
+    CFRelease(image);
+    free(bitmapBuffer);
+    return YES;
+}
+#endif
+
+/* JPEG rects are the only ones that are ever pending. */
+- (void)finishPendingRects
+{
+    NSString*	failure = nil;
+    unsigned	i;
+
+    if(jpegJobCount == 0) {
+        return;
+    }
+    dispatch_group_wait(jpegGroup, DISPATCH_TIME_FOREVER);
+    for(i=0; i<jpegJobCount; i++) {
+        TightJpegJob* job = jpegJobs + i;
+
+        if(!job->failed) {
+            [connection drawRectFromBuffer:job->rect];
+        } else if(failure == nil) {
+#if SUPPORT_JPEG
+            failure = [NSString stringWithFormat:@"Tight Encoding: Wrong JPEG data received (%s).\n", job->message];
+#else
+            failure = @"Tight Encoding: Wrong JPEG data received.\n";
+#endif
+        }
+        [[BufferPool sharedPool] releaseBuffer:job->data];
+        [job->frameBuffer release];
+    }
+    jpegJobCount = 0;
+    if(failure) {
+        @throw [NSException exceptionWithName:kRFBConnectionException reason:failure userInfo:nil];
+    }
+}
+
+- (void)finishPendingRectsIntersecting:(NSRect)aRect
+{
+    unsigned i;
+
+    for(i=0; i<jpegJobCount; i++) {
+        if(NSIntersectsRect(jpegJobs[i].rect, aRect)) {
+            [self finishPendingRects];
+            return;
+        }
+    }
+}
+
+- (BOOL)isRectanglePending
+{
+    return jpegRectPending;
+}
+
 @end
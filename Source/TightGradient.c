@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "TightGradient.h"
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define TIGHT_GRADIENT_X86 1
+#include <emmintrin.h>
+#endif
+
+int TightGradientCanDecode(const rfbPixelFormat * format, unsigned bytesPerPixel)
+{
+    unsigned shifts = (1u << format->redShift) | (1u << format->greenShift) | (1u << format->blueShift);
+
+    return bytesPerPixel == 3
+        && format->redMax == 255 && format->greenMax == 255 && format->blueMax == 255
+        && format->redShift <= 16 && format->greenShift <= 16 && format->blueShift <= 16
+        && shifts == ((1u << 0) | (1u << 8) | (1u << 16));
+}
+
+#if TIGHT_GRADIENT_X86
+
+//! The predictor is serial along the row, so the three channels of a pixel are worked on
+//! together in 16-bit lanes, which also makes clamping a min and a max.
+__attribute__((target("sse2")))
+void TightGradientDecodeRow(const uint8_t * source, uint8_t * row, unsigned width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    __m128i left = zero;        // This row's previous pixel.
+    __m128i aboveLeft = zero;   // The previous row's previous pixel.
+    uint32_t word, next, delta;
+    unsigned x;
+
+    // Words are read and written whole; the row buffer is long enough for that. The fourth
+    // byte of each word belongs to the next pixel of the previous row and is written back
+    // unchanged. Each word is loaded before the previous pixel is stored over part of it, so
+    // loads never wait on a store.
+    memcpy(&word, row, 4);
+    __m128i above = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)word), zero);
+    for (x = 0; x < width; ++x)
+    {
+        memcpy(&next, row + 3, 4);
+        if (x + 1 < width)
+        {
+            memcpy(&delta, source, 4);
+        }
+        else
+        {
+            delta = source[0] | (source[1] << 8) | ((uint32_t)source[2] << 16);
+        }
+
+        __m128i estimate = _mm_sub_epi16(_mm_add_epi16(above, left), aboveLeft);
+        estimate = _mm_min_epi16(_mm_max_epi16(estimate, zero), max);
+        __m128i pixel = _mm_add_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)delta), zero), estimate);
+        pixel = _mm_and_si128(pixel, max);
+
+        uint32_t packed = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(pixel, zero));
+        word = (packed & 0x00ffffff) | (word & 0xff000000);
+        memcpy(row, &word, 4);
+
+        aboveLeft = above;
+        above = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)next), zero);
+        left = pixel;
+        word = next;
+        row += 3;
+        source += 3;
+    }
+}
+
+#else
+
+static inline int Clamp(int value)
+{
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+void TightGradientDecodeRow(const uint8_t * source, uint8_t * row, unsigned width)
+{
+    int left[3] = { 0, 0, 0 };
+    int aboveLeft[3] = { 0, 0, 0 };
+    unsigned x, c;
+
+    for (x = 0; x < width; ++x)
+    {
+        for (c = 0; c < 3; ++c)
+        {
+            int above = row[c];
+            left[c] = (source[c] + Clamp(above + left[c] - aboveLeft[c])) & 255;
+            aboveLeft[c] = above;
+            row[c] = (uint8_t)left[c];
+        }
+        row += 3;
+        source += 3;
+    }
+}
+
+#endif // TIGHT_GRADIENT_X86
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#if !defined(_TightGradient_h_)
+#define _TightGradient_h_
+
+#include <stdint.h>
+#include "rfbproto.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @file TightGradient.h
+ * @brief Fused decoder for rows sent with the Tight gradient filter.
+ *
+ * When every channel of a Tight pixel is a whole byte, the gradient predictor can work on the
+ * bytes as they arrive instead of splitting pixels into channel values and combining them
+ * again. Each row is reconstructed in place over the previous one, so the only state is one
+ * row of pixels.
+ */
+
+//! @brief Whether rows of @a bytesPerPixel byte Tight pixels in @a format can be decoded by
+//!     TightGradientDecodeRow().
+int TightGradientCanDecode(const rfbPixelFormat * format, unsigned bytesPerPixel);
+
+//! @brief Number of bytes the row buffer must have for a row of @a width pixels.
+//!
+//! The decoder writes whole words, so the buffer is a little longer than the row.
+static inline unsigned TightGradientRowBufferSize(unsigned width)
+{
+    return width * 3 + 4;
+}
+
+//! @brief Reconstruct one row of 3-byte Tight pixels.
+//!
+//! @param source Filtered row as sent by the server.
+//! @param row On entry the previous row, all zero for the first row of a rect. On return the
+//!     reconstructed pixels of this row.
+void TightGradientDecodeRow(const uint8_t * source, uint8_t * row, unsigned width);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _TightGradient_h_
@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "TightJpeg.h"
+
+#if SUPPORT_JPEG
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+
+#if !defined(JCS_EXTENSIONS)
+#error libjpeg-turbo is required for SUPPORT_JPEG
+#endif
+
+//! Most rows libjpeg returns at once, for the largest vertical sampling factor.
+#define kMaxRows 4
+
+struct _TightJpeg
+{
+    struct jpeg_decompress_struct decompress;
+    struct jpeg_error_mgr errorManager;
+    struct jpeg_source_mgr source;
+    jmp_buf errorJump;                  //!< Where libjpeg errors return to.
+    char message[JMSG_LENGTH_MAX];
+    uint8_t * rows;                     //!< Decoded rows waiting to be converted.
+    size_t rowsCapacity;
+};
+
+//! libjpeg output colour space and pixel format channel shifts, as a little endian 32-bit
+//! pixel, of each layout.
+static const struct
+{
+    J_COLOR_SPACE colorSpace;
+    unsigned redShift, greenShift, blueShift;
+} kLayouts[] = {
+    [kTightJpegRGBX] = { JCS_EXT_RGBX, 0, 8, 16 },
+    [kTightJpegBGRX] = { JCS_EXT_BGRX, 16, 8, 0 },
+    [kTightJpegXRGB] = { JCS_EXT_XRGB, 8, 16, 24 },
+    [kTightJpegXBGR] = { JCS_EXT_XBGR, 24, 16, 8 },
+};
+
+int TightJpegConverterInit(PixelConverter_t * converter, TightJpegLayout * layout, const unsigned int * redClut, const unsigned int * greenClut, const unsigned int * blueClut, unsigned destBytes)
+{
+    rfbPixelFormat format;
+    unsigned n;
+
+    memset(&format, 0, sizeof(format));
+    format.bitsPerPixel = 32;
+    format.depth = 24;
+    format.trueColour = 1;
+    format.redMax = format.greenMax = format.blueMax = 255;
+    for (n = 0; n < sizeof(kLayouts) / sizeof(kLayouts[0]); ++n)
+    {
+        format.redShift = kLayouts[n].redShift;
+        format.greenShift = kLayouts[n].greenShift;
+        format.blueShift = kLayouts[n].blueShift;
+        if (PixelConverterInit(converter, &format, 4, 0, redClut, greenClut, blueClut, destBytes) < 0)
+        {
+            return -1;
+        }
+        if (PixelConverterIsCopy(converter))
+        {
+            *layout = (TightJpegLayout)n;
+            return 0;
+        }
+        PixelConverterFree(converter);
+    }
+
+    // No layout matches the framebuffer, so convert from the first.
+    format.redShift = kLayouts[kTightJpegRGBX].redShift;
+    format.greenShift = kLayouts[kTightJpegRGBX].greenShift;
+    format.blueShift = kLayouts[kTightJpegRGBX].blueShift;
+    *layout = kTightJpegRGBX;
+    return PixelConverterInit(converter, &format, 4, 0, redClut, greenClut, blueClut, destBytes);
+}
+
+//! Return to TightJpegDecode() instead of exiting, which is libjpeg's default.
+static void ErrorExit(j_common_ptr info)
+{
+    TightJpeg_t * decoder = info->client_data;
+
+    info->err->format_message(info, decoder->message);
+    longjmp(decoder->errorJump, 1);
+}
+
+//! Warnings about corrupt data are not worth printing; the rect is drawn as well as it can be.
+static void OutputMessage(j_common_ptr info)
+{
+    (void)info;
+}
+
+static void InitSource(j_decompress_ptr info)
+{
+    (void)info;
+}
+
+//! The whole rect is in memory, so running out of data means it is truncated. Finish the
+//! image with an end of image marker, as libjpeg's own memory source does.
+static boolean FillInputBuffer(j_decompress_ptr info)
+{
+    static const JOCTET kEndOfImage[2] = { 0xff, JPEG_EOI };
+
+    info->src->next_input_byte = kEndOfImage;
+    info->src->bytes_in_buffer = sizeof(kEndOfImage);
+    return TRUE;
+}
+
+static void SkipInputData(j_decompress_ptr info, long count)
+{
+    struct jpeg_source_mgr * source = info->src;
+
+    if (count <= 0)
+    {
+        return;
+    }
+    if ((size_t)count > source->bytes_in_buffer)
+    {
+        count = (long)source->bytes_in_buffer;
+    }
+    source->next_input_byte += count;
+    source->bytes_in_buffer -= count;
+}
+
+static void TermSource(j_decompress_ptr info)
+{
+    (void)info;
+}
+
+TightJpeg_t * TightJpegCreate(void)
+{
+    TightJpeg_t * volatile decoder = calloc(1, sizeof(TightJpeg_t));
+
+    if (!decoder)
+    {
+        return NULL;
+    }
+    decoder->decompress.err = jpeg_std_error(&decoder->errorManager);
+    decoder->errorManager.error_exit = ErrorExit;
+    decoder->errorManager.output_message = OutputMessage;
+    decoder->decompress.client_data = decoder;
+    if (setjmp(decoder->errorJump))
+    {
+        free(decoder);
+        return NULL;
+    }
+    jpeg_create_decompress(&decoder->decompress);
+
+    decoder->source.init_source = InitSource;
+    decoder->source.fill_input_buffer = FillInputBuffer;
+    decoder->source.skip_input_data = SkipInputData;
+    decoder->source.resync_to_restart = jpeg_resync_to_restart;
+    decoder->source.term_source = TermSource;
+    decoder->decompress.src = &decoder->source;
+    return decoder;
+}
+
+void TightJpegDestroy(TightJpeg_t * decoder)
+{
+    if (!decoder)
+    {
+        return;
+    }
+    jpeg_destroy_decompress(&decoder->decompress);
+    free(decoder->rows);
+    free(decoder);
+}
+
+int TightJpegDecode(TightJpeg_t * decoder, const uint8_t * data, size_t length, unsigned width, unsigned height, TightJpegLayout layout, const PixelConverter_t * converter, void * dest, size_t rowBytes)
+{
+    struct jpeg_decompress_struct * info = &decoder->decompress;
+    JSAMPROW rowPointers[kMaxRows];
+    size_t decodedBytes = (size_t)width * 4;
+
+    if (setjmp(decoder->errorJump))
+    {
+        jpeg_abort_decompress(info);
+        return -1;
+    }
+    decoder->source.next_input_byte = data;
+    decoder->source.bytes_in_buffer = length;
+    jpeg_read_header(info, TRUE);
+    info->out_color_space = kLayouts[layout].colorSpace;
+    jpeg_start_decompress(info);
+    if (info->output_width != width || info->output_height != height)
+    {
+        snprintf(decoder->message, sizeof(decoder->message), "image is %ux%u, rect is %ux%u",
+                 (unsigned)info->output_width, (unsigned)info->output_height, width, height);
+        jpeg_abort_decompress(info);
+        return -1;
+    }
+
+    unsigned batch = info->rec_outbuf_height < kMaxRows ? (unsigned)info->rec_outbuf_height : kMaxRows;
+    if (converter && decodedBytes * batch > decoder->rowsCapacity)
+    {
+        free(decoder->rows);
+        decoder->rowsCapacity = decodedBytes * batch;
+        decoder->rows = malloc(decoder->rowsCapacity);
+        if (!decoder->rows)
+        {
+            decoder->rowsCapacity = 0;
+            snprintf(decoder->message, sizeof(decoder->message), "out of memory");
+            jpeg_abort_decompress(info);
+            return -1;
+        }
+    }
+
+    while (info->output_scanline < height)
+    {
+        unsigned first = info->output_scanline;
+        unsigned count = height - first < batch ? height - first : batch;
+        unsigned n;
+
+        for (n = 0; n < count; ++n)
+        {
+            rowPointers[n] = converter ? decoder->rows + n * decodedBytes : (uint8_t *)dest + (first + n) * rowBytes;
+        }
+        count = jpeg_read_scanlines(info, rowPointers, count);
+        if (converter)
+        {
+            for (n = 0; n < count; ++n)
+            {
+                PixelConverterConvertRow(converter, rowPointers[n], (uint8_t *)dest + (first + n) * rowBytes, width);
+            }
+        }
+    }
+    jpeg_finish_decompress(info);
+    return 0;
+}
+
+const char * TightJpegErrorMessage(const TightJpeg_t * decoder)
+{
+    return decoder->message;
+}
+
+#endif // SUPPORT_JPEG
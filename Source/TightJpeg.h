@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#if !defined(_TightJpeg_h_)
+#define _TightJpeg_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "PixelConverter.h"
+
+//! Set to 1 to decode Tight JPEG rects with libjpeg-turbo instead of Core Graphics. The
+//! libjpeg-turbo headers must then be on the header search path.
+#if !defined(SUPPORT_JPEG)
+#define SUPPORT_JPEG 0
+#endif
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @file TightJpeg.h
+ * @brief Decodes Tight JPEG rects with libjpeg-turbo straight into the framebuffer.
+ *
+ * One decoder is kept per connection and reused for every rect, instead of setting up and
+ * tearing down libjpeg for each one. libjpeg-turbo writes 32-bit pixels with the channels in
+ * any byte order, so the framebuffer picks the order matching its own colours and rows are
+ * decoded in place. Framebuffers whose colours cannot be matched, because of their depth or
+ * gamma correction, have each row converted through a pixel converter instead.
+ */
+
+//! @brief Byte order of the 32-bit pixels libjpeg-turbo writes. X is always 0xff.
+typedef enum _TightJpegLayout
+{
+    kTightJpegRGBX,
+    kTightJpegBGRX,
+    kTightJpegXRGB,
+    kTightJpegXBGR
+} TightJpegLayout;
+
+//! @brief Decoder state. Opaque.
+typedef struct _TightJpeg TightJpeg_t;
+
+//! @brief Set up the converter from decoded pixels to framebuffer colours.
+//!
+//! Picks the layout for which the converter is a plain copy if there is one, so rows can be
+//! decoded in place, or RGBX otherwise. The colour tables are indexed by 8-bit channel values.
+//!
+//! @param layout Receives the layout to decode to.
+//! @return 0 on success, or -1 as for PixelConverterInit().
+int TightJpegConverterInit(PixelConverter_t * converter, TightJpegLayout * layout, const unsigned int * redClut, const unsigned int * greenClut, const unsigned int * blueClut, unsigned destBytes);
+
+//! @brief Create a decoder.
+//! @return The decoder, or NULL if there was not enough memory.
+TightJpeg_t * TightJpegCreate(void);
+
+//! @brief Release a decoder. NULL is ignored.
+void TightJpegDestroy(TightJpeg_t * decoder);
+
+//! @brief Decode one rect.
+//!
+//! @param layout Layout chosen by TightJpegConverterInit().
+//! @param converter Converter for each decoded row, or NULL to decode in place, in which case
+//!     the framebuffer colours must be laid out as @a layout.
+//! @param dest First framebuffer colour of the rect.
+//! @param rowBytes Distance between framebuffer rows, in bytes.
+//! @return 0 on success, or -1 if the data is not a JPEG image of @a width by @a height pixels.
+//!     The rect may then be partly drawn.
+int TightJpegDecode(TightJpeg_t * decoder, const uint8_t * data, size_t length, unsigned width, unsigned height, TightJpegLayout layout, const PixelConverter_t * converter, void * dest, size_t rowBytes);
+
+//! @brief Description of the last decoding error.
+const char * TightJpegErrorMessage(const TightJpeg_t * decoder);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _TightJpeg_h_
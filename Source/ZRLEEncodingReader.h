@@ -7,14 +7,55 @@
 //
 
 #import <Foundation/Foundation.h>
+#import <dispatch/dispatch.h>
 #import "ZlibEncodingreader.h"
 
+enum
+{
+    //! Size of the window tiles are inflated into. It holds a few of the largest tiles.
+    kZRLEWindowSize = 64*1024,
+    //! Size of a batch of tiles handed to a worker, header included.
+    kZRLEBatchSize = 64*1024,
+    //! Most tiles in one batch.
+    kZRLEBatchTiles = 32,
+    //! Rects with fewer tiles than this are drawn on the reading thread.
+    kZRLEParallelMinTiles = 16,
+    //! Most rects whose tiles may still be drawing.
+    kZRLEMaxPendingRects = 64
+};
+
+//! Tiles copied out of the window for a worker to draw. Lives in a BufferPool buffer.
+typedef struct _ZRLEBatch {
+	id				frameBuffer;
+	dispatch_semaphore_t	slots;	//!< Signalled once the batch is drawn.
+	unsigned		tileCount;
+	unsigned		length;			//!< Bytes of tile data.
+	NSRect			tiles[kZRLEBatchTiles];
+	unsigned char	data[];			//!< The tiles' bytes, one after the other.
+} ZRLEBatch_t;
+
+//! ZRLE rects are inflated into a small window as the compressed bytes arrive, and each
+//! 64x64 tile is drawn as soon as all of its bytes are in the window. Memory stays at the
+//! window size however big the rect is.
+//!
+//! Only the inflate is serial. In big rects the tiles are copied out of the window in batches
+//! and drawn by worker threads while the reading goes on; such a rect is pending until
+//! -finishPendingRects has waited for its tiles.
 @interface ZRLEEncodingReader : ZlibEncodingReader
 {
+	unsigned char*	window;
+	unsigned		windowBytes;	//!< Inflated bytes not yet used by a tile.
 	NSRect tile;
-	FrameBufferColor	palette[128];
-}
 
-- (void)setUncompressedData:(unsigned char*)data length:(int)length;
+	unsigned		renderThreads;	//!< From the connection when the first rect arrives.
+	dispatch_group_t	renderGroup;	//!< Batches being drawn, or NULL for a single thread.
+	dispatch_semaphore_t	renderSlots;	//!< One per worker, so batches can't pile up.
+	ZRLEBatch_t*	batch;			//!< Tiles not yet handed to a worker.
+	id				renderFrameBuffer;	//!< Retained while batches are being drawn into it.
+	BOOL			parallelRect;	//!< The current rect's tiles go to the workers.
+	BOOL			rectPending;	//!< Some of them have been handed over.
+	NSRect			pendingRects[kZRLEMaxPendingRects];	//!< Rects to display once drawn.
+	unsigned		pendingRectCount;
+}
 
 @end
@@ -8,116 +8,321 @@
 
 #import "ZRLEEncodingReader.h"
 #import "RFBConnection.h"
+#import "BufferPool.h"
+#import "ConnectionMetrics.h"
+#import "ZRLETile.h"
+
+@interface ZRLEEncodingReader ()
+- (void)drawTiles;
+- (unsigned)drawTileFromBytes:(unsigned char*)start length:(unsigned)length;
+- (void)queueTileFromBytes:(unsigned char*)start length:(unsigned)length;
+- (void)dispatchBatch;
+@end
+
+/* Runs on a worker thread. Draws the batch's tiles with ZRLEDrawTile, then gives the batch
+   and its slot back. */
+static void DrawBatch(void* context)
+{
+	ZRLEBatch_t* aBatch = (ZRLEBatch_t*)context;
+	dispatch_semaphore_t slots = aBatch->slots;
+	const unsigned char* data = aBatch->data;
+	const unsigned char* end = data + aBatch->length;
+	unsigned i;
+	int used;
+
+	for (i = 0; i < aBatch->tileCount; ++i)
+	{
+		// The tiles were measured with ZRLETileLength, so each one is whole and valid.
+		used = [aBatch->frameBuffer putZRLETile:aBatch->tiles[i] fromData:data length:end - data];
+		if (used <= 0)
+		{
+			break;
+		}
+		data += used;
+	}
+	[[BufferPool sharedPool] releaseBuffer:(const uint8_t *)aBatch];
+	dispatch_semaphore_signal(slots);
+}
 
 @implementation ZRLEEncodingReader
 
-- (void)setUncompressedData:(unsigned char*)data length:(int)length
+- (void)dealloc
 {
-	int i, y, samples, samplesPerByte, shift;
-	unsigned cPixelSize = [frameBuffer tightBytesPerPixel];
-	
-	// hack around UltraVN 1.0.1, Chicken Bug #1351494
-	if ( 4 == cPixelSize )
-	{
-		[frameBuffer setTightBytesPerPixelOverride: 3];
-		cPixelSize = 3;
-	}
-	
-	unsigned char subEncoding, b;
-	FrameBufferPaletteIndex tileBuffer[rfbZRLETileHeight * rfbZRLETileWidth];
-	FrameBufferPaletteIndex* current, *eol;
-
-	for(tile.origin.y = frame.origin.y; tile.origin.y < frame.origin.y+frame.size.height; tile.origin.y += rfbZRLETileHeight) {
-		tile.size.height = MIN(rfbZRLETileHeight, (frame.origin.y + frame.size.height - tile.origin.y));
-		for(tile.origin.x = frame.origin.x; tile.origin.x < frame.origin.x+frame.size.width; tile.origin.x += rfbZRLETileWidth) {
-			tile.size.width = MIN(rfbZRLETileWidth, (frame.origin.x + frame.size.width - tile.origin.x));
-			subEncoding = *data++;
-//			NSLog(@"Subencoding = %d\n", subEncoding);
-			if(subEncoding == 0) {
-				// raw pixels
-				[frameBuffer putRect:tile fromTightData:data];
-				data += (int)(cPixelSize * tile.size.width * tile.size.height);
-				continue;
-			}
-			if(subEncoding == 1) {
-				[frameBuffer fillRect:tile tightPixel:data];
-				data += cPixelSize;
-				continue;
-			}
-			if(subEncoding <= 16) {
-				unsigned char index = 0;
-				for(i=0; i<subEncoding; i++) {
-					[frameBuffer fillColor:palette + i fromTightPixel:data];
-					data += cPixelSize;
-				}
-				current = tileBuffer;
-				y = tile.size.height;
-				switch(subEncoding - 2) {
-					case 0: samplesPerByte = 8; break;
-					case 1:
-					case 2: samplesPerByte = 4; break;
-					default:samplesPerByte = 2; break;
-				}
-				shift = 8 / samplesPerByte;
-				while(y--) {
-					samples = 0;
-					eol = current + (int)tile.size.width;
-					while(current < eol) {
-						if(samples == 0) {
-							index = *data++;
-							samples = samplesPerByte;
-						}
-						*current++ = index >> (8 - shift);
-						index <<= shift;
-						samples--;
-					}
-				}
-				[frameBuffer putRect:tile withColors:tileBuffer fromPalette:palette];
-				continue;
-			}
-			if(subEncoding == 128) {
-				y = 0;
-				while(y < (tile.size.width * tile.size.height)) {
-					[frameBuffer fillColor:palette fromTightPixel:data];
-					data += cPixelSize;
-					i = 1;
-					do {
-						b = *data++;
-						i += b;
-					} while(b == 0xff);
-					[frameBuffer putRun:palette ofLength:i at:tile pixelOffset:y];
-					y += i;
-				}
-				continue;
-			}
-			if(subEncoding >= 130) {
-				for(i=0; i<(subEncoding - 128); i++) {
-					[frameBuffer fillColor:palette + i fromTightPixel:data];
-					data += cPixelSize;
-				}
-				y = 0;
-				while(y < (tile.size.width * tile.size.height)) {
-					unsigned char index = *data++;
-					if(index < 128) {
-						[frameBuffer putRun:palette + index ofLength:1 at:tile pixelOffset:y];
-						y++;
-						continue;
-					}
-					index &= 0x7f;
-					i = 1;
-					do {
-						b = *data++;
-						i += b;
-					} while(b == 0xff);
-					[frameBuffer putRun:palette + index ofLength:i at:tile pixelOffset:y];
-					y += i;
-				}
-				continue;
+	if (renderGroup)
+	{
+		dispatch_group_wait(renderGroup, DISPATCH_TIME_FOREVER);
+		dispatch_release(renderGroup);
+		dispatch_release(renderSlots);
+	}
+	[[BufferPool sharedPool] releaseBuffer:(const uint8_t *)batch];
+	[renderFrameBuffer release];
+	[[BufferPool sharedPool] releaseBuffer:window];
+    [super dealloc];
+}
+
+- (void)setFrameBuffer:(id)aBuffer
+{
+	// Workers may still be drawing into the old buffer.
+	[self finishPendingRects];
+	[super setFrameBuffer:aBuffer];
+}
+
+//! Tiles are drawn as they are inflated, so nothing is collected here.
+- (void)setNumBytes:(NSNumber*)numBytes
+{
+#ifdef COLLECT_STATS
+	bytesTransferred = 4 + [numBytes unsignedIntValue];
+#endif
+	compressedBytesLeft = [numBytes unsignedIntValue];
+	windowBytes = 0;
+	if (renderThreads == 0)
+	{
+		renderThreads = [connection renderThreads];
+		if (renderThreads > 1)
+		{
+			renderGroup = dispatch_group_create();
+			renderSlots = dispatch_semaphore_create(renderThreads);
+		}
+	}
+	// Handing tiles over costs more than drawing a few of them.
+	unsigned tilesAcross = ((unsigned)frame.size.width + rfbZRLETileWidth - 1) / rfbZRLETileWidth;
+	unsigned tilesDown = ((unsigned)frame.size.height + rfbZRLETileHeight - 1) / rfbZRLETileHeight;
+	parallelRect = renderGroup != NULL && tilesAcross * tilesDown >= kZRLEParallelMinTiles;
+	rectPending = NO;
+	if (batch)
+	{
+		// Left over from a rect that failed.
+		batch->tileCount = 0;
+		batch->length = 0;
+	}
+	tile.origin = frame.origin;
+	if (NSIsEmptyRect(frame))
+	{
+		// No tiles at all.
+		tile.origin.y = NSMaxY(frame);
+	}
+	if (!window)
+	{
+		window = [[BufferPool sharedPool] acquireBufferWithLength:kZRLEWindowSize options:kBufferOptionAllocate];
+	}
+
+	if (compressedBytesLeft == 0)
+	{
+		[target performSelector:action withObject:self];
+		return;
+	}
+	[target setReaderWithoutReset:self];
+}
+
+- (unsigned)readBytes:(unsigned char*)theBytes length:(unsigned)aLength
+{
+	unsigned length = MIN(aLength, compressedBytesLeft);
+
+	stream.next_in = theBytes;
+	stream.avail_in = length;
+	stream.data_type = Z_BINARY;
+
+	// Output left inside zlib when the window filled up is drained even after the input is
+	// used up, so the last tiles aren't held back until the next rect.
+	for (;;)
+	{
+		uInt availableIn = stream.avail_in;
+		unsigned room = kZRLEWindowSize - windowBytes;
+
+		stream.next_out = window + windowBytes;
+		stream.avail_out = room;
+		int inflateResult = inflate(&stream, Z_SYNC_FLUSH);
+		if (inflateResult == Z_NEED_DICT)
+		{
+			@throw [NSException exceptionWithName:kRFBConnectionException reason:NSLocalizedString(@"Zlib inflate needs a dictionary.", nil) userInfo:nil];
+		}
+		else if (inflateResult < 0 && inflateResult != Z_BUF_ERROR)
+		{
+			@throw [NSException exceptionWithName:kRFBConnectionException reason:[NSString stringWithFormat:NSLocalizedString(@"Zlib inflate error: %s", nil), stream.msg] userInfo:nil];
+		}
+
+		unsigned produced = room - stream.avail_out;
+		if (produced == 0 && stream.avail_in == availableIn)
+		{
+			break;
+		}
+		windowBytes += produced;
+		[self drawTiles];
+		if (stream.avail_in == 0 && stream.avail_out != 0)
+		{
+			break;
+		}
+	}
+
+	if ((compressedBytesLeft -= length) == 0)
+	{
+		if (parallelRect)
+		{
+			[self dispatchBatch];
+		}
+		if (rectPending)
+		{
+			if (pendingRectCount == kZRLEMaxPendingRects)
+			{
+				[self finishPendingRects];
 			}
-            @throw [NSException exceptionWithName:kRFBConnectionException reason:[NSString stringWithFormat:@"ZlibHex unknown subencoding %d encountered\n", subEncoding] userInfo:nil];
+			pendingRects[pendingRectCount++] = frame;
 		}
+		// Any tiles the server didn't send are left untouched.
+		[target performSelector:action withObject:self];
+	}
+	return length;
+}
+
+//! Draws every complete tile in the window and keeps the start of the next one.
+- (void)drawTiles
+{
+	unsigned char* data = window;
+	unsigned char* end = window + windowBytes;
+	float maxX = NSMaxX(frame);
+	float maxY = NSMaxY(frame);
+	unsigned used;
+
+	if (tile.origin.y >= maxY)
+	{
+		// Only the end of the server's flush should be left.
+		windowBytes = 0;
+		return;
 	}
-    [target performSelector:action withObject:self];	
+	while (tile.origin.y < maxY && (used = [self drawTileFromBytes:data length:end - data]))
+	{
+		data += used;
+		tile.origin.x += rfbZRLETileWidth;
+		if (tile.origin.x >= maxX)
+		{
+			tile.origin.x = frame.origin.x;
+			tile.origin.y += rfbZRLETileHeight;
+		}
+	}
+	if (data > window && !parallelRect)
+	{
+		[[self metrics] rectDidDrawPixels];
+	}
+
+	windowBytes = (tile.origin.y < maxY) ? end - data : 0;
+	if (windowBytes == kZRLEWindowSize)
+	{
+		@throw [NSException exceptionWithName:kRFBConnectionException reason:@"ZRLE tile larger than any valid tile\n" userInfo:nil];
+	}
+	memmove(window, data, windowBytes);
+}
+
+//! Draws the tile at tile.origin if all of its bytes are there.
+//!
+//! @return Bytes used by the tile, or 0 if more are needed.
+- (unsigned)drawTileFromBytes:(unsigned char*)start length:(unsigned)length
+{
+	int used;
+
+	tile.size.width = MIN(rfbZRLETileWidth, NSMaxX(frame) - tile.origin.x);
+	tile.size.height = MIN(rfbZRLETileHeight, NSMaxY(frame) - tile.origin.y);
+	if (parallelRect)
+	{
+		used = ZRLETileLength(start, length, [frameBuffer zrleBytesPerPixel], tile.size.width, tile.size.height);
+		if (used > 0)
+		{
+			[self queueTileFromBytes:start length:used];
+		}
+	}
+	else
+	{
+		used = [frameBuffer putZRLETile:tile fromData:start length:length];
+	}
+	if (used < 0)
+	{
+		@throw [NSException exceptionWithName:kRFBConnectionException reason:[NSString stringWithFormat:@"ZRLE unknown subencoding %d encountered\n", *start] userInfo:nil];
+	}
+	return used;
+}
+
+//! Copies the tile at tile.origin into the batch, handing the batch over first if it's full.
+- (void)queueTileFromBytes:(unsigned char*)start length:(unsigned)length
+{
+	if (batch && (batch->tileCount == kZRLEBatchTiles || batch->length + length > kZRLEBatchSize - sizeof(ZRLEBatch_t)))
+	{
+		[self dispatchBatch];
+	}
+	if (!batch)
+	{
+		batch = (ZRLEBatch_t *)[[BufferPool sharedPool] acquireBufferWithLength:kZRLEBatchSize options:kBufferOptionAllocate];
+		if (!batch)
+		{
+			@throw [NSException exceptionWithName:kRFBConnectionException reason:@"ZRLE: out of memory for tiles.\n" userInfo:nil];
+		}
+		batch->tileCount = 0;
+		batch->length = 0;
+	}
+	batch->tiles[batch->tileCount++] = tile;
+	memcpy(batch->data + batch->length, start, length);
+	batch->length += length;
+}
+
+//! Hands the batch to a worker, waiting while every worker is busy.
+- (void)dispatchBatch
+{
+	if (!batch || batch->tileCount == 0)
+	{
+		return;
+	}
+	if (!rectPending)
+	{
+		// Timed when the first tiles are handed over rather than when they land.
+		[[self metrics] rectDidDrawPixels];
+		rectPending = YES;
+	}
+	if (!renderFrameBuffer)
+	{
+		renderFrameBuffer = [frameBuffer retain];
+	}
+	batch->frameBuffer = renderFrameBuffer;
+	batch->slots = renderSlots;
+	dispatch_semaphore_wait(renderSlots, DISPATCH_TIME_FOREVER);
+	dispatch_group_async_f(renderGroup, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), batch, DrawBatch);
+	batch = NULL;
+}
+
+//! Waits for every batch, then has the rects displayed in the order they arrived.
+- (void)finishPendingRects
+{
+	unsigned i;
+
+	if (!renderFrameBuffer)
+	{
+		return;
+	}
+	// A rect that failed part way may have batches out without being pending.
+	dispatch_group_wait(renderGroup, DISPATCH_TIME_FOREVER);
+	for (i = 0; i < pendingRectCount; ++i)
+	{
+		[connection drawRectFromBuffer:pendingRects[i]];
+	}
+	pendingRectCount = 0;
+	[renderFrameBuffer release];
+	renderFrameBuffer = nil;
+}
+
+- (void)finishPendingRectsIntersecting:(NSRect)aRect
+{
+	unsigned i;
+
+	for (i = 0; i < pendingRectCount; ++i)
+	{
+		if (NSIntersectsRect(pendingRects[i], aRect))
+		{
+			[self finishPendingRects];
+			return;
+		}
+	}
+}
+
+- (BOOL)isRectanglePending
+{
+	return rectPending;
 }
 
 @end
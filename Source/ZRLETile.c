@@ -0,0 +1,396 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "ZRLETile.h"
+#include "FrameBufferRows.h"
+#include <string.h>
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+//! Largest palette of a palette RLE tile. Indices are 7 bits, so all 128 entries exist.
+#define kMaxPaletteSize 128
+
+//! Converts one CPIXEL. With @a inlineBytes the channels are moved as bytes, which is only
+//! valid when the converter has byteChannels set.
+static ALWAYS_INLINE uint32_t ConvertCPixel(const PixelConverter_t * c, const uint8_t * p, int inlineBytes)
+{
+    if (inlineBytes)
+    {
+        return ((uint32_t)p[c->sourceIndex[0]] << c->destShift[0])
+            | ((uint32_t)p[c->sourceIndex[1]] << c->destShift[1])
+            | ((uint32_t)p[c->sourceIndex[2]] << c->destShift[2]);
+    }
+    return c->convertPixel(c, p);
+}
+
+//! Stores colour @a i of a row.
+static ALWAYS_INLINE void StoreColor(uint8_t * row, unsigned colorBytes, unsigned i, uint32_t color)
+{
+    switch (colorBytes)
+    {
+        case 1:
+            row[i] = (uint8_t)color;
+            break;
+        case 2:
+            ((uint16_t *)row)[i] = (uint16_t)color;
+            break;
+        default:
+            ((uint32_t *)row)[i] = color;
+            break;
+    }
+}
+
+//! Draws rows of 2- or 4-bit palette indices. Each whole byte of indices is copied from a
+//! table of the colours it stands for; the last byte of a row may be partial.
+static ALWAYS_INLINE void DrawPackedRows(uint8_t * dest, size_t rowBytes, unsigned colorBytes, const uint8_t * p, unsigned width, unsigned height,
+    unsigned bits, const uint32_t * palette)
+{
+    const unsigned perByte = 8 / bits;
+    const unsigned mask = (1u << bits) - 1;
+    const size_t groupBytes = perByte * colorBytes;
+    const unsigned packedRow = (width * bits + 7) / 8;
+    uint8_t groups[256][16];
+    unsigned b, i, y;
+
+    for (b = 0; b < 256; ++b)
+    {
+        for (i = 0; i < perByte; ++i)
+        {
+            StoreColor(groups[b], colorBytes, i, palette[(b >> (8 - bits * (i + 1))) & mask]);
+        }
+    }
+
+    for (y = 0; y < height; ++y, dest += rowBytes, p += packedRow)
+    {
+        const uint8_t * in = p;
+        uint8_t * out = dest;
+        unsigned x = width;
+
+        for (; x >= perByte; x -= perByte, out += groupBytes)
+        {
+            memcpy(out, groups[*in++], groupBytes);
+        }
+        for (i = 0; i < x; ++i)
+        {
+            StoreColor(out, colorBytes, i, palette[(*in >> (8 - bits * (i + 1))) & mask]);
+        }
+    }
+}
+
+//! Fills a run of @a length colours, continuing on the next row at the end of each row.
+//! Pixels beyond the end of the tile are dropped.
+static ALWAYS_INLINE void FillRun(uint8_t ** row, unsigned * x, unsigned * lines, size_t rowBytes, unsigned colorBytes, unsigned width,
+    uint32_t color, unsigned length)
+{
+    while (length && *lines)
+    {
+        unsigned n = width - *x < length ? width - *x : length;
+        if (n == 1)
+        {
+            StoreColor(*row, colorBytes, *x, color);
+        }
+        else
+        {
+            FrameBufferFillRow(*row + (size_t)*x * colorBytes, colorBytes, color, n);
+        }
+        length -= n;
+        if ((*x += n) == width)
+        {
+            *x = 0;
+            *row += rowBytes;
+            --*lines;
+        }
+    }
+}
+
+//! Reads a run length: one plus the sum of bytes up to and including the first that isn't
+//! 255. Returns 0 if the bytes run out first.
+static ALWAYS_INLINE unsigned ReadRunLength(const uint8_t ** p, const uint8_t * end)
+{
+    unsigned length = 1;
+    unsigned b;
+
+    do
+    {
+        if (*p == end)
+        {
+            return 0;
+        }
+        b = *(*p)++;
+        length += b;
+    } while (b == 255);
+    return length;
+}
+
+//! The tile decoder. Every caller passes constant sizes, so each one gets a copy specialised
+//! for its colour size and CPIXEL layout.
+static ALWAYS_INLINE int DrawTile(const PixelConverter_t * c, const uint8_t * data, unsigned length, uint8_t * dest, size_t rowBytes,
+    unsigned width, unsigned height, unsigned colorBytes, unsigned cpixelBytes, int inlineBytes)
+{
+    const uint8_t * p = data;
+    const uint8_t * end = data + length;
+    uint32_t palette[kMaxPaletteSize];
+    unsigned subencoding, i, y;
+
+    if (p == end)
+    {
+        return 0;
+    }
+    subencoding = *p++;
+
+    if (subencoding == 0)
+    {
+        // Raw CPIXELs, converted a row at a time.
+        if ((size_t)(end - p) < (size_t)cpixelBytes * width * height)
+        {
+            return 0;
+        }
+        for (y = 0; y < height; ++y, dest += rowBytes, p += (size_t)cpixelBytes * width)
+        {
+            PixelConverterConvertRow(c, p, dest, width);
+        }
+    }
+    else if (subencoding == 1)
+    {
+        if ((size_t)(end - p) < cpixelBytes)
+        {
+            return 0;
+        }
+        FrameBufferFillRect(dest, rowBytes, colorBytes, ConvertCPixel(c, p, inlineBytes), width, height);
+        p += cpixelBytes;
+    }
+    else if (subencoding <= 16)
+    {
+        unsigned bits = subencoding == 2 ? 1 : (subencoding <= 4 ? 2 : 4);
+        if ((size_t)(end - p) < (size_t)cpixelBytes * subencoding + (size_t)((width * bits + 7) / 8) * height)
+        {
+            return 0;
+        }
+        for (i = 0; i < subencoding; ++i, p += cpixelBytes)
+        {
+            palette[i] = ConvertCPixel(c, p, inlineBytes);
+        }
+        for (; i < 16; ++i)
+        {
+            palette[i] = 0;
+        }
+        if (bits == 1)
+        {
+            for (y = 0; y < height; ++y, dest += rowBytes, p += (width + 7) / 8)
+            {
+                FrameBufferExpandBits(dest, colorBytes, p, width, palette[0], palette[1]);
+            }
+        }
+        else
+        {
+            DrawPackedRows(dest, rowBytes, colorBytes, p, width, height, bits, palette);
+            p += (size_t)((width * bits + 7) / 8) * height;
+        }
+    }
+    else if (subencoding == 128)
+    {
+        // Plain RLE: every run has its own CPIXEL.
+        unsigned x = 0, lines = height;
+        while (lines)
+        {
+            if ((size_t)(end - p) < (size_t)cpixelBytes + 1)
+            {
+                return 0;
+            }
+            uint32_t color = ConvertCPixel(c, p, inlineBytes);
+            p += cpixelBytes;
+            unsigned run = ReadRunLength(&p, end);
+            if (run == 0)
+            {
+                return 0;
+            }
+            FillRun(&dest, &x, &lines, rowBytes, colorBytes, width, color, run);
+        }
+    }
+    else if (subencoding >= 130)
+    {
+        // Palette RLE: indices below 128 are single pixels, the others start a run.
+        unsigned paletteSize = subencoding - 128;
+        unsigned x = 0, lines = height;
+        if ((size_t)(end - p) < (size_t)cpixelBytes * paletteSize)
+        {
+            return 0;
+        }
+        for (i = 0; i < paletteSize; ++i, p += cpixelBytes)
+        {
+            palette[i] = ConvertCPixel(c, p, inlineBytes);
+        }
+        for (; i < kMaxPaletteSize; ++i)
+        {
+            palette[i] = 0;
+        }
+        while (lines)
+        {
+            if (p == end)
+            {
+                return 0;
+            }
+            unsigned index = *p++;
+            if (index < 128)
+            {
+                FillRun(&dest, &x, &lines, rowBytes, colorBytes, width, palette[index], 1);
+                continue;
+            }
+            unsigned run = ReadRunLength(&p, end);
+            if (run == 0)
+            {
+                return 0;
+            }
+            FillRun(&dest, &x, &lines, rowBytes, colorBytes, width, palette[index & 0x7f], run);
+        }
+    }
+    else
+    {
+        return -1;
+    }
+    return (int)(p - data);
+}
+
+static int DrawTile8(const PixelConverter_t * c, const uint8_t * data, unsigned length, uint8_t * dest, size_t rowBytes, unsigned width, unsigned height)
+{
+    return DrawTile(c, data, length, dest, rowBytes, width, height, 1, c->sourceBytes, 0);
+}
+
+static int DrawTile16(const PixelConverter_t * c, const uint8_t * data, unsigned length, uint8_t * dest, size_t rowBytes, unsigned width, unsigned height)
+{
+    return DrawTile(c, data, length, dest, rowBytes, width, height, 2, c->sourceBytes, 0);
+}
+
+static int DrawTile32(const PixelConverter_t * c, const uint8_t * data, unsigned length, uint8_t * dest, size_t rowBytes, unsigned width, unsigned height)
+{
+    return DrawTile(c, data, length, dest, rowBytes, width, height, 4, c->sourceBytes, 0);
+}
+
+static int DrawTile32Bytes3(const PixelConverter_t * c, const uint8_t * data, unsigned length, uint8_t * dest, size_t rowBytes, unsigned width, unsigned height)
+{
+    return DrawTile(c, data, length, dest, rowBytes, width, height, 4, 3, 1);
+}
+
+static int DrawTile32Bytes4(const PixelConverter_t * c, const uint8_t * data, unsigned length, uint8_t * dest, size_t rowBytes, unsigned width, unsigned height)
+{
+    return DrawTile(c, data, length, dest, rowBytes, width, height, 4, 4, 1);
+}
+
+int ZRLEDrawTile(const PixelConverter_t * converter, const uint8_t * data, unsigned length, void * dest, size_t rowBytes, unsigned width, unsigned height)
+{
+    if (converter->byteChannels)
+    {
+        // Only set for 4-byte colours and 3- or 4-byte pixels.
+        if (converter->sourceBytes == 3)
+        {
+            return DrawTile32Bytes3(converter, data, length, (uint8_t *)dest, rowBytes, width, height);
+        }
+        return DrawTile32Bytes4(converter, data, length, (uint8_t *)dest, rowBytes, width, height);
+    }
+    switch (converter->destBytes)
+    {
+        case 1:
+            return DrawTile8(converter, data, length, (uint8_t *)dest, rowBytes, width, height);
+        case 2:
+            return DrawTile16(converter, data, length, (uint8_t *)dest, rowBytes, width, height);
+        default:
+            return DrawTile32(converter, data, length, (uint8_t *)dest, rowBytes, width, height);
+    }
+}
+
+int ZRLETileLength(const uint8_t * data, unsigned length, unsigned cpixelBytes, unsigned width, unsigned height)
+{
+    const uint8_t * p = data;
+    const uint8_t * end = data + length;
+    size_t need;
+    unsigned subencoding;
+
+    if (p == end)
+    {
+        return 0;
+    }
+    subencoding = *p++;
+
+    if (subencoding == 0)
+    {
+        need = (size_t)cpixelBytes * width * height;
+    }
+    else if (subencoding == 1)
+    {
+        need = cpixelBytes;
+    }
+    else if (subencoding <= 16)
+    {
+        unsigned bits = subencoding == 2 ? 1 : (subencoding <= 4 ? 2 : 4);
+        need = (size_t)cpixelBytes * subencoding + (size_t)((width * bits + 7) / 8) * height;
+    }
+    else if (subencoding == 128 || subencoding >= 130)
+    {
+        // Runs are counted the way DrawTile fills them: whatever is left of the tile ends
+        // the last one.
+        unsigned pixels = width * height;
+        if (subencoding >= 130)
+        {
+            if ((size_t)(end - p) < (size_t)cpixelBytes * (subencoding - 128))
+            {
+                return 0;
+            }
+            p += (size_t)cpixelBytes * (subencoding - 128);
+        }
+        while (pixels)
+        {
+            unsigned run = 1;
+            if (subencoding == 128)
+            {
+                if ((size_t)(end - p) < (size_t)cpixelBytes + 1)
+                {
+                    return 0;
+                }
+                p += cpixelBytes;
+                run = ReadRunLength(&p, end);
+            }
+            else
+            {
+                if (p == end)
+                {
+                    return 0;
+                }
+                if (*p++ >= 128)
+                {
+                    run = ReadRunLength(&p, end);
+                }
+            }
+            if (run == 0)
+            {
+                return 0;
+            }
+            pixels -= run < pixels ? run : pixels;
+        }
+        return (int)(p - data);
+    }
+    else
+    {
+        return -1;
+    }
+    return (size_t)(end - p) < need ? 0 : (int)(p - data + need);
+}
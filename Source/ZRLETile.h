@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#if !defined(_ZRLETile_h_)
+#define _ZRLETile_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "PixelConverter.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*!
+ * @file ZRLETile.h
+ * @brief Draws ZRLE tiles straight into the framebuffer.
+ *
+ * Every subencoding is decoded by one kernel per framebuffer colour size, so the tile loop
+ * never goes through the framebuffer's drawing methods:
+ *
+ * - Packed palette indices are unpacked a byte at a time. 1-bit tiles use the framebuffer's
+ *   bit expansion; 2- and 4-bit tiles look each byte up in a table of colour quads or pairs
+ *   built from the tile's palette.
+ * - Runs are filled into the framebuffer rows as they are read, without collecting a run
+ *   list first.
+ * - CPIXELs are converted with the converter's single pixel function, or for 3- and 4-byte
+ *   CPIXELs whose channels are whole bytes, by moving the bytes inline.
+ */
+
+//! @brief Decode one tile.
+//!
+//! The converter's source size is the CPIXEL size. If @a length bytes don't hold the whole
+//! tile, 0 is returned. Some of the tile may have been drawn already; drawing it again once
+//! the rest of its bytes have arrived gives the same result.
+//!
+//! @param dest First colour of the tile in the framebuffer.
+//! @param rowBytes Distance between framebuffer rows, in bytes.
+//! @return Bytes used by the tile, 0 if more are needed, or -1 if the subencoding is invalid.
+int ZRLEDrawTile(const PixelConverter_t * converter, const uint8_t * data, unsigned length, void * dest, size_t rowBytes, unsigned width, unsigned height);
+
+//! @brief Find where a tile ends without drawing it.
+//!
+//! Lets the tiles of a rect be split up before any of them is drawn.
+//!
+//! @return Bytes used by the tile, 0 if more are needed, or -1 if the subencoding is invalid.
+int ZRLETileLength(const uint8_t * data, unsigned length, unsigned cpixelBytes, unsigned width, unsigned height);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif // _ZRLETile_h_
@@ -9,26 +9,27 @@
 #import <Foundation/Foundation.h>
 #import <zlib.h>
 #import "EncodingReader.h"
+#import "InflateRows.h"
 
 enum
 {
-    //! Starting size for the output buffer.
-    kZlibInitialOutputBufferSize = 256*1024,
-    
-    //! The size used to expand the output buffer each time it is too small.
-    kZlibOutputBufferChunkSize = 64*1024
+    //! Size of the window rows are inflated into before they are converted.
+    kZlibRowWindowSize = 32*1024
 };
 
+//! Zlib rects are inflated a few rows at a time as the compressed bytes arrive, and each
+//! row is converted into the frame buffer as soon as it is complete. Rows that need no
+//! conversion are inflated straight into the frame buffer.
 @interface ZlibEncodingReader : EncodingReader
 {
-	unsigned char*	pixels;
-	unsigned int	capacity;
 	id				numBytesReader;
-	id				pixelReader;
 	id				connection;
 	z_stream		stream;
+	unsigned		compressedBytesLeft;
+	InflateRows_t	rows;
+	unsigned char*	rowWindow;
 }
 
-- (void)setUncompressedData:(unsigned char*)data length:(int)length;
+- (void)setNumBytes:(NSNumber*)numBytes;
 
 @end
@@ -8,8 +8,9 @@
 
 #import "ZlibEncodingReader.h"
 #import "CARD32Reader.h"
-#import "ByteBlockReader.h"
+#import "BufferPool.h"
 #import "RFBConnection.h"
+#import "ConnectionMetrics.h"
 
 
 @implementation ZlibEncodingReader
@@ -19,12 +20,7 @@
     if (self = [super initTarget:aTarget action:anAction]) {
 		int inflateResult;
 	
-		capacity = kZlibInitialOutputBufferSize;
-		pixels = malloc(capacity);
-        assert(pixels);
-        
 		numBytesReader = [[CARD32Reader alloc] initTarget:self action:@selector(setNumBytes:)];
-		pixelReader = [[ByteBlockReader alloc] initTarget:self action:@selector(setCompressedData:)];
 		connection = [aTarget topTarget];
         
 		inflateResult = inflateInit(&stream);
@@ -38,9 +34,8 @@
 
 - (void)dealloc
 {
-	free(pixels);
 	[numBytesReader release];
-    [pixelReader release];
+	[[BufferPool sharedPool] releaseBuffer:rowWindow];
 	inflateEnd(&stream);
     [super dealloc];
 }
@@ -52,57 +47,70 @@
 
 - (void)setNumBytes:(NSNumber*)numBytes
 {
+	unsigned rowBytes = [frameBuffer bytesPerPixel] * frame.size.width;
+	size_t stride = 0;
+	unsigned char* direct = [frameBuffer directRowsForRect:frame stride:&stride];
+
 #ifdef COLLECT_STATS
 	bytesTransferred = 4 + [numBytes unsignedIntValue];
 #endif
-	[pixelReader setBufferSize:[numBytes unsignedIntValue]];
-	[target setReader:pixelReader];
+	compressedBytesLeft = [numBytes unsignedIntValue];
+	if (!direct && !rowWindow)
+	{
+		rowWindow = [[BufferPool sharedPool] acquireBufferWithLength:kZlibRowWindowSize options:kBufferOptionAllocate];
+	}
+	if (!direct && rowBytes > kZlibRowWindowSize)
+	{
+		// Only very wide rects need a window bigger than the usual one.
+		if (rowBytes > [[BufferPool sharedPool] capacityOfBuffer:rowWindow])
+		{
+			[[BufferPool sharedPool] releaseBuffer:rowWindow];
+			rowWindow = [[BufferPool sharedPool] acquireBufferWithLength:rowBytes options:kBufferOptionAllocate];
+		}
+	}
+	InflateRowsBegin(&rows, &stream, rowBytes, frame.size.height, rowWindow,
+					 direct ? 0 : [[BufferPool sharedPool] capacityOfBuffer:rowWindow], direct, stride);
+	[target setReaderWithoutReset:self];
 }
 
-- (void)setCompressedData:(NSData*)data
+//! Converts completed rows into the frame buffer. Rows inflated in place need nothing more.
+static void PutRows(void * context, const uint8_t * data, unsigned firstRow, unsigned count)
 {
-    // Set up the stream with the new input data.
-    stream.next_in   = (unsigned char*)[data bytes];
-    stream.avail_in  = [data length];
-    stream.next_out  = pixels;
-    stream.avail_out = capacity;
-    stream.data_type = Z_BINARY;
-    
-    // Decompress input data until it is all used up. If the inflate function returns with
-    // input data remaining unprocessed, we have to grow our output buffer and continue.
-    uint32_t startTotalOutputLength = stream.total_out;
-    while (stream.avail_in)
-    {
-        int inflateResult = inflate(&stream, Z_SYNC_FLUSH);
-        if (inflateResult == Z_NEED_DICT)
-        {
-            @throw [NSException exceptionWithName:kRFBConnectionException reason:NSLocalizedString(@"Zlib inflate needs a dictionary.", nil) userInfo:nil];
-        }
-        else if (inflateResult < 0)
-        {
-            @throw [NSException exceptionWithName:kRFBConnectionException reason:[NSString stringWithFormat:NSLocalizedString(@"Zlib inflate error: %s", nil), stream.msg] userInfo:nil];
-        }
-        
-        // If there is still input data but no more room in the output buffer, we have to expand it.
-        if (inflateResult == Z_OK && stream.avail_in && !stream.avail_out)
-        {
-            uint32_t offset = stream.next_out - pixels;
-            capacity += kZlibOutputBufferChunkSize;
-            pixels = realloc(pixels, capacity);
-            assert(pixels);
-            stream.next_out = pixels + offset;
-            stream.avail_out = capacity - offset;
-        }
-    }
-    
-    uint32_t decompressedLength = stream.total_out - startTotalOutputLength;
-	[self setUncompressedData:pixels length:decompressedLength];
+	ZlibEncodingReader * reader = (ZlibEncodingReader *)context;
+
+	if (!reader->rows.dest)
+	{
+		NSRect r = reader->frame;
+		r.origin.y += firstRow;
+		r.size.height = count;
+		[reader->frameBuffer putRect:r fromData:(unsigned char*)data];
+	}
+	if (firstRow == 0)
+	{
+		[[reader metrics] rectDidDrawPixels];
+	}
 }
 
-- (void)setUncompressedData:(unsigned char*)data length:(int)length
+- (unsigned)readBytes:(unsigned char*)theBytes length:(unsigned)aLength
 {
-	[frameBuffer putRect:frame fromData:pixels];
-    [target performSelector:action withObject:self];
+	unsigned length = MIN(aLength, compressedBytesLeft);
+
+	int inflateResult = InflateRowsInput(&rows, theBytes, length, PutRows, self);
+	if (inflateResult == Z_NEED_DICT)
+	{
+		@throw [NSException exceptionWithName:kRFBConnectionException reason:NSLocalizedString(@"Zlib inflate needs a dictionary.", nil) userInfo:nil];
+	}
+	else if (inflateResult < 0)
+	{
+		@throw [NSException exceptionWithName:kRFBConnectionException reason:[NSString stringWithFormat:NSLocalizedString(@"Zlib inflate error: %s", nil), stream.msg] userInfo:nil];
+	}
+
+	if ((compressedBytesLeft -= length) == 0)
+	{
+		// Any rows the server didn't send are left untouched.
+		[target performSelector:action withObject:self];
+	}
+	return length;
 }
 
 @end
@@ -124,6 +124,12 @@
 	[super drawRawTile:data];
 }
 
+/* Zlib tiles need the inflate streams, so they always go through the sub-readers. */
+- (unsigned)readRectangleFromBytes:(const uint8_t *)bytes length:(unsigned)length
+{
+    return 0;
+}
+
 - (void)setZLength:(NSNumber*)theLength
 {
 #ifdef COLLECT_STATS
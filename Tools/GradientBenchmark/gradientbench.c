@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//! @file gradientbench.c
+//! @brief Correctness check and benchmark for the Tight gradient filter decoder.
+//!
+//! Filters random pictures the way a Tight server does and decodes them twice: with the
+//! filter GradientFilter used before, which splits each pixel into int channels, predicts
+//! with branches and combines the channels again, and with TightGradientDecodeRow(). Both must
+//! give the same pixels.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#if __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+#include "TightGradient.h"
+
+#define kMinimumSeconds 0.5
+
+static uint64_t NowNanoseconds(void)
+{
+#if __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+    {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+//! State of the reference filter, as GradientFilter kept it.
+typedef struct
+{
+    const rfbPixelFormat * format;
+    unsigned width;
+    int * prevRow;
+    int * thisRow;
+    int * src;
+} Reference_t;
+
+//! -[FrameBuffer splitRGB:pixels:into:] for little endian 3-byte pixels.
+static void SplitRGB(const rfbPixelFormat * f, const uint8_t * v, unsigned length, int * rgb)
+{
+    while (length--)
+    {
+        unsigned pix = v[0] | (v[1] << 8) | (v[2] << 16);
+        v += 3;
+        *rgb++ = (pix >> f->redShift) & f->redMax;
+        *rgb++ = (pix >> f->greenShift) & f->greenMax;
+        *rgb++ = (pix >> f->blueShift) & f->blueMax;
+    }
+}
+
+//! -[FrameBuffer combineRGB:pixels:into:] for little endian 3-byte pixels.
+static void CombineRGB(const rfbPixelFormat * f, const int * rgb, unsigned length, uint8_t * v)
+{
+    while (length--)
+    {
+        unsigned pix = ((unsigned)rgb[0] << f->redShift) | ((unsigned)rgb[1] << f->greenShift) | ((unsigned)rgb[2] << f->blueShift);
+        rgb += 3;
+        *v++ = pix;
+        *v++ = pix >> 8;
+        *v++ = pix >> 16;
+    }
+}
+
+//! -[GradientFilter filter:rows:] before TightGradientDecodeRow().
+static void ReferenceFilter(Reference_t * r, const uint8_t * bytes, unsigned numRows, uint8_t * dst)
+{
+    int * tmp;
+    unsigned c, x, y;
+    int est[3];
+    int col[3];
+    int max[3] = { r->format->redMax, r->format->greenMax, r->format->blueMax };
+    unsigned rowSize = r->width;
+    unsigned rowBytes = rowSize * 3;
+
+    for (y = 0; y < numRows; y++)
+    {
+        SplitRGB(r->format, bytes, rowSize, r->src);
+        bytes += rowBytes;
+        for (c = 0; c < 3; c++)
+        {
+            col[c] = (r->src[c] + r->prevRow[c]) & max[c];
+            r->thisRow[c] = col[c];
+        }
+        for (x = 1; x < rowSize; x++)
+        {
+            for (c = 0; c < 3; c++)
+            {
+                est[c] = r->prevRow[x * 3 + c] + col[c] - r->prevRow[(x - 1) * 3 + c];
+                if (est[c] > max[c])
+                {
+                    est[c] = max[c];
+                }
+                else if (est[c] < 0)
+                {
+                    est[c] = 0;
+                }
+                col[c] = (r->src[x * 3 + c] + est[c]) & max[c];
+                r->thisRow[x * 3 + c] = col[c];
+            }
+        }
+        CombineRGB(r->format, r->thisRow, rowSize, dst);
+        dst += rowBytes;
+        tmp = r->thisRow;
+        r->thisRow = r->prevRow;
+        r->prevRow = tmp;
+    }
+}
+
+//! Applies the gradient filter to a picture, as the server does.
+static void Encode(const uint8_t * pixels, unsigned width, unsigned height, uint8_t * out)
+{
+    unsigned x, y, c;
+    for (y = 0; y < height; ++y)
+    {
+        for (x = 0; x < width; ++x)
+        {
+            for (c = 0; c < 3; ++c)
+            {
+                int above = y ? pixels[((y - 1) * width + x) * 3 + c] : 0;
+                int left = x ? pixels[(y * width + x - 1) * 3 + c] : 0;
+                int aboveLeft = x && y ? pixels[((y - 1) * width + x - 1) * 3 + c] : 0;
+                int estimate = above + left - aboveLeft;
+                estimate = estimate < 0 ? 0 : (estimate > 255 ? 255 : estimate);
+                out[(y * width + x) * 3 + c] = (uint8_t)(pixels[(y * width + x) * 3 + c] - estimate);
+            }
+        }
+    }
+}
+
+//! Makes a picture of gradients with some noise and hard edges.
+static void MakePicture(uint8_t * pixels, unsigned width, unsigned height, int noise)
+{
+    unsigned x, y;
+    for (y = 0; y < height; ++y)
+    {
+        for (x = 0; x < width; ++x)
+        {
+            uint8_t * p = pixels + (y * width + x) * 3;
+            int edge = (x / 37 + y / 23) & 1 ? 90 : 0;
+            p[0] = x * 255 / width + edge + (noise ? rand() % noise : 0);
+            p[1] = y * 255 / height + (noise ? rand() % noise : 0);
+            p[2] = (x + y) + edge;
+        }
+    }
+}
+
+static void DecodeFused(const uint8_t * filtered, unsigned width, unsigned height, uint8_t * row, uint8_t * out)
+{
+    unsigned y;
+    memset(row, 0, TightGradientRowBufferSize(width));
+    for (y = 0; y < height; ++y)
+    {
+        TightGradientDecodeRow(filtered + (size_t)y * width * 3, row, width);
+        memcpy(out + (size_t)y * width * 3, row, width * 3);
+    }
+}
+
+int main(void)
+{
+    static const struct
+    {
+        unsigned width, height;
+        int noise;
+    } kCases[] = {
+        { 1, 1, 0 }, { 2, 3, 256 }, { 5, 7, 256 }, { 64, 64, 0 }, { 1920, 1080, 0 }, { 1920, 1080, 256 }, { 7680, 64, 8 },
+    };
+    rfbPixelFormat format;
+    memset(&format, 0, sizeof(format));
+    format.redMax = format.greenMax = format.blueMax = 255;
+    format.redShift = 16;
+    format.greenShift = 8;
+    format.blueShift = 0;
+    if (!TightGradientCanDecode(&format, 3))
+    {
+        fprintf(stderr, "format should be supported\n");
+        return 1;
+    }
+
+    printf("%-10s %6s %14s %14s %8s\n", "size", "noise", "reference MP/s", "fused MP/s", "speedup");
+    int failures = 0;
+    unsigned n;
+    srand(1);
+    for (n = 0; n < sizeof(kCases) / sizeof(kCases[0]); ++n)
+    {
+        unsigned width = kCases[n].width, height = kCases[n].height;
+        size_t bytes = (size_t)width * height * 3;
+        uint8_t * pixels = malloc(bytes);
+        uint8_t * filtered = malloc(bytes);
+        uint8_t * expected = malloc(bytes);
+        uint8_t * actual = malloc(bytes);
+        uint8_t * row = malloc(TightGradientRowBufferSize(width));
+        Reference_t reference = { &format, width, malloc(width * 3 * sizeof(int)), malloc(width * 3 * sizeof(int)), malloc(width * 3 * sizeof(int)) };
+
+        MakePicture(pixels, width, height, kCases[n].noise);
+        Encode(pixels, width, height, filtered);
+
+        double rates[2] = { 0, 0 };
+        int kind;
+        for (kind = 0; kind < 2; ++kind)
+        {
+            uint64_t start = NowNanoseconds();
+            do
+            {
+                uint64_t begin = NowNanoseconds();
+                if (kind == 0)
+                {
+                    memset(reference.prevRow, 0, width * 3 * sizeof(int));
+                    ReferenceFilter(&reference, filtered, height, expected);
+                }
+                else
+                {
+                    DecodeFused(filtered, width, height, row, actual);
+                }
+                double rate = (double)width * height / ((NowNanoseconds() - begin) * 1e-9) / 1e6;
+                if (rate > rates[kind])
+                {
+                    rates[kind] = rate;
+                }
+            } while (NowNanoseconds() - start < kMinimumSeconds * 1e9);
+        }
+
+        // The fused decoder works on bytes, which is only the same as the reference because
+        // every channel is a whole byte of the pixel.
+        if (memcmp(expected, pixels, bytes) != 0 || memcmp(actual, pixels, bytes) != 0)
+        {
+            fprintf(stderr, "%ux%u: decoded pixels differ (reference %s, fused %s)\n", width, height,
+                    memcmp(expected, pixels, bytes) ? "wrong" : "right", memcmp(actual, pixels, bytes) ? "wrong" : "right");
+            ++failures;
+        }
+
+        char size[32];
+        snprintf(size, sizeof(size), "%ux%u", width, height);
+        printf("%-10s %6d %14.1f %14.1f %7.2fx\n", size, kCases[n].noise, rates[0], rates[1], rates[1] / rates[0]);
+
+        free(pixels);
+        free(filtered);
+        free(expected);
+        free(actual);
+        free(row);
+        free(reference.prevRow);
+        free(reference.thisRow);
+        free(reference.src);
+    }
+    return failures ? 1 : 0;
+}
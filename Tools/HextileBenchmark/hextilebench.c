@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//! @file hextilebench.c
+//! @brief Correctness check and benchmark for the Hextile rect kernel.
+//!
+//! Encodes random 256x256 rects with different mixes of tiles and draws them twice: with the
+//! fills HextileEncodingReader's sub-readers end up making, and with HextileDrawRect(). Both
+//! must give the same pixels, and HextileRectLength() must find the end of each rect.
+//!
+//! The reference leaves out the sub-readers themselves, so the speedup column only compares
+//! the drawing. What the kernel saves by not sending messages or making NSData objects for
+//! each tile isn't measured here.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#if __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+#include "HextileRect.h"
+#include "FrameBufferRows.h"
+
+#define kMinimumSeconds 0.1
+#define kRounds 7
+#define kRectSize 256
+#define kTileSize 16
+
+static uint64_t NowNanoseconds(void)
+{
+#if __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+    {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static uint8_t * PutPixel(uint8_t * p)
+{
+    p[0] = rand();
+    p[1] = rand();
+    p[2] = rand();
+    p[3] = 0;
+    return p + 4;
+}
+
+//! Encodes a random rect. Each tile is raw with probability @a raw percent; the others
+//! have up to @a maxSubrects subrects, coloured with probability @a coloured percent.
+static uint8_t * EncodeRect(uint8_t * p, unsigned raw, unsigned maxSubrects, unsigned coloured)
+{
+    unsigned tiles = (kRectSize / kTileSize) * (kRectSize / kTileSize);
+    unsigned t, i;
+
+    for (t = 0; t < tiles; ++t)
+    {
+        unsigned subencoding = 0;
+        unsigned count = maxSubrects ? rand() % (maxSubrects + 1) : 0;
+
+        if ((unsigned)(rand() % 100) < raw)
+        {
+            *p++ = rfbHextileRaw;
+            for (i = 0; i < kTileSize * kTileSize; ++i)
+            {
+                p = PutPixel(p);
+            }
+            continue;
+        }
+        if (t == 0 || rand() % 4 == 0)
+        {
+            subencoding |= rfbHextileBackgroundSpecified;
+        }
+        if (count)
+        {
+            subencoding |= rfbHextileAnySubrects;
+            if ((unsigned)(rand() % 100) < coloured)
+            {
+                subencoding |= rfbHextileSubrectsColoured;
+            }
+            else if (t == 0 || rand() % 2 == 0)
+            {
+                subencoding |= rfbHextileForegroundSpecified;
+            }
+        }
+        *p++ = subencoding;
+        if (subencoding & rfbHextileBackgroundSpecified)
+        {
+            p = PutPixel(p);
+        }
+        if (subencoding & rfbHextileForegroundSpecified)
+        {
+            p = PutPixel(p);
+        }
+        if (count)
+        {
+            *p++ = count;
+            for (i = 0; i < count; ++i)
+            {
+                unsigned x = rand() % kTileSize, y = rand() % kTileSize;
+                unsigned w = 1 + rand() % (kTileSize - x), h = 1 + rand() % (kTileSize - y);
+                if (rand() % 2)
+                {
+                    w = h = 1;
+                }
+                if (subencoding & rfbHextileSubrectsColoured)
+                {
+                    p = PutPixel(p);
+                }
+                *p++ = rfbHextilePackXY(x, y);
+                *p++ = rfbHextilePackWH(w, h);
+            }
+        }
+    }
+    return p;
+}
+
+//! The sub-readers' drawing, for 4-byte colours.
+static unsigned ReferenceRect(const PixelConverter_t * c, const uint8_t * data, uint32_t * dest, uint32_t * background, uint32_t * foreground)
+{
+    const uint8_t * p = data;
+    const size_t rowBytes = kRectSize * 4;
+    unsigned tx, ty, y;
+
+    for (ty = 0; ty < kRectSize; ty += kTileSize)
+    {
+        for (tx = 0; tx < kRectSize; tx += kTileSize)
+        {
+            uint32_t * tile = dest + ty * kRectSize + tx;
+            unsigned subencoding = *p++;
+
+            if (subencoding & rfbHextileRaw)
+            {
+                for (y = 0; y < kTileSize; ++y, p += 4 * kTileSize)
+                {
+                    PixelConverterConvertRow(c, p, tile + y * kRectSize, kTileSize);
+                }
+                continue;
+            }
+            if (subencoding & rfbHextileBackgroundSpecified)
+            {
+                *background = PixelConverterConvertPixel(c, p);
+                p += 4;
+            }
+            FrameBufferFillRect(tile, rowBytes, 4, *background, kTileSize, kTileSize);
+            if (subencoding & rfbHextileForegroundSpecified)
+            {
+                *foreground = PixelConverterConvertPixel(c, p);
+                p += 4;
+                subencoding &= ~rfbHextileSubrectsColoured;
+            }
+            if (subencoding & rfbHextileAnySubrects)
+            {
+                unsigned count = *p++;
+                while (count--)
+                {
+                    uint32_t color = *foreground;
+                    if (subencoding & rfbHextileSubrectsColoured)
+                    {
+                        color = PixelConverterConvertPixel(c, p);
+                        p += 4;
+                    }
+                    FrameBufferFillRect(tile + rfbHextileExtractY(p[0]) * kRectSize + rfbHextileExtractX(p[0]), rowBytes, 4, color,
+                        rfbHextileExtractW(p[1]), rfbHextileExtractH(p[1]));
+                    p += 2;
+                }
+            }
+        }
+    }
+    return p - data;
+}
+
+static const struct
+{
+    const char * name;
+    unsigned raw;
+    unsigned maxSubrects;
+    unsigned coloured;
+} kCases[] = {
+    { "solid", 0, 0, 0 },
+    { "mono/8", 0, 8, 0 },
+    { "mono/64", 0, 64, 0 },
+    { "colour/16", 0, 16, 100 },
+    { "colour/96", 0, 96, 100 },
+    { "mixed", 10, 32, 50 },
+    { "raw", 100, 0, 0 },
+};
+
+int main(void)
+{
+    static uint32_t clut[3][256];
+    rfbPixelFormat format = { 32, 24, 0, 1, 255, 255, 255, 0, 8, 16, 0, 0 };
+    PixelConverter_t converter;
+    uint32_t * out[2];
+    uint8_t * rect;
+    unsigned i, n;
+
+    for (i = 0; i < 256; ++i)
+    {
+        clut[0][i] = i;
+        clut[1][i] = i << 8;
+        clut[2][i] = i << 16;
+    }
+    if (PixelConverterInit(&converter, &format, 4, 0, clut[0], clut[1], clut[2], 4) < 0)
+    {
+        fprintf(stderr, "format should be supported\n");
+        return 1;
+    }
+    rect = malloc(kRectSize * kRectSize * 5);
+    out[0] = calloc(kRectSize * kRectSize, 4);
+    out[1] = calloc(kRectSize * kRectSize, 4);
+
+    printf("%-10s %14s %14s %8s\n", "rect", "reference MP/s", "kernel MP/s", "speedup");
+    for (n = 0; n < sizeof(kCases) / sizeof(kCases[0]); ++n)
+    {
+        uint8_t * end;
+        unsigned length;
+        double rates[2];
+        unsigned round;
+
+        srand(n + 1);
+        end = EncodeRect(rect, kCases[n].raw, kCases[n].maxSubrects, kCases[n].coloured);
+        length = (unsigned)(end - rect);
+        if (HextileRectLength(rect, length, 4, kRectSize, kRectSize) != length
+            || HextileRectLength(rect, length - 1, 4, kRectSize, kRectSize) != 0)
+        {
+            fprintf(stderr, "%s: wrong rect length\n", kCases[n].name);
+            return 1;
+        }
+
+        // The two are timed in alternating rounds and each keeps its best, so a burst of
+        // load on the machine doesn't land on only one of them.
+        rates[0] = rates[1] = 0.0;
+        for (round = 0; round < kRounds * 2; ++round)
+        {
+            int pass = round & 1;
+            uint64_t start = NowNanoseconds(), elapsed;
+            uint64_t pixels = 0;
+            do
+            {
+                uint32_t background = 0, foreground = 0;
+                if (pass == 0)
+                {
+                    ReferenceRect(&converter, rect, out[0], &background, &foreground);
+                }
+                else
+                {
+                    HextileDrawRect(&converter, rect, out[1], kRectSize * 4, kRectSize, kRectSize, &background, &foreground);
+                }
+                pixels += kRectSize * kRectSize;
+                elapsed = NowNanoseconds() - start;
+            } while (elapsed < kMinimumSeconds * 1e9);
+            if ((double)pixels / (double)elapsed * 1e3 > rates[pass])
+            {
+                rates[pass] = (double)pixels / (double)elapsed * 1e3;
+            }
+        }
+
+        if (memcmp(out[0], out[1], kRectSize * kRectSize * 4) != 0)
+        {
+            fprintf(stderr, "%s: decoded pixels differ\n", kCases[n].name);
+            return 1;
+        }
+        printf("%-10s %14.1f %14.1f %7.2fx\n", kCases[n].name, rates[0], rates[1], rates[1] / rates[0]);
+    }
+
+    PixelConverterFree(&converter);
+    free(rect);
+    free(out[0]);
+    free(out[1]);
+    return 0;
+}
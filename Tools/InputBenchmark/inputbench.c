@@ -0,0 +1,457 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//! @file inputbench.c
+//! @brief Counts the pointer events local input turns into, with and without coalescing.
+//!
+//! Plays a stream of input events through the same steps as EventFilter, RFBProtocol and
+//! RFBConnection, without AppKit:
+//!     - motion goes through InputCoalescing's motion window, a held move being sent when
+//!       the window ends, as EventFilter's mouse timer does;
+//!     - a button change sends any held move first, then its own event;
+//!     - scrolling goes through ScrollAccumulatorAdd() and sends a press and release per click;
+//!     - pointer events that keep the button mask are queued with
+//!       SendQueueEnqueueCoalescing(), the others with SendQueueEnqueue();
+//!     - the writer drains the queue after every event, as it does on an uncongested socket.
+//! SendQueue.c is compiled in with writev() replaced by a stub that collects the wire bytes.
+//!
+//! "Before" is one pointer event per motion event and one press and release per scroll event,
+//! which is what the client sent without coalescing. The button masks on the wire must change
+//! in the same order as the input's, and the last position sent must be the input's last.
+//!
+//! The stream is read from a file given as the only argument, one event per line:
+//!     <seconds> move <x> <y>
+//!     <seconds> buttons <mask>
+//!     <seconds> scroll <pixels>       (a continuous device)
+//!     <seconds> wheel <lines>         (a line based wheel)
+//! Events other than moves happen where the last move left the pointer.
+//! Without one, a built-in stream of a 120 Hz trackpad is used.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <sys/uio.h>
+
+static ssize_t StubWritev(int fd, const struct iovec * vectors, int count);
+
+#define writev StubWritev
+#include "../../Source/SendQueue.c"
+#undef writev
+
+#include "InputCoalescing.h"
+
+#define kPointerEventSize 6
+#define kWheelUpMask 8
+#define kWheelDownMask 16
+#define kMaxEvents 100000
+#define kWireSize (kMaxEvents * 2 * kMaxScrollClicksPerEvent * kPointerEventSize)
+
+typedef enum { kEventMove, kEventButtons, kEventScroll, kEventWheel } EventType;
+
+typedef struct
+{
+    uint64_t time;      //!< Nanoseconds.
+    EventType type;
+    int x, y;
+    int value;          //!< Button mask, scroll pixels or wheel lines.
+} InputEvent_t;
+
+static InputEvent_t s_events[kMaxEvents];
+static unsigned s_eventCount;
+
+static uint8_t s_wire[kWireSize];
+static size_t s_wireLength;
+
+static ssize_t StubWritev(int fd, const struct iovec * vectors, int count)
+{
+    size_t written = 0;
+    int i;
+
+    (void)fd;
+
+    for (i = 0; i < count; ++i)
+    {
+        memcpy(s_wire + s_wireLength + written, vectors[i].iov_base, vectors[i].iov_len);
+        written += vectors[i].iov_len;
+    }
+    s_wireLength += written;
+    return (ssize_t)written;
+}
+
+static void AddEvent(double seconds, EventType type, int x, int y, int value)
+{
+    if (s_eventCount < kMaxEvents)
+    {
+        InputEvent_t * event = &s_events[s_eventCount++];
+        event->time = (uint64_t)(seconds * 1e9);
+        event->type = type;
+        event->x = x;
+        event->y = y;
+        event->value = value;
+    }
+}
+
+//! About twenty seconds of a trackpad reporting at 120 Hz: moving about, dragging a window, clicking,
+//! and scrolling with momentum, plus a few notches of a mouse wheel.
+static void MakeStream(void)
+{
+    const double tick = 1.0 / 120.0;
+    double t = 1.0;
+    int x = 400, y = 300;
+    int pass, i;
+
+    for (pass = 0; pass < 4; ++pass)
+    {
+        // Wander for two seconds.
+        for (i = 0; i < 240; ++i, t += tick)
+        {
+            x = 400 + (int)(300 * sin(t * 1.3));
+            y = 300 + (int)(200 * cos(t * 0.9));
+            AddEvent(t, kEventMove, x, y, 0);
+        }
+        // Click.
+        AddEvent(t, kEventButtons, x, y, 1);
+        t += 0.09;
+        AddEvent(t, kEventButtons, x, y, 0);
+        t += 0.3;
+        // Drag for one second.
+        AddEvent(t, kEventButtons, x, y, 1);
+        for (i = 0; i < 120; ++i, t += tick)
+        {
+            x += 3;
+            y += (i % 3) - 1;
+            AddEvent(t, kEventMove, x, y, 0);
+        }
+        AddEvent(t, kEventButtons, x, y, 0);
+        t += 0.2;
+        // A two finger flick and its momentum.
+        for (i = 0; i < 90; ++i, t += tick)
+        {
+            AddEvent(t, kEventScroll, x, y, (int)(-60 * exp(-i / 20.0)) - (i < 80));
+        }
+        t += 0.5;
+        // Three notches of a wheel.
+        for (i = 0; i < 3; ++i, t += 0.12)
+        {
+            AddEvent(t, kEventWheel, x, y, 1);
+        }
+        t += 0.5;
+    }
+}
+
+static int ReadStream(const char * path)
+{
+    FILE * file = fopen(path, "r");
+    char line[128], type[16];
+    double seconds;
+    int a, b, x = 0, y = 0;
+
+    if (!file)
+    {
+        perror(path);
+        return -1;
+    }
+    a = b = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        int fields = sscanf(line, "%lf %15s %d %d", &seconds, type, &a, &b);
+        if (fields >= 4 && strcmp(type, "move") == 0)
+        {
+            x = a;
+            y = b;
+            AddEvent(seconds, kEventMove, x, y, 0);
+        }
+        else if (fields >= 3 && strcmp(type, "buttons") == 0)
+        {
+            AddEvent(seconds, kEventButtons, x, y, a);
+        }
+        else if (fields >= 3 && strcmp(type, "scroll") == 0)
+        {
+            AddEvent(seconds, kEventScroll, x, y, a);
+        }
+        else if (fields >= 3 && strcmp(type, "wheel") == 0)
+        {
+            AddEvent(seconds, kEventWheel, x, y, a);
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+typedef struct
+{
+    SendQueue_t * queue;
+    MotionWindow_t motion;
+    ScrollAccumulator_t scroll;
+    uint64_t roundTrip;
+    uint32_t lastMask;          //!< As RFBProtocol's _lastPointerMask.
+    int buttons;
+    int heldX, heldY;
+    int hasHeldMove;
+    uint64_t heldSince;         //!< When the oldest move not yet sent arrived.
+    uint64_t timerDue;          //!< When the mouse timer fires, or 0.
+    uint64_t maxHeld;           //!< Longest a move waited for a newer position to be sent.
+    int lastX, lastY;
+} Client_t;
+
+//! RFBProtocol -sendMouse:mask: and the send queue's writer.
+static void SendPointer(Client_t * client, int x, int y, uint32_t mask)
+{
+    uint8_t msg[kPointerEventSize] = { 5, (uint8_t)mask, (uint8_t)(x >> 8), (uint8_t)x, (uint8_t)(y >> 8), (uint8_t)y };
+
+    if (client->queue)
+    {
+        if (mask == client->lastMask)
+        {
+            SendQueueEnqueueCoalescing(client->queue, kSendClassInput, msg, sizeof(msg), 2);
+        }
+        else
+        {
+            SendQueueEnqueue(client->queue, kSendClassInput, msg, sizeof(msg), NULL, 0);
+        }
+        while (!SendQueueFinishWriting(client->queue))
+        {
+            SendQueueWrite(client->queue, 0);
+        }
+    }
+    else
+    {
+        StubWritev(0, &(struct iovec){ msg, sizeof(msg) }, 1);
+    }
+    client->lastMask = mask;
+    client->lastX = x;
+    client->lastY = y;
+}
+
+//! EventFilter -sendUnpublishedMouseMove.
+static void SendHeldMove(Client_t * client, uint64_t now)
+{
+    if (client->hasHeldMove)
+    {
+        client->hasHeldMove = 0;
+        if (now - client->heldSince > client->maxHeld)
+        {
+            client->maxHeld = now - client->heldSince;
+        }
+        SendPointer(client, client->heldX, client->heldY, client->buttons);
+        MotionWindowDidSend(&client->motion, now);
+    }
+}
+
+static void FireTimer(Client_t * client, uint64_t now)
+{
+    if (client->timerDue && client->timerDue <= now)
+    {
+        uint64_t due = client->timerDue;
+        client->timerDue = 0;
+        SendHeldMove(client, due);
+    }
+}
+
+static void Play(Client_t * client, int coalesce)
+{
+    unsigned i;
+
+    for (i = 0; i < s_eventCount; ++i)
+    {
+        const InputEvent_t * event = &s_events[i];
+        uint64_t now = event->time;
+        int clicks, mask, x = event->x, y = event->y;
+
+        if (!coalesce)
+        {
+            switch (event->type)
+            {
+                case kEventMove:
+                    SendPointer(client, x, y, client->buttons);
+                    break;
+                case kEventButtons:
+                    client->buttons = event->value;
+                    SendPointer(client, x, y, client->buttons);
+                    break;
+                case kEventScroll:
+                case kEventWheel:
+                    if (event->value)
+                    {
+                        SendPointer(client, x, y, client->buttons | (event->value > 0 ? kWheelUpMask : kWheelDownMask));
+                        SendPointer(client, x, y, client->buttons);
+                    }
+                    break;
+            }
+            continue;
+        }
+
+        FireTimer(client, now);
+        switch (event->type)
+        {
+            case kEventMove:
+                if (!client->hasHeldMove)
+                {
+                    client->heldSince = now;
+                }
+                client->hasHeldMove = 1;
+                client->heldX = x;
+                client->heldY = y;
+                if (client->timerDue)
+                {
+                    break;
+                }
+                if (MotionWindowNeedsRoundTrip(&client->motion, now))
+                {
+                    MotionWindowSetRoundTrip(&client->motion, client->roundTrip, now);
+                }
+                if (MotionWindowDelay(&client->motion, now) == 0)
+                {
+                    SendHeldMove(client, now);
+                }
+                else
+                {
+                    client->timerDue = now + MotionWindowDelay(&client->motion, now);
+                }
+                break;
+            case kEventButtons:
+                SendHeldMove(client, now);
+                client->buttons = event->value;
+                SendPointer(client, x, y, client->buttons);
+                break;
+            case kEventScroll:
+            case kEventWheel:
+                clicks = ScrollAccumulatorAdd(&client->scroll, event->type == kEventScroll, event->value, event->value);
+                mask = clicks > 0 ? kWheelUpMask : kWheelDownMask;
+                if (clicks)
+                {
+                    client->hasHeldMove = 0;
+                }
+                for (clicks = abs(clicks); clicks; --clicks)
+                {
+                    SendPointer(client, x, y, client->buttons | mask);
+                    SendPointer(client, x, y, client->buttons);
+                }
+                break;
+        }
+    }
+    if (client->timerDue)
+    {
+        FireTimer(client, client->timerDue);
+    }
+}
+
+//! The button masks of consecutive pointer events, with repeats dropped.
+static unsigned MaskChanges(const uint8_t * wire, size_t length, uint8_t * masks)
+{
+    unsigned count = 0;
+    size_t offset;
+
+    for (offset = 0; offset + kPointerEventSize <= length; offset += kPointerEventSize)
+    {
+        if (count == 0 || masks[count - 1] != wire[offset + 1])
+        {
+            masks[count++] = wire[offset + 1];
+        }
+    }
+    return count;
+}
+
+int main(int argc, char ** argv)
+{
+    static const double kRoundTrips[] = { 0.0002, 0.010, 0.030, 0.100 };
+    static uint8_t referenceMasks[kWireSize / kPointerEventSize], masks[kWireSize / kPointerEventSize];
+    unsigned referenceCount, events[4] = { 0 }, n, i;
+    size_t beforeBytes;
+    Client_t client;
+    int passed = 1;
+
+    if (argc > 1 ? ReadStream(argv[1]) < 0 : (MakeStream(), 0))
+    {
+        return 1;
+    }
+    for (i = 0; i < s_eventCount; ++i)
+    {
+        events[s_events[i].type]++;
+    }
+    printf("%u events: %u moves, %u button changes, %u scrolls, %u wheel notches over %.1f s\n",
+           s_eventCount, events[kEventMove], events[kEventButtons], events[kEventScroll], events[kEventWheel],
+           s_eventCount ? (s_events[s_eventCount - 1].time - s_events[0].time) / 1e9 : 0.0);
+
+    memset(&client, 0, sizeof(client));
+    s_wireLength = 0;
+    Play(&client, 0);
+    beforeBytes = s_wireLength;
+    referenceCount = MaskChanges(s_wire, s_wireLength, referenceMasks);
+
+    printf("%-10s %10s %9s %9s %9s %9s %12s\n", "rtt", "window ms", "messages", "bytes", "msgs/s", "saved", "max held ms");
+    printf("%-10s %10s %9zu %9zu %9.1f %9s %12s\n", "before", "", beforeBytes / kPointerEventSize, beforeBytes,
+           beforeBytes / kPointerEventSize / ((s_events[s_eventCount - 1].time - s_events[0].time) / 1e9), "", "");
+
+    for (n = 0; n < sizeof(kRoundTrips) / sizeof(kRoundTrips[0]); ++n)
+    {
+        SendQueueStatistics_t stats;
+        char label[16];
+
+        memset(&client, 0, sizeof(client));
+        client.queue = SendQueueCreate();
+        client.roundTrip = (uint64_t)(kRoundTrips[n] * 1e9);
+        s_wireLength = 0;
+        Play(&client, 1);
+        SendQueueGetStatistics(client.queue, &stats);
+        SendQueueDestroy(client.queue);
+
+        snprintf(label, sizeof(label), "%.1f ms", kRoundTrips[n] * 1e3);
+        printf("%-10s %10.2f %9zu %9zu %9.1f %8.0f%% %12.2f\n", label, client.motion.window / 1e6, s_wireLength / kPointerEventSize, s_wireLength,
+               s_wireLength / kPointerEventSize / ((s_events[s_eventCount - 1].time - s_events[0].time) / 1e9),
+               100.0 * (1.0 - (double)s_wireLength / beforeBytes), client.maxHeld / 1e6);
+
+        // Scrolling is sent differently, so only button 1-3 transitions are compared.
+        {
+            unsigned count = 0, referenceButtons = 0, j;
+            uint8_t a[256], b[256];
+            unsigned changes = MaskChanges(s_wire, s_wireLength, masks);
+
+            for (j = 0; j < referenceCount && referenceButtons < sizeof(a); ++j)
+            {
+                if (!(referenceMasks[j] & (kWheelUpMask | kWheelDownMask)) && (referenceButtons == 0 || a[referenceButtons - 1] != referenceMasks[j]))
+                {
+                    a[referenceButtons++] = referenceMasks[j];
+                }
+            }
+            for (j = 0; j < changes && count < sizeof(b); ++j)
+            {
+                if (!(masks[j] & (kWheelUpMask | kWheelDownMask)) && (count == 0 || b[count - 1] != masks[j]))
+                {
+                    b[count++] = masks[j];
+                }
+            }
+            if (count != referenceButtons || memcmp(a, b, count) != 0)
+            {
+                fprintf(stderr, "%s: button changes differ\n", label);
+                passed = 0;
+            }
+        }
+        if (client.lastX != s_events[s_eventCount - 1].x || client.lastY != s_events[s_eventCount - 1].y)
+        {
+            fprintf(stderr, "%s: last position %d,%d is not the input's\n", label, client.lastX, client.lastY);
+            passed = 0;
+        }
+    }
+
+    printf("%s\n", passed ? "passed" : "FAILED");
+    return passed ? 0 : 1;
+}
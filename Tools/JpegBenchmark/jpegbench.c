@@ -0,0 +1,381 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//! @file jpegbench.c
+//! @brief Benchmark for decoding Tight JPEG rects.
+//!
+//! Splits a video-like frame into rects the size a Tight server sends, compresses each at the
+//! JPEG quality of every Tight quality level, and decodes them in two ways: as
+//! TightEncodingReader used to, setting up a libjpeg decompressor per rect, decoding RGB rows
+//! and looking each channel up in the colour tables, and as it does now, with one TightJpeg
+//! decoder writing rows in the framebuffer's layout. Both ways must produce the same
+//! framebuffer.
+//!
+//! Options: --size <width>x<height>, --rect <width>x<height>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#if __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+#include <jpeglib.h>
+
+#include "TightJpeg.h"
+#include "PixelConverter.h"
+
+#define kMinimumSeconds 0.5
+
+//! JPEG quality of each Tight quality level, as used by TightVNC and libvncserver.
+static const int kQuality[10] = { 5, 10, 15, 25, 37, 50, 60, 70, 75, 80 };
+
+typedef struct
+{
+    const char * name;
+    unsigned colorBytes;
+    unsigned maxValue;
+    unsigned redShift, greenShift, blueShift;   //!< Little endian host.
+} Format_t;
+
+//! Framebuffer colours of TrueColorFrameBuffer, a BGR variant of it, and HighColorFrameBuffer.
+static const Format_t kFormats[] = {
+    { "RGBX", 4, 255, 0, 8, 16 },
+    { "BGRX", 4, 255, 16, 8, 0 },
+    { "444", 2, 15, 4, 0, 12 },
+};
+
+static unsigned gWidth = 1920;
+static unsigned gHeight = 1080;
+static unsigned gRectWidth = 256;
+static unsigned gRectHeight = 256;
+
+typedef struct
+{
+    unsigned x, y, width, height;
+    uint8_t * data;
+    unsigned long length;
+} Rect_t;
+
+typedef struct
+{
+    Rect_t * rects;
+    unsigned count;
+    size_t length;
+} Frame_t;
+
+typedef struct
+{
+    const Format_t * format;
+    unsigned int redClut[256];
+    unsigned int greenClut[256];
+    unsigned int blueClut[256];
+    uint8_t * framebuffer;
+} Target_t;
+
+static uint64_t NowNanoseconds(void)
+{
+#if __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+    {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+//! Makes a video-like picture: smooth shading with a few soft highlights and some grain.
+static void MakePicture(uint8_t * rgb)
+{
+    unsigned x, y;
+    srand(1);
+    for (y = 0; y < gHeight; ++y)
+    {
+        for (x = 0; x < gWidth; ++x)
+        {
+            uint8_t * p = rgb + ((size_t)y * gWidth + x) * 3;
+            double fx = (double)x / gWidth, fy = (double)y / gHeight;
+            double glow = exp(-((fx - 0.3) * (fx - 0.3) + (fy - 0.4) * (fy - 0.4)) * 20);
+            int grain = rand() % 17 - 8;
+            int r = (int)(60 + 120 * fx + 70 * glow) + grain;
+            int g = (int)(40 + 100 * fy + 90 * glow * sin(fx * 9)) + grain;
+            int b = (int)(90 + 80 * sin(fx * 5 + fy * 3) + 50 * glow) + grain;
+            p[0] = r < 0 ? 0 : r > 255 ? 255 : r;
+            p[1] = g < 0 ? 0 : g > 255 ? 255 : g;
+            p[2] = b < 0 ? 0 : b > 255 ? 255 : b;
+        }
+    }
+}
+
+static void Compress(Frame_t * frame, const uint8_t * rgb, int quality)
+{
+    unsigned x, y, n = 0;
+    frame->count = ((gWidth + gRectWidth - 1) / gRectWidth) * ((gHeight + gRectHeight - 1) / gRectHeight);
+    frame->rects = calloc(frame->count, sizeof(Rect_t));
+    frame->length = 0;
+    for (y = 0; y < gHeight; y += gRectHeight)
+    {
+        for (x = 0; x < gWidth; x += gRectWidth)
+        {
+            struct jpeg_compress_struct info;
+            struct jpeg_error_mgr error;
+            Rect_t * r = &frame->rects[n++];
+            JSAMPROW row;
+
+            r->x = x;
+            r->y = y;
+            r->width = gWidth - x < gRectWidth ? gWidth - x : gRectWidth;
+            r->height = gHeight - y < gRectHeight ? gHeight - y : gRectHeight;
+            info.err = jpeg_std_error(&error);
+            jpeg_create_compress(&info);
+            jpeg_mem_dest(&info, &r->data, &r->length);
+            info.image_width = r->width;
+            info.image_height = r->height;
+            info.input_components = 3;
+            info.in_color_space = JCS_RGB;
+            jpeg_set_defaults(&info);
+            jpeg_set_quality(&info, quality, TRUE);
+            jpeg_start_compress(&info, TRUE);
+            while (info.next_scanline < r->height)
+            {
+                row = (JSAMPROW)(rgb + ((size_t)(y + info.next_scanline) * gWidth + x) * 3);
+                jpeg_write_scanlines(&info, &row, 1);
+            }
+            jpeg_finish_compress(&info);
+            jpeg_destroy_compress(&info);
+            frame->length += r->length;
+        }
+    }
+}
+
+static void FreeFrame(Frame_t * frame)
+{
+    unsigned n;
+    for (n = 0; n < frame->count; ++n)
+    {
+        free(frame->rects[n].data);
+    }
+    free(frame->rects);
+}
+
+//! TightEncodingReader before TightJpeg.
+static void DecodeBefore(const Frame_t * frame, Target_t * target)
+{
+    unsigned colorBytes = target->format->colorBytes;
+    size_t rowBytes = (size_t)gWidth * colorBytes;
+    unsigned n;
+
+    for (n = 0; n < frame->count; ++n)
+    {
+        const Rect_t * r = &frame->rects[n];
+        struct jpeg_decompress_struct info;
+        struct jpeg_error_mgr error;
+        JSAMPROW row;
+        uint8_t * buffer;
+        unsigned y = r->y, i;
+
+        info.err = jpeg_std_error(&error);
+        jpeg_create_decompress(&info);
+        jpeg_mem_src(&info, r->data, r->length);
+        jpeg_read_header(&info, TRUE);
+        info.out_color_space = JCS_RGB;
+        jpeg_start_decompress(&info);
+        buffer = malloc(3 * r->width);
+        row = buffer;
+        while (info.output_scanline < info.output_height)
+        {
+            const uint8_t * rgb = buffer;
+            uint8_t * dest = target->framebuffer + y++ * rowBytes + r->x * colorBytes;
+            jpeg_read_scanlines(&info, &row, 1);
+            for (i = 0; i < r->width; ++i, rgb += 3)
+            {
+                unsigned color = target->redClut[rgb[0]] + target->greenClut[rgb[1]] + target->blueClut[rgb[2]];
+                if (colorBytes == 4)
+                {
+                    ((uint32_t *)dest)[i] = color;
+                }
+                else
+                {
+                    ((uint16_t *)dest)[i] = color;
+                }
+            }
+        }
+        free(buffer);
+        jpeg_finish_decompress(&info);
+        jpeg_destroy_decompress(&info);
+    }
+}
+
+//! TightEncodingReader with TightJpeg.
+static void DecodeAfter(const Frame_t * frame, Target_t * target, TightJpeg_t * decoder, const PixelConverter_t * converter, TightJpegLayout layout)
+{
+    unsigned colorBytes = target->format->colorBytes;
+    size_t rowBytes = (size_t)gWidth * colorBytes;
+    unsigned n;
+
+    for (n = 0; n < frame->count; ++n)
+    {
+        const Rect_t * r = &frame->rects[n];
+        if (TightJpegDecode(decoder, r->data, r->length, r->width, r->height, layout,
+                            PixelConverterIsCopy(converter) ? NULL : converter,
+                            target->framebuffer + r->y * rowBytes + r->x * colorBytes, rowBytes) < 0)
+        {
+            fprintf(stderr, "decoding failed: %s\n", TightJpegErrorMessage(decoder));
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char * argv[])
+{
+    int i;
+    for (i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc && sscanf(argv[i + 1], "%ux%u", &gWidth, &gHeight) == 2)
+        {
+            ++i;
+        }
+        else if (strcmp(argv[i], "--rect") == 0 && i + 1 < argc && sscanf(argv[i + 1], "%ux%u", &gRectWidth, &gRectHeight) == 2)
+        {
+            ++i;
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--size <width>x<height>] [--rect <width>x<height>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (gWidth == 0 || gHeight == 0 || gRectWidth == 0 || gRectHeight == 0)
+    {
+        fprintf(stderr, "sizes must not be zero\n");
+        return 1;
+    }
+
+    uint8_t * rgb = malloc((size_t)gWidth * gHeight * 3);
+    size_t pixels = (size_t)gWidth * gHeight;
+    uint8_t * expected = malloc(pixels * 4);
+    uint8_t * actual = malloc(pixels * 4);
+    TightJpeg_t * decoder = TightJpegCreate();
+    MakePicture(rgb);
+
+    printf("%ux%u frame in %ux%u rects\n", gWidth, gHeight, gRectWidth, gRectHeight);
+    printf("%-5s %-7s %8s %-6s %-16s %12s %12s %8s\n", "level", "quality", "KB", "format", "kernel", "before MP/s", "after MP/s", "speedup");
+
+    int failures = 0;
+    unsigned level;
+    for (level = 0; level < 10; ++level)
+    {
+        Frame_t frame;
+        unsigned n;
+
+        Compress(&frame, rgb, kQuality[level]);
+        for (n = 0; n < sizeof(kFormats) / sizeof(kFormats[0]); ++n)
+        {
+            const Format_t * f = &kFormats[n];
+            Target_t before, after;
+            PixelConverter_t converter;
+            TightJpegLayout layout;
+            unsigned v;
+
+            // The colour tables -[FrameBuffer setPixelFormat:] builds for an 8-bit server
+            // format, without gamma correction.
+            before.format = f;
+            for (v = 0; v < 256; ++v)
+            {
+                before.redClut[v] = (unsigned)(v / 255.0 * f->maxValue + 0.5) << f->redShift;
+                before.greenClut[v] = (unsigned)(v / 255.0 * f->maxValue + 0.5) << f->greenShift;
+                before.blueClut[v] = (unsigned)(v / 255.0 * f->maxValue + 0.5) << f->blueShift;
+            }
+            after = before;
+            before.framebuffer = expected;
+            after.framebuffer = actual;
+            if (TightJpegConverterInit(&converter, &layout, after.redClut, after.greenClut, after.blueClut, f->colorBytes) < 0)
+            {
+                fprintf(stderr, "%s: could not set up converter\n", f->name);
+                return 1;
+            }
+
+            double best[2] = { 0, 0 };
+            int pass;
+            for (pass = 0; pass < 2; ++pass)
+            {
+                uint64_t start = NowNanoseconds();
+                do
+                {
+                    uint64_t begin = NowNanoseconds();
+                    if (pass == 0)
+                    {
+                        DecodeBefore(&frame, &before);
+                    }
+                    else
+                    {
+                        DecodeAfter(&frame, &after, decoder, &converter, layout);
+                    }
+                    double rate = (double)pixels / ((NowNanoseconds() - begin) * 1e-9) / 1e6;
+                    if (rate > best[pass])
+                    {
+                        best[pass] = rate;
+                    }
+                } while (NowNanoseconds() - start < kMinimumSeconds * 1e9);
+            }
+
+            // Rows decoded in place keep the 0xff libjpeg writes to the unused byte.
+            size_t p;
+            for (p = 0; p < pixels; ++p)
+            {
+                uint32_t a, e, mask = before.redClut[255] | before.greenClut[255] | before.blueClut[255];
+                if (f->colorBytes == 4)
+                {
+                    a = ((uint32_t *)actual)[p];
+                    e = ((uint32_t *)expected)[p];
+                }
+                else
+                {
+                    a = ((uint16_t *)actual)[p];
+                    e = ((uint16_t *)expected)[p];
+                }
+                if ((a & mask) != (e & mask))
+                {
+                    fprintf(stderr, "level %u %s: pixel %zu differs (%08x, expected %08x)\n", level, f->name, p, a, e);
+                    ++failures;
+                    break;
+                }
+            }
+
+            printf("%-5u %-7d %8.1f %-6s %-16s %12.1f %12.1f %7.2fx\n", level, kQuality[level], frame.length / 1e3, f->name,
+                   PixelConverterIsCopy(&converter) ? "in place" : converter.kernelName, best[0], best[1], best[1] / best[0]);
+            PixelConverterFree(&converter);
+        }
+        FreeFrame(&frame);
+    }
+
+    TightJpegDestroy(decoder);
+    free(rgb);
+    free(expected);
+    free(actual);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//! @file pixelbench.c
+//! @brief Microbenchmark for the pixel format converters.
+//!
+//! Converts a buffer of random server pixels for each common server format into the colours of
+//! each framebuffer class, once with the per-pixel channel table loop that FrameBufferDrawing.h
+//! used and once with PixelConverter, checks that both produce the same colours, including
+//! single pixel conversion, and prints the throughput of each.
+//!
+//! Pass --gamma <value> to benchmark with a gamma correction other than 1.0, which rules out
+//! the byte rearranging kernels.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#if __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+#include "PixelConverter.h"
+
+#define kWidth 1024
+#define kHeight 256
+#define kMinimumSeconds 0.25
+
+typedef struct
+{
+    const char * name;
+    unsigned bytes;         //!< Bytes per server pixel; 3 for compact 24-bit pixels.
+    int bigEndian;
+    unsigned redMax, greenMax, blueMax;
+    unsigned redShift, greenShift, blueShift;
+} Format_t;
+
+static const Format_t kFormats[] = {
+    { "32bpp RGBX little endian", 4, 0, 255, 255, 255, 0, 8, 16 },
+    { "32bpp BGRX little endian", 4, 0, 255, 255, 255, 16, 8, 0 },
+    { "32bpp RGBX big endian", 4, 1, 255, 255, 255, 24, 16, 8 },
+    { "32bpp BGRX big endian", 4, 1, 255, 255, 255, 8, 16, 24 },
+    { "24bpp CPIXEL little endian", 3, 0, 255, 255, 255, 16, 8, 0 },
+    { "24bpp CPIXEL big endian", 3, 1, 255, 255, 255, 16, 8, 0 },
+    { "16bpp 565 little endian", 2, 0, 31, 63, 31, 11, 5, 0 },
+    { "16bpp 565 big endian", 2, 1, 31, 63, 31, 11, 5, 0 },
+    { "16bpp 555 little endian", 2, 0, 31, 31, 31, 10, 5, 0 },
+    { "8bpp BGR233", 1, 0, 7, 7, 3, 0, 3, 6 },
+};
+
+typedef struct
+{
+    const char * name;
+    unsigned bytes;         //!< sizeof(FBColor).
+    unsigned maxValue;
+    unsigned rshift, gshift, bshift;    //!< Channel positions on a little endian host.
+    unsigned bigRshift, bigGshift, bigBshift;   //!< Channel positions on a big endian host.
+    double rweight, gweight, bweight;
+} FrameBufferClass_t;
+
+//! The framebuffer classes, as set up by their -initWithSize:andFormat:.
+static const FrameBufferClass_t kClasses[] = {
+    { "TrueColor", 4, 255, 0, 8, 16, 24, 16, 8, 1.0, 1.0, 1.0 },
+    { "HighColor", 2, 15, 4, 0, 12, 12, 8, 4, 1.0, 1.0, 1.0 },
+    { "LowColor", 1, 3, 6, 4, 2, 6, 4, 2, 1.0, 1.0, 1.0 },
+    { "GrayScale", 1, 255, 0, 0, 0, 0, 0, 0, 0.3, 0.59, 0.11 },
+};
+
+//! Channel tables of the framebuffer, built as -[FrameBuffer setPixelFormat:] does.
+static unsigned int gRedClut[256];
+static unsigned int gGreenClut[256];
+static unsigned int gBlueClut[256];
+
+static uint64_t NowNanoseconds(void)
+{
+#if __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+    {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void BuildCluts(const Format_t * f, const FrameBufferClass_t * fb, double gamma, int hostBig)
+{
+    unsigned rshift = hostBig ? fb->bigRshift : fb->rshift;
+    unsigned gshift = hostBig ? fb->bigGshift : fb->gshift;
+    unsigned bshift = hostBig ? fb->bigBshift : fb->bshift;
+    unsigned i;
+
+    memset(gRedClut, 0, sizeof(gRedClut));
+    memset(gGreenClut, 0, sizeof(gGreenClut));
+    memset(gBlueClut, 0, sizeof(gBlueClut));
+    for (i = 0; i <= f->redMax; ++i)
+    {
+        gRedClut[i] = (int)(fb->rweight * pow((double)i / f->redMax, 1.0 / gamma) * fb->maxValue + 0.5) << rshift;
+    }
+    for (i = 0; i <= f->greenMax; ++i)
+    {
+        gGreenClut[i] = (int)(fb->gweight * pow((double)i / f->greenMax, 1.0 / gamma) * fb->maxValue + 0.5) << gshift;
+    }
+    for (i = 0; i <= f->blueMax; ++i)
+    {
+        gBlueClut[i] = (int)(fb->bweight * pow((double)i / f->blueMax, 1.0 / gamma) * fb->maxValue + 0.5) << bshift;
+    }
+}
+
+//! Stands in for the -serverIsBigEndian message sent by the old per-pixel code.
+__attribute__((noinline))
+static int ServerIsBigEndian(const Format_t * f)
+{
+    return f->bigEndian;
+}
+
+//! The per-pixel conversion that FrameBufferDrawing.h used for a whole rect.
+static void ConvertReference(const Format_t * f, const FrameBufferClass_t * fb, const uint8_t * v, void * dest, unsigned count)
+{
+    uint8_t * out = dest;
+    while (count--)
+    {
+        unsigned pix = 0;
+        switch (f->bytes)
+        {
+            case 1:
+                pix = *v++;
+                break;
+            case 2:
+                if (ServerIsBigEndian(f))
+                {
+                    pix = *v++; pix <<= 8; pix += *v++;
+                }
+                else
+                {
+                    pix = *v++; pix += (((unsigned)*v++) << 8);
+                }
+                break;
+            case 3:
+                if (ServerIsBigEndian(f))
+                {
+                    pix = *v++; pix <<= 8; pix += *v++; pix <<= 8; pix += *v++;
+                }
+                else
+                {
+                    pix = *v++; pix += (((unsigned)*v++) << 8); pix += (((unsigned)*v++) << 16);
+                }
+                break;
+            default:
+                if (ServerIsBigEndian(f))
+                {
+                    pix = *v++; pix <<= 8; pix += *v++; pix <<= 8; pix += *v++; pix <<= 8; pix += *v++;
+                }
+                else
+                {
+                    pix = *v++; pix += (((unsigned)*v++) << 8); pix += (((unsigned)*v++) << 16); pix += (((unsigned)*v++) << 24);
+                }
+                break;
+        }
+        unsigned color = gRedClut[(pix >> f->redShift) & f->redMax]
+            + gGreenClut[(pix >> f->greenShift) & f->greenMax]
+            + gBlueClut[(pix >> f->blueShift) & f->blueMax];
+        switch (fb->bytes)
+        {
+            case 1:
+                *out = color;
+                break;
+            case 2:
+                *(uint16_t *)out = color;
+                break;
+            default:
+                *(uint32_t *)out = color;
+                break;
+        }
+        out += fb->bytes;
+    }
+}
+
+static uint32_t ReadColor(const uint8_t * color, unsigned bytes)
+{
+    switch (bytes)
+    {
+        case 1:
+            return *color;
+        case 2:
+            return *(const uint16_t *)color;
+        default:
+            return *(const uint32_t *)color;
+    }
+}
+
+//! Returns megapixels per second for converting the whole buffer, best of several runs.
+static double Measure(const Format_t * f, const FrameBufferClass_t * fb, const PixelConverter_t * converter, const uint8_t * source, uint8_t * dest)
+{
+    double best = 0;
+    uint64_t start = NowNanoseconds();
+    do
+    {
+        uint64_t begin = NowNanoseconds();
+        unsigned row;
+        for (row = 0; row < kHeight; ++row)
+        {
+            const uint8_t * in = source + (size_t)row * kWidth * f->bytes;
+            uint8_t * out = dest + (size_t)row * kWidth * fb->bytes;
+            if (converter)
+            {
+                PixelConverterConvertRow(converter, in, out, kWidth);
+            }
+            else
+            {
+                ConvertReference(f, fb, in, out, kWidth);
+            }
+        }
+        double rate = (double)kWidth * kHeight / ((NowNanoseconds() - begin) * 1e-9) / 1e6;
+        if (rate > best)
+        {
+            best = rate;
+        }
+    } while (NowNanoseconds() - start < kMinimumSeconds * 1e9);
+    return best;
+}
+
+int main(int argc, char * argv[])
+{
+    double gamma = 1.0;
+    if (argc == 3 && strcmp(argv[1], "--gamma") == 0)
+    {
+        gamma = atof(argv[2]);
+    }
+    else if (argc != 1)
+    {
+        fprintf(stderr, "usage: %s [--gamma <value>]\n", argv[0]);
+        return 1;
+    }
+
+    union
+    {
+        uint16_t s;
+        uint8_t c[2];
+    } host = { 0x1234 };
+    int hostBig = host.c[0] == 0x12;
+
+    size_t pixels = (size_t)kWidth * kHeight;
+    uint8_t * source = malloc(pixels * 4);
+    uint8_t * expected = malloc(pixels * sizeof(uint32_t));
+    uint8_t * actual = malloc(pixels * sizeof(uint32_t));
+    size_t i;
+    srand(1);
+    for (i = 0; i < pixels * 4; ++i)
+    {
+        source[i] = rand();
+    }
+
+    printf("%-28s %-10s %-16s %12s %12s %8s\n", "format", "framebuffer", "kernel", "scalar MP/s", "kernel MP/s", "speedup");
+    int failures = 0;
+    unsigned n, k;
+    for (n = 0; n < sizeof(kFormats) / sizeof(kFormats[0]); ++n)
+    {
+        for (k = 0; k < sizeof(kClasses) / sizeof(kClasses[0]); ++k)
+        {
+            const Format_t * f = &kFormats[n];
+            const FrameBufferClass_t * fb = &kClasses[k];
+            rfbPixelFormat format;
+            memset(&format, 0, sizeof(format));
+            format.redMax = f->redMax;
+            format.greenMax = f->greenMax;
+            format.blueMax = f->blueMax;
+            format.redShift = f->redShift;
+            format.greenShift = f->greenShift;
+            format.blueShift = f->blueShift;
+            BuildCluts(f, fb, gamma, hostBig);
+
+            PixelConverter_t converter;
+            if (PixelConverterInit(&converter, &format, f->bytes, f->bigEndian, gRedClut, gGreenClut, gBlueClut, fb->bytes) < 0)
+            {
+                fprintf(stderr, "%s: could not set up converter\n", f->name);
+                return 1;
+            }
+
+            double scalar = Measure(f, fb, NULL, source, expected);
+            double kernel = Measure(f, fb, &converter, source, actual);
+
+            // The copy kernel carries the server's unused byte through, which nothing reads.
+            uint32_t mask = fb->bytes == 4 ? (gRedClut[f->redMax] | gGreenClut[f->greenMax] | gBlueClut[f->blueMax]) : 0xffffffff;
+            for (i = 0; i < pixels; ++i)
+            {
+                uint32_t want = ReadColor(expected + i * fb->bytes, fb->bytes);
+                uint32_t got = ReadColor(actual + i * fb->bytes, fb->bytes);
+                uint32_t single = want;
+                if (i < kWidth)
+                {
+                    // The single pixel functions are checked on the first row only.
+                    single = PixelConverterConvertPixel(&converter, source + i * f->bytes);
+                }
+                if ((want & mask) != (got & mask) || (want & mask) != (single & mask))
+                {
+                    fprintf(stderr, "%s to %s: pixel %zu differs (%08x and %08x, expected %08x)\n", f->name, fb->name, i, got, single, want);
+                    ++failures;
+                    break;
+                }
+            }
+
+            printf("%-28s %-10s %-16s %12.1f %12.1f %7.2fx\n", f->name, fb->name, converter.kernelName, scalar, kernel, kernel / scalar);
+            PixelConverterFree(&converter);
+        }
+    }
+
+    free(source);
+    free(expected);
+    free(actual);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//! @file rrebench.c
+//! @brief Correctness check and benchmark for the RRE and CoRRE subrect kernel.
+//!
+//! Encodes random subrects in both geometries and fills them twice: one pixel conversion and
+//! one fill per subrect, the way the readers used to apart from the rectangle list, and with
+//! RREDrawSubrects(). Both must give the same pixels.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#if __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+#include "RRERects.h"
+#include "FrameBufferRows.h"
+
+#define kMinimumSeconds 0.5
+#define kRectSize 255
+#define kSubrectCount 4096
+
+static uint64_t NowNanoseconds(void)
+{
+#if __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+    {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+//! Encodes random subrects up to @a maxSize square, drawing their pixels from @a colors
+//! different values.
+static uint8_t * EncodeSubrects(uint8_t * p, unsigned geometryBytes, unsigned maxSize, unsigned colors)
+{
+    unsigned i;
+
+    for (i = 0; i < kSubrectCount; ++i)
+    {
+        unsigned color = rand() % colors;
+        unsigned x = rand() % kRectSize, y = rand() % kRectSize;
+        unsigned w = 1 + rand() % maxSize, h = 1 + rand() % maxSize;
+
+        // Some subrects reach outside the rect and are clipped.
+        p[0] = color * 37;
+        p[1] = color * 101;
+        p[2] = color * 7;
+        p[3] = 0;
+        p += 4;
+        if (geometryBytes == kRRESubrectGeometry)
+        {
+            uint16_t v[4] = { x, y, w, h };
+            unsigned k;
+            for (k = 0; k < 4; ++k)
+            {
+                *p++ = v[k] >> 8;
+                *p++ = v[k] & 0xff;
+            }
+        }
+        else
+        {
+            *p++ = x;
+            *p++ = y;
+            *p++ = w;
+            *p++ = h;
+        }
+    }
+    return p;
+}
+
+//! One conversion and one fill per subrect, for 4-byte colours.
+static void ReferenceSubrects(const PixelConverter_t * c, const uint8_t * p, unsigned geometryBytes, uint32_t * dest)
+{
+    unsigned i;
+
+    for (i = 0; i < kSubrectCount; ++i)
+    {
+        uint32_t color = PixelConverterConvertPixel(c, p);
+        unsigned x, y, w, h;
+
+        p += 4;
+        if (geometryBytes == kRRESubrectGeometry)
+        {
+            x = (p[0] << 8) | p[1];
+            y = (p[2] << 8) | p[3];
+            w = (p[4] << 8) | p[5];
+            h = (p[6] << 8) | p[7];
+        }
+        else
+        {
+            x = p[0];
+            y = p[1];
+            w = p[2];
+            h = p[3];
+        }
+        p += geometryBytes;
+        if (x + w > kRectSize)
+        {
+            w = kRectSize - x;
+        }
+        if (y + h > kRectSize)
+        {
+            h = kRectSize - y;
+        }
+        FrameBufferFillRect(dest + y * kRectSize + x, kRectSize * 4, 4, color, w, h);
+    }
+}
+
+static const struct
+{
+    const char * name;
+    unsigned geometryBytes;
+    unsigned maxSize;
+    unsigned colors;
+} kCases[] = {
+    { "rre/small/2", kRRESubrectGeometry, 4, 2 },
+    { "rre/small/256", kRRESubrectGeometry, 4, 256 },
+    { "rre/large/16", kRRESubrectGeometry, 64, 16 },
+    { "corre/small/2", kCoRRESubrectGeometry, 4, 2 },
+    { "corre/small/256", kCoRRESubrectGeometry, 4, 256 },
+    { "corre/large/16", kCoRRESubrectGeometry, 64, 16 },
+};
+
+int main(void)
+{
+    static uint32_t clut[3][256];
+    rfbPixelFormat format = { 32, 24, 0, 1, 255, 255, 255, 0, 8, 16, 0, 0 };
+    PixelConverter_t converter;
+    uint32_t * out[2];
+    uint8_t * data;
+    unsigned i, n;
+
+    for (i = 0; i < 256; ++i)
+    {
+        clut[0][i] = i;
+        clut[1][i] = i << 8;
+        clut[2][i] = i << 16;
+    }
+    if (PixelConverterInit(&converter, &format, 4, 0, clut[0], clut[1], clut[2], 4) < 0)
+    {
+        fprintf(stderr, "format should be supported\n");
+        return 1;
+    }
+    data = malloc(kSubrectCount * (4 + kRRESubrectGeometry));
+    out[0] = calloc(kRectSize * kRectSize, 4);
+    out[1] = calloc(kRectSize * kRectSize, 4);
+
+    printf("%-16s %16s %16s %8s\n", "subrects", "reference Mrect/s", "kernel Mrect/s", "speedup");
+    for (n = 0; n < sizeof(kCases) / sizeof(kCases[0]); ++n)
+    {
+        double rates[2];
+        int pass;
+
+        srand(n + 1);
+        EncodeSubrects(data, kCases[n].geometryBytes, kCases[n].maxSize, kCases[n].colors);
+
+        for (pass = 0; pass < 2; ++pass)
+        {
+            uint64_t start = NowNanoseconds(), elapsed;
+            uint64_t rects = 0;
+            do
+            {
+                if (pass == 0)
+                {
+                    ReferenceSubrects(&converter, data, kCases[n].geometryBytes, out[0]);
+                }
+                else
+                {
+                    RREDrawSubrects(&converter, data, kSubrectCount, kCases[n].geometryBytes, out[1], kRectSize * 4, kRectSize, kRectSize);
+                }
+                rects += kSubrectCount;
+                elapsed = NowNanoseconds() - start;
+            } while (elapsed < kMinimumSeconds * 1e9);
+            rates[pass] = (double)rects / (double)elapsed * 1e3;
+        }
+
+        if (memcmp(out[0], out[1], kRectSize * kRectSize * 4) != 0)
+        {
+            fprintf(stderr, "%s: filled pixels differ\n", kCases[n].name);
+            return 1;
+        }
+        printf("%-16s %16.1f %16.1f %7.2fx\n", kCases[n].name, rates[0], rates[1], rates[1] / rates[0]);
+    }
+
+    PixelConverterFree(&converter);
+    free(data);
+    free(out[0]);
+    free(out[1]);
+    return 0;
+}
@@ -0,0 +1,422 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//! @file reactorbench.c
+//! @brief Measures what idle and lightly busy connections cost with IOReactor.
+//!
+//! Opens a number of TCP connections over loopback and reads the client end of each one in
+//! two ways:
+//!     - "threads" is the old reader: a thread per connection that blocks in select() on its
+//!       socket, asks FIONREAD how much is waiting and reads that much;
+//!     - "reactor" registers every socket with one IOReactor, whose callback reads until the
+//!       socket would block, as RFBConnection's reader stage does.
+//! Each run first leaves the connections idle, then has the server end of every connection
+//! send a small message at a fixed rate, as a server does for a slowly changing screen.
+//! For both phases it reports wakeups per second, CPU time per connection and threads. CPU
+//! time is for the whole process, so the active phase includes the sending thread, which is
+//! the same for both readers.
+//!
+//! The connection counts to run can be given as arguments; the default is 1 10 40 80 200.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "IOReactor.h"
+
+#define kMaxConnections (1000)
+#define kIdleSeconds (2.0)
+#define kActiveSeconds (2.0)
+#define kMessagesPerSecond (30)     //!< Per connection during the active phase.
+#define kMessageSize (64)
+
+typedef struct _Connection
+{
+    int clientFD;       //!< End that is read.
+    int serverFD;       //!< End that sends.
+    pthread_t thread;
+    IOReactorSourceID_t source;
+} Connection_t;
+
+typedef struct _Sample
+{
+    double seconds;
+    double cpuSeconds;
+    uint64_t wakeups;
+    uint64_t switches;
+} Sample_t;
+
+static Connection_t s_connections[kMaxConnections];
+static volatile uint64_t s_threadWakeups;
+static volatile uint64_t s_bytesReceived;
+
+static double Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void SleepSeconds(double seconds)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    {
+    }
+}
+
+//! Number of threads in the process, or 0 where it can't be read.
+static unsigned ThreadCount(void)
+{
+    unsigned count = 0;
+#if defined(__linux__)
+    char line[256];
+    FILE * status = fopen("/proc/self/status", "r");
+
+    while (status && fgets(line, sizeof(line), status))
+    {
+        if (sscanf(line, "Threads: %u", &count) == 1)
+        {
+            break;
+        }
+    }
+    if (status)
+    {
+        fclose(status);
+    }
+#endif
+    return count;
+}
+
+static void TakeSample(Sample_t * sample, IOReactor_t * reactor)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    sample->seconds = Now();
+    sample->cpuSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    sample->switches = (uint64_t)usage.ru_nvcsw + (uint64_t)usage.ru_nivcsw;
+    if (reactor)
+    {
+        IOReactorStatistics_t stats;
+        IOReactorGetStatistics(reactor, &stats);
+        sample->wakeups = stats.wakeups;
+    }
+    else
+    {
+        sample->wakeups = __sync_fetch_and_add(&s_threadWakeups, 0);
+    }
+}
+
+static int OpenConnections(unsigned count)
+{
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    unsigned i;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0
+        || listen(listener, 128) < 0 || getsockname(listener, (struct sockaddr *)&address, &length) < 0)
+    {
+        perror("listen");
+        return -1;
+    }
+    for (i = 0; i < count; ++i)
+    {
+        Connection_t * connection = &s_connections[i];
+
+        memset(connection, 0, sizeof(*connection));
+        connection->clientFD = socket(AF_INET, SOCK_STREAM, 0);
+        if (connection->clientFD < 0 || connect(connection->clientFD, (struct sockaddr *)&address, sizeof(address)) < 0
+            || (connection->serverFD = accept(listener, NULL, NULL)) < 0)
+        {
+            perror("connect");
+            close(listener);
+            return -1;
+        }
+        setsockopt(connection->serverFD, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    close(listener);
+    return 0;
+}
+
+//! The old reader thread: select(), FIONREAD, read().
+static void * ReaderThread(void * context)
+{
+    Connection_t * connection = (Connection_t *)context;
+    uint8_t buffer[4096];
+
+    for (;;)
+    {
+        fd_set readSet;
+        int waiting = 0;
+        ssize_t n;
+
+        FD_ZERO(&readSet);
+        FD_SET(connection->clientFD, &readSet);
+        if (select(connection->clientFD + 1, &readSet, NULL, NULL, NULL) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        __sync_fetch_and_add(&s_threadWakeups, 1);
+        if (ioctl(connection->clientFD, FIONREAD, &waiting) < 0)
+        {
+            break;
+        }
+        if (waiting <= 0)
+        {
+            waiting = 1;    // Read the end of the stream.
+        }
+        n = read(connection->clientFD, buffer, waiting < (int)sizeof(buffer) ? waiting : (int)sizeof(buffer));
+        if (n <= 0)
+        {
+            break;
+        }
+        __sync_fetch_and_add(&s_bytesReceived, (uint64_t)n);
+    }
+    return NULL;
+}
+
+static int ReactorCallback(void * context, int fd)
+{
+    uint8_t buffer[4096];
+    ssize_t n;
+
+    (void)context;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        __sync_fetch_and_add(&s_bytesReceived, (uint64_t)n);
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        return kIOReactorRemove;
+    }
+    return kIOReactorContinue;
+}
+
+//! Sends one message on every connection at kMessagesPerSecond for kActiveSeconds.
+//! @return Bytes sent.
+static uint64_t SendMessages(unsigned count)
+{
+    uint8_t message[kMessageSize];
+    double start = Now();
+    uint64_t sent = 0;
+    unsigned tick;
+    unsigned ticks = (unsigned)(kActiveSeconds * kMessagesPerSecond);
+    unsigned i;
+
+    memset(message, 0x5a, sizeof(message));
+    for (tick = 0; tick < ticks; ++tick)
+    {
+        double wait = start + (double)tick / kMessagesPerSecond - Now();
+
+        if (wait > 0)
+        {
+            SleepSeconds(wait);
+        }
+        for (i = 0; i < count; ++i)
+        {
+            if (write(s_connections[i].serverFD, message, sizeof(message)) == (ssize_t)sizeof(message))
+            {
+                sent += sizeof(message);
+            }
+        }
+    }
+    return sent;
+}
+
+static void Report(const char * model, unsigned count, const char * phase, const Sample_t * before, const Sample_t * after, unsigned threads, uint64_t messages)
+{
+    double seconds = after->seconds - before->seconds;
+    double cpu = after->cpuSeconds - before->cpuSeconds;
+    uint64_t wakeups = after->wakeups - before->wakeups;
+
+    printf("%-8s %6u %-7s %8u %12.1f %14.2f %12.1f %12.1f", model, count, phase, threads,
+           wakeups / seconds, cpu / seconds * 1e6 / count, (after->switches - before->switches) / seconds,
+           cpu / seconds * 100.0);
+    if (messages)
+    {
+        printf(" %12.2f", cpu * 1e6 / messages);
+    }
+    printf("\n");
+}
+
+//! @return 0 if every byte sent was read.
+static int Run(unsigned count, int useReactor)
+{
+    const char * model = useReactor ? "reactor" : "threads";
+    IOReactor_t * reactor = NULL;
+    Sample_t before, after;
+    uint64_t sent;
+    unsigned threads;
+    unsigned i;
+    double deadline;
+    int result = 0;
+
+    if (OpenConnections(count) < 0)
+    {
+        return -1;
+    }
+    s_bytesReceived = 0;
+    s_threadWakeups = 0;
+    if (useReactor)
+    {
+        reactor = IOReactorCreate(kIOReactorDefaultThreadCount);
+        if (!reactor)
+        {
+            fprintf(stderr, "IOReactorCreate failed\n");
+            return -1;
+        }
+    }
+    for (i = 0; i < count; ++i)
+    {
+        Connection_t * connection = &s_connections[i];
+
+        if (useReactor)
+        {
+            fcntl(connection->clientFD, F_SETFL, fcntl(connection->clientFD, F_GETFL) | O_NONBLOCK);
+            connection->source = IOReactorAddSource(reactor, connection->clientFD, ReactorCallback, NULL, connection);
+            if (!connection->source)
+            {
+                perror("IOReactorAddSource");
+                return -1;
+            }
+        }
+        else if (pthread_create(&connection->thread, NULL, ReaderThread, connection) != 0)
+        {
+            fprintf(stderr, "pthread_create failed at connection %u\n", i);
+            return -1;
+        }
+    }
+    threads = ThreadCount();
+
+    // Let the threads reach their first wait before measuring.
+    SleepSeconds(0.2);
+    TakeSample(&before, reactor);
+    SleepSeconds(kIdleSeconds);
+    TakeSample(&after, reactor);
+    Report(model, count, "idle", &before, &after, threads, 0);
+
+    TakeSample(&before, reactor);
+    sent = SendMessages(count);
+    deadline = Now() + 5.0;
+    while (__sync_fetch_and_add(&s_bytesReceived, 0) < sent && Now() < deadline)
+    {
+        SleepSeconds(0.001);
+    }
+    TakeSample(&after, reactor);
+    Report(model, count, "active", &before, &after, threads, sent / kMessageSize);
+    if (s_bytesReceived != sent)
+    {
+        fprintf(stderr, "%s: %llu bytes sent but %llu read\n", model, (unsigned long long)sent, (unsigned long long)s_bytesReceived);
+        result = -1;
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        Connection_t * connection = &s_connections[i];
+
+        if (useReactor)
+        {
+            IOReactorRemoveSource(reactor, connection->source);
+        }
+        // The reader thread sees the end of the stream and exits.
+        close(connection->serverFD);
+        if (!useReactor)
+        {
+            pthread_join(connection->thread, NULL);
+        }
+        close(connection->clientFD);
+    }
+    if (reactor)
+    {
+        IOReactorDestroy(reactor);
+    }
+    return result;
+}
+
+int main(int argc, char ** argv)
+{
+    static const unsigned kDefaultCounts[] = { 1, 10, 40, 80, 200 };
+    unsigned counts[64];
+    unsigned countCount = 0;
+    struct rlimit limit;
+    int passed = 1;
+    unsigned n;
+    int i;
+
+    for (i = 1; i < argc && countCount < sizeof(counts) / sizeof(counts[0]); ++i)
+    {
+        int count = atoi(argv[i]);
+        if (count < 1 || count > kMaxConnections)
+        {
+            fprintf(stderr, "usage: %s [connections ...], each 1 to %d\n", argv[0], kMaxConnections);
+            return 1;
+        }
+        counts[countCount++] = (unsigned)count;
+    }
+    if (!countCount)
+    {
+        memcpy(counts, kDefaultCounts, sizeof(kDefaultCounts));
+        countCount = sizeof(kDefaultCounts) / sizeof(kDefaultCounts[0]);
+    }
+
+    // Two descriptors per connection.
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < 2 * kMaxConnections + 64)
+    {
+        limit.rlim_cur = limit.rlim_max < 2 * kMaxConnections + 64 ? limit.rlim_max : 2 * kMaxConnections + 64;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    printf("%d messages of %d bytes per second per connection while active\n", kMessagesPerSecond, kMessageSize);
+    printf("%-8s %6s %-7s %8s %12s %14s %12s %12s %12s\n", "reader", "conns", "phase", "threads",
+           "wakeups/s", "cpu us/s/conn", "switches/s", "cpu %", "cpu us/msg");
+    for (n = 0; n < countCount; ++n)
+    {
+        passed &= (Run(counts[n], 0) == 0);
+        passed &= (Run(counts[n], 1) == 0);
+    }
+
+    printf("%s\n", passed ? "passed" : "FAILED");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,904 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//! @file receivebench.c
+//! @brief Measures the receive path on a stream recorded from the test server.
+//!
+//! Connects to Tools/TestServer, asks for updates until enough of the stream has been
+//! recorded, then replays the recording over a loopback connection into two receive paths:
+//!     - "pool" is the old reader: a thread that waits in select(), asks FIONREAD how much is
+//!       waiting, takes a buffer of that size from a locked pool with a list scan, reads into
+//!       it, decodes it and gives it back;
+//!     - "ring" is the reader/decode split: the reader thread reads into a RingBuffer's free
+//!       space until the socket would block, and a decode thread consumes the data in place.
+//! Both decode with the same streaming parser, which walks the updates and sums every byte
+//! of rectangle data, and must end with the same sums as the recording.
+//!
+//! For each path it reports MB/s, reads and heap allocations per MB received. Allocations are
+//! counted for the whole process with AllocationCounter. The pool is shared by all runs, as
+//! g_sharedBuffers was; the first run, which grows it, is reported on its own as "pool (cold)".
+//!
+//! Start the server, then the benchmark:
+//!
+//!     rfbtestserver --port 5999 --workload mixed --fps 1000
+//!     receivebench [--port 5999] [--megabytes 64] [--encoding raw|zlib|zrle] [--runs 3]
+//!         [--write-size 65536]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "RingBuffer.h"
+#include "AllocationCounter.h"
+#include "rfbproto.h"
+
+//! Same as RECEIVE_BUFFER_SIZE in RFBConnection.m.
+#define kRingCapacity (256 * 1024)
+
+//! Most bytes read from the server at once while recording, and the default for the most
+//! bytes the replay writer hands to one write() call.
+#define kReplayChunk (64 * 1024)
+
+//! Longest time spent recording, however little has been recorded.
+#define kMaxRecordSeconds (60.0)
+
+static double Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double CPUSeconds(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Decode stage
+
+enum
+{
+    kParseMessage,      //!< Waiting for a server message header.
+    kParseRectHeader,   //!< Waiting for a rectangle header.
+    kParseDataLength,   //!< Waiting for the length in front of Zlib or ZRLE data.
+    kParseRectData      //!< Inside rectangle data.
+};
+
+//! @brief Streaming parser for FramebufferUpdate messages. Like the client's readers, it
+//!     takes the stream in whatever pieces it arrives and keeps short headers in a scratch
+//!     buffer when they are split.
+typedef struct _StreamParser
+{
+    int state;
+    uint8_t header[sz_rfbFramebufferUpdateRectHeader];
+    unsigned headerLength;
+    uint32_t rectsLeft;
+    uint64_t dataLeft;
+    uint64_t position;      //!< Bytes parsed so far.
+    uint64_t updateEnd;     //!< Position just after the last complete update.
+    uint64_t updates;
+    uint64_t rects;
+    uint64_t checksum;      //!< Sum of every byte of rectangle data.
+    int failed;
+} StreamParser_t;
+
+static void ParserInit(StreamParser_t * parser)
+{
+    memset(parser, 0, sizeof(*parser));
+}
+
+static unsigned HeaderLength(int state)
+{
+    switch (state)
+    {
+        case kParseMessage:
+            return sz_rfbFramebufferUpdateMsg;
+        case kParseRectHeader:
+            return sz_rfbFramebufferUpdateRectHeader;
+        default:
+            return 4;
+    }
+}
+
+static void ParserEndRect(StreamParser_t * parser)
+{
+    parser->rects++;
+    if (--parser->rectsLeft)
+    {
+        parser->state = kParseRectHeader;
+        return;
+    }
+    parser->state = kParseMessage;
+    parser->updates++;
+    parser->updateEnd = parser->position;
+}
+
+static void ParserHandleHeader(StreamParser_t * parser)
+{
+    const uint8_t * h = parser->header;
+
+    switch (parser->state)
+    {
+        case kParseMessage:
+            if (h[0] != rfbFramebufferUpdate)
+            {
+                fprintf(stderr, "unexpected server message %d\n", h[0]);
+                parser->failed = 1;
+                return;
+            }
+            parser->rectsLeft = (h[2] << 8) | h[3];
+            if (!parser->rectsLeft)
+            {
+                parser->updates++;
+                parser->updateEnd = parser->position;
+                return;
+            }
+            parser->state = kParseRectHeader;
+            return;
+
+        case kParseRectHeader:
+        {
+            uint32_t width = (h[4] << 8) | h[5];
+            uint32_t height = (h[6] << 8) | h[7];
+            int32_t encoding = (int32_t)(((uint32_t)h[8] << 24) | (h[9] << 16) | (h[10] << 8) | h[11]);
+
+            if (encoding == rfbEncodingRaw)
+            {
+                parser->dataLeft = (uint64_t)width * height * 4;
+                parser->state = kParseRectData;
+            }
+            else if (encoding == rfbEncodingCopyRect)
+            {
+                parser->dataLeft = 4;
+                parser->state = kParseRectData;
+            }
+            else if (encoding == rfbEncodingZlib || encoding == rfbEncodingZRLE)
+            {
+                parser->state = kParseDataLength;
+                return;
+            }
+            else
+            {
+                fprintf(stderr, "unexpected encoding %d\n", encoding);
+                parser->failed = 1;
+                return;
+            }
+            if (!parser->dataLeft)
+            {
+                ParserEndRect(parser);
+            }
+            return;
+        }
+
+        case kParseDataLength:
+            parser->dataLeft = ((uint32_t)h[0] << 24) | (h[1] << 16) | (h[2] << 8) | h[3];
+            parser->state = kParseRectData;
+            if (!parser->dataLeft)
+            {
+                ParserEndRect(parser);
+            }
+            return;
+    }
+}
+
+//! Parses all of @a length bytes.
+//! @return 0, or -1 if the stream isn't one the parser understands.
+static int ParserConsume(StreamParser_t * parser, const uint8_t * bytes, size_t length)
+{
+    while (length && !parser->failed)
+    {
+        if (parser->state == kParseRectData)
+        {
+            size_t count = length < parser->dataLeft ? length : (size_t)parser->dataLeft;
+            uint64_t sum = 0;
+            size_t i;
+
+            for (i = 0; i < count; ++i)
+            {
+                sum += bytes[i];
+            }
+            parser->checksum += sum;
+            parser->dataLeft -= count;
+            parser->position += count;
+            bytes += count;
+            length -= count;
+            if (!parser->dataLeft)
+            {
+                ParserEndRect(parser);
+            }
+        }
+        else
+        {
+            unsigned needed = HeaderLength(parser->state) - parser->headerLength;
+            unsigned count = length < needed ? (unsigned)length : needed;
+
+            memcpy(parser->header + parser->headerLength, bytes, count);
+            parser->headerLength += count;
+            parser->position += count;
+            bytes += count;
+            length -= count;
+            if (parser->headerLength == HeaderLength(parser->state))
+            {
+                parser->headerLength = 0;
+                ParserHandleHeader(parser);
+            }
+        }
+    }
+    return parser->failed ? -1 : 0;
+}
+
+// The old buffer pool, as BufferPool.m had it: a lock, first fit from the free list and a
+// scan of the active list to give a buffer back.
+
+typedef struct _PoolBuffer
+{
+    uint8_t * data;
+    size_t length;
+    struct _PoolBuffer * next;
+    struct _PoolBuffer * prev;
+} PoolBuffer_t;
+
+typedef struct _PoolList
+{
+    PoolBuffer_t * head;
+    PoolBuffer_t * tail;
+} PoolList_t;
+
+static pthread_mutex_t s_poolLock = PTHREAD_MUTEX_INITIALIZER;
+static PoolList_t s_freeBuffers;
+static PoolList_t s_activeBuffers;
+
+static void PoolListAdd(PoolList_t * list, PoolBuffer_t * buffer)
+{
+    buffer->next = NULL;
+    buffer->prev = list->tail;
+    if (list->tail)
+    {
+        list->tail->next = buffer;
+    }
+    else
+    {
+        list->head = buffer;
+    }
+    list->tail = buffer;
+}
+
+static void PoolListRemove(PoolList_t * list, PoolBuffer_t * buffer)
+{
+    if (buffer == list->head)
+    {
+        list->head = buffer->next;
+    }
+    if (buffer == list->tail)
+    {
+        list->tail = buffer->prev;
+    }
+    if (buffer->prev)
+    {
+        buffer->prev->next = buffer->next;
+    }
+    if (buffer->next)
+    {
+        buffer->next->prev = buffer->prev;
+    }
+    buffer->next = NULL;
+    buffer->prev = NULL;
+}
+
+static uint8_t * PoolAcquire(size_t length)
+{
+    PoolBuffer_t * buffer;
+
+    pthread_mutex_lock(&s_poolLock);
+    for (buffer = s_freeBuffers.head; buffer; buffer = buffer->next)
+    {
+        if (buffer->length >= length)
+        {
+            PoolListRemove(&s_freeBuffers, buffer);
+            break;
+        }
+    }
+    if (!buffer)
+    {
+        buffer = (PoolBuffer_t *)malloc(sizeof(PoolBuffer_t));
+        buffer->length = length;
+        buffer->data = (uint8_t *)malloc(length);
+    }
+    PoolListAdd(&s_activeBuffers, buffer);
+    pthread_mutex_unlock(&s_poolLock);
+    return buffer->data;
+}
+
+static void PoolRelease(const uint8_t * data)
+{
+    PoolBuffer_t * buffer;
+
+    pthread_mutex_lock(&s_poolLock);
+    for (buffer = s_activeBuffers.head; buffer; buffer = buffer->next)
+    {
+        if (buffer->data == data)
+        {
+            PoolListRemove(&s_activeBuffers, buffer);
+            PoolListAdd(&s_freeBuffers, buffer);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s_poolLock);
+}
+
+// Recording
+
+static int ReadFully(int fd, void * buffer, size_t length)
+{
+    uint8_t * bytes = (uint8_t *)buffer;
+
+    while (length)
+    {
+        ssize_t n = read(fd, bytes, length);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        bytes += n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+static int SendUpdateRequest(int fd, int incremental, uint16_t width, uint16_t height)
+{
+    uint8_t request[sz_rfbFramebufferUpdateRequestMsg] = {
+        rfbFramebufferUpdateRequest, (uint8_t)incremental, 0, 0, 0, 0,
+        (uint8_t)(width >> 8), (uint8_t)width, (uint8_t)(height >> 8), (uint8_t)height
+    };
+    return write(fd, request, sizeof(request)) == (ssize_t)sizeof(request) ? 0 : -1;
+}
+
+//! Connects to the test server with RFB 3.8 and no authentication.
+//! @return The socket, or -1.
+static int ConnectToServer(int port, int32_t encoding, uint16_t * width, uint16_t * height)
+{
+    struct sockaddr_in address;
+    uint8_t version[sz_rfbProtocolVersionMsg];
+    uint8_t serverInit[sz_rfbServerInitMsg];
+    uint8_t byte;
+    uint8_t types[256];
+    uint32_t result;
+    uint32_t nameLength;
+    char name[256];
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        fprintf(stderr, "can't connect to 127.0.0.1:%d: %s\n", port, strerror(errno));
+        return -1;
+    }
+
+    if (ReadFully(fd, version, sizeof(version)) < 0 || write(fd, "RFB 003.008\n", sz_rfbProtocolVersionMsg) != sz_rfbProtocolVersionMsg
+        || ReadFully(fd, &byte, 1) < 0 || !byte || ReadFully(fd, types, byte) < 0)
+    {
+        goto failed;
+    }
+    byte = rfbNoAuth;
+    if (write(fd, &byte, 1) != 1 || ReadFully(fd, &result, 4) < 0 || result != 0)
+    {
+        goto failed;
+    }
+    byte = 1;   // Shared.
+    if (write(fd, &byte, 1) != 1 || ReadFully(fd, serverInit, sizeof(serverInit)) < 0)
+    {
+        goto failed;
+    }
+    // The name length is the last field of rfbServerInitMsg.
+    nameLength = ((uint32_t)serverInit[20] << 24) | (serverInit[21] << 16) | (serverInit[22] << 8) | serverInit[23];
+    if (nameLength >= sizeof(name) || ReadFully(fd, name, nameLength) < 0)
+    {
+        goto failed;
+    }
+    name[nameLength] = 0;
+    *width = (serverInit[0] << 8) | serverInit[1];
+    *height = (serverInit[2] << 8) | serverInit[3];
+    fprintf(stderr, "connected to \"%s\", %ux%u\n", name, *width, *height);
+
+    {
+        uint8_t setEncodings[sz_rfbSetEncodingsMsg + 8] = { rfbSetEncodings, 0, 0, 2 };
+        uint32_t list[2] = { htonl((uint32_t)encoding), htonl((uint32_t)rfbEncodingCopyRect) };
+
+        memcpy(setEncodings + sz_rfbSetEncodingsMsg, list, sizeof(list));
+        if (write(fd, setEncodings, sizeof(setEncodings)) != (ssize_t)sizeof(setEncodings)
+            || SendUpdateRequest(fd, 0, *width, *height) < 0)
+        {
+            goto failed;
+        }
+    }
+    return fd;
+
+failed:
+    fprintf(stderr, "handshake with the test server failed\n");
+    close(fd);
+    return -1;
+}
+
+//! Records the server's updates until @a target bytes have arrived.
+//! @return Bytes recorded, ending with a complete update, or 0 on failure.
+static size_t Record(int fd, uint8_t * recording, size_t target, uint16_t width, uint16_t height, StreamParser_t * parser)
+{
+    size_t length = 0;
+    uint64_t updates = 0;
+    double deadline = Now() + kMaxRecordSeconds;
+
+    ParserInit(parser);
+    while (length < target && Now() < deadline)
+    {
+        ssize_t n = read(fd, recording + length, target - length < kReplayChunk ? target - length : kReplayChunk);
+
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if (ParserConsume(parser, recording + length, (size_t)n) < 0)
+        {
+            return 0;
+        }
+        length += (size_t)n;
+        if (parser->updates != updates)
+        {
+            updates = parser->updates;
+            if (SendUpdateRequest(fd, 1, width, height) < 0)
+            {
+                break;
+            }
+        }
+    }
+    return (size_t)parser->updateEnd;
+}
+
+// Replay
+
+typedef struct _Replay
+{
+    const uint8_t * recording;
+    size_t length;
+    int fd;     //!< Writing end.
+} Replay_t;
+
+//! Most bytes per write() during replay. Small writes arrive as many small reads, as a
+//! stream from a real network does.
+static size_t s_writeSize = kReplayChunk;
+
+static void * ReplayWriter(void * context)
+{
+    Replay_t * replay = (Replay_t *)context;
+    size_t offset = 0;
+
+    while (offset < replay->length)
+    {
+        size_t chunk = replay->length - offset < s_writeSize ? replay->length - offset : s_writeSize;
+        ssize_t n = write(replay->fd, replay->recording + offset, chunk);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("replay write");
+            break;
+        }
+        offset += (size_t)n;
+    }
+    shutdown(replay->fd, SHUT_WR);
+    return NULL;
+}
+
+static int OpenLoopback(int * readFD, int * writeFD)
+{
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0
+        || listen(listener, 1) < 0 || getsockname(listener, (struct sockaddr *)&address, &length) < 0)
+    {
+        perror("listen");
+        return -1;
+    }
+    *readFD = socket(AF_INET, SOCK_STREAM, 0);
+    if (*readFD < 0 || connect(*readFD, (struct sockaddr *)&address, sizeof(address)) < 0
+        || (*writeFD = accept(listener, NULL, NULL)) < 0)
+    {
+        perror("connect");
+        close(listener);
+        return -1;
+    }
+    close(listener);
+    return 0;
+}
+
+//! The old reader: select(), FIONREAD, a pool buffer, read() and decode on the same thread.
+static uint64_t ReceiveWithPool(int fd, StreamParser_t * parser)
+{
+    uint64_t reads = 0;
+
+    for (;;)
+    {
+        fd_set readSet;
+        int waiting = 0;
+        uint8_t * buffer;
+        ssize_t n;
+
+        FD_ZERO(&readSet);
+        FD_SET(fd, &readSet);
+        if (select(fd + 1, &readSet, NULL, NULL, NULL) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if (ioctl(fd, FIONREAD, &waiting) < 0)
+        {
+            break;
+        }
+        if (waiting <= 0)
+        {
+            waiting = 1;    // Read the end of the stream.
+        }
+        buffer = PoolAcquire((size_t)waiting);
+        n = read(fd, buffer, (size_t)waiting);
+        if (n > 0)
+        {
+            reads++;
+            ParserConsume(parser, buffer, (size_t)n);
+        }
+        PoolRelease(buffer);
+        if (n <= 0)
+        {
+            break;
+        }
+    }
+    return reads;
+}
+
+typedef struct _RingReceiver
+{
+    RingBuffer_t * ring;
+    StreamParser_t * parser;
+    pthread_mutex_t lock;
+    pthread_cond_t dataReady;   //!< Signalled by the reader when it commits data or ends.
+    pthread_cond_t spaceReady;  //!< Signalled by the decoder when it consumes data.
+    pthread_t decoder;
+    int ended;
+} RingReceiver_t;
+
+//! Decode stage: consumes the ring in place.
+static void * RingDecoder(void * context)
+{
+    RingReceiver_t * receiver = (RingReceiver_t *)context;
+
+    for (;;)
+    {
+        const uint8_t * bytes;
+        uint32_t count;
+
+        pthread_mutex_lock(&receiver->lock);
+        while (!RingBufferGetUsed(receiver->ring) && !receiver->ended)
+        {
+            pthread_cond_wait(&receiver->dataReady, &receiver->lock);
+        }
+        pthread_mutex_unlock(&receiver->lock);
+
+        if (!RingBufferGetUsed(receiver->ring))
+        {
+            break;
+        }
+        while ((count = RingBufferGetReadPointer(receiver->ring, &bytes)) != 0)
+        {
+            ParserConsume(receiver->parser, bytes, count);
+            RingBufferConsume(receiver->ring, count);
+        }
+        pthread_mutex_lock(&receiver->lock);
+        pthread_cond_signal(&receiver->spaceReady);
+        pthread_mutex_unlock(&receiver->lock);
+    }
+    return NULL;
+}
+
+//! Starts the decode stage. RFBConnection creates its decode queue with the connection, so
+//! this happens before a run is timed; creating a thread also allocates its TLS, which would
+//! otherwise be counted as one allocation per run.
+static void RingReceiverStart(RingReceiver_t * receiver, RingBuffer_t * ring, StreamParser_t * parser)
+{
+    memset(receiver, 0, sizeof(*receiver));
+    receiver->ring = ring;
+    receiver->parser = parser;
+    pthread_mutex_init(&receiver->lock, NULL);
+    pthread_cond_init(&receiver->dataReady, NULL);
+    pthread_cond_init(&receiver->spaceReady, NULL);
+    pthread_create(&receiver->decoder, NULL, RingDecoder, receiver);
+}
+
+static void RingReceiverDestroy(RingReceiver_t * receiver)
+{
+    pthread_cond_destroy(&receiver->spaceReady);
+    pthread_cond_destroy(&receiver->dataReady);
+    pthread_mutex_destroy(&receiver->lock);
+}
+
+//! Reader stage: reads into the ring until the socket would block, then waits for more.
+//! Returns once the decode stage has consumed everything.
+static uint64_t ReceiveWithRing(int fd, RingReceiver_t * receiver)
+{
+    RingBuffer_t * ring = receiver->ring;
+    uint64_t reads = 0;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    for (;;)
+    {
+        struct pollfd descriptor = { fd, POLLIN, 0 };
+        ssize_t n;
+
+        if (!RingBufferGetFree(ring))
+        {
+            // Paused until the decoder makes room.
+            pthread_mutex_lock(&receiver->lock);
+            while (!RingBufferGetFree(ring))
+            {
+                pthread_cond_wait(&receiver->spaceReady, &receiver->lock);
+            }
+            pthread_mutex_unlock(&receiver->lock);
+        }
+        n = RingBufferReadFromDescriptor(ring, fd);
+        if (n > 0)
+        {
+            reads++;
+            pthread_mutex_lock(&receiver->lock);
+            pthread_cond_signal(&receiver->dataReady);
+            pthread_mutex_unlock(&receiver->lock);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            poll(&descriptor, 1, -1);
+            continue;
+        }
+        break;
+    }
+
+    pthread_mutex_lock(&receiver->lock);
+    receiver->ended = 1;
+    pthread_cond_signal(&receiver->dataReady);
+    pthread_mutex_unlock(&receiver->lock);
+    pthread_join(receiver->decoder, NULL);
+    return reads;
+}
+
+typedef struct _RunResult
+{
+    double seconds;
+    double cpuSeconds;
+    uint64_t reads;
+    int64_t allocations;
+} RunResult_t;
+
+//! @return 0 if the replay decoded to the same sums as the recording.
+static int Replay(const uint8_t * recording, size_t length, int useRing, const StreamParser_t * expected, RunResult_t * result)
+{
+    Replay_t replay;
+    StreamParser_t parser;
+    RingBuffer_t * ring = NULL;
+    RingReceiver_t receiver;
+    pthread_t writer;
+    int readFD, writeFD;
+    int counted;
+    double start, cpuStart;
+
+    if (OpenLoopback(&readFD, &writeFD) < 0)
+    {
+        return -1;
+    }
+    ParserInit(&parser);
+    if (useRing)
+    {
+        // Created with the connection, before any data arrives.
+        ring = RingBufferCreate(kRingCapacity);
+        RingReceiverStart(&receiver, ring, &parser);
+    }
+    replay.recording = recording;
+    replay.length = length;
+    replay.fd = writeFD;
+    pthread_create(&writer, NULL, ReplayWriter, &replay);
+
+    counted = (AllocationCounterStart() == 0);
+    start = Now();
+    cpuStart = CPUSeconds();
+    result->reads = useRing ? ReceiveWithRing(readFD, &receiver) : ReceiveWithPool(readFD, &parser);
+    result->seconds = Now() - start;
+    result->cpuSeconds = CPUSeconds() - cpuStart;
+    result->allocations = counted ? AllocationCounterGetCount() : -1;
+    AllocationCounterStop();
+
+    pthread_join(writer, NULL);
+    close(readFD);
+    close(writeFD);
+    if (ring)
+    {
+        RingReceiverDestroy(&receiver);
+        RingBufferDestroy(ring);
+    }
+
+    if (parser.position != length || parser.updates != expected->updates || parser.checksum != expected->checksum)
+    {
+        fprintf(stderr, "%s: decoded %llu bytes, %llu updates, sum %llx; expected %zu, %llu, %llx\n", useRing ? "ring" : "pool",
+                (unsigned long long)parser.position, (unsigned long long)parser.updates, (unsigned long long)parser.checksum,
+                length, (unsigned long long)expected->updates, (unsigned long long)expected->checksum);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    static const char * const kPathNames[2] = { "pool", "ring" };
+    int port = 5999;
+    unsigned megabytes = 64;
+    unsigned runs = 3;
+    int32_t encoding = rfbEncodingRaw;
+    uint16_t width, height;
+    StreamParser_t expected;
+    uint8_t * recording;
+    size_t length;
+    int passed = 1;
+    int fd;
+    int i;
+
+    for (i = 1; i < argc; ++i)
+    {
+        const char * value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (value && strcmp(argv[i], "--port") == 0)
+        {
+            port = atoi(value);
+        }
+        else if (value && strcmp(argv[i], "--megabytes") == 0)
+        {
+            megabytes = (unsigned)atoi(value);
+        }
+        else if (value && strcmp(argv[i], "--runs") == 0)
+        {
+            runs = (unsigned)atoi(value);
+        }
+        else if (value && strcmp(argv[i], "--write-size") == 0)
+        {
+            s_writeSize = (size_t)atoi(value);
+        }
+        else if (value && strcmp(argv[i], "--encoding") == 0)
+        {
+            encoding = strcmp(value, "zrle") == 0 ? rfbEncodingZRLE : strcmp(value, "zlib") == 0 ? rfbEncodingZlib : rfbEncodingRaw;
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--port <n>] [--megabytes <n>] [--encoding raw|zlib|zrle] [--runs <n>] [--write-size <bytes>]\n", argv[0]);
+            return 1;
+        }
+        ++i;
+    }
+    if (!megabytes || !runs || !s_writeSize)
+    {
+        fprintf(stderr, "megabytes, runs and write size must be positive\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    recording = (uint8_t *)malloc((size_t)megabytes << 20);
+    fd = ConnectToServer(port, encoding, &width, &height);
+    if (!recording || fd < 0)
+    {
+        return 1;
+    }
+    length = Record(fd, recording, (size_t)megabytes << 20, width, height, &expected);
+    close(fd);
+    if (!length)
+    {
+        fprintf(stderr, "nothing was recorded\n");
+        return 1;
+    }
+    // The recording was cut at the end of the last whole update; parse just that part.
+    ParserInit(&expected);
+    ParserConsume(&expected, recording, length);
+    printf("recorded %.1f MB: %llu updates, %llu rects\n", length / 1048576.0,
+           (unsigned long long)expected.updates, (unsigned long long)expected.rects);
+
+    printf("%-11s %10s %10s %12s %14s\n", "path", "MB/s", "reads/MB", "allocs/MB", "cpu ms/MB");
+    for (i = -1; i < 2; ++i)
+    {
+        RunResult_t best;
+        unsigned run;
+
+        memset(&best, 0, sizeof(best));
+        for (run = 0; run < runs; ++run)
+        {
+            RunResult_t result;
+
+            if (Replay(recording, length, i > 0, &expected, &result) < 0)
+            {
+                passed = 0;
+                break;
+            }
+            if (!run || result.seconds < best.seconds)
+            {
+                best = result;
+            }
+            if (i < 0)
+            {
+                // The first run grows the pool, as the first updates of a connection did.
+                break;
+            }
+        }
+        double mb = length / 1048576.0;
+        printf("%-11s %10.1f %10.1f ", i < 0 ? "pool (cold)" : kPathNames[i], best.seconds > 0 ? mb / best.seconds : 0.0, best.reads / mb);
+        if (best.allocations >= 0)
+        {
+            printf("%12.2f", best.allocations / mb);
+        }
+        else
+        {
+            printf("%12s", "n/a");
+        }
+        printf(" %14.3f\n", best.cpuSeconds * 1e3 / mb);
+    }
+
+    free(recording);
+    printf("%s\n", passed ? "passed" : "FAILED");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//! @file sendqueuetest.c
+//! @brief Checks what SendQueue puts on the wire when messages are queued during a write.
+//!
+//! SendQueue.c is compiled into this file with writev() replaced by a stub. The stub
+//! appends what it is given to a wire buffer, may write only part of it, and may queue more
+//! messages before it returns, just as another thread can while the writer is in writev().
+//! Every message on the wire must be whole, in order within its class, and sent once.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
+static ssize_t StubWritev(int fd, const struct iovec * vectors, int count);
+
+#define writev StubWritev
+#include "../../Source/SendQueue.c"
+#undef writev
+
+#define kWireSize (1024 * 1024)
+#define kMessageCount 20000
+
+static SendQueue_t * s_queue;
+static uint8_t s_wire[kWireSize];
+static size_t s_wireLength;
+static size_t s_writeLimit;     //!< Most bytes one call takes, or 0 for all of them.
+static void (*s_duringWrite)(void);
+
+static ssize_t StubWritev(int fd, const struct iovec * vectors, int count)
+{
+    size_t limit = s_writeLimit ? s_writeLimit : (size_t)-1;
+    size_t written = 0;
+    int i;
+
+    (void)fd;
+
+    for (i = 0; i < count && written < limit; ++i)
+    {
+        size_t length = vectors[i].iov_len < limit - written ? vectors[i].iov_len : limit - written;
+        memcpy(s_wire + s_wireLength + written, vectors[i].iov_base, length);
+        written += length;
+    }
+    s_wireLength += written;
+    if (s_duringWrite)
+    {
+        s_duringWrite();
+    }
+    return (ssize_t)written;
+}
+
+static void Drain(void)
+{
+    do
+    {
+        if (SendQueueWrite(s_queue, 0) < 0)
+        {
+            fprintf(stderr, "write failed\n");
+            exit(1);
+        }
+    } while (!SendQueueFinishWriting(s_queue));
+}
+
+//! The case that was reported: input queued while a control message is in writev().
+static void QueueInput(void)
+{
+    static const uint8_t input[6] = { 'P', 'P', 'P', 'P', 'P', 'P' };
+
+    s_duringWrite = NULL;
+    SendQueueEnqueue(s_queue, kSendClassInput, input, sizeof(input), NULL, 0);
+}
+
+static int TestHigherPriorityDuringWrite(void)
+{
+    static const uint8_t control[10] = { 'C', 'C', 'C', 'C', 'C', 'C', 'C', 'C', 'C', 'C' };
+
+    s_wireLength = 0;
+    s_writeLimit = 0;
+    SendQueueEnqueue(s_queue, kSendClassControl, control, sizeof(control), NULL, 0);
+    s_duringWrite = QueueInput;
+    Drain();
+    if (s_wireLength != 16 || memcmp(s_wire, "CCCCCCCCCCPPPPPP", 16) != 0)
+    {
+        fprintf(stderr, "input queued during a write: wire has \"%.*s\"\n", (int)s_wireLength, s_wire);
+        return 0;
+    }
+    return 1;
+}
+
+//! Messages are [class, sequence high, sequence low, payload length, payload...], where every
+//! payload byte is the low byte of the sequence number.
+static unsigned s_nextSequence;
+
+static void QueueRandomMessage(void)
+{
+    uint8_t message[64];
+    unsigned messageClass = rand() % kSendClassCount;
+    unsigned payloadLength = rand() % 60;
+
+    if (s_nextSequence == kMessageCount)
+    {
+        return;
+    }
+    message[0] = messageClass;
+    message[1] = s_nextSequence >> 8;
+    message[2] = s_nextSequence;
+    message[3] = payloadLength;
+    memset(message + 4, s_nextSequence, payloadLength);
+    s_nextSequence++;
+    if (messageClass == kSendClassInput && payloadLength > 4 && rand() % 2)
+    {
+        // Keyed on the class byte alone, so it replaces any unsent message of its length.
+        SendQueueEnqueueCoalescing(s_queue, messageClass, message, 4 + payloadLength, 1);
+    }
+    else
+    {
+        SendQueueEnqueue(s_queue, messageClass, message, 4, message + 4, payloadLength);
+    }
+}
+
+static void QueueDuringWrite(void)
+{
+    unsigned n = rand() % 4;
+
+    while (n--)
+    {
+        QueueRandomMessage();
+    }
+}
+
+static int TestRandomWrites(void)
+{
+    unsigned lastSequence[kSendClassCount];
+    unsigned messages = 0;
+    size_t offset = 0;
+    SendQueueStatistics_t stats;
+
+    srand(1);
+    s_wireLength = 0;
+    s_nextSequence = 0;
+    s_duringWrite = QueueDuringWrite;
+    memset(lastSequence, 0xff, sizeof(lastSequence));
+    while (s_nextSequence < kMessageCount)
+    {
+        QueueRandomMessage();
+        s_writeLimit = 1 + rand() % 100;
+        if (SendQueueWrite(s_queue, 0) < 0)
+        {
+            fprintf(stderr, "write failed\n");
+            return 0;
+        }
+    }
+    s_writeLimit = 0;
+    Drain();
+
+    while (offset < s_wireLength)
+    {
+        unsigned messageClass = s_wire[offset];
+        unsigned sequence = (s_wire[offset + 1] << 8) | s_wire[offset + 2];
+        unsigned payloadLength = s_wire[offset + 3];
+        unsigned i;
+
+        if (messageClass >= kSendClassCount || offset + 4 + payloadLength > s_wireLength)
+        {
+            fprintf(stderr, "garbage on the wire at byte %zu\n", offset);
+            return 0;
+        }
+        for (i = 0; i < payloadLength; ++i)
+        {
+            if (s_wire[offset + 4 + i] != (uint8_t)sequence)
+            {
+                fprintf(stderr, "message %u is broken at byte %zu\n", sequence, offset);
+                return 0;
+            }
+        }
+        if (lastSequence[messageClass] != ~0U && sequence <= lastSequence[messageClass])
+        {
+            fprintf(stderr, "message %u sent after %u in class %u\n", sequence, lastSequence[messageClass], messageClass);
+            return 0;
+        }
+        lastSequence[messageClass] = sequence;
+        offset += 4 + payloadLength;
+        messages++;
+    }
+
+    SendQueueGetStatistics(s_queue, &stats);
+    if (messages + stats.coalesced != kMessageCount)
+    {
+        fprintf(stderr, "%u messages sent and %llu coalesced, %u queued\n", messages, (unsigned long long)stats.coalesced, kMessageCount);
+        return 0;
+    }
+    printf("%u messages, %llu coalesced, %llu writes, %zu bytes\n", messages,
+           (unsigned long long)stats.coalesced, (unsigned long long)stats.writeCalls, s_wireLength);
+    return 1;
+}
+
+int main(void)
+{
+    int passed = 1;
+
+    s_queue = SendQueueCreate();
+    passed &= TestHigherPriorityDuringWrite();
+    passed &= TestRandomWrites();
+    SendQueueDestroy(s_queue);
+
+    printf("%s\n", passed ? "passed" : "FAILED");
+    return passed ? 0 : 1;
+}
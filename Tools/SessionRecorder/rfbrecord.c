@@ -0,0 +1,534 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//! @file rfbrecord.c
+//! @brief Records a session with the test server to a capture file.
+//!
+//! Connects to Tools/TestServer and talks to it as the client does: RFB 3.8 without
+//! authentication, a SetPixelFormat with the server's format, a SetEncodings naming one
+//! encoding, CopyRect and optionally a Tight quality level, and one update request at the
+//! start of each update. Everything is written to a SessionCapture file, the data from the
+//! server in the pieces it was read in and each message to the server as one record, so the
+//! file can be replayed with --Benchmark or --Replay like a capture made by the client.
+//!
+//! The updates are framed as they arrive, without decoding them, so the capture can be cut
+//! after a whole number of updates; the last record ends at the end of the last update.
+//!
+//!     rfbtestserver --port 5999 --size 400x300 --workload mixed --fps 30
+//!     rfbrecord --output raw.rfbcap [--port 5999] [--encoding raw] [--quality <0-9>] [--updates 32]
+//!
+//! Encodings are raw, rre, corre, hextile, zlib, zrle and tight.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "HextileRect.h"
+#include "SessionCapture.h"
+
+//! Most bytes read from the server at once.
+#define kReadChunk (64 * 1024)
+
+typedef struct _Recorder
+{
+    int fd;
+    SessionCapture_t * capture;
+    rfbPixelFormat format;
+    unsigned pixelBytes;
+    unsigned tightPixelBytes;
+    uint16_t width;
+    uint16_t height;
+    uint8_t * pending;      //!< Received bytes not yet framed.
+    size_t pendingLength;
+    size_t pendingCapacity;
+    uint64_t updates;
+    uint64_t rects;
+    uint64_t bytes;
+} Recorder_t;
+
+static unsigned Read16(const uint8_t * bytes)
+{
+    return (bytes[0] << 8) | bytes[1];
+}
+
+static uint32_t Read32(const uint8_t * bytes)
+{
+    return ((uint32_t)bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+// Recording
+
+//! Reads exactly @a length bytes and records them as one chunk from the server.
+static int ReceiveFully(Recorder_t * recorder, void * buffer, size_t length)
+{
+    uint8_t * bytes = (uint8_t *)buffer;
+    size_t left = length;
+
+    while (left)
+    {
+        ssize_t n = read(recorder->fd, bytes, left);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        bytes += n;
+        left -= (size_t)n;
+    }
+    return SessionCaptureWrite(recorder->capture, kSessionCaptureFromServer, buffer, length);
+}
+
+//! Writes one message to the server and records it.
+static int Send(Recorder_t * recorder, const void * message, size_t length)
+{
+    if (write(recorder->fd, message, length) != (ssize_t)length)
+    {
+        return -1;
+    }
+    return SessionCaptureWrite(recorder->capture, kSessionCaptureToServer, message, length);
+}
+
+static int SendUpdateRequest(Recorder_t * recorder, int incremental)
+{
+    uint8_t request[sz_rfbFramebufferUpdateRequestMsg] = {
+        rfbFramebufferUpdateRequest, (uint8_t)incremental, 0, 0, 0, 0,
+        (uint8_t)(recorder->width >> 8), (uint8_t)recorder->width, (uint8_t)(recorder->height >> 8), (uint8_t)recorder->height
+    };
+    return Send(recorder, request, sizeof(request));
+}
+
+//! Connects and handshakes with RFB 3.8 and no authentication, then sends the client's
+//! setup messages and the first update request.
+static int Connect(Recorder_t * recorder, int port, int32_t encoding, int quality)
+{
+    struct sockaddr_in address;
+    uint8_t version[sz_rfbProtocolVersionMsg];
+    uint8_t serverInit[sz_rfbServerInitMsg];
+    uint8_t byte;
+    uint8_t types[256];
+    uint8_t result[4];
+    uint32_t nameLength;
+    char name[256];
+    uint8_t setPixelFormat[sz_rfbSetPixelFormatMsg] = { rfbSetPixelFormat };
+    uint8_t setEncodings[sz_rfbSetEncodingsMsg + 12] = { rfbSetEncodings };
+    uint32_t list[3] = { htonl((uint32_t)encoding), htonl((uint32_t)rfbEncodingCopyRect), htonl((uint32_t)(rfbEncodingQualityLevel0 + quality)) };
+    unsigned count = quality >= 0 ? 3 : 2;
+
+    recorder->fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (recorder->fd < 0 || connect(recorder->fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        fprintf(stderr, "can't connect to 127.0.0.1:%d: %s\n", port, strerror(errno));
+        return -1;
+    }
+
+    if (ReceiveFully(recorder, version, sizeof(version)) < 0 || Send(recorder, "RFB 003.008\n", sz_rfbProtocolVersionMsg) < 0
+        || ReceiveFully(recorder, &byte, 1) < 0 || !byte || ReceiveFully(recorder, types, byte) < 0)
+    {
+        goto failed;
+    }
+    byte = rfbNoAuth;
+    if (Send(recorder, &byte, 1) < 0 || ReceiveFully(recorder, result, 4) < 0 || Read32(result) != 0)
+    {
+        goto failed;
+    }
+    byte = 1;   // Shared.
+    if (Send(recorder, &byte, 1) < 0 || ReceiveFully(recorder, serverInit, sizeof(serverInit)) < 0)
+    {
+        goto failed;
+    }
+    nameLength = Read32(serverInit + sz_rfbServerInitMsg - 4);
+    if (nameLength >= sizeof(name) || ReceiveFully(recorder, name, nameLength) < 0)
+    {
+        goto failed;
+    }
+    name[nameLength] = 0;
+    recorder->width = (uint16_t)Read16(serverInit);
+    recorder->height = (uint16_t)Read16(serverInit + 2);
+    memcpy(&recorder->format, serverInit + 4, sz_rfbPixelFormat);
+    recorder->pixelBytes = recorder->format.bitsPerPixel / 8;
+    recorder->tightPixelBytes = recorder->pixelBytes;
+    if (recorder->format.bitsPerPixel == 32 && recorder->format.depth == 24 && ntohs(recorder->format.redMax) == 255
+        && ntohs(recorder->format.greenMax) == 255 && ntohs(recorder->format.blueMax) == 255)
+    {
+        recorder->tightPixelBytes = 3;
+    }
+    fprintf(stderr, "connected to \"%s\", %ux%u, %u bpp\n", name, recorder->width, recorder->height, recorder->format.bitsPerPixel);
+
+    // The client's default profile asks for the server's own format.
+    memcpy(setPixelFormat + 4, serverInit + 4, sz_rfbPixelFormat);
+    setEncodings[3] = (uint8_t)count;
+    memcpy(setEncodings + sz_rfbSetEncodingsMsg, list, count * 4);
+    if (Send(recorder, setPixelFormat, sizeof(setPixelFormat)) < 0 || Send(recorder, setEncodings, sz_rfbSetEncodingsMsg + count * 4) < 0
+        || SendUpdateRequest(recorder, 0) < 0)
+    {
+        goto failed;
+    }
+    return 0;
+
+failed:
+    fprintf(stderr, "handshake with the test server failed\n");
+    return -1;
+}
+
+// Framing
+
+//! Reads a Tight compact length.
+//! @return Bytes used by the length, or 0 if @a length bytes don't hold all of it.
+static unsigned ReadCompactLength(const uint8_t * bytes, size_t length, uint32_t * value)
+{
+    unsigned i;
+
+    *value = 0;
+    for (i = 0; i < 3; ++i)
+    {
+        if (i >= length)
+        {
+            return 0;
+        }
+        *value |= (uint32_t)(i < 2 ? bytes[i] & 0x7f : bytes[i]) << (7 * i);
+        if (i == 2 || !(bytes[i] & 0x80))
+        {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+//! Finds the length of a Tight rect's data.
+//! @return The length, 0 if @a length bytes don't hold all of it, or -1 if it isn't valid.
+static int64_t TightRectLength(const Recorder_t * recorder, const uint8_t * bytes, size_t length, unsigned width, unsigned height)
+{
+    size_t used = 1;
+    unsigned control;
+    unsigned bits = recorder->tightPixelBytes * 8;
+    unsigned lengthBytes;
+    uint32_t dataLength;
+    uint64_t size;
+
+    if (length < 1)
+    {
+        return 0;
+    }
+    control = bytes[0] >> 4;
+    if (control == rfbTightFill)
+    {
+        return length < 1 + recorder->tightPixelBytes ? 0 : 1 + recorder->tightPixelBytes;
+    }
+    if (control > rfbTightMaxSubencoding)
+    {
+        return -1;
+    }
+    if (control != rfbTightJpeg && (control & rfbTightExplicitFilter))
+    {
+        if (length < 2)
+        {
+            return 0;
+        }
+        used = 2;
+        if (bytes[1] == rfbTightFilterPalette)
+        {
+            unsigned colours;
+
+            if (length < 3)
+            {
+                return 0;
+            }
+            colours = bytes[2] + 1;
+            used = 3 + (size_t)colours * recorder->tightPixelBytes;
+            bits = colours == 2 ? 1 : 8;
+        }
+        else if (bytes[1] > rfbTightFilterGradient)
+        {
+            return -1;
+        }
+    }
+    if (control != rfbTightJpeg)
+    {
+        size = (uint64_t)(((uint64_t)width * bits + 7) / 8) * height;
+        if (size < 12)
+        {
+            return length < used + size ? 0 : (int64_t)(used + size);
+        }
+    }
+    if (length < used || !(lengthBytes = ReadCompactLength(bytes + used, length - used, &dataLength)))
+    {
+        return 0;
+    }
+    used += lengthBytes + dataLength;
+    return length < used ? 0 : (int64_t)used;
+}
+
+//! Finds the length of a rect's data.
+//! @return The length, 0 if @a length bytes don't hold all of it, or -1 if the encoding
+//!     isn't known.
+static int64_t RectLength(const Recorder_t * recorder, const uint8_t * bytes, size_t length, int32_t encoding, unsigned width, unsigned height)
+{
+    unsigned bpp = recorder->pixelBytes;
+    uint64_t total;
+
+    switch (encoding)
+    {
+        case rfbEncodingRaw:
+            total = (uint64_t)bpp * width * height;
+            break;
+        case rfbEncodingCopyRect:
+            total = 4;
+            break;
+        case rfbEncodingRRE:
+        case rfbEncodingCoRRE:
+            if (length < 4 + bpp)
+            {
+                return 0;
+            }
+            total = 4 + bpp + (uint64_t)Read32(bytes) * (bpp + (encoding == rfbEncodingRRE ? 8 : 4));
+            break;
+        case rfbEncodingHextile:
+            return HextileRectLength(bytes, length > UINT32_MAX ? UINT32_MAX : (unsigned)length, bpp, width, height);
+        case rfbEncodingZlib:
+        case rfbEncodingZRLE:
+            if (length < 4)
+            {
+                return 0;
+            }
+            total = 4 + (uint64_t)Read32(bytes);
+            break;
+        case rfbEncodingTight:
+            return TightRectLength(recorder, bytes, length, width, height);
+        default:
+            return -1;
+    }
+    return length < total ? 0 : (int64_t)total;
+}
+
+//! Frames one FramebufferUpdate message.
+//! @return Its length, 0 if @a length bytes don't hold all of it, or -1 if it can't be framed.
+static int64_t UpdateLength(Recorder_t * recorder, const uint8_t * bytes, size_t length, unsigned * rectCount)
+{
+    size_t used = sz_rfbFramebufferUpdateMsg;
+    unsigned rects;
+
+    if (length < sz_rfbFramebufferUpdateMsg)
+    {
+        return 0;
+    }
+    if (bytes[0] != rfbFramebufferUpdate)
+    {
+        fprintf(stderr, "unexpected server message %d\n", bytes[0]);
+        return -1;
+    }
+    rects = *rectCount = Read16(bytes + 2);
+    while (rects--)
+    {
+        const uint8_t * header = bytes + used;
+        int64_t rectLength;
+
+        if (length - used < sz_rfbFramebufferUpdateRectHeader)
+        {
+            return 0;
+        }
+        used += sz_rfbFramebufferUpdateRectHeader;
+        rectLength = RectLength(recorder, bytes + used, length - used, (int32_t)Read32(header + 8), Read16(header + 4), Read16(header + 6));
+        if (rectLength < 0)
+        {
+            fprintf(stderr, "can't frame rect with encoding %d\n", (int32_t)Read32(header + 8));
+            return -1;
+        }
+        if (rectLength == 0)
+        {
+            return 0;
+        }
+        used += (size_t)rectLength;
+    }
+    return (int64_t)used;
+}
+
+//! Records updates until @a updates have arrived.
+//! @return 0, or -1 on failure.
+static int RecordUpdates(Recorder_t * recorder, uint64_t updates)
+{
+    static uint8_t chunk[kReadChunk];
+    int requested = 0;  // Whether the update after the one arriving has been asked for.
+
+    while (recorder->updates < updates)
+    {
+        ssize_t n = read(recorder->fd, chunk, sizeof(chunk));
+        size_t keep;
+
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "the server closed the connection\n");
+            return -1;
+        }
+        if (recorder->pendingCapacity - recorder->pendingLength < (size_t)n)
+        {
+            recorder->pendingCapacity = recorder->pendingCapacity ? recorder->pendingCapacity * 2 : 1 << 20;
+            recorder->pending = (uint8_t *)realloc(recorder->pending, recorder->pendingCapacity);
+            if (!recorder->pending)
+            {
+                return -1;
+            }
+        }
+        memcpy(recorder->pending + recorder->pendingLength, chunk, (size_t)n);
+        recorder->pendingLength += (size_t)n;
+
+        // Frame whole updates; the chunk is recorded only up to the end of the last one wanted.
+        keep = (size_t)n;
+        for (;;)
+        {
+            unsigned rectCount = 0;
+            int64_t length;
+
+            // Like the client, ask for the next update as soon as this one starts arriving.
+            if (!requested && recorder->pendingLength && recorder->updates + 1 < updates)
+            {
+                if (SendUpdateRequest(recorder, 1) < 0)
+                {
+                    return -1;
+                }
+                requested = 1;
+            }
+            length = UpdateLength(recorder, recorder->pending, recorder->pendingLength, &rectCount);
+            if (length <= 0)
+            {
+                if (length < 0)
+                {
+                    return -1;
+                }
+                break;
+            }
+            recorder->updates++;
+            recorder->rects += rectCount;
+            recorder->bytes += (uint64_t)length;
+            requested = 0;
+            recorder->pendingLength -= (size_t)length;
+            memmove(recorder->pending, recorder->pending + length, recorder->pendingLength);
+            if (recorder->updates == updates)
+            {
+                keep -= recorder->pendingLength;
+                break;
+            }
+        }
+        if (SessionCaptureWrite(recorder->capture, kSessionCaptureFromServer, chunk, keep) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    Recorder_t recorder;
+    const char * output = NULL;
+    int port = 5999;
+    int32_t encoding = rfbEncodingRaw;
+    int quality = -1;
+    unsigned updates = 32;
+    int i;
+
+    for (i = 1; i < argc; ++i)
+    {
+        const char * value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (value && strcmp(argv[i], "--port") == 0)
+        {
+            port = atoi(value);
+        }
+        else if (value && strcmp(argv[i], "--output") == 0)
+        {
+            output = value;
+        }
+        else if (value && strcmp(argv[i], "--updates") == 0)
+        {
+            updates = (unsigned)atoi(value);
+        }
+        else if (value && strcmp(argv[i], "--quality") == 0)
+        {
+            quality = atoi(value);
+        }
+        else if (value && strcmp(argv[i], "--encoding") == 0)
+        {
+            static const struct { const char * name; int32_t encoding; } kEncodings[] = {
+                { "raw", rfbEncodingRaw }, { "rre", rfbEncodingRRE }, { "corre", rfbEncodingCoRRE }, { "hextile", rfbEncodingHextile },
+                { "zlib", rfbEncodingZlib }, { "zrle", rfbEncodingZRLE }, { "tight", rfbEncodingTight }
+            };
+            unsigned e;
+
+            for (e = 0; e < sizeof(kEncodings) / sizeof(kEncodings[0]) && strcmp(value, kEncodings[e].name) != 0; ++e)
+            {
+            }
+            if (e == sizeof(kEncodings) / sizeof(kEncodings[0]))
+            {
+                fprintf(stderr, "unknown encoding %s\n", value);
+                return 1;
+            }
+            encoding = kEncodings[e].encoding;
+        }
+        else
+        {
+            output = NULL;
+            break;
+        }
+        ++i;
+    }
+    if (!output || !updates || quality > 9)
+    {
+        fprintf(stderr, "usage: %s --output <file> [--port <n>] [--encoding raw|rre|corre|hextile|zlib|zrle|tight] [--quality <0-9>] [--updates <n>]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&recorder, 0, sizeof(recorder));
+    recorder.capture = SessionCaptureCreate(output);
+    if (!recorder.capture)
+    {
+        fprintf(stderr, "can't create %s: %s\n", output, strerror(errno));
+        return 1;
+    }
+    if (Connect(&recorder, port, encoding, quality) < 0 || RecordUpdates(&recorder, updates) < 0)
+    {
+        SessionCaptureClose(recorder.capture);
+        unlink(output);
+        return 1;
+    }
+    close(recorder.fd);
+    SessionCaptureClose(recorder.capture);
+    free(recorder.pending);
+    printf("%s: %llu updates, %llu rects, %.1f KB of updates\n", output, (unsigned long long)recorder.updates,
+           (unsigned long long)recorder.rects, recorder.bytes / 1024.0);
+    return 0;
+}
@@ -0,0 +1,2399 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//! @file rfbtestserver.c
+//! @brief Stand-in RFB server for load and latency testing of the client.
+//!
+//! This is a small single-threaded RFB 3.3/3.7/3.8 server that listens on
+//! loopback and serves a synthetic desktop. It is not part of the application
+//! target; Tools/Makefile builds it.
+//!
+//! The desktop is driven by one of several workloads, advanced at a fixed
+//! frame rate whether or not the client is keeping up:
+//!     - scroll: a terminal window scrolling one line of text per frame.
+//!     - video: a region whose every pixel changes each frame.
+//!     - drag: a window bouncing around the desktop, sent as CopyRect.
+//!     - mixed: the terminal and the video region together.
+//!     - idle: a static desktop, for measuring idle cost.
+//!
+//! Updates are encoded with the first encoding in the client's SetEncodings
+//! list that the server implements: Raw, CopyRect, RRE, CoRRE, Hextile, Zlib,
+//! ZRLE and Tight. Tight rects are filled, sent through the palette filter or,
+//! with more colours, as JPEG if the client asked for a quality level and the
+//! server was built with SUPPORT_JPEG, and through the gradient filter
+//! otherwise. The outgoing bandwidth can be capped with a token bucket and each
+//! update can be held back to simulate network latency. Statistics are printed
+//! to stderr once per second and when the client disconnects.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#if SUPPORT_JPEG
+#include <jpeglib.h>
+#endif
+#if __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+#include "rfbproto.h"
+
+//! Maximum number of dirty rectangles tracked before they are merged.
+#define kMaxDirtyRects 32
+
+//! Size of a Hextile tile.
+#define kHextileTileSize 16
+
+//! Largest palette used for ZRLE packed palette tiles.
+#define kZRLEMaxPaletteSize 16
+
+//! Largest palette sent with the Tight palette filter.
+#define kTightMaxPaletteSize 16
+
+//! Tight rects are no wider than this, and are split into bands of at most
+//! kTightMaxRectPixels pixels, as TightVNC does.
+#define kTightMaxRectWidth 2048
+#define kTightMaxRectPixels 65536
+
+//! Tight data shorter than this is sent without compressing it.
+#define kTightMinToCompress 12
+
+//! Height of a line of text in the terminal workload.
+#define kLineHeight 16
+
+//! Width of a character cell in the terminal workload.
+#define kCharWidth 8
+
+#define kDesktopColour 0x3a6ea5
+#define kTerminalBackground 0xf0f0f0
+#define kTerminalText 0x202020
+#define kTerminalKeyword 0x0000c0
+#define kTerminalString 0xa00000
+#define kTitleBarColour 0x5080c0
+
+enum
+{
+    kWorkloadIdle,
+    kWorkloadScroll,
+    kWorkloadVideo,
+    kWorkloadDrag,
+    kWorkloadMixed
+};
+
+enum
+{
+    kStateVersion,
+    kStateSecurity,
+    kStateClientInit,
+    kStateNormal
+};
+
+typedef struct
+{
+    int x;
+    int y;
+    int w;
+    int h;
+} Rect_t;
+
+//! A growable byte buffer. The offset marks bytes already consumed or sent.
+typedef struct
+{
+    uint8_t * data;
+    size_t length;
+    size_t capacity;
+    size_t offset;
+} Buffer_t;
+
+//! Statistics accumulated over one interval.
+typedef struct
+{
+    uint64_t updates;
+    uint64_t rects;
+    uint64_t bytes;
+    uint64_t latencySamples;
+    uint64_t latencyNanoseconds;
+    uint64_t maxLatencyNanoseconds;
+    uint64_t encodeNanoseconds;
+    uint64_t inputEvents;
+} Statistics_t;
+
+//! State of the connected client.
+typedef struct
+{
+    int fd;
+    int state;
+    int minorVersion;
+    Buffer_t input;
+    Buffer_t output;
+
+    rfbPixelFormat format;
+    uint32_t redTable[256];
+    uint32_t greenTable[256];
+    uint32_t blueTable[256];
+    int bytesPerPixel;
+    int bytesPerCPixel;
+    int cpixelOffset;
+    int bytesPerTightPixel;
+
+    int32_t encoding;
+    int canCopyRect;
+    int compressLevel;
+    z_stream zlibStream;
+    z_stream zrleStream;
+    z_stream tightStreams[4];
+    int jpegQuality;    //!< Tight quality level the client asked for, or -1.
+    Buffer_t scratch;
+    Buffer_t compressed;
+
+    Rect_t dirty[kMaxDirtyRects];
+    int dirtyCount;
+    int hasCopy;
+    Rect_t copyDest;
+    int copyDx;
+    int copyDy;
+
+    int hasRequest;
+    uint64_t requestTime;
+
+    //! Bytes actually written over the life of the connection.
+    uint64_t totalSent;
+    //! When totalSent reaches this, the last update has been fully sent.
+    uint64_t pendingUpdateEnd;
+    uint64_t pendingRequestTime;
+    int hasPendingUpdate;
+
+    double tokens;
+    uint64_t lastRefill;
+
+    uint64_t connectTime;
+    Statistics_t interval;
+    Statistics_t total;
+} Client_t;
+
+//! Server options and the synthetic desktop.
+typedef struct
+{
+    int port;
+    int width;
+    int height;
+    int workload;
+    int fps;
+    int minorVersion;
+    long bandwidth;
+    int latencyMs;
+    int duration;
+    int once;
+    int32_t forcedEncoding;
+
+    uint32_t * screen;
+    uint64_t frame;
+    uint32_t random;
+
+    Rect_t terminal;
+    int terminalLine;
+    Rect_t video;
+    Rect_t window;
+    int windowDx;
+    int windowDy;
+
+    Client_t * client;
+} Server_t;
+
+static volatile sig_atomic_t gShouldQuit = 0;
+
+// Utilities
+
+static uint64_t NowNanoseconds(void)
+{
+#if __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+    {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static uint32_t NextRandom(Server_t * server)
+{
+    uint32_t x = server->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    server->random = x;
+    return x;
+}
+
+static void BufferReserve(Buffer_t * buffer, size_t count)
+{
+    if (buffer->length + count <= buffer->capacity)
+    {
+        return;
+    }
+
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (capacity < buffer->length + count)
+    {
+        capacity *= 2;
+    }
+
+    uint8_t * data = realloc(buffer->data, capacity);
+    if (!data)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+}
+
+static uint8_t * BufferAppendSpace(Buffer_t * buffer, size_t count)
+{
+    BufferReserve(buffer, count);
+    uint8_t * result = buffer->data + buffer->length;
+    buffer->length += count;
+    return result;
+}
+
+static void BufferAppend(Buffer_t * buffer, const void * data, size_t count)
+{
+    memcpy(BufferAppendSpace(buffer, count), data, count);
+}
+
+static void BufferAppendU8(Buffer_t * buffer, uint8_t value)
+{
+    *BufferAppendSpace(buffer, 1) = value;
+}
+
+static void BufferAppendU16(Buffer_t * buffer, uint16_t value)
+{
+    uint8_t * p = BufferAppendSpace(buffer, 2);
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static void BufferAppendU32(Buffer_t * buffer, uint32_t value)
+{
+    uint8_t * p = BufferAppendSpace(buffer, 4);
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static void BufferPutU16(Buffer_t * buffer, size_t offset, uint16_t value)
+{
+    buffer->data[offset] = value >> 8;
+    buffer->data[offset + 1] = value;
+}
+
+static void BufferPutU32(Buffer_t * buffer, size_t offset, uint32_t value)
+{
+    buffer->data[offset] = value >> 24;
+    buffer->data[offset + 1] = value >> 16;
+    buffer->data[offset + 2] = value >> 8;
+    buffer->data[offset + 3] = value;
+}
+
+//! Drops the consumed or sent bytes from the front of the buffer.
+static void BufferCompact(Buffer_t * buffer)
+{
+    if (buffer->offset == 0)
+    {
+        return;
+    }
+    memmove(buffer->data, buffer->data + buffer->offset, buffer->length - buffer->offset);
+    buffer->length -= buffer->offset;
+    buffer->offset = 0;
+}
+
+static void BufferFree(Buffer_t * buffer)
+{
+    free(buffer->data);
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+static uint16_t GetU16(const uint8_t * p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t GetU32(const uint8_t * p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Rectangles
+
+static int RectIsEmpty(Rect_t r)
+{
+    return r.w <= 0 || r.h <= 0;
+}
+
+static int RectIntersect(Rect_t a, Rect_t b, Rect_t * result)
+{
+    int x1 = a.x > b.x ? a.x : b.x;
+    int y1 = a.y > b.y ? a.y : b.y;
+    int x2 = (a.x + a.w) < (b.x + b.w) ? (a.x + a.w) : (b.x + b.w);
+    int y2 = (a.y + a.h) < (b.y + b.h) ? (a.y + a.h) : (b.y + b.h);
+    result->x = x1;
+    result->y = y1;
+    result->w = x2 - x1;
+    result->h = y2 - y1;
+    return !RectIsEmpty(*result);
+}
+
+static int RectContains(Rect_t outer, Rect_t inner)
+{
+    return inner.x >= outer.x && inner.y >= outer.y
+        && inner.x + inner.w <= outer.x + outer.w
+        && inner.y + inner.h <= outer.y + outer.h;
+}
+
+static Rect_t RectUnion(Rect_t a, Rect_t b)
+{
+    int x1 = a.x < b.x ? a.x : b.x;
+    int y1 = a.y < b.y ? a.y : b.y;
+    int x2 = (a.x + a.w) > (b.x + b.w) ? (a.x + a.w) : (b.x + b.w);
+    int y2 = (a.y + a.h) > (b.y + b.h) ? (a.y + a.h) : (b.y + b.h);
+    Rect_t result = { x1, y1, x2 - x1, y2 - y1 };
+    return result;
+}
+
+//! Computes a minus b as up to four rectangles, returning how many.
+static int RectSubtract(Rect_t a, Rect_t b, Rect_t pieces[4])
+{
+    Rect_t overlap;
+    if (!RectIntersect(a, b, &overlap))
+    {
+        pieces[0] = a;
+        return 1;
+    }
+
+    int count = 0;
+    Rect_t r;
+
+    // Full-width bands above and below the overlap.
+    r = (Rect_t){ a.x, a.y, a.w, overlap.y - a.y };
+    if (!RectIsEmpty(r)) pieces[count++] = r;
+    r = (Rect_t){ a.x, overlap.y + overlap.h, a.w, a.y + a.h - overlap.y - overlap.h };
+    if (!RectIsEmpty(r)) pieces[count++] = r;
+
+    // Left and right of the overlap within its band.
+    r = (Rect_t){ a.x, overlap.y, overlap.x - a.x, overlap.h };
+    if (!RectIsEmpty(r)) pieces[count++] = r;
+    r = (Rect_t){ overlap.x + overlap.w, overlap.y, a.x + a.w - overlap.x - overlap.w, overlap.h };
+    if (!RectIsEmpty(r)) pieces[count++] = r;
+
+    return count;
+}
+
+// Damage tracking
+
+static void AddDirty(Server_t * server, Client_t * client, Rect_t r)
+{
+    Rect_t screen = { 0, 0, server->width, server->height };
+    if (!RectIntersect(r, screen, &r))
+    {
+        return;
+    }
+
+    int i;
+    for (i = 0; i < client->dirtyCount; ++i)
+    {
+        if (RectContains(client->dirty[i], r))
+        {
+            return;
+        }
+        if (RectContains(r, client->dirty[i]))
+        {
+            client->dirty[i--] = client->dirty[--client->dirtyCount];
+        }
+    }
+
+    if (client->dirtyCount == kMaxDirtyRects)
+    {
+        // Too many pieces; collapse everything into the bounding box.
+        Rect_t bounds = r;
+        for (i = 0; i < client->dirtyCount; ++i)
+        {
+            bounds = RectUnion(bounds, client->dirty[i]);
+        }
+        client->dirty[0] = bounds;
+        client->dirtyCount = 1;
+        return;
+    }
+
+    client->dirty[client->dirtyCount++] = r;
+}
+
+//! @brief Records that dest now holds what was at dest offset by (-dx, -dy).
+//!
+//! Dirty areas and the pending copy are expressed against what the client
+//! will have after applying the pending copy. Dirty areas inside the source
+//! move along with it, and a second copy is folded into the first so that
+//! a client that falls behind still receives a single CopyRect.
+static void AddCopy(Server_t * server, Client_t * client, Rect_t dest, int dx, int dy)
+{
+    if (!client->canCopyRect)
+    {
+        AddDirty(server, client, dest);
+        return;
+    }
+
+    Rect_t source = { dest.x - dx, dest.y - dy, dest.w, dest.h };
+    Rect_t moved[kMaxDirtyRects];
+    int movedCount = 0;
+    int i;
+    for (i = 0; i < client->dirtyCount; ++i)
+    {
+        Rect_t overlap;
+        if (RectIntersect(client->dirty[i], source, &overlap))
+        {
+            overlap.x += dx;
+            overlap.y += dy;
+            moved[movedCount++] = overlap;
+        }
+    }
+    for (i = 0; i < movedCount; ++i)
+    {
+        AddDirty(server, client, moved[i]);
+    }
+
+    if (!client->hasCopy)
+    {
+        client->hasCopy = 1;
+        client->copyDest = dest;
+        client->copyDx = dx;
+        client->copyDy = dy;
+        return;
+    }
+
+    Rect_t pieces[4];
+    int count;
+
+    // Whatever the new copy does not overwrite of the old destination must
+    // be sent as pixels once the two copies are combined.
+    count = RectSubtract(client->copyDest, dest, pieces);
+    for (i = 0; i < count; ++i)
+    {
+        AddDirty(server, client, pieces[i]);
+    }
+
+    Rect_t previous = client->copyDest;
+    previous.x += dx;
+    previous.y += dy;
+    Rect_t combined;
+    if (RectIntersect(dest, previous, &combined))
+    {
+        count = RectSubtract(dest, combined, pieces);
+        for (i = 0; i < count; ++i)
+        {
+            AddDirty(server, client, pieces[i]);
+        }
+        client->copyDest = combined;
+        client->copyDx += dx;
+        client->copyDy += dy;
+    }
+    else
+    {
+        client->hasCopy = 0;
+        AddDirty(server, client, dest);
+    }
+}
+
+// Desktop
+
+static void FillRect(Server_t * server, Rect_t r, uint32_t colour)
+{
+    int x, y;
+    for (y = r.y; y < r.y + r.h; ++y)
+    {
+        uint32_t * row = server->screen + (size_t)y * server->width;
+        for (x = r.x; x < r.x + r.w; ++x)
+        {
+            row[x] = colour;
+        }
+    }
+}
+
+//! Moves the pixels of dest offset by (-dx, -dy) into dest.
+static void MoveScreenRect(Server_t * server, Rect_t dest, int dx, int dy)
+{
+    int step = dy > 0 ? -1 : 1;
+    int y = dy > 0 ? dest.y + dest.h - 1 : dest.y;
+    int i;
+    for (i = 0; i < dest.h; ++i, y += step)
+    {
+        memmove(server->screen + (size_t)y * server->width + dest.x,
+                server->screen + (size_t)(y - dy) * server->width + dest.x - dx,
+                dest.w * sizeof(uint32_t));
+    }
+}
+
+//! Draws a pseudo-random glyph for character code c.
+static void DrawGlyph(Server_t * server, int x, int y, unsigned c, uint32_t colour)
+{
+    int row;
+    for (row = 3; row < kLineHeight - 3; ++row)
+    {
+        uint32_t bits = (c * 2654435761u + row * 40503u) >> 13;
+        int col;
+        for (col = 1; col < kCharWidth - 1; ++col)
+        {
+            if (bits & (1 << col))
+            {
+                server->screen[(size_t)(y + row) * server->width + x + col] = colour;
+            }
+        }
+    }
+}
+
+//! Draws one line of synthetic source code at row y of the terminal.
+static void DrawTextLine(Server_t * server, int y)
+{
+    Rect_t line = { server->terminal.x, y, server->terminal.w, kLineHeight };
+    FillRect(server, line, kTerminalBackground);
+
+    int columns = server->terminal.w / kCharWidth - 1;
+    int indent = (NextRandom(server) % 4) * 4;
+    int length = indent + NextRandom(server) % (columns > indent ? columns - indent : 1);
+    uint32_t colour = kTerminalText;
+    int col;
+    for (col = indent; col < length && col < columns; ++col)
+    {
+        uint32_t r = NextRandom(server);
+        if ((r & 7) == 0)
+        {
+            // Word break, possibly switching to a highlight colour.
+            uint32_t kind = (r >> 3) % 6;
+            colour = kind == 0 ? kTerminalKeyword : (kind == 1 ? kTerminalString : kTerminalText);
+            continue;
+        }
+        DrawGlyph(server, server->terminal.x + kCharWidth / 2 + col * kCharWidth, y, 33 + (r >> 8) % 94, colour);
+    }
+}
+
+static void DrawVideoFrame(Server_t * server)
+{
+    Rect_t r = server->video;
+    unsigned f = (unsigned)server->frame;
+    int x, y;
+    for (y = 0; y < r.h; ++y)
+    {
+        uint32_t * row = server->screen + (size_t)(r.y + y) * server->width + r.x;
+        for (x = 0; x < r.w; ++x)
+        {
+            uint32_t red = (x * 2 + f * 4) & 0xff;
+            uint32_t green = (y * 2 + f * 2) & 0xff;
+            uint32_t blue = ((x ^ y) + f * 8) & 0xff;
+            uint32_t noise = NextRandom(server) & 0x070707;
+            row[x] = ((red << 16) | (green << 8) | blue) ^ noise;
+        }
+    }
+}
+
+static void DrawWindow(Server_t * server)
+{
+    Rect_t r = server->window;
+    Rect_t title = { r.x, r.y, r.w, 20 };
+    Rect_t body = { r.x + 1, r.y + 20, r.w - 2, r.h - 21 };
+    FillRect(server, r, 0x404040);
+    FillRect(server, title, kTitleBarColour);
+    FillRect(server, body, 0xe8e8e8);
+
+    int y;
+    for (y = body.y + 8; y + kLineHeight < body.y + body.h; y += kLineHeight)
+    {
+        int x;
+        for (x = body.x + 8; x + kCharWidth < body.x + body.w - 8; x += kCharWidth)
+        {
+            DrawGlyph(server, x, y, (unsigned)(x * 7 + y), kTerminalText);
+        }
+    }
+}
+
+static void SetUpDesktop(Server_t * server)
+{
+    Rect_t all = { 0, 0, server->width, server->height };
+    FillRect(server, all, kDesktopColour);
+
+    int half = server->width / 2;
+    int lines = (server->height - 32) / kLineHeight;
+    server->terminal = (Rect_t){ 16, 16, half - 24, lines * kLineHeight };
+    server->video = (Rect_t){ half + 8, 16, half - 24, server->height / 2 };
+    server->window = (Rect_t){ 40, 40, 320, 240 };
+    server->windowDx = 5;
+    server->windowDy = 3;
+
+    if (server->workload == kWorkloadScroll || server->workload == kWorkloadMixed || server->workload == kWorkloadIdle)
+    {
+        int y;
+        for (y = 0; y < server->terminal.h; y += kLineHeight)
+        {
+            DrawTextLine(server, server->terminal.y + y);
+        }
+    }
+    if (server->workload == kWorkloadVideo || server->workload == kWorkloadMixed)
+    {
+        DrawVideoFrame(server);
+    }
+    if (server->workload == kWorkloadDrag || server->workload == kWorkloadIdle)
+    {
+        if (server->workload == kWorkloadIdle)
+        {
+            server->window.x = server->width - server->window.w - 16;
+            server->window.y = server->video.y;
+        }
+        DrawWindow(server);
+    }
+}
+
+static void StepScroll(Server_t * server)
+{
+    Client_t * client = server->client;
+    Rect_t dest = server->terminal;
+    dest.h -= kLineHeight;
+    MoveScreenRect(server, dest, 0, -kLineHeight);
+    Rect_t line = { server->terminal.x, server->terminal.y + dest.h, server->terminal.w, kLineHeight };
+    DrawTextLine(server, line.y);
+
+    if (client)
+    {
+        AddCopy(server, client, dest, 0, -kLineHeight);
+        AddDirty(server, client, line);
+    }
+}
+
+static void StepVideo(Server_t * server)
+{
+    DrawVideoFrame(server);
+    if (server->client)
+    {
+        AddDirty(server, server->client, server->video);
+    }
+}
+
+static void StepDrag(Server_t * server)
+{
+    Client_t * client = server->client;
+    Rect_t old = server->window;
+    Rect_t r = old;
+
+    if (r.x + server->windowDx < 0 || r.x + r.w + server->windowDx > server->width)
+    {
+        server->windowDx = -server->windowDx;
+    }
+    if (r.y + server->windowDy < 0 || r.y + r.h + server->windowDy > server->height)
+    {
+        server->windowDy = -server->windowDy;
+    }
+    r.x += server->windowDx;
+    r.y += server->windowDy;
+    server->window = r;
+    MoveScreenRect(server, r, server->windowDx, server->windowDy);
+
+    Rect_t exposed[4];
+    int count = RectSubtract(old, r, exposed);
+    int i;
+    for (i = 0; i < count; ++i)
+    {
+        FillRect(server, exposed[i], kDesktopColour);
+    }
+
+    if (client)
+    {
+        AddCopy(server, client, r, server->windowDx, server->windowDy);
+        for (i = 0; i < count; ++i)
+        {
+            AddDirty(server, client, exposed[i]);
+        }
+    }
+}
+
+static void StepWorkload(Server_t * server)
+{
+    ++server->frame;
+    switch (server->workload)
+    {
+        case kWorkloadScroll:
+            StepScroll(server);
+            break;
+        case kWorkloadVideo:
+            StepVideo(server);
+            break;
+        case kWorkloadDrag:
+            StepDrag(server);
+            break;
+        case kWorkloadMixed:
+            StepScroll(server);
+            StepVideo(server);
+            break;
+        default:
+            break;
+    }
+}
+
+// Pixel formats
+
+//! Builds the translation tables and CPIXEL layout for the client's format.
+static int SetPixelFormat(Client_t * client, const rfbPixelFormat * format)
+{
+    if (!format->trueColour || (format->bitsPerPixel != 8 && format->bitsPerPixel != 16 && format->bitsPerPixel != 32))
+    {
+        fprintf(stderr, "unsupported pixel format (%d bpp, true colour %d)\n", format->bitsPerPixel, format->trueColour);
+        return -1;
+    }
+
+    client->format = *format;
+    client->bytesPerPixel = format->bitsPerPixel / 8;
+
+    int i;
+    for (i = 0; i < 256; ++i)
+    {
+        client->redTable[i] = (uint32_t)((i * format->redMax + 127) / 255) << format->redShift;
+        client->greenTable[i] = (uint32_t)((i * format->greenMax + 127) / 255) << format->greenShift;
+        client->blueTable[i] = (uint32_t)((i * format->blueMax + 127) / 255) << format->blueShift;
+    }
+
+    // Tight sends three-byte pixels for 24-bit colour with 8-bit channels.
+    client->bytesPerTightPixel = client->bytesPerPixel;
+    if (format->bitsPerPixel == 32 && format->depth == 24 && format->redMax == 255 && format->greenMax == 255 && format->blueMax == 255)
+    {
+        client->bytesPerTightPixel = 3;
+    }
+
+    // ZRLE sends three-byte pixels when the colour bits fit in three bytes.
+    client->bytesPerCPixel = client->bytesPerPixel;
+    client->cpixelOffset = 0;
+    if (format->bitsPerPixel == 32 && format->depth <= 24)
+    {
+        uint32_t mask = ((uint32_t)format->redMax << format->redShift)
+            | ((uint32_t)format->greenMax << format->greenShift)
+            | ((uint32_t)format->blueMax << format->blueShift);
+        if ((mask & 0xff000000) == 0)
+        {
+            client->bytesPerCPixel = 3;
+            client->cpixelOffset = format->bigEndian ? 1 : 0;
+        }
+        else if ((mask & 0x000000ff) == 0)
+        {
+            client->bytesPerCPixel = 3;
+            client->cpixelOffset = format->bigEndian ? 0 : 1;
+        }
+    }
+    return 0;
+}
+
+static void TranslatePixel(Client_t * client, uint32_t rgb, uint8_t * out)
+{
+    uint32_t value = client->redTable[(rgb >> 16) & 0xff]
+        | client->greenTable[(rgb >> 8) & 0xff]
+        | client->blueTable[rgb & 0xff];
+
+    switch (client->bytesPerPixel)
+    {
+        case 1:
+            out[0] = value;
+            break;
+        case 2:
+            if (client->format.bigEndian)
+            {
+                out[0] = value >> 8;
+                out[1] = value;
+            }
+            else
+            {
+                out[0] = value;
+                out[1] = value >> 8;
+            }
+            break;
+        default:
+            if (client->format.bigEndian)
+            {
+                out[0] = value >> 24;
+                out[1] = value >> 16;
+                out[2] = value >> 8;
+                out[3] = value;
+            }
+            else
+            {
+                out[0] = value;
+                out[1] = value >> 8;
+                out[2] = value >> 16;
+                out[3] = value >> 24;
+            }
+            break;
+    }
+}
+
+static void AppendPixel(Client_t * client, Buffer_t * buffer, uint32_t rgb)
+{
+    TranslatePixel(client, rgb, BufferAppendSpace(buffer, client->bytesPerPixel));
+}
+
+static void AppendCPixel(Client_t * client, Buffer_t * buffer, uint32_t rgb)
+{
+    uint8_t pixel[4];
+    TranslatePixel(client, rgb, pixel);
+    BufferAppend(buffer, pixel + client->cpixelOffset, client->bytesPerCPixel);
+}
+
+static void AppendRawPixels(Server_t * server, Client_t * client, Buffer_t * buffer, Rect_t r)
+{
+    uint8_t * out = BufferAppendSpace(buffer, (size_t)r.w * r.h * client->bytesPerPixel);
+    int x, y;
+    for (y = r.y; y < r.y + r.h; ++y)
+    {
+        const uint32_t * row = server->screen + (size_t)y * server->width;
+        for (x = r.x; x < r.x + r.w; ++x)
+        {
+            TranslatePixel(client, row[x], out);
+            out += client->bytesPerPixel;
+        }
+    }
+}
+
+// Encoders
+
+static void AppendRectHeader(Buffer_t * buffer, Rect_t r, int32_t encoding)
+{
+    BufferAppendU16(buffer, r.x);
+    BufferAppendU16(buffer, r.y);
+    BufferAppendU16(buffer, r.w);
+    BufferAppendU16(buffer, r.h);
+    BufferAppendU32(buffer, (uint32_t)encoding);
+}
+
+static int EncodeRaw(Server_t * server, Client_t * client, Rect_t r)
+{
+    AppendRectHeader(&client->output, r, rfbEncodingRaw);
+    AppendRawPixels(server, client, &client->output, r);
+    return 1;
+}
+
+//! Encodes with RRE or CoRRE as horizontal runs; returns 0 if raw is smaller.
+static int EncodeRRE(Server_t * server, Client_t * client, Rect_t r, int compact)
+{
+    Buffer_t * out = &client->output;
+    size_t start = out->length;
+    size_t rawSize = (size_t)r.w * r.h * client->bytesPerPixel;
+
+    AppendRectHeader(out, r, compact ? rfbEncodingCoRRE : rfbEncodingRRE);
+    size_t countOffset = out->length;
+    BufferAppendU32(out, 0);
+
+    uint32_t background = server->screen[(size_t)r.y * server->width + r.x];
+    AppendPixel(client, out, background);
+
+    uint32_t subrects = 0;
+    int x, y;
+    for (y = 0; y < r.h; ++y)
+    {
+        const uint32_t * row = server->screen + (size_t)(r.y + y) * server->width + r.x;
+        for (x = 0; x < r.w; )
+        {
+            uint32_t colour = row[x];
+            int runStart = x;
+            while (x < r.w && row[x] == colour)
+            {
+                ++x;
+            }
+            if (colour == background)
+            {
+                continue;
+            }
+
+            AppendPixel(client, out, colour);
+            if (compact)
+            {
+                uint8_t * p = BufferAppendSpace(out, 4);
+                p[0] = runStart;
+                p[1] = y;
+                p[2] = x - runStart;
+                p[3] = 1;
+            }
+            else
+            {
+                BufferAppendU16(out, runStart);
+                BufferAppendU16(out, y);
+                BufferAppendU16(out, x - runStart);
+                BufferAppendU16(out, 1);
+            }
+            ++subrects;
+        }
+
+        if (out->length - start > rawSize)
+        {
+            out->length = start;
+            return 0;
+        }
+    }
+
+    BufferPutU32(out, countOffset, subrects);
+    return 1;
+}
+
+static int EncodeCoRRE(Server_t * server, Client_t * client, Rect_t r)
+{
+    int count = 0;
+    int x, y;
+    for (y = r.y; y < r.y + r.h; y += 255)
+    {
+        for (x = r.x; x < r.x + r.w; x += 255)
+        {
+            Rect_t piece = { x, y, r.w - (x - r.x), r.h - (y - r.y) };
+            if (piece.w > 255) piece.w = 255;
+            if (piece.h > 255) piece.h = 255;
+            if (!EncodeRRE(server, client, piece, 1))
+            {
+                EncodeRaw(server, client, piece);
+            }
+            ++count;
+        }
+    }
+    return count;
+}
+
+static int EncodeHextile(Server_t * server, Client_t * client, Rect_t r)
+{
+    Buffer_t * out = &client->output;
+    AppendRectHeader(out, r, rfbEncodingHextile);
+
+    uint32_t background = 0;
+    uint32_t foreground = 0;
+    int hasBackground = 0;
+    int hasForeground = 0;
+    int tx, ty;
+    for (ty = r.y; ty < r.y + r.h; ty += kHextileTileSize)
+    {
+        for (tx = r.x; tx < r.x + r.w; tx += kHextileTileSize)
+        {
+            Rect_t tile = { tx, ty, r.x + r.w - tx, r.y + r.h - ty };
+            if (tile.w > kHextileTileSize) tile.w = kHextileTileSize;
+            if (tile.h > kHextileTileSize) tile.h = kHextileTileSize;
+
+            // Count up to three colours, tracking how often the first appears.
+            uint32_t first = server->screen[(size_t)tile.y * server->width + tile.x];
+            uint32_t second = first;
+            int colours = 1;
+            int firstCount = 0;
+            int x, y;
+            for (y = 0; y < tile.h && colours < 3; ++y)
+            {
+                const uint32_t * row = server->screen + (size_t)(tile.y + y) * server->width + tile.x;
+                for (x = 0; x < tile.w; ++x)
+                {
+                    if (row[x] == first)
+                    {
+                        ++firstCount;
+                    }
+                    else if (colours == 1)
+                    {
+                        second = row[x];
+                        colours = 2;
+                    }
+                    else if (row[x] != second)
+                    {
+                        colours = 3;
+                        break;
+                    }
+                }
+            }
+
+            size_t flagsOffset = out->length;
+            uint8_t flags = 0;
+            BufferAppendU8(out, 0);
+
+            if (colours == 1)
+            {
+                if (!hasBackground || background != first)
+                {
+                    flags |= rfbHextileBackgroundSpecified;
+                    AppendPixel(client, out, first);
+                    background = first;
+                    hasBackground = 1;
+                }
+                out->data[flagsOffset] = flags;
+                continue;
+            }
+
+            if (colours == 2)
+            {
+                uint32_t bg = firstCount * 2 >= tile.w * tile.h ? first : second;
+                uint32_t fg = bg == first ? second : first;
+                if (!hasBackground || background != bg)
+                {
+                    flags |= rfbHextileBackgroundSpecified;
+                    AppendPixel(client, out, bg);
+                }
+                if (!hasForeground || foreground != fg)
+                {
+                    flags |= rfbHextileForegroundSpecified;
+                    AppendPixel(client, out, fg);
+                }
+                flags |= rfbHextileAnySubrects;
+                size_t countOffset = out->length;
+                BufferAppendU8(out, 0);
+
+                int subrects = 0;
+                for (y = 0; y < tile.h && subrects <= 255; ++y)
+                {
+                    const uint32_t * row = server->screen + (size_t)(tile.y + y) * server->width + tile.x;
+                    for (x = 0; x < tile.w; )
+                    {
+                        if (row[x] != fg)
+                        {
+                            ++x;
+                            continue;
+                        }
+                        int runStart = x;
+                        while (x < tile.w && row[x] == fg)
+                        {
+                            ++x;
+                        }
+                        BufferAppendU8(out, rfbHextilePackXY(runStart, y));
+                        BufferAppendU8(out, rfbHextilePackWH(x - runStart, 1));
+                        ++subrects;
+                    }
+                }
+
+                size_t rawSize = (size_t)tile.w * tile.h * client->bytesPerPixel;
+                if (subrects <= 255 && out->length - flagsOffset - 1 <= rawSize)
+                {
+                    out->data[flagsOffset] = flags;
+                    out->data[countOffset] = subrects;
+                    background = bg;
+                    foreground = fg;
+                    hasBackground = 1;
+                    hasForeground = 1;
+                    continue;
+                }
+
+                // Subrects would be larger than the pixels; fall through to raw.
+                out->length = flagsOffset + 1;
+            }
+
+            out->data[flagsOffset] = rfbHextileRaw;
+            AppendRawPixels(server, client, out, tile);
+
+            // Colours are not carried over from a raw tile.
+            hasBackground = 0;
+            hasForeground = 0;
+        }
+    }
+    return 1;
+}
+
+//! Deflates data into the output preceded by a 32-bit length.
+static void AppendDeflated(Client_t * client, z_stream * stream, const Buffer_t * data)
+{
+    Buffer_t * out = &client->output;
+    size_t lengthOffset = out->length;
+    BufferAppendU32(out, 0);
+
+    stream->next_in = data->data;
+    stream->avail_in = (uInt)data->length;
+    do
+    {
+        size_t space = deflateBound(stream, stream->avail_in) + 64;
+        BufferReserve(out, space);
+        stream->next_out = out->data + out->length;
+        stream->avail_out = (uInt)space;
+        deflate(stream, Z_SYNC_FLUSH);
+        out->length += space - stream->avail_out;
+    } while (stream->avail_out == 0);
+
+    BufferPutU32(out, lengthOffset, (uint32_t)(out->length - lengthOffset - 4));
+}
+
+static int EncodeZlib(Server_t * server, Client_t * client, Rect_t r)
+{
+    Buffer_t * scratch = &client->scratch;
+    scratch->length = 0;
+    AppendRawPixels(server, client, scratch, r);
+
+    AppendRectHeader(&client->output, r, rfbEncodingZlib);
+    AppendDeflated(client, &client->zlibStream, scratch);
+    return 1;
+}
+
+static void AppendZRLETile(Server_t * server, Client_t * client, Buffer_t * out, Rect_t tile)
+{
+    uint32_t palette[kZRLEMaxPaletteSize];
+    int paletteSize = 0;
+    int x, y, i;
+
+    for (y = 0; y < tile.h && paletteSize <= kZRLEMaxPaletteSize; ++y)
+    {
+        const uint32_t * row = server->screen + (size_t)(tile.y + y) * server->width + tile.x;
+        for (x = 0; x < tile.w; ++x)
+        {
+            for (i = 0; i < paletteSize; ++i)
+            {
+                if (palette[i] == row[x])
+                {
+                    break;
+                }
+            }
+            if (i == paletteSize)
+            {
+                if (paletteSize == kZRLEMaxPaletteSize)
+                {
+                    paletteSize = kZRLEMaxPaletteSize + 1;
+                    break;
+                }
+                palette[paletteSize++] = row[x];
+            }
+        }
+    }
+
+    if (paletteSize == 1)
+    {
+        BufferAppendU8(out, 1);
+        AppendCPixel(client, out, palette[0]);
+        return;
+    }
+
+    if (paletteSize > kZRLEMaxPaletteSize)
+    {
+        BufferAppendU8(out, 0);
+        for (y = 0; y < tile.h; ++y)
+        {
+            const uint32_t * row = server->screen + (size_t)(tile.y + y) * server->width + tile.x;
+            for (x = 0; x < tile.w; ++x)
+            {
+                AppendCPixel(client, out, row[x]);
+            }
+        }
+        return;
+    }
+
+    BufferAppendU8(out, paletteSize);
+    for (i = 0; i < paletteSize; ++i)
+    {
+        AppendCPixel(client, out, palette[i]);
+    }
+
+    int bits = paletteSize == 2 ? 1 : (paletteSize <= 4 ? 2 : 4);
+    for (y = 0; y < tile.h; ++y)
+    {
+        const uint32_t * row = server->screen + (size_t)(tile.y + y) * server->width + tile.x;
+        uint8_t byte = 0;
+        int used = 0;
+        for (x = 0; x < tile.w; ++x)
+        {
+            for (i = 0; palette[i] != row[x]; ++i)
+            {
+            }
+            byte = (byte << bits) | i;
+            used += bits;
+            if (used == 8)
+            {
+                BufferAppendU8(out, byte);
+                byte = 0;
+                used = 0;
+            }
+        }
+        if (used)
+        {
+            BufferAppendU8(out, byte << (8 - used));
+        }
+    }
+}
+
+static int EncodeZRLE(Server_t * server, Client_t * client, Rect_t r)
+{
+    Buffer_t * scratch = &client->scratch;
+    scratch->length = 0;
+
+    int tx, ty;
+    for (ty = r.y; ty < r.y + r.h; ty += rfbZRLETileHeight)
+    {
+        for (tx = r.x; tx < r.x + r.w; tx += rfbZRLETileWidth)
+        {
+            Rect_t tile = { tx, ty, r.x + r.w - tx, r.y + r.h - ty };
+            if (tile.w > rfbZRLETileWidth) tile.w = rfbZRLETileWidth;
+            if (tile.h > rfbZRLETileHeight) tile.h = rfbZRLETileHeight;
+            AppendZRLETile(server, client, scratch, tile);
+        }
+    }
+
+    AppendRectHeader(&client->output, r, rfbEncodingZRLE);
+    AppendDeflated(client, &client->zrleStream, scratch);
+    return 1;
+}
+
+// Tight
+
+//! Appends a Tight pixel: three bytes, red first, when the colours fit in them.
+static void AppendTightPixel(Client_t * client, Buffer_t * buffer, uint32_t rgb)
+{
+    if (client->bytesPerTightPixel == 3)
+    {
+        uint32_t value = client->redTable[(rgb >> 16) & 0xff]
+            | client->greenTable[(rgb >> 8) & 0xff]
+            | client->blueTable[rgb & 0xff];
+        uint8_t * p = BufferAppendSpace(buffer, 3);
+        p[0] = value >> 16;
+        p[1] = value >> 8;
+        p[2] = value;
+    }
+    else
+    {
+        AppendPixel(client, buffer, rgb);
+    }
+}
+
+static void AppendCompactLength(Buffer_t * buffer, size_t length)
+{
+    BufferAppendU8(buffer, (length & 0x7f) | (length > 0x7f ? 0x80 : 0));
+    if (length > 0x7f)
+    {
+        BufferAppendU8(buffer, ((length >> 7) & 0x7f) | (length > 0x3fff ? 0x80 : 0));
+        if (length > 0x3fff)
+        {
+            BufferAppendU8(buffer, length >> 14);
+        }
+    }
+}
+
+//! Appends filtered data, deflated with one of the four streams unless it is short.
+static void AppendTightData(Client_t * client, int streamId, const Buffer_t * data)
+{
+    Buffer_t * out = &client->output;
+    Buffer_t * compressed = &client->compressed;
+    z_stream * stream = &client->tightStreams[streamId];
+
+    if (data->length < kTightMinToCompress)
+    {
+        BufferAppend(out, data->data, data->length);
+        return;
+    }
+
+    compressed->length = 0;
+    stream->next_in = data->data;
+    stream->avail_in = (uInt)data->length;
+    do
+    {
+        size_t space = deflateBound(stream, stream->avail_in) + 64;
+        BufferReserve(compressed, space);
+        stream->next_out = compressed->data + compressed->length;
+        stream->avail_out = (uInt)space;
+        deflate(stream, Z_SYNC_FLUSH);
+        compressed->length += space - stream->avail_out;
+    } while (stream->avail_out == 0);
+
+    AppendCompactLength(out, compressed->length);
+    BufferAppend(out, compressed->data, compressed->length);
+}
+
+//! Counts the colours of a rect, giving up past kTightMaxPaletteSize.
+static int GetTightPalette(Server_t * server, Rect_t r, uint32_t palette[kTightMaxPaletteSize])
+{
+    int paletteSize = 0;
+    int x, y, i;
+
+    for (y = r.y; y < r.y + r.h; ++y)
+    {
+        const uint32_t * row = server->screen + (size_t)y * server->width;
+        for (x = r.x; x < r.x + r.w; ++x)
+        {
+            for (i = 0; i < paletteSize && palette[i] != row[x]; ++i)
+            {
+            }
+            if (i == paletteSize)
+            {
+                if (paletteSize == kTightMaxPaletteSize)
+                {
+                    return kTightMaxPaletteSize + 1;
+                }
+                palette[paletteSize++] = row[x];
+            }
+        }
+    }
+    return paletteSize;
+}
+
+static void AppendTightPalette(Server_t * server, Client_t * client, Rect_t r, const uint32_t * palette, int paletteSize)
+{
+    Buffer_t * out = &client->output;
+    Buffer_t * scratch = &client->scratch;
+    int streamId = paletteSize == 2 ? 1 : 2;
+    int x, y, i;
+
+    BufferAppendU8(out, (rfbTightExplicitFilter | streamId) << 4);
+    BufferAppendU8(out, rfbTightFilterPalette);
+    BufferAppendU8(out, paletteSize - 1);
+    for (i = 0; i < paletteSize; ++i)
+    {
+        AppendTightPixel(client, out, palette[i]);
+    }
+
+    // Two colours are sent as rows of bits, more as a byte per pixel.
+    scratch->length = 0;
+    for (y = r.y; y < r.y + r.h; ++y)
+    {
+        const uint32_t * row = server->screen + (size_t)y * server->width;
+        uint8_t byte = 0;
+        int used = 0;
+        for (x = r.x; x < r.x + r.w; ++x)
+        {
+            for (i = 0; palette[i] != row[x]; ++i)
+            {
+            }
+            if (paletteSize > 2)
+            {
+                BufferAppendU8(scratch, i);
+                continue;
+            }
+            byte = (byte << 1) | i;
+            if (++used == 8)
+            {
+                BufferAppendU8(scratch, byte);
+                byte = 0;
+                used = 0;
+            }
+        }
+        if (used)
+        {
+            BufferAppendU8(scratch, byte << (8 - used));
+        }
+    }
+    AppendTightData(client, streamId, scratch);
+}
+
+//! Sends a rect through the gradient filter if its pixels are three bytes,
+//! otherwise unfiltered.
+static void AppendTightFullColour(Server_t * server, Client_t * client, Rect_t r)
+{
+    Buffer_t * out = &client->output;
+    Buffer_t * scratch = &client->scratch;
+    int x, y;
+
+    scratch->length = 0;
+    if (client->bytesPerTightPixel != 3)
+    {
+        BufferAppendU8(out, 0);
+        AppendRawPixels(server, client, scratch, r);
+        AppendTightData(client, 0, scratch);
+        return;
+    }
+
+    // Each row's pixels are kept to predict the next row from.
+    uint8_t rows[2][kTightMaxRectWidth * 3];
+    memset(rows[1], 0, (size_t)r.w * 3);
+    BufferAppendU8(out, (rfbTightExplicitFilter | 3) << 4);
+    BufferAppendU8(out, rfbTightFilterGradient);
+    for (y = 0; y < r.h; ++y)
+    {
+        uint8_t * above = rows[(y + 1) & 1];
+        uint8_t * pixels = rows[y & 1];
+        Buffer_t row = { pixels, 0, sizeof(rows[0]), 0 };
+        uint8_t * d = BufferAppendSpace(scratch, (size_t)r.w * 3);
+
+        for (x = 0; x < r.w; ++x)
+        {
+            AppendTightPixel(client, &row, server->screen[(size_t)(r.y + y) * server->width + r.x + x]);
+        }
+        for (x = 0; x < r.w * 3; ++x)
+        {
+            int left = x >= 3 ? pixels[x - 3] : 0;
+            int aboveLeft = x >= 3 ? above[x - 3] : 0;
+            int estimate = above[x] + left - aboveLeft;
+            estimate = estimate < 0 ? 0 : (estimate > 255 ? 255 : estimate);
+            d[x] = (uint8_t)(pixels[x] - estimate);
+        }
+    }
+    AppendTightData(client, 3, scratch);
+}
+
+#if SUPPORT_JPEG
+//! JPEG quality of each Tight quality level, as used by TightVNC and libvncserver.
+static const int kTightJpegQuality[10] = { 5, 10, 15, 25, 37, 50, 60, 70, 75, 80 };
+
+static void AppendTightJpeg(Server_t * server, Client_t * client, Rect_t r)
+{
+    Buffer_t * out = &client->output;
+    Buffer_t * scratch = &client->scratch;
+    struct jpeg_compress_struct info;
+    struct jpeg_error_mgr error;
+    unsigned char * data = NULL;
+    unsigned long length = 0;
+    int x, y;
+
+    BufferReserve(scratch, (size_t)r.w * 3);
+    info.err = jpeg_std_error(&error);
+    jpeg_create_compress(&info);
+    jpeg_mem_dest(&info, &data, &length);
+    info.image_width = r.w;
+    info.image_height = r.h;
+    info.input_components = 3;
+    info.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&info);
+    jpeg_set_quality(&info, kTightJpegQuality[client->jpegQuality], TRUE);
+    jpeg_start_compress(&info, TRUE);
+    for (y = r.y; y < r.y + r.h; ++y)
+    {
+        const uint32_t * row = server->screen + (size_t)y * server->width;
+        JSAMPROW line = scratch->data;
+        for (x = 0; x < r.w; ++x)
+        {
+            uint32_t rgb = row[r.x + x];
+            line[x * 3] = rgb >> 16;
+            line[x * 3 + 1] = rgb >> 8;
+            line[x * 3 + 2] = rgb;
+        }
+        jpeg_write_scanlines(&info, &line, 1);
+    }
+    jpeg_finish_compress(&info);
+    jpeg_destroy_compress(&info);
+
+    BufferAppendU8(out, rfbTightJpeg << 4);
+    AppendCompactLength(out, length);
+    BufferAppend(out, data, length);
+    free(data);
+}
+#endif
+
+static int EncodeTight(Server_t * server, Client_t * client, Rect_t r)
+{
+    uint32_t palette[kTightMaxPaletteSize];
+    int count = 0;
+    int bandHeight;
+    int x, y;
+
+    for (x = r.x; x < r.x + r.w; x += kTightMaxRectWidth)
+    {
+        int w = r.x + r.w - x < kTightMaxRectWidth ? r.x + r.w - x : kTightMaxRectWidth;
+        bandHeight = kTightMaxRectPixels / w;
+        for (y = r.y; y < r.y + r.h; y += bandHeight)
+        {
+            Rect_t band = { x, y, w, r.y + r.h - y < bandHeight ? r.y + r.h - y : bandHeight };
+            int paletteSize = GetTightPalette(server, band, palette);
+
+            AppendRectHeader(&client->output, band, rfbEncodingTight);
+            if (paletteSize == 1)
+            {
+                BufferAppendU8(&client->output, rfbTightFill << 4);
+                AppendTightPixel(client, &client->output, palette[0]);
+            }
+            else if (paletteSize <= kTightMaxPaletteSize)
+            {
+                AppendTightPalette(server, client, band, palette, paletteSize);
+            }
+#if SUPPORT_JPEG
+            else if (client->jpegQuality >= 0 && client->bytesPerPixel > 1)
+            {
+                AppendTightJpeg(server, client, band);
+            }
+#endif
+            else
+            {
+                AppendTightFullColour(server, client, band);
+            }
+            ++count;
+        }
+    }
+    return count;
+}
+
+//! Encodes one dirty rectangle, returning the number of rectangles written.
+static int EncodeRect(Server_t * server, Client_t * client, Rect_t r)
+{
+    switch (client->encoding)
+    {
+        case rfbEncodingRRE:
+            return EncodeRRE(server, client, r, 0) ? 1 : EncodeRaw(server, client, r);
+        case rfbEncodingCoRRE:
+            return EncodeCoRRE(server, client, r);
+        case rfbEncodingHextile:
+            return EncodeHextile(server, client, r);
+        case rfbEncodingZlib:
+            return EncodeZlib(server, client, r);
+        case rfbEncodingZRLE:
+            return EncodeZRLE(server, client, r);
+        case rfbEncodingTight:
+            return EncodeTight(server, client, r);
+        default:
+            return EncodeRaw(server, client, r);
+    }
+}
+
+static const char * NameOfEncoding(int32_t encoding)
+{
+    switch (encoding)
+    {
+        case rfbEncodingRaw:
+            return "raw";
+        case rfbEncodingRRE:
+            return "rre";
+        case rfbEncodingCoRRE:
+            return "corre";
+        case rfbEncodingHextile:
+            return "hextile";
+        case rfbEncodingZlib:
+            return "zlib";
+        case rfbEncodingZRLE:
+            return "zrle";
+        case rfbEncodingTight:
+            return "tight";
+        default:
+            return "unknown";
+    }
+}
+
+static int32_t EncodingForName(const char * name)
+{
+    static const int32_t encodings[] = { rfbEncodingRaw, rfbEncodingRRE, rfbEncodingCoRRE, rfbEncodingHextile, rfbEncodingZlib, rfbEncodingZRLE, rfbEncodingTight };
+    unsigned i;
+    for (i = 0; i < sizeof(encodings) / sizeof(encodings[0]); ++i)
+    {
+        if (strcmp(name, NameOfEncoding(encodings[i])) == 0)
+        {
+            return encodings[i];
+        }
+    }
+    return -1;
+}
+
+// Updates
+
+static void SendUpdate(Server_t * server, Client_t * client, uint64_t now)
+{
+    Buffer_t * out = &client->output;
+    BufferAppendU8(out, rfbFramebufferUpdate);
+    BufferAppendU8(out, 0);
+    size_t countOffset = out->length;
+    BufferAppendU16(out, 0);
+
+    int count = 0;
+    if (client->hasCopy)
+    {
+        AppendRectHeader(out, client->copyDest, rfbEncodingCopyRect);
+        BufferAppendU16(out, client->copyDest.x - client->copyDx);
+        BufferAppendU16(out, client->copyDest.y - client->copyDy);
+        client->hasCopy = 0;
+        ++count;
+    }
+
+    int i;
+    for (i = 0; i < client->dirtyCount; ++i)
+    {
+        count += EncodeRect(server, client, client->dirty[i]);
+    }
+    client->dirtyCount = 0;
+
+    BufferPutU16(out, countOffset, count);
+
+    client->pendingUpdateEnd = client->totalSent + (out->length - out->offset);
+    client->pendingRequestTime = client->requestTime;
+    client->hasPendingUpdate = 1;
+    client->hasRequest = 0;
+
+    client->interval.updates++;
+    client->interval.rects += count;
+    client->interval.encodeNanoseconds += NowNanoseconds() - now;
+}
+
+static int IsUpdateDue(Server_t * server, Client_t * client, uint64_t now)
+{
+    return client->state == kStateNormal
+        && client->hasRequest
+        && (client->dirtyCount || client->hasCopy)
+        && client->output.offset == client->output.length
+        && now >= client->requestTime + (uint64_t)server->latencyMs * 1000000ULL;
+}
+
+// Client messages
+
+static void SendServerInit(Server_t * server, Client_t * client)
+{
+    static const char * const workloadNames[] = { "idle", "scroll", "video", "drag", "mixed" };
+    char name[64];
+    snprintf(name, sizeof(name), "cotvnc test server (%s)", workloadNames[server->workload]);
+
+    Buffer_t * out = &client->output;
+    BufferAppendU16(out, server->width);
+    BufferAppendU16(out, server->height);
+
+    // 32-bit little endian xRGB, matching the screen buffer.
+    rfbPixelFormat format;
+    memset(&format, 0, sizeof(format));
+    format.bitsPerPixel = 32;
+    format.depth = 24;
+    format.bigEndian = 0;
+    format.trueColour = 1;
+    format.redMax = 255;
+    format.greenMax = 255;
+    format.blueMax = 255;
+    format.redShift = 16;
+    format.greenShift = 8;
+    format.blueShift = 0;
+    SetPixelFormat(client, &format);
+
+    BufferAppendU8(out, format.bitsPerPixel);
+    BufferAppendU8(out, format.depth);
+    BufferAppendU8(out, format.bigEndian);
+    BufferAppendU8(out, format.trueColour);
+    BufferAppendU16(out, format.redMax);
+    BufferAppendU16(out, format.greenMax);
+    BufferAppendU16(out, format.blueMax);
+    BufferAppendU8(out, format.redShift);
+    BufferAppendU8(out, format.greenShift);
+    BufferAppendU8(out, format.blueShift);
+    BufferAppend(out, "\0\0\0", 3);
+    BufferAppendU32(out, (uint32_t)strlen(name));
+    BufferAppend(out, name, strlen(name));
+}
+
+static void HandleSetEncodings(Server_t * server, Client_t * client, const uint8_t * list, int count)
+{
+    client->encoding = rfbEncodingRaw;
+    client->canCopyRect = 0;
+    client->jpegQuality = -1;
+    int chosen = 0;
+    int i;
+    for (i = 0; i < count; ++i)
+    {
+        int32_t encoding = (int32_t)GetU32(list + i * 4);
+        if (encoding == rfbEncodingCopyRect)
+        {
+            client->canCopyRect = 1;
+        }
+        else if (encoding >= (int32_t)rfbEncodingCompressLevel0 && encoding <= (int32_t)rfbEncodingCompressLevel9)
+        {
+            client->compressLevel = encoding - (int32_t)rfbEncodingCompressLevel0;
+        }
+        else if (encoding >= (int32_t)rfbEncodingQualityLevel0 && encoding <= (int32_t)rfbEncodingQualityLevel9)
+        {
+            client->jpegQuality = encoding - (int32_t)rfbEncodingQualityLevel0;
+        }
+        else if (!chosen && strcmp(NameOfEncoding(encoding), "unknown") != 0
+            && (server->forcedEncoding < 0 || encoding == server->forcedEncoding))
+        {
+            client->encoding = encoding;
+            chosen = 1;
+        }
+    }
+
+    deflateParams(&client->zlibStream, client->compressLevel, Z_DEFAULT_STRATEGY);
+    deflateParams(&client->zrleStream, client->compressLevel, Z_DEFAULT_STRATEGY);
+    for (i = 0; i < 4; ++i)
+    {
+        deflateParams(&client->tightStreams[i], client->compressLevel, Z_DEFAULT_STRATEGY);
+    }
+
+    if (!client->canCopyRect && client->hasCopy)
+    {
+        client->hasCopy = 0;
+        AddDirty(server, client, client->copyDest);
+    }
+
+    fprintf(stderr, "client encodings: %d, using %s%s", count, NameOfEncoding(client->encoding), client->canCopyRect ? " + copyrect" : "");
+    if (client->encoding == rfbEncodingTight && client->jpegQuality >= 0)
+    {
+        fprintf(stderr, ", quality %d", client->jpegQuality);
+    }
+    fprintf(stderr, "\n");
+}
+
+//! Parses one message from the input buffer; returns its length, 0 if more
+//! bytes are needed, or -1 if the connection should be closed.
+static int HandleMessage(Server_t * server, Client_t * client, const uint8_t * p, size_t available, uint64_t now)
+{
+    switch (client->state)
+    {
+        case kStateVersion:
+        {
+            if (available < sz_rfbProtocolVersionMsg)
+            {
+                return 0;
+            }
+            int major, minor;
+            if (sscanf((const char *)p, "RFB %03d.%03d\n", &major, &minor) != 2 || major != 3)
+            {
+                fprintf(stderr, "bad protocol version\n");
+                return -1;
+            }
+            client->minorVersion = minor < server->minorVersion ? minor : server->minorVersion;
+            if (client->minorVersion < 7)
+            {
+                client->minorVersion = 3;
+                BufferAppendU32(&client->output, rfbNoAuth);
+                client->state = kStateClientInit;
+            }
+            else
+            {
+                BufferAppendU8(&client->output, 1);
+                BufferAppendU8(&client->output, rfbNoAuth);
+                client->state = kStateSecurity;
+            }
+            fprintf(stderr, "negotiated RFB 3.%d\n", client->minorVersion);
+            return sz_rfbProtocolVersionMsg;
+        }
+
+        case kStateSecurity:
+            if (p[0] != rfbNoAuth)
+            {
+                fprintf(stderr, "client chose unsupported security type %d\n", p[0]);
+                return -1;
+            }
+            if (client->minorVersion >= 8)
+            {
+                BufferAppendU32(&client->output, 0);
+            }
+            client->state = kStateClientInit;
+            return 1;
+
+        case kStateClientInit:
+            SendServerInit(server, client);
+            client->state = kStateNormal;
+            return sz_rfbClientInitMsg;
+
+        default:
+            break;
+    }
+
+    switch (p[0])
+    {
+        case rfbSetPixelFormat:
+        {
+            if (available < sz_rfbSetPixelFormatMsg)
+            {
+                return 0;
+            }
+            const uint8_t * f = p + 4;
+            rfbPixelFormat format;
+            memset(&format, 0, sizeof(format));
+            format.bitsPerPixel = f[0];
+            format.depth = f[1];
+            format.bigEndian = f[2];
+            format.trueColour = f[3];
+            format.redMax = GetU16(f + 4);
+            format.greenMax = GetU16(f + 6);
+            format.blueMax = GetU16(f + 8);
+            format.redShift = f[10];
+            format.greenShift = f[11];
+            format.blueShift = f[12];
+            if (SetPixelFormat(client, &format) < 0)
+            {
+                return -1;
+            }
+            fprintf(stderr, "client pixel format: %d bpp, depth %d, %s endian\n", format.bitsPerPixel, format.depth, format.bigEndian ? "big" : "little");
+            return sz_rfbSetPixelFormatMsg;
+        }
+
+        case rfbSetEncodings:
+        {
+            if (available < sz_rfbSetEncodingsMsg)
+            {
+                return 0;
+            }
+            int count = GetU16(p + 2);
+            size_t length = sz_rfbSetEncodingsMsg + (size_t)count * 4;
+            if (available < length)
+            {
+                return 0;
+            }
+            HandleSetEncodings(server, client, p + sz_rfbSetEncodingsMsg, count);
+            return (int)length;
+        }
+
+        case rfbFramebufferUpdateRequest:
+        {
+            if (available < sz_rfbFramebufferUpdateRequestMsg)
+            {
+                return 0;
+            }
+            if (!p[1])
+            {
+                Rect_t r = { GetU16(p + 2), GetU16(p + 4), GetU16(p + 6), GetU16(p + 8) };
+                AddDirty(server, client, r);
+            }
+            if (!client->hasRequest)
+            {
+                client->hasRequest = 1;
+                client->requestTime = now;
+            }
+            return sz_rfbFramebufferUpdateRequestMsg;
+        }
+
+        case rfbKeyEvent:
+            if (available < sz_rfbKeyEventMsg)
+            {
+                return 0;
+            }
+            client->interval.inputEvents++;
+            return sz_rfbKeyEventMsg;
+
+        case rfbPointerEvent:
+            if (available < sz_rfbPointerEventMsg)
+            {
+                return 0;
+            }
+            client->interval.inputEvents++;
+            return sz_rfbPointerEventMsg;
+
+        case rfbClientCutText:
+        {
+            if (available < sz_rfbClientCutTextMsg)
+            {
+                return 0;
+            }
+            size_t length = sz_rfbClientCutTextMsg + GetU32(p + 4);
+            if (available < length)
+            {
+                return 0;
+            }
+            return (int)length;
+        }
+
+        default:
+            fprintf(stderr, "unknown message type %d\n", p[0]);
+            return -1;
+    }
+}
+
+static int ReadFromClient(Server_t * server, Client_t * client, uint64_t now)
+{
+    Buffer_t * in = &client->input;
+    BufferCompact(in);
+    BufferReserve(in, 65536);
+    ssize_t count = read(client->fd, in->data + in->length, in->capacity - in->length);
+    if (count == 0)
+    {
+        return -1;
+    }
+    if (count < 0)
+    {
+        return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+    }
+    in->length += count;
+
+    while (in->offset < in->length)
+    {
+        int used = HandleMessage(server, client, in->data + in->offset, in->length - in->offset, now);
+        if (used < 0)
+        {
+            return -1;
+        }
+        if (used == 0)
+        {
+            break;
+        }
+        in->offset += used;
+    }
+    return 0;
+}
+
+//! Refills the token bucket; the bucket holds at most 100 ms of bandwidth.
+static void RefillTokens(Server_t * server, Client_t * client, uint64_t now)
+{
+    if (server->bandwidth <= 0)
+    {
+        return;
+    }
+    double burst = server->bandwidth / 10.0 > 4096 ? server->bandwidth / 10.0 : 4096;
+    client->tokens += (now - client->lastRefill) * 1e-9 * server->bandwidth;
+    if (client->tokens > burst)
+    {
+        client->tokens = burst;
+    }
+    client->lastRefill = now;
+}
+
+static int WriteToClient(Server_t * server, Client_t * client, uint64_t now)
+{
+    Buffer_t * out = &client->output;
+    size_t pending = out->length - out->offset;
+    if (server->bandwidth > 0)
+    {
+        RefillTokens(server, client, now);
+        if (client->tokens < 1)
+        {
+            return 0;
+        }
+        if (pending > client->tokens)
+        {
+            pending = (size_t)client->tokens;
+        }
+    }
+
+    ssize_t count = write(client->fd, out->data + out->offset, pending);
+    if (count < 0)
+    {
+        return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+    }
+
+    out->offset += count;
+    client->tokens -= count;
+    client->totalSent += count;
+    client->interval.bytes += count;
+    if (out->offset == out->length)
+    {
+        out->offset = 0;
+        out->length = 0;
+    }
+
+    if (client->hasPendingUpdate && client->totalSent >= client->pendingUpdateEnd)
+    {
+        uint64_t latency = now - client->pendingRequestTime;
+        client->interval.latencySamples++;
+        client->interval.latencyNanoseconds += latency;
+        if (latency > client->interval.maxLatencyNanoseconds)
+        {
+            client->interval.maxLatencyNanoseconds = latency;
+        }
+        client->hasPendingUpdate = 0;
+    }
+    return 0;
+}
+
+// Statistics
+
+static void AccumulateStatistics(Statistics_t * total, const Statistics_t * interval)
+{
+    total->updates += interval->updates;
+    total->rects += interval->rects;
+    total->bytes += interval->bytes;
+    total->latencySamples += interval->latencySamples;
+    total->latencyNanoseconds += interval->latencyNanoseconds;
+    if (interval->maxLatencyNanoseconds > total->maxLatencyNanoseconds)
+    {
+        total->maxLatencyNanoseconds = interval->maxLatencyNanoseconds;
+    }
+    total->encodeNanoseconds += interval->encodeNanoseconds;
+    total->inputEvents += interval->inputEvents;
+}
+
+static void LogStatistics(const char * label, const Statistics_t * stats, double seconds)
+{
+    double averageLatency = stats->latencySamples ? stats->latencyNanoseconds / 1e6 / stats->latencySamples : 0;
+    double averageEncode = stats->updates ? stats->encodeNanoseconds / 1e6 / stats->updates : 0;
+    fprintf(stderr, "%s: %.1f updates/s, %.1f rects/s, %.1f KB/s, latency avg %.2f ms max %.2f ms, encode %.2f ms/update, %llu input events\n",
+            label,
+            stats->updates / seconds,
+            stats->rects / seconds,
+            stats->bytes / 1024.0 / seconds,
+            averageLatency,
+            stats->maxLatencyNanoseconds / 1e6,
+            averageEncode,
+            (unsigned long long)stats->inputEvents);
+}
+
+// Server
+
+static void CloseClient(Server_t * server, Client_t * client, uint64_t now)
+{
+    AccumulateStatistics(&client->total, &client->interval);
+    double seconds = (now - client->connectTime) * 1e-9;
+    if (seconds > 0)
+    {
+        LogStatistics("total", &client->total, seconds);
+    }
+    fprintf(stderr, "client disconnected after %.1f s: %llu updates, %llu bytes\n",
+            seconds,
+            (unsigned long long)client->total.updates,
+            (unsigned long long)client->total.bytes);
+
+    close(client->fd);
+    deflateEnd(&client->zlibStream);
+    deflateEnd(&client->zrleStream);
+    int i;
+    for (i = 0; i < 4; ++i)
+    {
+        deflateEnd(&client->tightStreams[i]);
+    }
+    BufferFree(&client->input);
+    BufferFree(&client->output);
+    BufferFree(&client->scratch);
+    BufferFree(&client->compressed);
+    free(client);
+    server->client = NULL;
+}
+
+static Client_t * AcceptClient(Server_t * server, int listener, uint64_t now)
+{
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (server->client)
+    {
+        // Only one client at a time keeps measurements meaningful.
+        close(fd);
+        return NULL;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    Client_t * client = calloc(1, sizeof(Client_t));
+    client->fd = fd;
+    client->state = kStateVersion;
+    client->encoding = rfbEncodingRaw;
+    client->compressLevel = Z_DEFAULT_COMPRESSION;
+    client->connectTime = now;
+    client->lastRefill = now;
+    deflateInit(&client->zlibStream, Z_DEFAULT_COMPRESSION);
+    deflateInit(&client->zrleStream, Z_DEFAULT_COMPRESSION);
+    int i;
+    for (i = 0; i < 4; ++i)
+    {
+        deflateInit(&client->tightStreams[i], Z_DEFAULT_COMPRESSION);
+    }
+    client->jpegQuality = -1;
+
+    char version[sz_rfbProtocolVersionMsg + 1];
+    snprintf(version, sizeof(version), "RFB 003.%03d\n", server->minorVersion);
+    BufferAppend(&client->output, version, sz_rfbProtocolVersionMsg);
+
+    server->client = client;
+    fprintf(stderr, "client connected\n");
+    return client;
+}
+
+static int CreateListener(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, 4) < 0)
+    {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void Run(Server_t * server, int listener)
+{
+    uint64_t frameInterval = 1000000000ULL / server->fps;
+    uint64_t now = NowNanoseconds();
+    uint64_t nextFrame = now + frameInterval;
+    uint64_t nextReport = now + 1000000000ULL;
+    uint64_t intervalStart = now;
+
+    while (!gShouldQuit)
+    {
+        Client_t * client = server->client;
+        struct pollfd fds[2];
+        int count = 0;
+        fds[count++] = (struct pollfd){ listener, POLLIN, 0 };
+        if (client)
+        {
+            short events = POLLIN;
+            if (client->output.offset < client->output.length && (server->bandwidth <= 0 || client->tokens >= 1))
+            {
+                events |= POLLOUT;
+            }
+            fds[count++] = (struct pollfd){ client->fd, events, 0 };
+        }
+
+        // Wake for the next frame, the next report, a held-back update or
+        // a token bucket refill, whichever comes first.
+        uint64_t wake = nextFrame < nextReport ? nextFrame : nextReport;
+        if (client && client->hasRequest && (client->dirtyCount || client->hasCopy)
+            && client->output.offset == client->output.length)
+        {
+            uint64_t due = client->requestTime + (uint64_t)server->latencyMs * 1000000ULL;
+            if (due < wake)
+            {
+                wake = due;
+            }
+        }
+        if (client && server->bandwidth > 0 && client->output.offset < client->output.length && client->tokens < 1)
+        {
+            uint64_t refill = now + 1000000ULL;
+            if (refill < wake)
+            {
+                wake = refill;
+            }
+        }
+        int timeout = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+
+        if (poll(fds, count, timeout) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        now = NowNanoseconds();
+
+        if (fds[0].revents & POLLIN)
+        {
+            if (AcceptClient(server, listener, now))
+            {
+                intervalStart = now;
+                nextReport = now + 1000000000ULL;
+            }
+        }
+
+        if (client && count > 1)
+        {
+            int failed = 0;
+            if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                failed = ReadFromClient(server, client, now) < 0;
+            }
+            if (!failed && (fds[1].revents & POLLOUT))
+            {
+                failed = WriteToClient(server, client, now) < 0;
+            }
+            if (failed)
+            {
+                CloseClient(server, client, now);
+                if (server->once)
+                {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        while (now >= nextFrame)
+        {
+            StepWorkload(server);
+            nextFrame += frameInterval;
+        }
+
+        client = server->client;
+        if (client && IsUpdateDue(server, client, now))
+        {
+            SendUpdate(server, client, now);
+        }
+        if (client && client->output.offset < client->output.length)
+        {
+            // Try to send right away rather than waiting for the next poll.
+            RefillTokens(server, client, now);
+            if (WriteToClient(server, client, now) < 0)
+            {
+                CloseClient(server, client, now);
+                if (server->once)
+                {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        if (now >= nextReport)
+        {
+            if (client && client->state == kStateNormal)
+            {
+                LogStatistics("1s", &client->interval, (now - intervalStart) * 1e-9);
+                AccumulateStatistics(&client->total, &client->interval);
+                memset(&client->interval, 0, sizeof(client->interval));
+            }
+            intervalStart = now;
+            nextReport = now + 1000000000ULL;
+
+            if (client && server->duration > 0 && now - client->connectTime >= (uint64_t)server->duration * 1000000000ULL)
+            {
+                CloseClient(server, client, now);
+                if (server->once)
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    if (server->client)
+    {
+        CloseClient(server, server->client, NowNanoseconds());
+    }
+}
+
+static void HandleSignal(int sig)
+{
+    (void)sig;
+    gShouldQuit = 1;
+}
+
+static void PrintUsage(const char * name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --port <n>            TCP port on 127.0.0.1 (default 5900)\n"
+            "  --size <w>x<h>        desktop size (default 1280x800)\n"
+            "  --workload <name>     scroll, video, drag, mixed or idle (default mixed)\n"
+            "  --fps <n>             workload frames per second (default 30)\n"
+            "  --protocol <3.x>      highest protocol version offered: 3.3, 3.7 or 3.8 (default 3.8)\n"
+            "  --encoding <name>     only use this encoding: raw, rre, corre, hextile, zlib, zrle or tight\n"
+            "  --bandwidth <KB/s>    cap outgoing bandwidth (default unlimited)\n"
+            "  --latency <ms>        hold each update this long after its request (default 0)\n"
+            "  --duration <s>        disconnect the client after this many seconds\n"
+            "  --once                exit after the first client disconnects\n",
+            name);
+}
+
+int main(int argc, char * argv[])
+{
+    Server_t server;
+    memset(&server, 0, sizeof(server));
+    server.port = 5900;
+    server.width = 1280;
+    server.height = 800;
+    server.workload = kWorkloadMixed;
+    server.fps = 30;
+    server.minorVersion = 8;
+    server.forcedEncoding = -1;
+    server.random = 0x2545f491;
+
+    int i;
+    for (i = 1; i < argc; ++i)
+    {
+        const char * option = argv[i];
+        const char * value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(option, "--once") == 0)
+        {
+            server.once = 1;
+            continue;
+        }
+        if (!value)
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+        ++i;
+
+        if (strcmp(option, "--port") == 0)
+        {
+            server.port = atoi(value);
+        }
+        else if (strcmp(option, "--size") == 0)
+        {
+            if (sscanf(value, "%dx%d", &server.width, &server.height) != 2)
+            {
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(option, "--workload") == 0)
+        {
+            static const char * const names[] = { "idle", "scroll", "video", "drag", "mixed" };
+            int w;
+            for (w = 0; w < 5 && strcmp(value, names[w]) != 0; ++w)
+            {
+            }
+            if (w == 5)
+            {
+                PrintUsage(argv[0]);
+                return 1;
+            }
+            server.workload = w;
+        }
+        else if (strcmp(option, "--fps") == 0)
+        {
+            server.fps = atoi(value);
+        }
+        else if (strcmp(option, "--protocol") == 0)
+        {
+            server.minorVersion = strcmp(value, "3.3") == 0 ? 3 : (strcmp(value, "3.7") == 0 ? 7 : 8);
+        }
+        else if (strcmp(option, "--encoding") == 0)
+        {
+            server.forcedEncoding = EncodingForName(value);
+            if (server.forcedEncoding < 0)
+            {
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(option, "--bandwidth") == 0)
+        {
+            server.bandwidth = atol(value) * 1024;
+        }
+        else if (strcmp(option, "--latency") == 0)
+        {
+            server.latencyMs = atoi(value);
+        }
+        else if (strcmp(option, "--duration") == 0)
+        {
+            server.duration = atoi(value);
+        }
+
+        else
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (server.width < 400 || server.height < 300 || server.width > 4096 || server.height > 4096 || server.fps <= 0)
+    {
+        fprintf(stderr, "desktop must be between 400x300 and 4096x4096 and fps positive\n");
+        return 1;
+    }
+
+    server.screen = malloc((size_t)server.width * server.height * sizeof(uint32_t));
+    SetUpDesktop(&server);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, HandleSignal);
+    signal(SIGTERM, HandleSignal);
+
+    int listener = CreateListener(server.port);
+    if (listener < 0)
+    {
+        return 1;
+    }
+    fprintf(stderr, "listening on 127.0.0.1:%d\n", server.port);
+
+    Run(&server, listener);
+
+    close(listener);
+    free(server.screen);
+    return 0;
+}
@@ -0,0 +1,911 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//! @file updatealloctest.c
+//! @brief Checks that the in-place update path doesn't allocate once it is warmed up.
+//!
+//! Records updates from Tools/TestServer in one encoding, then decodes the recording the way
+//! FrameBufferUpdateReader does when a whole rect is in the receive buffer: the headers are
+//! parsed in place and each rect is drawn straight from the buffer with the kernels the
+//! framebuffer methods call. Raw rows go through PixelConverterConvertRow(), CopyRect through
+//! FrameBufferCopyRect(), RRE and CoRRE through FrameBufferFillRect() and RREDrawSubrects(),
+//! and Hextile through HextileRectLength() and HextileDrawRect(). Decoded rects are batched
+//! into a fixed array under a lock, as -drawRectFromBuffer: does, and handed to a display
+//! thread at the end of each update, standing in for the draw queue.
+//!
+//! Allocations are counted with AllocationCounter after the first kWarmupUpdates updates,
+//! and the test fails if any are made. The Objective-C layer around these calls, the
+//! messages, NSRects and dispatch_async_f(), isn't part of the test, and neither is the
+//! receive path, which Tools/ReceiveBenchmark covers.
+//!
+//!     rfbtestserver --port 5999 --workload mixed --fps 1000
+//!     updatealloctest [--port 5999] [--encoding raw|rre|corre|hextile] [--updates 200]
+//!
+//! CopyRect is asked for with every encoding; the server sends it when the terminal scrolls.
+//!
+//! With --capture, the updates are read from a capture file such as those in Tools/Captures
+//! instead, and the recording is decoded --iterations times. The results are printed as JSON
+//! with the keys DecodeBenchmark uses, the time being that of the fastest pass, so the C
+//! kernels can be compared between builds without the app.
+//!
+//!     updatealloctest --capture ../Captures/hextile.rfbcap [--iterations 5]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#if __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "AllocationCounter.h"
+#include "FrameBufferRows.h"
+#include "HextileRect.h"
+#include "PixelConverter.h"
+#include "RRERects.h"
+#include "SessionCapture.h"
+
+//! Same as kAllocationWarmupUpdates in ConnectionMetrics.h.
+#define kWarmupUpdates (16)
+
+//! Same as kMaxDrawRects in RFBConnection.h.
+#define kMaxDrawRects (64)
+
+//! Most bytes read from the server at once while recording.
+#define kRecordChunk (64 * 1024)
+
+//! Framebuffer colours are 32 bits, as TrueColorFrameBuffer's are.
+typedef uint32_t FBColor;
+
+typedef struct _Rect
+{
+    unsigned x;
+    unsigned y;
+    unsigned width;
+    unsigned height;
+} Rect_t;
+
+typedef struct _FrameBuffer
+{
+    FBColor * pixels;
+    unsigned width;
+    unsigned height;
+    unsigned pixelBytes;    //!< Size of a server pixel.
+    PixelConverter_t converter;
+    unsigned redClut[256];
+    unsigned greenClut[256];
+    unsigned blueClut[256];
+    uint32_t background;    //!< Hextile colours carried from rect to rect.
+    uint32_t foreground;
+} FrameBuffer_t;
+
+//! Decoded rects waiting for the display thread, as RFBConnection keeps them.
+typedef struct _DrawBatch
+{
+    pthread_mutex_t lock;
+    pthread_cond_t scheduled;
+    pthread_cond_t idle;
+    Rect_t rects[kMaxDrawRects];
+    unsigned count;
+    int isScheduled;
+    int ended;
+    uint64_t displayed;
+    uint64_t pixelsDisplayed;
+} DrawBatch_t;
+
+typedef struct _Counts
+{
+    uint64_t updates;
+    uint64_t rects[5];      //!< Raw, CopyRect, RRE, CoRRE and Hextile rects.
+    uint64_t pixels[5];
+    uint64_t bytes[5];
+} Counts_t;
+
+static const char * const kKindNames[5] = { "raw", "copyrect", "rre", "corre", "hextile" };
+
+static uint64_t NowNanoseconds(void)
+{
+#if __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+    {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// Display
+
+static void * DisplayThread(void * context)
+{
+    DrawBatch_t * batch = (DrawBatch_t *)context;
+    Rect_t rects[kMaxDrawRects];
+    unsigned count;
+    unsigned i;
+
+    pthread_mutex_lock(&batch->lock);
+    for (;;)
+    {
+        while (!batch->isScheduled && !batch->ended)
+        {
+            pthread_cond_wait(&batch->scheduled, &batch->lock);
+        }
+        if (!batch->isScheduled)
+        {
+            break;
+        }
+        count = batch->count;
+        memcpy(rects, batch->rects, count * sizeof(Rect_t));
+        batch->count = 0;
+        batch->isScheduled = 0;
+        pthread_cond_signal(&batch->idle);
+        pthread_mutex_unlock(&batch->lock);
+
+        // Stands in for -displayFromBuffer:.
+        for (i = 0; i < count; ++i)
+        {
+            batch->pixelsDisplayed += (uint64_t)rects[i].width * rects[i].height;
+        }
+
+        pthread_mutex_lock(&batch->lock);
+        batch->displayed += count;
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+//! As -scheduleDisplay: queues a display unless one is already waiting.
+static void ScheduleDisplay(DrawBatch_t * batch)
+{
+    pthread_mutex_lock(&batch->lock);
+    if (batch->count && !batch->isScheduled)
+    {
+        batch->isScheduled = 1;
+        pthread_cond_signal(&batch->scheduled);
+    }
+    pthread_mutex_unlock(&batch->lock);
+}
+
+//! As -drawRectFromBuffer:.
+static void DrawRectFromBuffer(DrawBatch_t * batch, Rect_t rect)
+{
+    int isFull;
+
+    pthread_mutex_lock(&batch->lock);
+    if (batch->count < kMaxDrawRects)
+    {
+        batch->rects[batch->count++] = rect;
+    }
+    else
+    {
+        Rect_t * last = &batch->rects[kMaxDrawRects - 1];
+        unsigned right = last->x + last->width > rect.x + rect.width ? last->x + last->width : rect.x + rect.width;
+        unsigned bottom = last->y + last->height > rect.y + rect.height ? last->y + last->height : rect.y + rect.height;
+
+        last->x = last->x < rect.x ? last->x : rect.x;
+        last->y = last->y < rect.y ? last->y : rect.y;
+        last->width = right - last->x;
+        last->height = bottom - last->y;
+    }
+    isFull = (batch->count == kMaxDrawRects);
+    pthread_mutex_unlock(&batch->lock);
+
+    if (isFull)
+    {
+        ScheduleDisplay(batch);
+    }
+}
+
+// Decoding
+
+static unsigned Read16(const uint8_t * bytes)
+{
+    return (bytes[0] << 8) | bytes[1];
+}
+
+static uint32_t Read32(const uint8_t * bytes)
+{
+    return ((uint32_t)bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+}
+
+static int KindOfEncoding(int32_t encoding)
+{
+    switch (encoding)
+    {
+        case rfbEncodingRaw:
+            return 0;
+        case rfbEncodingCopyRect:
+            return 1;
+        case rfbEncodingRRE:
+            return 2;
+        case rfbEncodingCoRRE:
+            return 3;
+        case rfbEncodingHextile:
+            return 4;
+        default:
+            return -1;
+    }
+}
+
+//! Finds the length of a rect's data, as each reader's -readRectangleFromBytes:length: does.
+//! @return Bytes used by the rect, 0 if @a length bytes don't hold all of it, or -1 if the
+//!     encoding isn't one of the fast path's.
+static int64_t RectLength(const FrameBuffer_t * frameBuffer, const uint8_t * bytes, size_t length, int kind, const Rect_t * rect)
+{
+    unsigned bpp = frameBuffer->pixelBytes;
+    uint64_t total;
+
+    switch (kind)
+    {
+        case 0:
+            total = (uint64_t)bpp * rect->width * rect->height;
+            break;
+        case 1:
+            total = 4;
+            break;
+        case 2:
+        case 3:
+            if (length < 4 + bpp)
+            {
+                return 0;
+            }
+            total = 4 + bpp + (uint64_t)Read32(bytes) * (bpp + (kind == 2 ? kRRESubrectGeometry : kCoRRESubrectGeometry));
+            break;
+        case 4:
+            return HextileRectLength(bytes, length > UINT32_MAX ? UINT32_MAX : (unsigned)length, bpp, rect->width, rect->height);
+        default:
+            return -1;
+    }
+    return length < total ? 0 : (int64_t)total;
+}
+
+//! Draws a rect whose length has been checked with RectLength(), with the kernels the
+//! framebuffer's drawing methods call.
+static void DrawRect(FrameBuffer_t * frameBuffer, const uint8_t * bytes, int kind, const Rect_t * rect)
+{
+    size_t rowBytes = (size_t)frameBuffer->width * sizeof(FBColor);
+    FBColor * start = frameBuffer->pixels + (size_t)rect->y * frameBuffer->width + rect->x;
+    unsigned lines = rect->height;
+
+    switch (kind)
+    {
+        case 0:
+            while (lines--)
+            {
+                PixelConverterConvertRow(&frameBuffer->converter, bytes, start, rect->width);
+                bytes += rect->width * frameBuffer->pixelBytes;
+                start += frameBuffer->width;
+            }
+            break;
+        case 1:
+            FrameBufferCopyRect(frameBuffer->pixels, rowBytes, sizeof(FBColor), Read16(bytes), Read16(bytes + 2),
+                                rect->width, rect->height, rect->x, rect->y);
+            break;
+        case 2:
+        case 3:
+            FrameBufferFillRect(start, rowBytes, sizeof(FBColor), PixelConverterConvertPixel(&frameBuffer->converter, bytes + 4),
+                                rect->width, rect->height);
+            RREDrawSubrects(&frameBuffer->converter, bytes + 4 + frameBuffer->pixelBytes, Read32(bytes),
+                            kind == 2 ? kRRESubrectGeometry : kCoRRESubrectGeometry, start, rowBytes, rect->width, rect->height);
+            break;
+        case 4:
+            HextileDrawRect(&frameBuffer->converter, bytes, start, rowBytes, rect->width, rect->height,
+                            &frameBuffer->background, &frameBuffer->foreground);
+            break;
+    }
+}
+
+//! Walks one FramebufferUpdate message in place, drawing its rects if @a batch is set.
+//! @return Length of the message, 0 if @a length bytes don't hold all of it, or -1 if it
+//!     can't be decoded.
+static int64_t DecodeUpdate(FrameBuffer_t * frameBuffer, DrawBatch_t * batch, const uint8_t * bytes, size_t length, Counts_t * counts)
+{
+    const uint8_t * p = bytes;
+    const uint8_t * end = bytes + length;
+    unsigned rects;
+
+    if (length < sz_rfbFramebufferUpdateMsg)
+    {
+        return 0;
+    }
+    if (p[0] != rfbFramebufferUpdate)
+    {
+        fprintf(stderr, "unexpected server message %d\n", p[0]);
+        return -1;
+    }
+    rects = Read16(p + 2);
+    p += sz_rfbFramebufferUpdateMsg;
+
+    while (rects--)
+    {
+        Rect_t rect;
+        int kind;
+        int64_t rectLength;
+
+        if ((size_t)(end - p) < sz_rfbFramebufferUpdateRectHeader)
+        {
+            return 0;
+        }
+        rect.x = Read16(p);
+        rect.y = Read16(p + 2);
+        rect.width = Read16(p + 4);
+        rect.height = Read16(p + 6);
+        kind = KindOfEncoding((int32_t)Read32(p + 8));
+        p += sz_rfbFramebufferUpdateRectHeader;
+        if (kind < 0 || rect.x + rect.width > frameBuffer->width || rect.y + rect.height > frameBuffer->height)
+        {
+            fprintf(stderr, "can't decode rect with encoding %d at %u,%u %ux%u\n", (int32_t)Read32(p - 4),
+                    rect.x, rect.y, rect.width, rect.height);
+            return -1;
+        }
+        rectLength = RectLength(frameBuffer, p, (size_t)(end - p), kind, &rect);
+        if (rectLength <= 0)
+        {
+            return rectLength;
+        }
+        if (batch)
+        {
+            DrawRect(frameBuffer, p, kind, &rect);
+            DrawRectFromBuffer(batch, rect);
+        }
+        if (counts)
+        {
+            counts->rects[kind]++;
+            counts->pixels[kind] += (uint64_t)rect.width * rect.height;
+            counts->bytes[kind] += sz_rfbFramebufferUpdateRectHeader + (uint64_t)rectLength;
+        }
+        p += rectLength;
+    }
+    if (batch)
+    {
+        // As -flushDrawing at the end of the update.
+        ScheduleDisplay(batch);
+    }
+    if (counts)
+    {
+        counts->updates++;
+    }
+    return p - bytes;
+}
+
+// Recording
+
+static int ReadFully(int fd, void * buffer, size_t length)
+{
+    uint8_t * bytes = (uint8_t *)buffer;
+
+    while (length)
+    {
+        ssize_t n = read(fd, bytes, length);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        bytes += n;
+        length -= (size_t)n;
+    }
+    return 0;
+}
+
+static int SendUpdateRequest(int fd, int incremental, uint16_t width, uint16_t height)
+{
+    uint8_t request[sz_rfbFramebufferUpdateRequestMsg] = {
+        rfbFramebufferUpdateRequest, (uint8_t)incremental, 0, 0, 0, 0,
+        (uint8_t)(width >> 8), (uint8_t)width, (uint8_t)(height >> 8), (uint8_t)height
+    };
+    return write(fd, request, sizeof(request)) == (ssize_t)sizeof(request) ? 0 : -1;
+}
+
+//! Connects to the test server with RFB 3.8 and no authentication, and keeps the server's
+//! pixel format.
+//! @return The socket, or -1.
+static int ConnectToServer(int port, int32_t encoding, uint16_t * width, uint16_t * height, rfbPixelFormat * format)
+{
+    struct sockaddr_in address;
+    uint8_t version[sz_rfbProtocolVersionMsg];
+    uint8_t serverInit[sz_rfbServerInitMsg];
+    uint8_t byte;
+    uint8_t types[256];
+    uint32_t result;
+    uint32_t nameLength;
+    char name[256];
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        fprintf(stderr, "can't connect to 127.0.0.1:%d: %s\n", port, strerror(errno));
+        return -1;
+    }
+
+    if (ReadFully(fd, version, sizeof(version)) < 0 || write(fd, "RFB 003.008\n", sz_rfbProtocolVersionMsg) != sz_rfbProtocolVersionMsg
+        || ReadFully(fd, &byte, 1) < 0 || !byte || ReadFully(fd, types, byte) < 0)
+    {
+        goto failed;
+    }
+    byte = rfbNoAuth;
+    if (write(fd, &byte, 1) != 1 || ReadFully(fd, &result, 4) < 0 || result != 0)
+    {
+        goto failed;
+    }
+    byte = 1;   // Shared.
+    if (write(fd, &byte, 1) != 1 || ReadFully(fd, serverInit, sizeof(serverInit)) < 0)
+    {
+        goto failed;
+    }
+    nameLength = Read32(serverInit + sz_rfbServerInitMsg - 4);
+    if (nameLength >= sizeof(name) || ReadFully(fd, name, nameLength) < 0)
+    {
+        goto failed;
+    }
+    name[nameLength] = 0;
+    *width = (uint16_t)Read16(serverInit);
+    *height = (uint16_t)Read16(serverInit + 2);
+    memcpy(format, serverInit + 4, sz_rfbPixelFormat);
+    format->redMax = ntohs(format->redMax);
+    format->greenMax = ntohs(format->greenMax);
+    format->blueMax = ntohs(format->blueMax);
+    fprintf(stderr, "connected to \"%s\", %ux%u, %u bpp\n", name, *width, *height, format->bitsPerPixel);
+
+    {
+        uint8_t setEncodings[sz_rfbSetEncodingsMsg + 8] = { rfbSetEncodings, 0, 0, 2 };
+        uint32_t list[2] = { htonl((uint32_t)encoding), htonl((uint32_t)rfbEncodingCopyRect) };
+
+        memcpy(setEncodings + sz_rfbSetEncodingsMsg, list, sizeof(list));
+        if (write(fd, setEncodings, sizeof(setEncodings)) != (ssize_t)sizeof(setEncodings)
+            || SendUpdateRequest(fd, 0, *width, *height) < 0)
+        {
+            goto failed;
+        }
+    }
+    return fd;
+
+failed:
+    fprintf(stderr, "handshake with the test server failed\n");
+    close(fd);
+    return -1;
+}
+
+//! Records @a updates updates, asking for the next one as each arrives.
+//! @return Bytes recorded, or 0 on failure. @a recording is grown as needed.
+static size_t Record(int fd, FrameBuffer_t * frameBuffer, uint64_t updates, uint8_t ** recording, Counts_t * counts)
+{
+    size_t capacity = 1 << 20;
+    size_t length = 0;
+    size_t parsed = 0;
+
+    *recording = (uint8_t *)malloc(capacity);
+    memset(counts, 0, sizeof(*counts));
+    while (counts->updates < updates && *recording)
+    {
+        int64_t updateLength;
+        ssize_t n;
+
+        while ((updateLength = DecodeUpdate(frameBuffer, NULL, *recording + parsed, length - parsed, counts)) > 0)
+        {
+            parsed += (size_t)updateLength;
+            if (counts->updates == updates)
+            {
+                return parsed;
+            }
+            if (SendUpdateRequest(fd, 1, (uint16_t)frameBuffer->width, (uint16_t)frameBuffer->height) < 0)
+            {
+                return 0;
+            }
+        }
+        if (updateLength < 0)
+        {
+            return 0;
+        }
+        if (capacity - length < kRecordChunk)
+        {
+            capacity *= 2;
+            *recording = (uint8_t *)realloc(*recording, capacity);
+            if (!*recording)
+            {
+                break;
+            }
+        }
+        n = read(fd, *recording + length, kRecordChunk);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "the server closed the connection\n");
+            return 0;
+        }
+        length += (size_t)n;
+    }
+    return 0;
+}
+
+static int SetUpFrameBuffer(FrameBuffer_t * frameBuffer, const rfbPixelFormat * format, unsigned width, unsigned height)
+{
+    unsigned i;
+
+    memset(frameBuffer, 0, sizeof(*frameBuffer));
+    frameBuffer->width = width;
+    frameBuffer->height = height;
+    frameBuffer->pixelBytes = format->bitsPerPixel / 8;
+    for (i = 0; i < 256; ++i)
+    {
+        // FrameBuffer's tables without gamma or weights.
+        frameBuffer->redClut[i] = (format->redMax ? (i * 255 + format->redMax / 2) / format->redMax : 0) << 16;
+        frameBuffer->greenClut[i] = (format->greenMax ? (i * 255 + format->greenMax / 2) / format->greenMax : 0) << 8;
+        frameBuffer->blueClut[i] = format->blueMax ? (i * 255 + format->blueMax / 2) / format->blueMax : 0;
+    }
+    if (!format->trueColour || PixelConverterInit(&frameBuffer->converter, format, frameBuffer->pixelBytes, format->bigEndian,
+        frameBuffer->redClut, frameBuffer->greenClut, frameBuffer->blueClut, sizeof(FBColor)) < 0)
+    {
+        fprintf(stderr, "unsupported pixel format\n");
+        return -1;
+    }
+    frameBuffer->pixels = (FBColor *)calloc((size_t)width * height, sizeof(FBColor));
+    return frameBuffer->pixels ? 0 : -1;
+}
+
+//! Reads the data from the server in a capture file and skips the handshake, keeping the
+//! server's pixel format. Versions 3.3 to 3.8 are understood, but only without authentication.
+//! @return Bytes of updates in @a recording, or 0 on failure.
+static size_t LoadCapture(const char * path, FrameBuffer_t * frameBuffer, rfbPixelFormat * format, uint8_t ** recording, Counts_t * counts)
+{
+    SessionCaptureReader_t * reader = SessionCaptureOpen(path);
+    SessionCaptureRecord_t record;
+    size_t capacity = 1 << 20;
+    size_t length = 0;
+    size_t offset;
+    size_t parsed;
+    int64_t updateLength;
+    int result;
+
+    if (!reader)
+    {
+        fprintf(stderr, "can't read %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    *recording = (uint8_t *)malloc(capacity);
+    while (*recording && (result = SessionCaptureReadRecord(reader, &record)) > 0)
+    {
+        if (record.direction != kSessionCaptureFromServer)
+        {
+            continue;
+        }
+        while (*recording && capacity - length < record.length)
+        {
+            capacity *= 2;
+            *recording = (uint8_t *)realloc(*recording, capacity);
+        }
+        if (*recording)
+        {
+            memcpy(*recording + length, record.data, record.length);
+            length += record.length;
+        }
+    }
+    SessionCaptureCloseReader(reader);
+    if (!*recording || result < 0)
+    {
+        fprintf(stderr, "can't read %s\n", path);
+        return 0;
+    }
+
+    // Version, security and ServerInit.
+    offset = sz_rfbProtocolVersionMsg;
+    if (length < offset || memcmp(*recording, "RFB 003.", 8) != 0)
+    {
+        goto failed;
+    }
+    if (atoi((const char *)*recording + 8) < 7)
+    {
+        offset += 4;
+    }
+    else if (length > offset)
+    {
+        // 3.8 also sends a result for no authentication.
+        offset += 1 + (*recording)[offset] + (atoi((const char *)*recording + 8) >= 8 ? 4 : 0);
+    }
+    if (length < offset + sz_rfbServerInitMsg || length < offset + sz_rfbServerInitMsg + Read32(*recording + offset + sz_rfbServerInitMsg - 4))
+    {
+        goto failed;
+    }
+    memcpy(format, *recording + offset + 4, sz_rfbPixelFormat);
+    format->redMax = ntohs(format->redMax);
+    format->greenMax = ntohs(format->greenMax);
+    format->blueMax = ntohs(format->blueMax);
+    if (SetUpFrameBuffer(frameBuffer, format, Read16(*recording + offset), Read16(*recording + offset + 2)) < 0)
+    {
+        return 0;
+    }
+    offset += sz_rfbServerInitMsg + Read32(*recording + offset + sz_rfbServerInitMsg - 4);
+    length -= offset;
+    memmove(*recording, *recording + offset, length);
+
+    memset(counts, 0, sizeof(*counts));
+    for (parsed = 0; parsed < length; parsed += (size_t)updateLength)
+    {
+        updateLength = DecodeUpdate(frameBuffer, NULL, *recording + parsed, length - parsed, counts);
+        if (updateLength <= 0)
+        {
+            goto failed;
+        }
+    }
+    return length;
+
+failed:
+    fprintf(stderr, "%s doesn't hold a whole session with raw, copyrect, rre, corre or hextile updates\n", path);
+    return 0;
+}
+
+//! Prints the results of decoding a capture as a JSON object with DecodeBenchmark's keys.
+static void PrintJSON(const char * path, const Counts_t * counts, size_t length, uint64_t nanoseconds,
+                      unsigned iterations, int64_t allocations, int64_t peakBytes)
+{
+    const char * name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    double seconds = nanoseconds / 1e9;
+    uint64_t pixels = 0;
+    uint64_t rects = 0;
+    uint64_t steadyUpdates = counts->updates - kWarmupUpdates;
+    int printed = 0;
+    int i;
+
+    for (i = 0; i < 5; ++i)
+    {
+        pixels += counts->pixels[i];
+        rects += counts->rects[i];
+    }
+    printf("{\n  \"capture\": \"%s\",\n  \"iterations\": %u,\n", name, iterations);
+    printf("  \"bytesIn\": %llu,\n  \"pixels\": %llu,\n  \"rects\": %llu,\n  \"updates\": %llu,\n",
+           (unsigned long long)length, (unsigned long long)pixels, (unsigned long long)rects, (unsigned long long)counts->updates);
+    printf("  \"decodeSeconds\": %.6f,\n", seconds);
+    printf("  \"megabytesPerSecond\": %.3f,\n", seconds > 0.0 ? length / seconds / 1.0e6 : 0.0);
+    printf("  \"megapixelsPerSecond\": %.3f,\n", seconds > 0.0 ? pixels / seconds / 1.0e6 : 0.0);
+    printf("  \"nanosecondsPerRect\": %.1f,\n", rects ? (double)nanoseconds / (double)rects : 0.0);
+    printf("  \"steadyUpdates\": %llu,\n", (unsigned long long)steadyUpdates);
+    if (allocations >= 0)
+    {
+        printf("  \"steadyAllocationsPerUpdate\": %.2f,\n  \"peakHeapBytes\": %lld,\n",
+               (double)allocations / (double)steadyUpdates, (long long)peakBytes);
+    }
+    else
+    {
+        printf("  \"steadyAllocationsPerUpdate\": null,\n  \"peakHeapBytes\": null,\n");
+    }
+    printf("  \"encodings\": {");
+    for (i = 0; i < 5; ++i)
+    {
+        if (counts->rects[i])
+        {
+            printf("%s\n    \"%s\": { \"rects\": %llu, \"pixels\": %llu, \"bytes\": %llu }", printed++ ? "," : "", kKindNames[i],
+                   (unsigned long long)counts->rects[i], (unsigned long long)counts->pixels[i], (unsigned long long)counts->bytes[i]);
+        }
+    }
+    printf("%s}\n}\n", printed ? "\n  " : "");
+}
+
+int main(int argc, char ** argv)
+{
+    int port = 5999;
+    unsigned updates = 200;
+    unsigned iterations = 0;
+    const char * capturePath = NULL;
+    int32_t encoding = rfbEncodingRaw;
+    uint16_t width, height;
+    rfbPixelFormat format;
+    FrameBuffer_t frameBuffer;
+    DrawBatch_t batch;
+    pthread_t display;
+    Counts_t counts;
+    uint8_t * recording = NULL;
+    size_t length;
+    size_t offset;
+    uint64_t update;
+    uint64_t best = 0;
+    int64_t allocations = -1;
+    int64_t peakBytes = 0;
+    unsigned iteration;
+    int fd;
+    int i;
+
+    for (i = 1; i < argc; ++i)
+    {
+        const char * value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (value && strcmp(argv[i], "--port") == 0)
+        {
+            port = atoi(value);
+        }
+        else if (value && strcmp(argv[i], "--updates") == 0)
+        {
+            updates = (unsigned)atoi(value);
+        }
+        else if (value && strcmp(argv[i], "--encoding") == 0)
+        {
+            encoding = strcmp(value, "rre") == 0 ? rfbEncodingRRE : strcmp(value, "corre") == 0 ? rfbEncodingCoRRE
+                : strcmp(value, "hextile") == 0 ? rfbEncodingHextile : rfbEncodingRaw;
+        }
+        else if (value && strcmp(argv[i], "--capture") == 0)
+        {
+            capturePath = value;
+        }
+        else if (value && strcmp(argv[i], "--iterations") == 0)
+        {
+            iterations = (unsigned)atoi(value);
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--port <n>] [--encoding raw|rre|corre|hextile] [--updates <n>]\n"
+                    "       %s --capture <file> [--iterations <n>]\n", argv[0], argv[0]);
+            return 1;
+        }
+        ++i;
+    }
+    if (!iterations)
+    {
+        iterations = capturePath ? 5 : 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (capturePath)
+    {
+        length = LoadCapture(capturePath, &frameBuffer, &format, &recording, &counts);
+        if (!length)
+        {
+            return 1;
+        }
+        updates = (unsigned)counts.updates;
+    }
+    else
+    {
+        if (updates <= kWarmupUpdates)
+        {
+            fprintf(stderr, "updates must be more than the %d warmup updates\n", kWarmupUpdates);
+            return 1;
+        }
+        fd = ConnectToServer(port, encoding, &width, &height, &format);
+        if (fd < 0 || SetUpFrameBuffer(&frameBuffer, &format, width, height) < 0)
+        {
+            return 1;
+        }
+        length = Record(fd, &frameBuffer, updates, &recording, &counts);
+        close(fd);
+        if (!length)
+        {
+            fprintf(stderr, "nothing was recorded\n");
+            return 1;
+        }
+    }
+    if (updates <= kWarmupUpdates)
+    {
+        fprintf(stderr, "the capture must hold more than the %d warmup updates\n", kWarmupUpdates);
+        return 1;
+    }
+    fprintf(capturePath ? stderr : stdout, "%s %.1f MB: %llu updates,", capturePath ? "loaded" : "recorded",
+            length / 1048576.0, (unsigned long long)counts.updates);
+    for (i = 0; i < 5; ++i)
+    {
+        if (counts.rects[i])
+        {
+            fprintf(capturePath ? stderr : stdout, " %llu %s", (unsigned long long)counts.rects[i], kKindNames[i]);
+        }
+    }
+    fprintf(capturePath ? stderr : stdout, " rects\n");
+
+    memset(&batch, 0, sizeof(batch));
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.scheduled, NULL);
+    pthread_cond_init(&batch.idle, NULL);
+    // Created with the connection, as the draw queue is.
+    pthread_create(&display, NULL, DisplayThread, &batch);
+
+    // Allocations are counted during the first pass; the fastest pass is timed.
+    for (iteration = 0; iteration < iterations; ++iteration)
+    {
+        uint64_t start = NowNanoseconds();
+        uint64_t elapsed;
+
+        for (offset = 0, update = 0; offset < length; ++update)
+        {
+            int64_t updateLength;
+
+            if (iteration == 0 && update == kWarmupUpdates)
+            {
+                allocations = AllocationCounterStart() == 0 ? 0 : -1;
+            }
+            updateLength = DecodeUpdate(&frameBuffer, &batch, recording + offset, length - offset, NULL);
+            if (updateLength <= 0)
+            {
+                fprintf(stderr, "the recording didn't decode the second time\n");
+                return 1;
+            }
+            offset += (size_t)updateLength;
+        }
+        elapsed = NowNanoseconds() - start;
+        best = iteration == 0 || elapsed < best ? elapsed : best;
+        if (iteration == 0)
+        {
+            if (allocations == 0)
+            {
+                allocations = AllocationCounterGetCount();
+                peakBytes = AllocationCounterGetPeakBytes();
+            }
+            AllocationCounterStop();
+        }
+    }
+
+    pthread_mutex_lock(&batch.lock);
+    while (batch.isScheduled)
+    {
+        pthread_cond_wait(&batch.idle, &batch.lock);
+    }
+    batch.ended = 1;
+    pthread_cond_signal(&batch.scheduled);
+    pthread_mutex_unlock(&batch.lock);
+    pthread_join(display, NULL);
+
+    if (capturePath)
+    {
+        PrintJSON(capturePath, &counts, length, best, iterations, allocations, peakBytes);
+    }
+    else
+    {
+        printf("displayed %llu rects, %.1f Mpixels\n", (unsigned long long)batch.displayed, batch.pixelsDisplayed / 1e6);
+        if (allocations < 0)
+        {
+            printf("allocations can't be counted on this system\n");
+            return 1;
+        }
+        printf("%llu updates after warmup: %lld allocations, %.3f per update, peak %lld bytes\n",
+               (unsigned long long)(update - kWarmupUpdates), (long long)allocations,
+               (double)allocations / (double)(update - kWarmupUpdates), (long long)peakBytes);
+    }
+
+    pthread_cond_destroy(&batch.idle);
+    pthread_cond_destroy(&batch.scheduled);
+    pthread_mutex_destroy(&batch.lock);
+    PixelConverterFree(&frameBuffer.converter);
+    free(frameBuffer.pixels);
+    free(recording);
+    if (!capturePath)
+    {
+        printf("%s\n", allocations ? "FAILED" : "passed");
+    }
+    return allocations ? 1 : 0;
+}
@@ -0,0 +1,328 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//! @file zrlebench.c
+//! @brief Correctness check and benchmark for the ZRLE tile kernels.
+//!
+//! Encodes random 64x64 tiles with each ZRLE subencoding and draws them twice: the way
+//! ZRLEEncodingReader used to, unpacking palette indices into a tile buffer and collecting a
+//! run list with one pixel conversion per CPIXEL before drawing it, and with ZRLEDrawTile().
+//! Both must give the same pixels.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#if __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+#include "ZRLETile.h"
+#include "FrameBufferRows.h"
+
+#define kMinimumSeconds 0.5
+#define kTileSize 64
+#define kTileCount 64
+#define kRowColors (kTileSize * kTileCount)
+
+static uint64_t NowNanoseconds(void)
+{
+#if __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+    {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+//! Appends a run length in ZRLE form.
+static uint8_t * PutRunLength(uint8_t * p, unsigned length)
+{
+    length--;
+    while (length >= 255)
+    {
+        *p++ = 255;
+        length -= 255;
+    }
+    *p++ = length;
+    return p;
+}
+
+//! Encodes a random tile with the given subencoding. Runs average @a meanRun pixels.
+static uint8_t * EncodeTile(uint8_t * p, unsigned subencoding, unsigned meanRun)
+{
+    unsigned pixels = kTileSize * kTileSize;
+    unsigned i;
+
+    *p++ = subencoding;
+    if (subencoding == 0)
+    {
+        for (i = 0; i < pixels * 3; ++i)
+        {
+            *p++ = rand();
+        }
+    }
+    else if (subencoding <= 16)
+    {
+        unsigned bits = subencoding == 2 ? 1 : (subencoding <= 4 ? 2 : 4);
+        for (i = 0; i < subencoding * 3; ++i)
+        {
+            *p++ = rand();
+        }
+        for (i = 0; i < kTileSize * kTileSize * bits / 8; ++i)
+        {
+            *p++ = rand();
+        }
+    }
+    else if (subencoding == 128)
+    {
+        for (i = 0; i < pixels; )
+        {
+            unsigned run = 1 + rand() % (2 * meanRun);
+            p[0] = rand();
+            p[1] = rand();
+            p[2] = rand();
+            p = PutRunLength(p + 3, run);
+            i += run;
+        }
+    }
+    else
+    {
+        unsigned paletteSize = subencoding - 128;
+        for (i = 0; i < paletteSize * 3; ++i)
+        {
+            *p++ = rand();
+        }
+        for (i = 0; i < pixels; )
+        {
+            unsigned run = 1 + rand() % (2 * meanRun);
+            unsigned index = rand() % paletteSize;
+            if (run == 1)
+            {
+                *p++ = index;
+            }
+            else
+            {
+                *p++ = index | 128;
+                p = PutRunLength(p, run);
+            }
+            i += run;
+        }
+    }
+    return p;
+}
+
+//! The old tile loop, for 4-byte colours.
+static unsigned ReferenceTile(const PixelConverter_t * c, const uint8_t * data, uint32_t * dest, unsigned rowColors)
+{
+    const uint8_t * p = data;
+    uint32_t palette[128];
+    uint8_t indices[kTileSize * kTileSize];
+    struct { uint32_t color; unsigned length; } runs[kTileSize * kTileSize];
+    unsigned subencoding = *p++;
+    unsigned count = 0, i, x, y;
+
+    if (subencoding == 0)
+    {
+        for (y = 0; y < kTileSize; ++y, p += 3 * kTileSize)
+        {
+            PixelConverterConvertRow(c, p, dest + y * rowColors, kTileSize);
+        }
+        return p - data;
+    }
+    if (subencoding <= 16)
+    {
+        unsigned bits = subencoding == 2 ? 1 : (subencoding <= 4 ? 2 : 4);
+        for (i = 0; i < subencoding; ++i, p += 3)
+        {
+            palette[i] = PixelConverterConvertPixel(c, p);
+        }
+        for (i = 0; i < kTileSize * kTileSize; ++i)
+        {
+            unsigned shift = 8 - bits - (i * bits) % 8;
+            indices[i] = (p[i * bits / 8] >> shift) & ((1 << bits) - 1);
+        }
+        p += kTileSize * kTileSize * bits / 8;
+        for (y = 0; y < kTileSize; ++y)
+        {
+            for (x = 0; x < kTileSize; ++x)
+            {
+                dest[y * rowColors + x] = palette[indices[y * kTileSize + x]];
+            }
+        }
+        return p - data;
+    }
+    if (subencoding >= 130)
+    {
+        for (i = 0; i < subencoding - 128; ++i, p += 3)
+        {
+            palette[i] = PixelConverterConvertPixel(c, p);
+        }
+    }
+    for (i = 0; i < kTileSize * kTileSize; )
+    {
+        unsigned length = 1, b;
+        if (subencoding == 128)
+        {
+            runs[count].color = PixelConverterConvertPixel(c, p);
+            p += 3;
+        }
+        else
+        {
+            unsigned index = *p++;
+            runs[count].color = palette[index & 0x7f];
+            if (index < 128)
+            {
+                runs[count++].length = 1;
+                i++;
+                continue;
+            }
+        }
+        do
+        {
+            b = *p++;
+            length += b;
+        } while (b == 255);
+        runs[count++].length = length;
+        i += length;
+    }
+    for (i = 0, x = 0, y = 0; i < count && y < kTileSize; ++i)
+    {
+        unsigned length = runs[i].length;
+        while (length && y < kTileSize)
+        {
+            unsigned n = kTileSize - x < length ? kTileSize - x : length;
+            FrameBufferFillRow(dest + y * rowColors + x, 4, runs[i].color, n);
+            length -= n;
+            if ((x += n) == kTileSize)
+            {
+                x = 0;
+                y++;
+            }
+        }
+    }
+    return p - data;
+}
+
+static const struct
+{
+    const char * name;
+    unsigned subencoding;
+    unsigned meanRun;
+} kCases[] = {
+    { "raw", 0, 0 },
+    { "1-bit", 2, 0 },
+    { "2-bit", 4, 0 },
+    { "4-bit", 16, 0 },
+    { "rle/4", 128, 4 },
+    { "rle/32", 128, 32 },
+    { "prle/2", 140, 2 },
+    { "prle/16", 140, 16 },
+};
+
+int main(void)
+{
+    static uint32_t clut[3][256];
+    rfbPixelFormat format = { 32, 24, 0, 1, 255, 255, 255, 0, 8, 16, 0, 0 };
+    PixelConverter_t converter;
+    uint32_t * out[2];
+    uint8_t * tiles;
+    unsigned i, n;
+
+    for (i = 0; i < 256; ++i)
+    {
+        clut[0][i] = i;
+        clut[1][i] = i << 8;
+        clut[2][i] = i << 16;
+    }
+    if (PixelConverterInit(&converter, &format, 3, 0, clut[0], clut[1], clut[2], 4) < 0)
+    {
+        fprintf(stderr, "format should be supported\n");
+        return 1;
+    }
+    tiles = malloc(kTileCount * (1 + 5 * kTileSize * kTileSize));
+    out[0] = calloc(kRowColors * kTileSize, 4);
+    out[1] = calloc(kRowColors * kTileSize, 4);
+
+    printf("%-8s %14s %14s %8s\n", "tile", "reference MP/s", "kernel MP/s", "speedup");
+    for (n = 0; n < sizeof(kCases) / sizeof(kCases[0]); ++n)
+    {
+        uint8_t * end = tiles;
+        double rates[2];
+        int pass;
+
+        srand(n + 1);
+        for (i = 0; i < kTileCount; ++i)
+        {
+            end = EncodeTile(end, kCases[n].subencoding, kCases[n].meanRun);
+        }
+
+        for (pass = 0; pass < 2; ++pass)
+        {
+            uint64_t start = NowNanoseconds(), elapsed;
+            uint64_t pixels = 0;
+            do
+            {
+                const uint8_t * p = tiles;
+                for (i = 0; i < kTileCount; ++i)
+                {
+                    uint32_t * dest = out[pass] + i * kTileSize;
+                    if (pass == 0)
+                    {
+                        p += ReferenceTile(&converter, p, dest, kRowColors);
+                    }
+                    else
+                    {
+                        int used = ZRLEDrawTile(&converter, p, (unsigned)(end - p), dest, kRowColors * 4, kTileSize, kTileSize);
+                        if (used <= 0)
+                        {
+                            fprintf(stderr, "%s: tile %u not decoded\n", kCases[n].name, i);
+                            return 1;
+                        }
+                        p += used;
+                    }
+                }
+                pixels += kTileCount * kTileSize * kTileSize;
+                elapsed = NowNanoseconds() - start;
+            } while (elapsed < kMinimumSeconds * 1e9);
+            rates[pass] = (double)pixels / (double)elapsed * 1e3;
+        }
+
+        if (memcmp(out[0], out[1], kRowColors * kTileSize * 4) != 0)
+        {
+            fprintf(stderr, "%s: decoded pixels differ\n", kCases[n].name);
+            return 1;
+        }
+        printf("%-8s %14.1f %14.1f %7.2fx\n", kCases[n].name, rates[0], rates[1], rates[1] / rates[0]);
+    }
+
+    PixelConverterFree(&converter);
+    free(tiles);
+    free(out[0]);
+    free(out[1]);
+    return 0;
+}
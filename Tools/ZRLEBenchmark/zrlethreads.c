@@ -0,0 +1,544 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//! @file zrlethreads.c
+//! @brief Thread scaling of the ZRLE tile pipeline.
+//!
+//! Compresses a full-screen rect of desktop-like tiles and decodes it the way
+//! ZRLEEncodingReader does: the compressed bytes arrive in socket-sized pieces and are
+//! inflated into a 64KB window on one thread, each tile is found with ZRLETileLength(), and
+//! the tiles are copied into batches of up to 32 that worker threads draw with ZRLEDrawTile().
+//! The number of batches in flight is capped at one per worker. With one thread the tiles
+//! are drawn straight from the window, as the reader does for a single render thread.
+//!
+//! Prints megapixels per second for each thread count and checks every count draws the
+//! same pixels. The reading thread alone, with the batches thrown away undrawn, gives the
+//! most the workers can be fed; the bound column is what each count could reach with a core
+//! per worker.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+#if __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+#include "ZRLETile.h"
+
+#define kMinimumSeconds 1.0
+#define kWidth 1920
+#define kHeight 1080
+#define kTileSize 64
+#define kWindowSize (64 * 1024)
+#define kReadSize (16 * 1024)
+#define kBatchSize (64 * 1024)
+#define kBatchTiles 32
+#define kMaxThreads 8
+
+//! Same layout as ZRLEBatch_t, with plain tile geometry.
+typedef struct _Batch {
+    struct _Batch * next;
+    unsigned tileCount;
+    unsigned length;
+    struct { unsigned x, y, width, height; } tiles[kBatchTiles];
+    uint8_t data[];
+} Batch_t;
+
+//! Stands in for the global queue, the reader's slot semaphore and its dispatch group.
+typedef struct _Pool {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t threads[kMaxThreads];
+    unsigned threadCount;
+    unsigned freeSlots;
+    unsigned outstanding;
+    Batch_t * queue;
+    Batch_t * queueTail;
+    Batch_t * spare;
+    int quit;
+    int readerOnly;     //!< Batches go straight back undrawn.
+    const PixelConverter_t * converter;
+    uint32_t * frameBuffer;
+} Pool_t;
+
+static uint64_t NowNanoseconds(void)
+{
+#if __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+    {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+//! Appends a run length in ZRLE form.
+static uint8_t * PutRunLength(uint8_t * p, unsigned length)
+{
+    length--;
+    while (length >= 255)
+    {
+        *p++ = 255;
+        length -= 255;
+    }
+    *p++ = length;
+    return p;
+}
+
+//! Encodes a tile the way a desktop mostly looks: solid areas, text-like palette runs, some
+//! gradients as plain runs, and now and then a photo as raw pixels.
+static uint8_t * EncodeTile(uint8_t * p, unsigned pixels)
+{
+    unsigned kind = rand() % 100;
+    unsigned i;
+
+    if (kind < 40)
+    {
+        *p++ = 1;
+        p[0] = rand();
+        p[1] = rand();
+        p[2] = rand();
+        return p + 3;
+    }
+    if (kind < 70)
+    {
+        unsigned paletteSize = 2 + rand() % 14;
+        *p++ = 128 + paletteSize;
+        for (i = 0; i < paletteSize * 3; ++i)
+        {
+            *p++ = rand();
+        }
+        for (i = 0; i < pixels; )
+        {
+            unsigned run = 1 + rand() % 16;
+            unsigned index = rand() % paletteSize;
+            if (run > pixels - i)
+            {
+                run = pixels - i;
+            }
+            if (run == 1)
+            {
+                *p++ = index;
+            }
+            else
+            {
+                *p++ = index | 128;
+                p = PutRunLength(p, run);
+            }
+            i += run;
+        }
+        return p;
+    }
+    if (kind < 95)
+    {
+        *p++ = 128;
+        for (i = 0; i < pixels; )
+        {
+            unsigned run = 1 + rand() % 8;
+            if (run > pixels - i)
+            {
+                run = pixels - i;
+            }
+            p[0] = rand();
+            p[1] = rand();
+            p[2] = rand();
+            p = PutRunLength(p + 3, run);
+            i += run;
+        }
+        return p;
+    }
+    *p++ = 0;
+    for (i = 0; i < pixels * 3; ++i)
+    {
+        *p++ = rand();
+    }
+    return p;
+}
+
+static void DrawBatch(Pool_t * pool, Batch_t * batch)
+{
+    const uint8_t * data = batch->data;
+    const uint8_t * end = data + batch->length;
+    unsigned i;
+
+    for (i = 0; i < batch->tileCount; ++i)
+    {
+        uint32_t * dest = pool->frameBuffer + batch->tiles[i].y * kWidth + batch->tiles[i].x;
+        data += ZRLEDrawTile(pool->converter, data, (unsigned)(end - data), dest, kWidth * 4,
+                             batch->tiles[i].width, batch->tiles[i].height);
+    }
+}
+
+static void * Worker(void * context)
+{
+    Pool_t * pool = context;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        Batch_t * batch;
+
+        while (!pool->queue && !pool->quit)
+        {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        if (!pool->queue)
+        {
+            break;
+        }
+        batch = pool->queue;
+        if (!(pool->queue = batch->next))
+        {
+            pool->queueTail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        DrawBatch(pool, batch);
+
+        pthread_mutex_lock(&pool->lock);
+        batch->next = pool->spare;
+        pool->spare = batch;
+        pool->freeSlots++;
+        pool->outstanding--;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+//! Hands a batch over, waiting while every worker has one.
+static void DispatchBatch(Pool_t * pool, Batch_t * batch)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->readerOnly)
+    {
+        batch->next = pool->spare;
+        pool->spare = batch;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    while (pool->freeSlots == 0)
+    {
+        pthread_cond_wait(&pool->changed, &pool->lock);
+    }
+    pool->freeSlots--;
+    pool->outstanding++;
+    batch->next = NULL;
+    if (pool->queueTail)
+    {
+        pool->queueTail->next = batch;
+    }
+    else
+    {
+        pool->queue = batch;
+    }
+    pool->queueTail = batch;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static Batch_t * AcquireBatch(Pool_t * pool)
+{
+    Batch_t * batch;
+
+    pthread_mutex_lock(&pool->lock);
+    batch = pool->spare;
+    pool->spare = batch->next;
+    pthread_mutex_unlock(&pool->lock);
+    batch->tileCount = 0;
+    batch->length = 0;
+    return batch;
+}
+
+static void WaitForBatches(Pool_t * pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->outstanding)
+    {
+        pthread_cond_wait(&pool->changed, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+//! Decodes the whole compressed rect once.
+static void DecodeRect(Pool_t * pool, z_stream * stream, const uint8_t * compressed, unsigned compressedLength, uint8_t * window)
+{
+    unsigned windowBytes = 0, tileX = 0, tileY = 0, offset = 0;
+    Batch_t * batch = NULL;
+
+    inflateReset(stream);
+    while (offset < compressedLength)
+    {
+        unsigned length = compressedLength - offset < kReadSize ? compressedLength - offset : kReadSize;
+
+        stream->next_in = (Bytef *)compressed + offset;
+        stream->avail_in = length;
+        offset += length;
+        for (;;)
+        {
+            unsigned room = kWindowSize - windowBytes;
+            uint8_t * data = window;
+            uint8_t * end;
+            int used;
+
+            stream->next_out = window + windowBytes;
+            stream->avail_out = room;
+            inflate(stream, Z_SYNC_FLUSH);
+            if (room == stream->avail_out)
+            {
+                break;
+            }
+            windowBytes += room - stream->avail_out;
+            end = window + windowBytes;
+
+            for (; tileY < kHeight; data += used)
+            {
+                unsigned width = kWidth - tileX < kTileSize ? kWidth - tileX : kTileSize;
+                unsigned height = kHeight - tileY < kTileSize ? kHeight - tileY : kTileSize;
+
+                if (pool->threadCount == 1)
+                {
+                    used = ZRLEDrawTile(pool->converter, data, (unsigned)(end - data),
+                                        pool->frameBuffer + tileY * kWidth + tileX, kWidth * 4, width, height);
+                }
+                else if ((used = ZRLETileLength(data, (unsigned)(end - data), 3, width, height)) > 0)
+                {
+                    if (batch && (batch->tileCount == kBatchTiles || batch->length + used > kBatchSize - sizeof(Batch_t)))
+                    {
+                        DispatchBatch(pool, batch);
+                        batch = NULL;
+                    }
+                    if (!batch)
+                    {
+                        batch = AcquireBatch(pool);
+                    }
+                    batch->tiles[batch->tileCount].x = tileX;
+                    batch->tiles[batch->tileCount].y = tileY;
+                    batch->tiles[batch->tileCount].width = width;
+                    batch->tiles[batch->tileCount].height = height;
+                    batch->tileCount++;
+                    memcpy(batch->data + batch->length, data, used);
+                    batch->length += used;
+                }
+                if (used <= 0)
+                {
+                    break;
+                }
+                if ((tileX += kTileSize) >= kWidth)
+                {
+                    tileX = 0;
+                    tileY += kTileSize;
+                }
+            }
+            windowBytes = end - data;
+            memmove(window, data, windowBytes);
+            if (stream->avail_in == 0 && stream->avail_out != 0)
+            {
+                break;
+            }
+        }
+    }
+    if (batch)
+    {
+        DispatchBatch(pool, batch);
+    }
+    WaitForBatches(pool);
+}
+
+int main(void)
+{
+    static const unsigned kThreadCounts[] = { 1, 2, 4, 8 };
+    static uint32_t clut[3][256];
+    rfbPixelFormat format = { 32, 24, 0, 1, 255, 255, 255, 0, 8, 16, 0, 0 };
+    PixelConverter_t converter;
+    uint8_t * raw, * compressed, * window;
+    uint32_t * reference;
+    unsigned rawLength, compressedLength, tileX, tileY, i, n;
+    uLongf destLength;
+    z_stream stream;
+    double baseRate = 0, readerRate = 0;
+
+    for (i = 0; i < 256; ++i)
+    {
+        clut[0][i] = i;
+        clut[1][i] = i << 8;
+        clut[2][i] = i << 16;
+    }
+    if (PixelConverterInit(&converter, &format, 3, 0, clut[0], clut[1], clut[2], 4) < 0)
+    {
+        fprintf(stderr, "format should be supported\n");
+        return 1;
+    }
+
+    // Plain runs of one pixel take four bytes each.
+    raw = malloc(kWidth * kHeight * 4 + (kWidth / kTileSize + 1) * (kHeight / kTileSize + 1) * 64);
+    srand(1);
+    {
+        uint8_t * p = raw;
+        for (tileY = 0; tileY < kHeight; tileY += kTileSize)
+        {
+            for (tileX = 0; tileX < kWidth; tileX += kTileSize)
+            {
+                unsigned width = kWidth - tileX < kTileSize ? kWidth - tileX : kTileSize;
+                unsigned height = kHeight - tileY < kTileSize ? kHeight - tileY : kTileSize;
+                p = EncodeTile(p, width * height);
+            }
+        }
+        rawLength = p - raw;
+    }
+    destLength = compressBound(rawLength);
+    compressed = malloc(destLength);
+    if (compress2(compressed, &destLength, raw, rawLength, 6) != Z_OK)
+    {
+        fprintf(stderr, "compress failed\n");
+        return 1;
+    }
+    compressedLength = (unsigned)destLength;
+    memset(&stream, 0, sizeof(stream));
+    inflateInit(&stream);
+    window = malloc(kWindowSize);
+    reference = calloc(kWidth * kHeight, 4);
+
+    printf("%ux%u rect, %u tile bytes, %u compressed, %ld cores\n", kWidth, kHeight, rawLength, compressedLength,
+           sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-8s %10s %8s %8s\n", "threads", "MP/s", "scaling", "bound");
+    // The first pass only reads.
+    for (n = 0; n <= sizeof(kThreadCounts) / sizeof(kThreadCounts[0]); ++n)
+    {
+        int readerOnly = n == 0;
+        Pool_t pool;
+        uint64_t start, elapsed;
+        unsigned frames = 0;
+        double rate;
+
+        memset(&pool, 0, sizeof(pool));
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.changed, NULL);
+        pool.threadCount = readerOnly ? 2 : kThreadCounts[n - 1];
+        pool.readerOnly = readerOnly;
+        pool.freeSlots = pool.threadCount;
+        pool.converter = &converter;
+        pool.frameBuffer = calloc(kWidth * kHeight, 4);
+        if (readerOnly)
+        {
+            Batch_t * batch = malloc(kBatchSize);
+            batch->next = NULL;
+            pool.spare = batch;
+        }
+        else if (pool.threadCount > 1)
+        {
+            // One batch per slot and one being filled.
+            for (i = 0; i <= pool.threadCount; ++i)
+            {
+                Batch_t * batch = malloc(kBatchSize);
+                batch->next = pool.spare;
+                pool.spare = batch;
+            }
+            for (i = 0; i < pool.threadCount; ++i)
+            {
+                pthread_create(&pool.threads[i], NULL, Worker, &pool);
+            }
+        }
+
+        start = NowNanoseconds();
+        do
+        {
+            DecodeRect(&pool, &stream, compressed, compressedLength, window);
+            frames++;
+            elapsed = NowNanoseconds() - start;
+        } while (elapsed < kMinimumSeconds * 1e9);
+        rate = (double)frames * kWidth * kHeight / (double)elapsed * 1e3;
+
+        if (readerOnly)
+        {
+            readerRate = rate;
+            printf("%-8s %10.1f\n", "reader", rate);
+        }
+        else
+        {
+            double bound = pool.threadCount * baseRate;
+
+            if (n == 1)
+            {
+                memcpy(reference, pool.frameBuffer, kWidth * kHeight * 4);
+                baseRate = rate;
+                bound = rate;
+            }
+            else if (memcmp(reference, pool.frameBuffer, kWidth * kHeight * 4) != 0)
+            {
+                fprintf(stderr, "%u threads: decoded pixels differ\n", pool.threadCount);
+                return 1;
+            }
+            if (bound > readerRate && n > 1)
+            {
+                bound = readerRate;
+            }
+            printf("%-8u %10.1f %7.2fx %7.2fx\n", pool.threadCount, rate, rate / baseRate, bound / baseRate);
+        }
+
+        if (readerOnly || pool.threadCount == 1)
+        {
+            while (pool.spare)
+            {
+                Batch_t * batch = pool.spare;
+                pool.spare = batch->next;
+                free(batch);
+            }
+        }
+        else
+        {
+            pthread_mutex_lock(&pool.lock);
+            pool.quit = 1;
+            pthread_cond_broadcast(&pool.changed);
+            pthread_mutex_unlock(&pool.lock);
+            for (i = 0; i < pool.threadCount; ++i)
+            {
+                pthread_join(pool.threads[i], NULL);
+            }
+            while (pool.spare)
+            {
+                Batch_t * batch = pool.spare;
+                pool.spare = batch->next;
+                free(batch);
+            }
+        }
+        pthread_cond_destroy(&pool.changed);
+        pthread_mutex_destroy(&pool.lock);
+        free(pool.frameBuffer);
+    }
+
+    inflateEnd(&stream);
+    PixelConverterFree(&converter);
+    free(raw);
+    free(compressed);
+    free(window);
+    free(reference);
+    return 0;
+}
@@ -0,0 +1,404 @@
+/*
+ * Copyright (C) 2010 Chris Reed
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+//! @file zlibbench.c
+//! @brief Benchmark for decoding large Zlib encoded rects.
+//!
+//! Compresses a few full-screen rects the way a server does, one sync flush per rect on a
+//! single stream, and decodes them into a 32-bit framebuffer in two ways: as
+//! ZlibEncodingReader used to, collecting the compressed rect, inflating all of it into a
+//! growable buffer and then converting it, and as it does now, with InflateRows converting
+//! each row as it is inflated or inflating it in place. Input arrives in socket sized reads.
+//! Both ways must produce the same framebuffer.
+//!
+//! Options: --size <width>x<height>, --rects <count>, --read <bytes per read>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#if __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+#include <zlib.h>
+
+#include "InflateRows.h"
+#include "PixelConverter.h"
+
+#define kMinimumSeconds 1.0
+
+//! The sizes ZlibEncodingReader used for its output buffer.
+#define kInitialOutputBufferSize (256 * 1024)
+#define kOutputBufferChunkSize (64 * 1024)
+
+//! Size of ZlibEncodingReader's row window.
+#define kRowWindowSize (32 * 1024)
+
+typedef struct
+{
+    const char * name;
+    unsigned redShift, greenShift, blueShift;
+} Format_t;
+
+//! Server formats, both 32bpp little endian. The first needs no conversion on a little endian
+//! host and is inflated in place.
+static const Format_t kFormats[] = {
+    { "RGBX", 0, 8, 16 },
+    { "BGRX", 16, 8, 0 },
+};
+
+static unsigned gWidth = 2560;
+static unsigned gHeight = 1440;
+static unsigned gRects = 4;
+static unsigned gReadSize = 16 * 1024;
+
+static unsigned int gRedClut[256];
+static unsigned int gGreenClut[256];
+static unsigned int gBlueClut[256];
+
+typedef struct
+{
+    uint8_t * data;
+    size_t * lengths;   //!< Compressed length of each rect.
+    size_t length;
+} Compressed_t;
+
+typedef struct
+{
+    PixelConverter_t * converter;
+    uint32_t * framebuffer;
+    unsigned rowBytes;
+} Context_t;
+
+static uint64_t NowNanoseconds(void)
+{
+#if __APPLE__
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+    {
+        mach_timebase_info(&timebase);
+    }
+    return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+//! Makes a desktop-like picture: gradients, flat windows and a block of noise.
+static void MakePicture(uint8_t * pixels, unsigned rect)
+{
+    unsigned x, y;
+    srand(rect + 1);
+    for (y = 0; y < gHeight; ++y)
+    {
+        for (x = 0; x < gWidth; ++x)
+        {
+            uint8_t * p = pixels + ((size_t)y * gWidth + x) * 4;
+            if (x > gWidth / 4 && x < gWidth / 2 && y > gHeight / 4 && y < gHeight / 2)
+            {
+                p[0] = rand();
+                p[1] = rand();
+                p[2] = rand();
+            }
+            else if ((x / 200 + y / 150 + rect) % 3 == 0)
+            {
+                p[0] = 0xe0;
+                p[1] = 0xe0;
+                p[2] = 0xe8;
+            }
+            else
+            {
+                p[0] = x + rect * 16;
+                p[1] = y;
+                p[2] = (x + y) / 4;
+            }
+            p[3] = 0;
+        }
+    }
+}
+
+static void Compress(Compressed_t * out)
+{
+    size_t rectBytes = (size_t)gWidth * gHeight * 4;
+    uint8_t * pixels = malloc(rectBytes);
+    size_t capacity = compressBound(rectBytes) * gRects + 1024;
+    z_stream stream;
+    unsigned n;
+
+    memset(&stream, 0, sizeof(stream));
+    deflateInit(&stream, 6);
+    out->data = malloc(capacity);
+    out->lengths = calloc(gRects, sizeof(size_t));
+    out->length = 0;
+    for (n = 0; n < gRects; ++n)
+    {
+        MakePicture(pixels, n);
+        stream.next_in = pixels;
+        stream.avail_in = (uInt)rectBytes;
+        stream.next_out = out->data + out->length;
+        stream.avail_out = (uInt)(capacity - out->length);
+        deflate(&stream, Z_SYNC_FLUSH);
+        out->lengths[n] = capacity - out->length - stream.avail_out;
+        out->length += out->lengths[n];
+    }
+    deflateEnd(&stream);
+    free(pixels);
+}
+
+//! ZlibEncodingReader before InflateRows. Returns the largest staging memory used.
+static size_t DecodeBefore(const Compressed_t * in, PixelConverter_t * converter, uint32_t * framebuffer)
+{
+    z_stream stream;
+    size_t capacity = kInitialOutputBufferSize;
+    uint8_t * pixels = malloc(capacity);
+    uint8_t * block = NULL;
+    size_t blockCapacity = 0;
+    const uint8_t * input = in->data;
+    unsigned n, y;
+
+    memset(&stream, 0, sizeof(stream));
+    inflateInit(&stream);
+    for (n = 0; n < gRects; ++n)
+    {
+        // ByteBlockReader collects the whole compressed rect, one read at a time.
+        size_t length = in->lengths[n], done = 0;
+        if (length > blockCapacity)
+        {
+            free(block);
+            blockCapacity = length;
+            block = malloc(blockCapacity);
+        }
+        while (done < length)
+        {
+            size_t chunk = length - done < gReadSize ? length - done : gReadSize;
+            memcpy(block + done, input + done, chunk);
+            done += chunk;
+        }
+        input += length;
+
+        stream.next_in = block;
+        stream.avail_in = (uInt)length;
+        stream.next_out = pixels;
+        stream.avail_out = (uInt)capacity;
+        while (stream.avail_in)
+        {
+            int result = inflate(&stream, Z_SYNC_FLUSH);
+            if (result < 0 && result != Z_BUF_ERROR)
+            {
+                fprintf(stderr, "inflate failed: %d\n", result);
+                exit(1);
+            }
+            if (result == Z_OK && stream.avail_in && !stream.avail_out)
+            {
+                size_t offset = stream.next_out - pixels;
+                capacity += kOutputBufferChunkSize;
+                pixels = realloc(pixels, capacity);
+                stream.next_out = pixels + offset;
+                stream.avail_out = (uInt)(capacity - offset);
+            }
+        }
+
+        for (y = 0; y < gHeight; ++y)
+        {
+            PixelConverterConvertRow(converter, pixels + (size_t)y * gWidth * 4, framebuffer + (size_t)y * gWidth, gWidth);
+        }
+    }
+    inflateEnd(&stream);
+    free(pixels);
+    free(block);
+    return capacity + blockCapacity;
+}
+
+static void PutRows(void * context, const uint8_t * rows, unsigned firstRow, unsigned count)
+{
+    Context_t * c = context;
+    unsigned y;
+    if (!c->converter)
+    {
+        return;
+    }
+    for (y = 0; y < count; ++y)
+    {
+        PixelConverterConvertRow(c->converter, rows + (size_t)y * c->rowBytes, c->framebuffer + (size_t)(firstRow + y) * gWidth, gWidth);
+    }
+}
+
+//! ZlibEncodingReader with InflateRows. Returns the largest staging memory used.
+static size_t DecodeAfter(const Compressed_t * in, PixelConverter_t * converter, uint32_t * framebuffer)
+{
+    z_stream stream;
+    size_t windowSize = gWidth * 4 > kRowWindowSize ? gWidth * 4 : kRowWindowSize;
+    uint8_t * window = malloc(windowSize);
+    int direct = PixelConverterIsCopy(converter);
+    Context_t context = { direct ? NULL : converter, framebuffer, gWidth * 4 };
+    const uint8_t * input = in->data;
+    unsigned n;
+
+    memset(&stream, 0, sizeof(stream));
+    inflateInit(&stream);
+    for (n = 0; n < gRects; ++n)
+    {
+        InflateRows_t rows;
+        size_t length = in->lengths[n], done = 0;
+        InflateRowsBegin(&rows, &stream, gWidth * 4, gHeight, window, windowSize,
+                         direct ? (uint8_t *)framebuffer : NULL, (size_t)gWidth * 4);
+        while (done < length)
+        {
+            size_t chunk = length - done < gReadSize ? length - done : gReadSize;
+            if (InflateRowsInput(&rows, input + done, (unsigned)chunk, PutRows, &context) != Z_OK)
+            {
+                fprintf(stderr, "inflate failed: %s\n", stream.msg);
+                exit(1);
+            }
+            done += chunk;
+        }
+        if (!InflateRowsIsComplete(&rows))
+        {
+            fprintf(stderr, "rect %u is short\n", n);
+            exit(1);
+        }
+        input += length;
+    }
+    inflateEnd(&stream);
+    free(window);
+    return direct ? 0 : windowSize;
+}
+
+typedef size_t (*DecodeFunction)(const Compressed_t * in, PixelConverter_t * converter, uint32_t * framebuffer);
+
+//! Returns megapixels per second, best of several runs.
+static double Measure(DecodeFunction decode, const Compressed_t * in, PixelConverter_t * converter, uint32_t * framebuffer, size_t * staging)
+{
+    double best = 0;
+    uint64_t start = NowNanoseconds();
+    do
+    {
+        uint64_t begin = NowNanoseconds();
+        *staging = decode(in, converter, framebuffer);
+        double rate = (double)gWidth * gHeight * gRects / ((NowNanoseconds() - begin) * 1e-9) / 1e6;
+        if (rate > best)
+        {
+            best = rate;
+        }
+    } while (NowNanoseconds() - start < kMinimumSeconds * 1e9);
+    return best;
+}
+
+int main(int argc, char * argv[])
+{
+    int i;
+    for (i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc && sscanf(argv[i + 1], "%ux%u", &gWidth, &gHeight) == 2)
+        {
+            ++i;
+        }
+        else if (strcmp(argv[i], "--rects") == 0 && i + 1 < argc)
+        {
+            gRects = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--read") == 0 && i + 1 < argc)
+        {
+            gReadSize = atoi(argv[++i]);
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--size <width>x<height>] [--rects <count>] [--read <bytes>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (gWidth == 0 || gHeight == 0 || gRects == 0 || gReadSize == 0)
+    {
+        fprintf(stderr, "sizes must not be zero\n");
+        return 1;
+    }
+
+    union
+    {
+        uint16_t s;
+        uint8_t c[2];
+    } host = { 0x1234 };
+    int hostBig = host.c[0] == 0x12;
+    unsigned v;
+    for (v = 0; v < 256; ++v)
+    {
+        gRedClut[v] = v << (hostBig ? 24 : 0);
+        gGreenClut[v] = v << (hostBig ? 16 : 8);
+        gBlueClut[v] = v << (hostBig ? 8 : 16);
+    }
+
+    Compressed_t compressed;
+    Compress(&compressed);
+    size_t pixels = (size_t)gWidth * gHeight;
+    uint32_t * expected = malloc(pixels * 4);
+    uint32_t * actual = malloc(pixels * 4);
+    printf("%u rects of %ux%u, %.1f MB compressed, %u byte reads\n", gRects, gWidth, gHeight, compressed.length / 1e6, gReadSize);
+    printf("%-6s %-16s %12s %12s %8s %14s %14s\n", "format", "kernel", "before MP/s", "after MP/s", "speedup", "before staging", "after staging");
+
+    int failures = 0;
+    unsigned n;
+    for (n = 0; n < sizeof(kFormats) / sizeof(kFormats[0]); ++n)
+    {
+        const Format_t * f = &kFormats[n];
+        rfbPixelFormat format;
+        memset(&format, 0, sizeof(format));
+        format.redMax = format.greenMax = format.blueMax = 255;
+        format.redShift = f->redShift;
+        format.greenShift = f->greenShift;
+        format.blueShift = f->blueShift;
+
+        PixelConverter_t converter;
+        if (PixelConverterInit(&converter, &format, 4, 0, gRedClut, gGreenClut, gBlueClut, 4) < 0)
+        {
+            fprintf(stderr, "%s: could not set up converter\n", f->name);
+            return 1;
+        }
+
+        size_t beforeStaging, afterStaging;
+        double before = Measure(DecodeBefore, &compressed, &converter, expected, &beforeStaging);
+        double after = Measure(DecodeAfter, &compressed, &converter, actual, &afterStaging);
+
+        // The copy kernel and the in place path keep the server's unused byte.
+        uint32_t mask = gRedClut[255] | gGreenClut[255] | gBlueClut[255];
+        size_t p;
+        for (p = 0; p < pixels; ++p)
+        {
+            if ((expected[p] & mask) != (actual[p] & mask))
+            {
+                fprintf(stderr, "%s: pixel %zu differs (%08x, expected %08x)\n", f->name, p, actual[p], expected[p]);
+                ++failures;
+                break;
+            }
+        }
+
+        printf("%-6s %-16s %12.1f %12.1f %7.2fx %11.1f MB %11.1f KB\n", f->name, PixelConverterIsCopy(&converter) ? "in place" : converter.kernelName,
+               before, after, after / before, beforeStaging / 1e6, afterStaging / 1e3);
+        PixelConverterFree(&converter);
+    }
+
+    free(expected);
+    free(actual);
+    free(compressed.data);
+    free(compressed.lengths);
+    return failures ? 1 : 0;
+}